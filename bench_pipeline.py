@@ -0,0 +1,520 @@
+#!/usr/bin/env python3
+# bench_pipeline.py
+"""Load test for the suggestion IPC pipeline and end-to-end benchmark of the C shell.
+
+servers: replays a command trace (the `history` table of commands.db, or the
+    `command` column of powershell_commands_cleaned.csv) from N concurrent
+    clients, each on its own long-lived connection, against suggestion_server.py
+    and simple_server.py (the no-ML baseline). For every corpus size the server
+    is started on a corpus of that many distinct commands: by default a model
+    trained from them with train_from_csv.py (--corpus-in model, so the engines
+    search that many commands), or a fresh history database its learner reads
+    before the run (--corpus-in history, on top of the models/ it ships with).
+    Reports throughput, latency percentiles, busy answers, how often every
+    engine was ok / late / failed ("engines" of each answer), every engine's
+    own run time percentiles ("engine_us", asked for with "timing"), and the
+    result cache hit rate over the run, warmup included. Replaying a trace
+    repeats its queries, so later runs are mostly cache hits; --cold sends
+    "cache": false to measure the engines on every request.
+
+shell: runs the built shell (core.c) on a scripted stdin in a scratch directory
+    (so in script mode: no prompts or hints) and reports the wall time per
+    command together with the latency histograms the shell writes to
+    ISH_STATS_FILE on exit (line read -> exec -> next line).
+
+Both servers bind TCP port 9999, so stop a running server before benchmarking.
+Trace commands are only sent as queries, never executed; the shell mode runs its
+own harmless script (--script replaces it).
+
+Usage:  python3 bench_pipeline.py servers [--servers suggestion simple] [--sizes 100 1000 10000]
+                                          [--clients 1 8 32] [--requests 2000] [--proto json|bin1]
+                                          [--corpus-in model|history] [--cold]
+        python3 bench_pipeline.py shell [--ish ./ish] [--repeat 200] [--script FILE]
+Output: one JSON object per line:
+        {"mode":"servers","server":..,"corpus":..,"clients":..,"requests":..,"throughput_rps":..,
+         "mean_us":..,"p50_us":..,"p99_us":..,"p999_us":..,"busy":..,"errors":..,"engines":{..},
+         "engine_us":{"TypoFixer":{"count":..,"p50_us":..,..},..},"cache_hit_rate":..,..}
+        {"mode":"shell","commands":..,"wall_ms":..,"per_command_us":..,"histograms":{..},..}
+"""
+import argparse
+import csv
+import json
+import os
+import re
+import shlex
+import socket
+import sqlite3
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+import wire
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+TCP_ADDR = ("127.0.0.1", 9999)
+SERVERS = {
+    "suggestion": [sys.executable, os.path.join(HERE, "suggestion_server.py")],
+    "simple": [sys.executable, os.path.join(HERE, "simple_server.py")],
+}
+# Servers that learn their corpus from SUGGEST_HISTORY_DB; the others are measured once
+LEARNING = {"suggestion"}
+TRAIN = [sys.executable, os.path.join(HERE, "train_from_csv.py")]
+START_TIMEOUT = 60.0
+SHELL_SCRIPT = [
+    "true",
+    "echo hello",
+    "pwd",
+    "ls",
+    "echo one two three | wc -w",
+    "cd ..",
+    "cd /tmp",
+    "history 3",
+]
+
+
+def git_commit():
+    try:
+        out = subprocess.run(["git", "-C", HERE, "rev-parse", "--short", "HEAD"],
+                             capture_output=True, text=True, timeout=5)
+        return out.stdout.strip() or None
+    except (OSError, subprocess.SubprocessError):
+        return None
+
+
+def percentiles(samples):
+    """Summary of latencies in microseconds; samples is sorted in place."""
+    samples.sort()
+    n = len(samples)
+    if not n:
+        return {"mean_us": None, "p50_us": None, "p99_us": None, "p999_us": None, "max_us": None}
+    return {
+        "mean_us": round(sum(samples) / n, 1),
+        "p50_us": round(samples[n // 2], 1),
+        "p99_us": round(samples[(n * 99) // 100], 1),
+        "p999_us": round(samples[min(n - 1, (n * 999) // 1000)], 1),
+        "max_us": round(samples[-1], 1),
+    }
+
+
+# -- trace -------------------------------------------------------------------
+
+def load_trace(path):
+    """[(command, prev, cwd)] in the order the trace recorded them."""
+    if path.endswith(".csv"):
+        with open(path, newline="", encoding="utf8") as f:
+            cmds = [(row.get("command") or "").strip() for row in csv.DictReader(f)]
+        rows = [(c, None) for c in cmds if c]
+    else:
+        conn = sqlite3.connect(f"file:{path}?mode=ro", uri=True)
+        try:
+            cols = {row[1] for row in conn.execute("PRAGMA table_info(history)")}
+            sql = "SELECT cmd, " + ("cwd" if "cwd" in cols else "NULL") + " FROM history ORDER BY id"
+            rows = [((c or "").strip(), cwd) for c, cwd in conn.execute(sql)]
+        finally:
+            conn.close()
+        rows = [r for r in rows if r[0]]
+    out, prev = [], None
+    for cmd, cwd in rows:
+        out.append((cmd, prev, cwd))
+        prev = cmd
+    return out
+
+
+def default_trace():
+    for db in (os.environ.get("ISH_HISTORY_DB"), os.path.expanduser("~/commands.db"), os.path.join(HERE, "commands.db")):
+        if db and os.path.exists(db):
+            return db
+    return os.path.join(HERE, "powershell_commands_cleaned.csv")
+
+
+def corpus_commands(trace, n):
+    """n distinct commands: the trace's own first, then numbered variants of them."""
+    seen, out = set(), []
+    for cmd, _, _ in trace:
+        if cmd not in seen:
+            seen.add(cmd)
+            out.append(cmd)
+            if len(out) == n:
+                return out
+    base, i = list(out), 0
+    while len(out) < n:
+        cmd = f"{base[i % len(base)]} --bench{i // len(base)}"
+        if cmd not in seen:
+            seen.add(cmd)
+            out.append(cmd)
+        i += 1
+    return out
+
+
+def write_history(path, commands):
+    """A history table like the shell's, one command per second so it reads as one session."""
+    conn = sqlite3.connect(path)
+    conn.execute("CREATE TABLE history (id INTEGER PRIMARY KEY AUTOINCREMENT, cmd TEXT NOT NULL, "
+                 "ts DATETIME DEFAULT CURRENT_TIMESTAMP, cwd TEXT)")
+    start = int(time.time()) - len(commands)
+    conn.executemany("INSERT INTO history (cmd, ts, cwd) VALUES (?, datetime(?, 'unixepoch'), ?)",
+                     [(c, start + i, HERE) for i, c in enumerate(commands)])
+    conn.commit()
+    conn.close()
+
+
+def train_models(outdir, commands):
+    """Train the served model on commands (train_from_csv.py); returns the seconds it took."""
+    csv_path = os.path.join(outdir, "corpus.csv")
+    with open(csv_path, "w", newline="", encoding="utf8") as f:
+        w = csv.writer(f)
+        w.writerow(["command"])
+        w.writerows([c] for c in commands)
+    t0 = time.perf_counter()
+    proc = subprocess.run(TRAIN + ["--input", csv_path, "--col", "command", "--outdir", outdir],
+                          cwd=HERE, capture_output=True, text=True)
+    if proc.returncode != 0:
+        sys.exit(f"training on {len(commands)} commands failed:\n{proc.stderr[-2000:]}")
+    return time.perf_counter() - t0
+
+
+def replay_requests(trace, typing):
+    """Request objects in trace order; with typing, every prefix a user types on the way."""
+    out = []
+    for cmd, prev, cwd in trace:
+        texts = [cmd[:i] for i in range(2, len(cmd) + 1)] if typing else [cmd]
+        for text in texts:
+            req = {"cmd": text}
+            if prev:
+                req["prev"] = prev
+            if cwd:
+                req["cwd"] = cwd
+            out.append(req)
+    return out
+
+
+# -- servers -----------------------------------------------------------------
+
+class Server:
+    """A server process under test; stdout is watched for the learner's progress."""
+
+    def __init__(self, argv, env, cwd):
+        self.known = 0
+        self.output = []
+        self.proc = subprocess.Popen(argv, env=env, cwd=cwd, stdin=subprocess.DEVNULL,
+                                     stdout=subprocess.PIPE, stderr=subprocess.STDOUT, text=True)
+        threading.Thread(target=self._watch, daemon=True).start()
+
+    def _watch(self):
+        for line in self.proc.stdout:
+            self.output = (self.output + [line.rstrip()])[-20:]
+            m = re.search(r"(\d+) known", line)
+            if m:
+                self.known = int(m.group(1))
+
+    def wait_ready(self, connect, corpus):
+        deadline = time.monotonic() + START_TIMEOUT
+        while time.monotonic() < deadline:
+            if self.proc.poll() is not None:
+                break
+            try:
+                connect().close()
+                if not corpus or self.known >= corpus:
+                    return
+            except OSError:
+                pass
+            time.sleep(0.1)
+        self.stop()
+        tail = "\n".join(self.output)
+        raise RuntimeError(f"server not ready (known {self.known}/{corpus}):\n{tail}")
+
+    def stop(self):
+        if self.proc.poll() is None:
+            self.proc.terminate()
+            try:
+                self.proc.wait(5)
+            except subprocess.TimeoutExpired:
+                self.proc.kill()
+                self.proc.wait()
+
+
+class Client:
+    """One connection speaking the JSON line protocol or, after a hello, bin1 frames."""
+
+    def __init__(self, sock, proto):
+        self.sock = sock
+        self.buf = b""
+        self.frames = None
+        if proto == wire.PROTO:
+            self.sock.sendall((json.dumps({"op": "hello", "proto": wire.PROTO}) + "\n").encode())
+            reply = json.loads(self._line())
+            if reply.get("op") == "hello" and reply.get("proto") == wire.PROTO:
+                self.frames = wire.FrameReader()
+                self.frames.buf += self.buf
+
+    def _line(self):
+        while b"\n" not in self.buf:
+            chunk = self.sock.recv(65536)
+            if not chunk:
+                raise ConnectionError("server closed the connection")
+            self.buf += chunk
+        line, self.buf = self.buf.split(b"\n", 1)
+        return line
+
+    def request(self, obj):
+        if self.frames is None:
+            self.sock.sendall((json.dumps(obj) + "\n").encode())
+            return json.loads(self._line())
+        self.sock.sendall(wire.frame(obj))
+        while True:
+            got = self.frames.feed(b"")
+            if got:
+                return wire.unpack(got[0])
+            chunk = self.sock.recv(65536)
+            if not chunk:
+                raise ConnectionError("server closed the connection")
+            self.frames.buf += chunk
+
+    def close(self):
+        self.sock.close()
+
+
+class Tally:
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.samples = []
+        self.partial = []
+        self.busy = self.errors = 0
+        self.engines = {}
+        self.engine_us = {}  # engine -> run times reported by the server
+
+    def add(self, us, resp):
+        with self.lock:
+            if not isinstance(resp, dict) or resp.get("error"):
+                if isinstance(resp, dict) and resp.get("busy"):
+                    self.busy += 1
+                else:
+                    self.errors += 1
+                return
+            engines = resp.get("engines") or {}
+            (self.samples if all(s == "ok" for s in engines.values()) else self.partial).append(us)
+            for name, status in engines.items():
+                row = self.engines.setdefault(name, {"ok": 0, "late": 0, "error": 0})
+                row[status] = row.get(status, 0) + 1
+            for name, run_us in (resp.get("engine_us") or {}).items():
+                self.engine_us.setdefault(name, []).append(run_us)
+
+
+def drive(connect, proto, requests, clients, total, warmup, deadline_ms, cold):
+    """Send total requests (after warmup) from clients threads; returns (Tally, elapsed seconds)."""
+    tally = Tally()
+    lock = threading.Lock()
+    cursor = [0]
+    start = threading.Barrier(clients + 1)
+    failures = []
+
+    def worker():
+        try:
+            client = Client(connect(), proto)
+        except (OSError, ValueError) as e:
+            failures.append(e)
+            start.wait()
+            return
+        start.wait()
+        try:
+            while True:
+                with lock:
+                    i = cursor[0]
+                    cursor[0] += 1
+                if i >= warmup + total:
+                    return
+                req = dict(requests[i % len(requests)], id=i, timing=True)
+                if cold:
+                    req["cache"] = False
+                if deadline_ms:
+                    req["deadline_ms"] = deadline_ms
+                t0 = time.perf_counter()
+                try:
+                    resp = client.request(req)
+                except (OSError, ValueError) as e:
+                    failures.append(e)
+                    return
+                if i >= warmup:
+                    tally.add((time.perf_counter() - t0) * 1e6, resp)
+        finally:
+            client.close()
+
+    threads = [threading.Thread(target=worker, daemon=True) for _ in range(clients)]
+    for t in threads:
+        t.start()
+    start.wait()
+    t0 = time.perf_counter()
+    for t in threads:
+        t.join()
+    tally.errors += len(failures)
+    if failures:
+        print(f"{len(failures)} client(s) failed: {failures[0]}", file=sys.stderr)
+    return tally, time.perf_counter() - t0
+
+
+def server_stats(connect):
+    """The suggestion server's cache counters ({"op":"stats"}); None for servers without them."""
+    try:
+        client = Client(connect(), "json")
+        try:
+            resp = client.request({"op": "stats"})
+        finally:
+            client.close()
+    except (OSError, ValueError):
+        return None
+    return {k: resp[k] for k in ("cache", "partial") if k in resp} or None
+
+
+def hit_rate(before, after):
+    """Result cache hits over lookups between two server_stats(); None without counters."""
+    if not before or not after or "cache" not in after:
+        return None
+    hits = after["cache"]["hits"] - before["cache"]["hits"]
+    lookups = hits + after["cache"]["misses"] - before["cache"]["misses"]
+    return round(hits / lookups, 4) if lookups else None
+
+
+def bench_servers(args):
+    trace = load_trace(args.trace)
+    if not trace:
+        sys.exit(f"no commands in {args.trace}")
+    requests = replay_requests(trace, args.typing)
+    commit = git_commit()
+    for spec in args.servers:
+        name, _, cmdline = spec.partition("=")
+        argv = shlex.split(cmdline) if cmdline else SERVERS.get(name)
+        if argv is None:
+            sys.exit(f"unknown server {name!r}; use one of {sorted(SERVERS)} or NAME=COMMAND")
+        learns = bool(cmdline) or name in LEARNING
+        for corpus in (args.sizes if learns else [None]):
+            with tempfile.TemporaryDirectory(prefix="bench_pipeline.") as tmp:
+                sock_path = os.path.join(tmp, "suggest.sock")
+                env = dict(os.environ, PYTHONUNBUFFERED="1", SUGGEST_SOCKET_PATH=sock_path)
+                train_s, learn = None, corpus
+                if corpus and args.corpus_in == "model":
+                    models_dir = os.path.join(tmp, "models")
+                    os.mkdir(models_dir)
+                    train_s = round(train_models(models_dir, corpus_commands(trace, corpus)), 3)
+                    # the user's own history would add to the corpus
+                    env.update(SUGGEST_MODELS_DIR=models_dir, SUGGEST_HISTORY_POLL="0")
+                    learn = None
+                elif corpus:
+                    db = os.path.join(tmp, "history.db")
+                    write_history(db, corpus_commands(trace, corpus))
+                    env.update(SUGGEST_HISTORY_DB=db, SUGGEST_HISTORY_POLL="0.2")
+
+                def connect():
+                    if learns and hasattr(socket, "AF_UNIX"):
+                        s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+                        s.settimeout(args.timeout)
+                        s.connect(sock_path)
+                        return s
+                    return socket.create_connection(TCP_ADDR, timeout=args.timeout)
+
+                server = Server(argv, env, HERE)
+                try:
+                    server.wait_ready(connect, learn)
+                    for clients in args.clients:
+                        before = server_stats(connect)
+                        tally, elapsed = drive(connect, args.proto, requests, clients,
+                                               args.requests, args.warmup, args.deadline_ms, args.cold)
+                        after = server_stats(connect)
+                        answered = len(tally.samples) + len(tally.partial)
+                        print(json.dumps({
+                            "mode": "servers", "commit": commit, "server": name, "corpus": corpus,
+                            "corpus_in": args.corpus_in if corpus else None, "train_s": train_s,
+                            "trace": os.path.basename(args.trace), "typing": args.typing, "cold": args.cold,
+                            "proto": args.proto, "clients": clients, "requests": args.requests,
+                            "answered": answered, "busy": tally.busy, "errors": tally.errors,
+                            "elapsed_s": round(elapsed, 3),
+                            "throughput_rps": round(answered / elapsed, 1) if elapsed else None,
+                            **percentiles(tally.samples + tally.partial),
+                            "complete": {"count": len(tally.samples), **percentiles(tally.samples)},
+                            "partial": {"count": len(tally.partial), **percentiles(tally.partial)},
+                            "engines": tally.engines,
+                            "engine_us": {engine: {"count": len(us), **percentiles(us)}
+                                          for engine, us in sorted(tally.engine_us.items())},
+                            "cache_hit_rate": hit_rate(before, after),
+                            "server_stats": after,
+                        }), flush=True)
+                finally:
+                    server.stop()
+
+
+# -- shell -------------------------------------------------------------------
+
+def bench_shell(args):
+    if args.script:
+        with open(args.script, encoding="utf8") as f:
+            script = [line.rstrip("\n") for line in f if line.strip()]
+    else:
+        script = SHELL_SCRIPT
+    ish = os.path.abspath(args.ish)
+    lines = script * args.repeat
+    stdin = ("\n".join(lines) + "\nexit\n").encode()
+    with tempfile.TemporaryDirectory(prefix="bench_pipeline.") as tmp:
+        stats_file = os.path.join(tmp, "stats.json")
+        env = dict(os.environ, ISH_STATS_FILE=stats_file, ISH_STATS_FORMAT="json",
+                   ISH_HISTORY_DB=os.path.join(tmp, "commands.db"))
+        t0 = time.perf_counter()
+        proc = subprocess.run([ish], input=stdin, cwd=tmp, env=env,
+                              stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+        wall = time.perf_counter() - t0
+        if proc.returncode != 0:
+            sys.exit(f"{ish} exited with {proc.returncode}: {proc.stderr.decode(errors='replace')[-500:]}")
+        try:
+            with open(stats_file, encoding="utf8") as f:
+                stats = json.load(f)
+        except (OSError, ValueError) as e:
+            print(f"no stats from {ish} ({e}); is it built with the stats builtin?", file=sys.stderr)
+            stats = {}
+    histograms = {}
+    for name, h in stats.get("histograms", {}).items():
+        if h.get("count"):
+            histograms[name] = {"count": h["count"], "mean_us": round(h["sum"] / h["count"], 1),
+                                **{f"{q}_us": h[q] for q in ("p50", "p90", "p99", "p999") if q in h},
+                                "max_us": h["max"]}
+    print(json.dumps({
+        "mode": "shell", "commit": git_commit(), "ish": args.ish, "commands": len(lines),
+        "wall_ms": round(wall * 1e3, 1), "per_command_us": round(wall * 1e6 / max(1, len(lines)), 1),
+        "hints_missed": stats.get("hints_missed"), "histograms": histograms,
+    }), flush=True)
+
+
+def main():
+    ap = argparse.ArgumentParser()
+    sub = ap.add_subparsers(dest="mode", required=True)
+
+    sp = sub.add_parser("servers", help="concurrent clients against the suggestion servers")
+    sp.add_argument("--servers", nargs="+", default=["suggestion", "simple"],
+                    help="server names, or NAME=COMMAND to start any command speaking the protocol")
+    sp.add_argument("--trace", default=default_trace(), help="commands.db or a CSV with a command column")
+    sp.add_argument("--sizes", type=int, nargs="+", default=[100, 1000, 10000],
+                    help="distinct commands in the corpus the server is started on")
+    sp.add_argument("--corpus-in", choices=["model", "history"], default="model",
+                    help="train the served model on the corpus, or have the server learn it as history")
+    sp.add_argument("--clients", type=int, nargs="+", default=[1, 8, 32])
+    sp.add_argument("--requests", type=int, default=2000, help="measured requests per run")
+    sp.add_argument("--warmup", type=int, default=100)
+    sp.add_argument("--typing", action="store_true", help="replay every prefix of each command")
+    sp.add_argument("--proto", choices=["json", wire.PROTO], default="json")
+    sp.add_argument("--cold", action="store_true", help='send "cache": false so no answer comes from a cache')
+    sp.add_argument("--deadline-ms", type=int, default=0, help="deadline_ms sent with each request")
+    sp.add_argument("--timeout", type=float, default=10.0, help="socket timeout in seconds")
+
+    sh = sub.add_parser("shell", help="the C shell on a scripted stdin")
+    sh.add_argument("--ish", default=os.path.join(HERE, "ish"), help="path to the built shell")
+    sh.add_argument("--script", help="file with one command per line (default: a built-in mix)")
+    sh.add_argument("--repeat", type=int, default=200, help="times the script is run")
+
+    args = ap.parse_args()
+    if args.mode == "servers":
+        bench_servers(args)
+    else:
+        bench_shell(args)
+
+
+if __name__ == "__main__":
+    main()
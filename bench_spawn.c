@@ -0,0 +1,103 @@
+/* bench_spawn.c
+ * Launch-latency benchmark for the shell's two process launch paths:
+ *  - fork() + execvp() + waitpid()          (ISH_SPAWN=fork in core.c)
+ *  - posix_spawnp() + waitpid()             (default in core.c)
+ * The parent first grows its own heap to a given size and touches every page, so
+ * the page tables fork() has to copy the way a large shell process would.
+ * Compile: gcc -std=gnu11 -O2 -Wall -Wextra bench_spawn.c -o bench_spawn
+ * Usage:   ./bench_spawn [iterations] [rss_mb ...]   (default: 200 0 64 256 1024)
+ * Output:  one JSON object per line: {"rss_mb":..,"method":"fork|spawn","iters":..,"mean_us":..,"p50_us":..,"p99_us":..}
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+static char *const g_child_argv[] = { "true", NULL };
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int launch_fork(void) {
+    pid_t pid = fork();
+    if (pid < 0) return -1;
+    if (pid == 0) {
+        execvp(g_child_argv[0], g_child_argv);
+        _exit(127);
+    }
+    return waitpid(pid, NULL, 0) < 0 ? -1 : 0;
+}
+
+static int launch_spawn(void) {
+    pid_t pid;
+    if (posix_spawnp(&pid, g_child_argv[0], NULL, NULL, g_child_argv, environ) != 0) return -1;
+    return waitpid(pid, NULL, 0) < 0 ? -1 : 0;
+}
+
+static int cmp_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+static void run(const char *method, int (*launch)(void), int iters, long rss_mb) {
+    long long *samples = malloc(sizeof(long long) * (size_t)iters);
+    if (!samples) return;
+    long long total = 0;
+    for (int i = 0; i < iters; ++i) {
+        long long t0 = now_ns();
+        if (launch() != 0) {
+            fprintf(stderr, "%s: launch failed: %s\n", method, strerror(errno));
+            free(samples);
+            return;
+        }
+        samples[i] = now_ns() - t0;
+        total += samples[i];
+    }
+    qsort(samples, (size_t)iters, sizeof(long long), cmp_ll);
+    printf("{\"rss_mb\":%ld,\"method\":\"%s\",\"iters\":%d,\"mean_us\":%.1f,\"p50_us\":%.1f,\"p99_us\":%.1f}\n",
+           rss_mb, method, iters,
+           total / (double)iters / 1000.0,
+           samples[iters / 2] / 1000.0,
+           samples[(iters * 99) / 100] / 1000.0);
+    fflush(stdout);
+    free(samples);
+}
+
+int main(int argc, char **argv) {
+    int iters = argc > 1 ? atoi(argv[1]) : 200;
+    if (iters <= 0) iters = 200;
+    long default_sizes[] = { 0, 64, 256, 1024 };
+    int nsizes = argc > 2 ? argc - 2 : (int)(sizeof(default_sizes) / sizeof(default_sizes[0]));
+
+    char *ballast = NULL;
+    long have_mb = 0;
+    for (int s = 0; s < nsizes; ++s) {
+        long mb = argc > 2 ? atol(argv[s + 2]) : default_sizes[s];
+        if (mb > have_mb) {
+            /* grow and touch the ballast so every page is resident and mapped */
+            char *p = realloc(ballast, (size_t)mb << 20);
+            if (!p) {
+                fprintf(stderr, "cannot allocate %ld MB\n", mb);
+                break;
+            }
+            ballast = p;
+            memset(ballast + (have_mb << 20), 1, (size_t)(mb - have_mb) << 20);
+            have_mb = mb;
+        }
+        run("fork", launch_fork, iters, have_mb);
+        run("spawn", launch_spawn, iters, have_mb);
+    }
+    free(ballast);
+    return 0;
+}
@@ -0,0 +1,94 @@
+#!/usr/bin/env python3
+# bench_templates.py
+"""Template recommender latency against corpus size.
+
+Compares the old per-query path (re-vectorize the corpus, dense cosine, full
+argsort) with TemplateIndex (precomputed CSR, sparse dot, argpartition top-k)
+on synthetic shell-command corpora.
+
+Usage:  python3 bench_templates.py [--sizes 1000 10000 50000 200000] [--queries 200]
+Output: one JSON object per line:
+        {"corpus":..,"method":"rescan|index","queries":..,"build_ms":..,"mean_us":..,"p50_us":..,"p99_us":..}
+"""
+import argparse
+import json
+import random
+import time
+
+from sklearn.feature_extraction.text import TfidfVectorizer
+from sklearn.metrics.pairwise import cosine_similarity
+
+from template_index import TemplateIndex
+
+VERBS = ["git", "docker", "kubectl", "npm", "python", "pip", "ls", "grep", "find", "ssh",
+         "tar", "curl", "make", "cargo", "systemctl", "journalctl", "rsync", "awk", "sed", "go"]
+SUBS = ["status", "add", "commit", "push", "pull", "run", "build", "exec", "logs", "get",
+        "describe", "apply", "install", "test", "start", "stop", "restart", "list", "show", "clean"]
+FLAGS = ["-a", "-l", "-v", "-f", "-n", "-r", "--all", "--force", "--verbose", "--dry-run",
+         "--name", "--output", "--tail", "--since", "--namespace", "--rm", "-it", "-p", "-m", "-x"]
+
+
+def synth_corpus(n, seed=1):
+    """n distinct commands built from a verb, a subcommand, flags and a numbered argument."""
+    rng = random.Random(seed)
+    out = set()
+    while len(out) < n:
+        words = [rng.choice(VERBS), rng.choice(SUBS)]
+        words += rng.sample(FLAGS, rng.randint(0, 3))
+        words.append(f"arg{rng.randint(0, n)}")
+        out.add(" ".join(words))
+    return sorted(out)
+
+
+def rescan_search(vectorizer, commands, query, topk=5):
+    """What recommend_templates() did before the index: O(corpus) work per query."""
+    qv = vectorizer.transform([query])
+    sims = cosine_similarity(qv, vectorizer.transform(commands)).flatten()
+    idx = sims.argsort()[-topk:][::-1]
+    return [(commands[i], float(sims[i])) for i in idx]
+
+
+def measure(fn, queries):
+    samples = []
+    for q in queries:
+        t0 = time.perf_counter()
+        fn(q)
+        samples.append((time.perf_counter() - t0) * 1e6)
+    samples.sort()
+    return {
+        "queries": len(samples),
+        "mean_us": round(sum(samples) / len(samples), 1),
+        "p50_us": round(samples[len(samples) // 2], 1),
+        "p99_us": round(samples[(len(samples) * 99) // 100], 1),
+    }
+
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument("--sizes", type=int, nargs="+", default=[1000, 10000, 50000, 200000])
+    ap.add_argument("--queries", type=int, default=200)
+    ap.add_argument("--rescan-max", type=int, default=50000,
+                    help="skip the old path above this corpus size (it takes seconds per query)")
+    args = ap.parse_args()
+
+    for n in args.sizes:
+        commands = synth_corpus(n)
+        vectorizer = TfidfVectorizer().fit(commands)
+        rng = random.Random(n)
+        # half exact corpus lines, half partial prefixes like a user mid-typing
+        queries = [c if i % 2 else " ".join(c.split()[:2]) for i, c in enumerate(rng.sample(commands, min(args.queries, n)))]
+
+        t0 = time.perf_counter()
+        index = TemplateIndex(vectorizer, commands)
+        build_ms = round((time.perf_counter() - t0) * 1e3, 1)
+        print(json.dumps({"corpus": n, "method": "index", "build_ms": build_ms,
+                          **measure(lambda q: index.search(q, 5), queries)}), flush=True)
+
+        if n <= args.rescan_max:
+            few = queries[:max(1, min(len(queries), 2000000 // n))]
+            print(json.dumps({"corpus": n, "method": "rescan", "build_ms": 0.0,
+                              **measure(lambda q: rescan_search(vectorizer, commands, q, 5), few)}), flush=True)
+
+
+if __name__ == "__main__":
+    main()
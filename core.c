@@ -1,29 +1,60 @@
 /* intelligent_shell.c
  * Cross-platform C shell core:
- *  - Read / parse / execute loop
- *  - Built-ins: cd, exit, history
- *  - Background job support (&)
+ *  - Read / parse / execute loop; single-pass tokenizer over the input line
+ *    (quotes, backslash escapes, # comments) with words kept as spans until exec
+ *  - Pipelines (|), redirections (<, >, >>), sequencing (;) and background (&)
+ *  - Built-ins: cd, exit, history (indexed --grep/--prefix/--since/--until, -r reverse search)
+ *  - Job table with SIGCHLD reaping and per-job rusage; jobs, fg, bg, wait
+ *  - Commands launched with posix_spawn (vfork-style), fork only where needed
+ *  - Hashed $PATH lookup cache (hash, hash -r)
  *  - Command logging to SQLite
- *  - IPC to a Python suggestion server via Unix domain socket (Unix) or TCP (fallback)
- * Compile (Linux/macOS): gcc -std=gnu11 -Wall -Wextra core.c -o intelligent_shell -lsqlite3
- * Compile (Windows, MinGW): gcc -std=gnu11 -Wall -Wextra core.c -o intelligent_shell.exe -lsqlite3 -lws2_32
+ *  - IPC to a Python suggestion server via Unix domain socket (Unix) or TCP (fallback),
+ *    over one persistent connection with request ids; ISH_SUGGEST_ENDPOINT selects
+ *    the server (e.g. a shared daemon's per-user socket)
+ *  - Native in-process engine for the default model (typo / next / templates)
+ *    from the binary model exported by train_from_csv.py
+ *  - Small LRU cache of suggestion answers (suggest, suggest -r)
+ *  - Script mode (ish -c COMMANDS, ish FILE, or stdin not a terminal): no prompt or
+ *    hints, buffered chunk reads, history of the whole run in one transaction
+ *  - Per-command arena for the line's tokens, parse tables and argv, reset before
+ *    each line; input lines of any length (getline, growing script buffer)
+ * Compile (Linux/macOS): gcc -std=gnu11 -Wall -Wextra core.c -o intelligent_shell -lsqlite3 -lm
+ * Compile (Windows, MinGW): gcc -std=gnu11 -Wall -Wextra core.c -o intelligent_shell.exe -lsqlite3 -lws2_32 -lm
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* pipe2() */
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <errno.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <time.h>
+#include <stdint.h>
+#include <math.h>
 #include <sqlite3.h>
+#include <spawn.h>
 
 #if defined(__unix__) || defined(__APPLE__)
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/time.h>
+#include <sys/select.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
 #define HAVE_UNIX_SOCKETS 1
+extern char **environ;
 #else
 #define HAVE_UNIX_SOCKETS 0
 #endif
@@ -42,17 +73,277 @@
 #endif
 #endif
 
+/* History database name, kept in $HOME unless ISH_HISTORY_DB names another file */
 #define DB_PATH "commands.db"
+/* Suggestion server endpoints tried when ISH_SUGGEST_ENDPOINT is not set */
 #define SUGGEST_SOCKET_PATH "/tmp/shell_suggest.sock"
 #define MAXLINE 4096
-#define MAXARGS 256
 /* TCP fallback for suggestion server (matches suggestion server default) */
 #define SUGGEST_HOST "127.0.0.1"
 #define SUGGEST_PORT 9999
 /* Default suggestion model requested from server */
 #define DEFAULT_SUGGEST_MODEL "Claude Haiku 4.5"
 
+/* History writes are buffered (write-behind) and flushed in one transaction when
+ * HISTORY_FLUSH_PENDING commands are queued, when the oldest queued command is
+ * older than HISTORY_FLUSH_INTERVAL_MS (checked between commands, and by a timer
+ * while the shell waits at the prompt or for a job), before history is read
+ * back, and at exit or SIGHUP. Journal mode and synchronous level can be tuned with
+ * ISH_DB_JOURNAL_MODE (default WAL) and ISH_DB_SYNCHRONOUS (default NORMAL).
+ * A script run (history_begin_batch) queues up to HISTORY_BATCH_PENDING commands
+ * per transaction instead, still committing at least every
+ * HISTORY_FLUSH_INTERVAL_MS, so other shells and the suggestion server's learner
+ * are never locked out or kept behind for long. */
+#define HISTORY_FLUSH_PENDING 64
+#define HISTORY_BATCH_PENDING 512
+#define HISTORY_FLUSH_INTERVAL_MS 2000
+#define HISTORY_QUEUE_MAX 1024
+
+/* What a command line did, written into its history row: the exit status of the
+ * last foreground pipeline (exit code, or 128 + signal number) and the summed
+ * wait4 rusage of every foreground job the line ran. Lines that only started
+ * background jobs have no status. */
+struct cmd_result {
+    int have_status;
+    int status;
+    struct rusage ru;
+};
+
+struct history_entry {
+    char *cmd;
+    char *cwd;      /* directory the command was run in, NULL if unknown */
+    time_t ts;
+    int has_result;
+    int status;
+    long long wall_us, user_us, sys_us;
+    long long maxrss_kb, inblock, oublock;
+};
+
 static sqlite3 *g_db = NULL;
+static sqlite3_stmt *g_insert_stmt = NULL;
+static struct history_entry g_hist_queue[HISTORY_QUEUE_MAX];
+static int g_hist_pending = 0;
+static long long g_hist_oldest_ms = 0;
+static int g_hist_flush_at = HISTORY_FLUSH_PENDING;
+static struct history_entry g_hist_current;  /* the running line, queued when it finishes */
+static struct cmd_result g_cmd_result;
+
+/* Context for next-command prediction: the shell's working directory (refreshed
+ * after cd), the last command logged and its exit status. They go into the history
+ * rows and into every suggestion request; g_context_changed tells the request code
+ * to re-escape. */
+static char g_cwd[MAXLINE];
+static char *g_last_cmd = "";       /* the whole line, however long; grown, never shrunk */
+static size_t g_last_cmd_cap = 0;
+static int g_last_status = -1;      /* of g_last_cmd; -1 while unknown */
+static int g_context_changed = 1;
+
+/* Make *buf (heap, or a literal while *cap is 0) hold at least need bytes.
+ * Grows by doubling so a buffer reused every command settles at its largest
+ * size and stops reallocating. Returns 0, or -1 with *buf unchanged. */
+static int grow_buf(char **buf, size_t *cap, size_t need) {
+    if (need <= *cap) return 0;
+    size_t n = *cap ? *cap : 256;
+    while (n < need) n *= 2;
+    char *p = realloc(*cap ? *buf : NULL, n);
+    if (!p) return -1;
+    *buf = p;
+    *cap = n;
+    return 0;
+}
+
+static void refresh_cwd(void) {
+    if (!getcwd(g_cwd, sizeof(g_cwd))) g_cwd[0] = '\0';
+    g_context_changed = 1;
+}
+
+static long long monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static long long monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Latency histograms. Each timed operation adds its duration in microseconds to
+ * a log-linear (HDR-style) histogram: values below HIST_SUB get a bucket each,
+ * and every power of two above is split into HIST_SUB buckets, so a recorded
+ * value is off by less than 1/HIST_SUB (3%) anywhere up to 2^HIST_MAX_BITS us
+ * (12 days). Recording is one clock read and a few integer ops; reporting is
+ * the `stats` builtin and stats_dump() (ISH_STATS_FILE on exit and on SIGUSR1). */
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+enum stat_id {
+    STAT_PROMPT,            /* line read -> next prompt */
+    STAT_EXEC_SPAWN,        /* pipes, fork/posix_spawn of every stage */
+    STAT_EXEC_WAIT,         /* foreground job running until it exits or stops */
+    STAT_HISTORY_LOG,       /* log_command: queue the row */
+    STAT_HISTORY_FLUSH,     /* one SQLite transaction of queued rows */
+    STAT_SUGGEST_SEND,      /* queue a server request (connect and hello included) */
+    STAT_SUGGEST_RTT,       /* blocking request -> answer (get_suggestion) */
+    STAT_SUGGEST_HINT,      /* hint request -> answer read at the next prompt */
+    STAT_SUGGEST_NATIVE,    /* in-process answer from suggest.bin */
+    STAT_COUNT
+};
+
+struct histogram {
+    const char *name;
+    const char *help;
+    unsigned long long count, sum_us, min_us, max_us;
+    uint32_t buckets[HIST_BUCKETS];
+};
+
+static struct histogram g_stats[STAT_COUNT] = {
+    [STAT_PROMPT] = { "prompt", "Time from reading a command line to the next prompt" },
+    [STAT_EXEC_SPAWN] = { "exec_spawn", "Time to create the pipes and processes of a pipeline" },
+    [STAT_EXEC_WAIT] = { "exec_wait", "Time spent waiting for a foreground job" },
+    [STAT_HISTORY_LOG] = { "history_log", "Time to queue a history row" },
+    [STAT_HISTORY_FLUSH] = { "history_flush", "Time of one history insert transaction" },
+    [STAT_SUGGEST_SEND] = { "suggest_send", "Time to send a suggestion request" },
+    [STAT_SUGGEST_RTT] = { "suggest_rtt", "Suggestion request round trip" },
+    [STAT_SUGGEST_HINT] = { "suggest_hint", "Hint request until its answer was read" },
+    [STAT_SUGGEST_NATIVE] = { "suggest_native", "In-process suggestion from the mapped model" },
+};
+
+/* Hint answers that had not arrived when the next prompt was printed */
+static unsigned long long g_hints_missed = 0;
+
+static int hist_bucket(unsigned long long v) {
+    if (v < HIST_SUB) return (int)v;
+    if (v >> HIST_MAX_BITS) v = (1ULL << HIST_MAX_BITS) - 1;
+    int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (int)((v >> shift) - HIST_SUB);
+}
+
+/* Largest value that falls in bucket i */
+static unsigned long long hist_bucket_high(int i) {
+    if (i < HIST_SUB) return (unsigned long long)i;
+    int shift = i / HIST_SUB - 1;
+    return ((unsigned long long)(HIST_SUB + i % HIST_SUB) << shift) + (1ULL << shift) - 1;
+}
+
+static void stat_record(enum stat_id id, long long us) {
+    struct histogram *h = &g_stats[id];
+    unsigned long long v = us > 0 ? (unsigned long long)us : 0;
+    if (h->count == 0 || v < h->min_us) h->min_us = v;
+    if (v > h->max_us) h->max_us = v;
+    h->count++;
+    h->sum_us += v;
+    h->buckets[hist_bucket(v)]++;
+}
+
+static void stat_since(enum stat_id id, long long start_us) {
+    stat_record(id, monotonic_us() - start_us);
+}
+
+/* Pick value from env var `name` if it is one of the allowed keywords, else def */
+static const char *pragma_value(const char *name, const char *const *allowed, const char *def) {
+    const char *v = getenv(name);
+    if (!v || !*v) return def;
+    for (int i = 0; allowed[i]; ++i) {
+        if (strcasecmp(v, allowed[i]) == 0) return allowed[i];
+    }
+    fprintf(stderr, "Warning: ignoring %s=%s\n", name, v);
+    return def;
+}
+
+static void apply_db_pragmas(void) {
+    static const char *const journal_modes[] = { "WAL", "DELETE", "TRUNCATE", "PERSIST", "MEMORY", "OFF", NULL };
+    static const char *const sync_levels[] = { "OFF", "NORMAL", "FULL", "EXTRA", NULL };
+    char sql[128];
+    snprintf(sql, sizeof(sql), "PRAGMA journal_mode=%s;",
+             pragma_value("ISH_DB_JOURNAL_MODE", journal_modes, "WAL"));
+    sqlite3_exec(g_db, sql, 0, 0, NULL);
+    snprintf(sql, sizeof(sql), "PRAGMA synchronous=%s;",
+             pragma_value("ISH_DB_SYNCHRONOUS", sync_levels, "NORMAL"));
+    sqlite3_exec(g_db, sql, 0, 0, NULL);
+}
+
+/* Indexes for history queries: ts for --since/--until, cmd for --prefix range
+ * scans, and an FTS5 trigram index (kept in sync by triggers) for --grep and
+ * reverse search. Without FTS5 --grep falls back to a newest-first scan. */
+static int g_have_fts = 0;
+
+/* History query filters and orders. Every combination maps to one SQL statement
+ * that is prepared on first use and cached in g_history_stmts. */
+#define HQ_PREFIX   0x01
+#define HQ_GREP_FTS 0x02
+#define HQ_GREP_SCAN 0x04
+#define HQ_SINCE    0x08
+#define HQ_UNTIL    0x10
+#define HQ_BEFORE   0x20
+#define HQ_BY_WALL  0x40        /* slowest first (rows with a result only) */
+#define HQ_BY_CPU   0x80        /* most user + sys CPU first */
+#define HQ_COMBOS   0x100
+
+enum history_order { HISTORY_NEWEST, HISTORY_SLOWEST, HISTORY_TOP_CPU };
+
+struct history_query {
+    int limit;
+    const char *prefix;
+    const char *grep;
+    const char *since;              /* 'YYYY-MM-DD[ HH:MM:SS]' UTC, as stored in ts */
+    const char *until;
+    sqlite3_int64 before;           /* only ids below this (paging), 0 = no bound */
+    enum history_order order;
+};
+
+/* One row as delivered to history_query_run() callbacks */
+struct history_row {
+    sqlite3_int64 id;
+    const char *ts;
+    const char *cmd;
+    int has_result;                 /* the command's status and rusage were recorded */
+    int status;
+    long long wall_us, user_us, sys_us, maxrss_kb, inblock, oublock;
+};
+
+static sqlite3_stmt *g_history_stmts[HQ_COMBOS];
+
+static void init_history_search(void) {
+    sqlite3_exec(g_db, "CREATE INDEX IF NOT EXISTS idx_history_ts ON history(ts);"
+                       "CREATE INDEX IF NOT EXISTS idx_history_cmd ON history(cmd);", 0, 0, NULL);
+
+    sqlite3_stmt *stmt = NULL;
+    int existed = 0;
+    if (sqlite3_prepare_v2(g_db, "SELECT 1 FROM sqlite_master WHERE name = 'history_fts';", -1, &stmt, NULL) == SQLITE_OK) {
+        existed = sqlite3_step(stmt) == SQLITE_ROW;
+        sqlite3_finalize(stmt);
+    }
+    const char *fts =
+        "CREATE VIRTUAL TABLE IF NOT EXISTS history_fts USING fts5(cmd, content='history', content_rowid='id', tokenize='trigram');"
+        "CREATE TRIGGER IF NOT EXISTS history_fts_ai AFTER INSERT ON history BEGIN"
+        "  INSERT INTO history_fts(rowid, cmd) VALUES (new.id, new.cmd); END;"
+        "CREATE TRIGGER IF NOT EXISTS history_fts_ad AFTER DELETE ON history BEGIN"
+        "  INSERT INTO history_fts(history_fts, rowid, cmd) VALUES ('delete', old.id, old.cmd); END;"
+        "CREATE TRIGGER IF NOT EXISTS history_fts_au AFTER UPDATE OF cmd ON history BEGIN"
+        "  INSERT INTO history_fts(history_fts, rowid, cmd) VALUES ('delete', old.id, old.cmd);"
+        "  INSERT INTO history_fts(rowid, cmd) VALUES (new.id, new.cmd); END;";
+    if (sqlite3_exec(g_db, fts, 0, 0, NULL) != SQLITE_OK) return;
+    /* index rows logged before the FTS table existed */
+    if (!existed) sqlite3_exec(g_db, "INSERT INTO history_fts(history_fts) VALUES ('rebuild');", 0, 0, NULL);
+    g_have_fts = 1;
+}
+
+/* ISH_HISTORY_DB, else $HOME/DB_PATH (where the suggestion server looks), else DB_PATH */
+static const char *history_db_path(void) {
+    static char path[MAXLINE];
+    const char *v = getenv("ISH_HISTORY_DB");
+    if (v && *v) return v;
+    const char *home = getenv("HOME");
+    if (home && *home) {
+        int n = snprintf(path, sizeof(path), "%s/%s", home, DB_PATH);
+        if (n > 0 && (size_t)n < sizeof(path)) return path;
+    }
+    return DB_PATH;
+}
 
 /* Initialize SQLite database and history table */
 int init_db(const char *path) {
@@ -61,6 +352,7 @@ int init_db(const char *path) {
         fprintf(stderr, "Cannot open database: %s\n", sqlite3_errmsg(g_db));
         return rc;
     }
+    apply_db_pragmas();
     const char *sql = "CREATE TABLE IF NOT EXISTS history (id INTEGER PRIMARY KEY AUTOINCREMENT, cmd TEXT NOT NULL, ts DATETIME DEFAULT CURRENT_TIMESTAMP);";
     char *errmsg = NULL;
     rc = sqlite3_exec(g_db, sql, 0, 0, &errmsg);
@@ -69,50 +361,439 @@ int init_db(const char *path) {
         sqlite3_free(errmsg);
         return rc;
     }
+    /* columns added later; older databases get them on first open */
+    static const char *const added[][2] = {
+        { "cwd", "TEXT" }, { "status", "INTEGER" }, { "wall_us", "INTEGER" },
+        { "user_us", "INTEGER" }, { "sys_us", "INTEGER" }, { "maxrss_kb", "INTEGER" },
+        { "inblock", "INTEGER" }, { "oublock", "INTEGER" },
+    };
+    for (size_t i = 0; i < sizeof(added) / sizeof(added[0]); ++i) {
+        char q[128];
+        sqlite3_stmt *probe = NULL;
+        snprintf(q, sizeof(q), "SELECT %s FROM history LIMIT 0;", added[i][0]);
+        if (sqlite3_prepare_v2(g_db, q, -1, &probe, NULL) != SQLITE_OK) {
+            snprintf(q, sizeof(q), "ALTER TABLE history ADD COLUMN %s %s;", added[i][0], added[i][1]);
+            sqlite3_exec(g_db, q, 0, 0, NULL);
+        }
+        sqlite3_finalize(probe);
+    }
+    init_history_search();
+
+    /* ts is bound explicitly: rows are written some time after the command ran */
+    const char *ins = "INSERT INTO history (cmd, ts, cwd, status, wall_us, user_us, sys_us, maxrss_kb, inblock, oublock)"
+                      " VALUES (?, datetime(?, 'unixepoch'), ?, ?, ?, ?, ?, ?, ?, ?);";
+    rc = sqlite3_prepare_v2(g_db, ins, -1, &g_insert_stmt, NULL);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(g_db));
+        return rc;
+    }
     return SQLITE_OK;
 }
 
-/* Insert command into history */
-void log_command(const char *cmd) {
-    if (!g_db || !cmd || strlen(cmd) == 0) return;
-    const char *sql = "INSERT INTO history (cmd) VALUES (?);";
-    sqlite3_stmt *stmt = NULL;
-    if (sqlite3_prepare_v2(g_db, sql, -1, &stmt, NULL) != SQLITE_OK) return;
-    sqlite3_bind_text(stmt, 1, cmd, -1, SQLITE_TRANSIENT);
-    sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
+/* Release the first n queued commands */
+static void history_drop_queued(int n) {
+    for (int i = 0; i < n; ++i) {
+        free(g_hist_queue[i].cmd);
+        free(g_hist_queue[i].cwd);
+    }
+    memmove(g_hist_queue, g_hist_queue + n, (size_t)(g_hist_pending - n) * sizeof(g_hist_queue[0]));
+    g_hist_pending -= n;
 }
 
-/* Print history (most recent N) */
-void print_history(int limit) {
+/* Write all queued commands in a single transaction */
+void history_flush(void) {
+    if (!g_db || !g_insert_stmt || g_hist_pending == 0) return;
+    long long t0 = monotonic_us();
+    if (sqlite3_exec(g_db, "BEGIN;", 0, 0, NULL) != SQLITE_OK) return;
+    int done = 0;
+    for (; done < g_hist_pending; ++done) {
+        const struct history_entry *e = &g_hist_queue[done];
+        sqlite3_bind_text(g_insert_stmt, 1, e->cmd, -1, SQLITE_STATIC);
+        sqlite3_bind_int64(g_insert_stmt, 2, (sqlite3_int64)e->ts);
+        if (e->cwd) sqlite3_bind_text(g_insert_stmt, 3, e->cwd, -1, SQLITE_STATIC);
+        else sqlite3_bind_null(g_insert_stmt, 3);
+        if (e->has_result) {
+            const long long vals[] = { e->status, e->wall_us, e->user_us, e->sys_us, e->maxrss_kb, e->inblock, e->oublock };
+            for (int c = 0; c < 7; ++c) sqlite3_bind_int64(g_insert_stmt, 4 + c, vals[c]);
+        } else {
+            for (int c = 0; c < 7; ++c) sqlite3_bind_null(g_insert_stmt, 4 + c);
+        }
+        int rc = sqlite3_step(g_insert_stmt);
+        sqlite3_reset(g_insert_stmt);
+        if (rc != SQLITE_DONE) break;
+    }
+    sqlite3_clear_bindings(g_insert_stmt);
+    if (done < g_hist_pending || sqlite3_exec(g_db, "COMMIT;", 0, 0, NULL) != SQLITE_OK) {
+        /* keep the queue and retry on the next flush (e.g. database locked) */
+        sqlite3_exec(g_db, "ROLLBACK;", 0, 0, NULL);
+        return;
+    } else {
+        history_drop_queued(g_hist_pending);
+    }
+    stat_since(STAT_HISTORY_FLUSH, t0);
+}
+
+/* Script mode: fewer, larger transactions; the flush interval still applies */
+void history_begin_batch(void) {
+    g_hist_flush_at = HISTORY_BATCH_PENDING;
+}
+
+/* Flush when the oldest queued command has waited long enough */
+void history_flush_if_due(void) {
+    if (g_hist_pending > 0 && monotonic_ms() - g_hist_oldest_ms >= HISTORY_FLUSH_INTERVAL_MS)
+        history_flush();
+}
+
+/* Time left until the oldest queued command is due, for waits that wake up to
+ * commit it; NULL when nothing is queued */
+static struct timespec *history_flush_timeout(struct timespec *ts) {
+    if (g_hist_pending == 0) return NULL;
+    long long left = g_hist_oldest_ms + HISTORY_FLUSH_INTERVAL_MS - monotonic_ms();
+    if (left < 0) left = 0;
+    ts->tv_sec = (time_t)(left / 1000);
+    ts->tv_nsec = (long)(left % 1000) * 1000000;
+    return ts;
+}
+
+/* sigsuspend(waitmask) that also commits queued history when it comes due, so a
+ * long foreground job or `wait` does not hold back the commands run before it */
+static void history_wait(const sigset_t *waitmask) {
+    struct timespec ts;
+    if (pselect(0, NULL, NULL, NULL, history_flush_timeout(&ts), waitmask) == 0) history_flush_if_due();
+}
+
+/* The prompt's read is interrupted by a one-shot SIGALRM (no SA_RESTART) when
+ * the oldest queued command comes due; see prompt_getline() */
+static volatile sig_atomic_t g_hist_timer_fired = 0;
+
+static void sigalrm_handler(int signo) {
+    (void)signo;
+    g_hist_timer_fired = 1;
+}
+
+/* Arm the SIGALRM for the oldest queued command (if any), or disarm it */
+static void history_arm_timer(int arm) {
+    struct itimerval it;
+    struct timespec ts;
+    memset(&it, 0, sizeof(it));
+    if (arm && history_flush_timeout(&ts)) {
+        it.it_value.tv_sec = ts.tv_sec;
+        it.it_value.tv_usec = ts.tv_nsec / 1000;
+        if (it.it_value.tv_sec == 0 && it.it_value.tv_usec == 0) it.it_value.tv_usec = 1; /* 0 disarms */
+    }
+    g_hist_timer_fired = 0;
+    setitimer(ITIMER_REAL, &it, NULL);
+}
+
+/* Flush and release the cached statement and database handle */
+void close_db(void) {
     if (!g_db) return;
-    const char *sql = "SELECT id, ts, cmd FROM history ORDER BY id DESC LIMIT ?;";
-    sqlite3_stmt *stmt = NULL;
-    if (sqlite3_prepare_v2(g_db, sql, -1, &stmt, NULL) != SQLITE_OK) return;
-    sqlite3_bind_int(stmt, 1, limit);
-    while (sqlite3_step(stmt) == SQLITE_ROW) {
-        int id = sqlite3_column_int(stmt, 0);
+    free(g_hist_current.cmd);
+    free(g_hist_current.cwd);
+    g_hist_current.cmd = g_hist_current.cwd = NULL;
+    history_flush();
+    history_drop_queued(g_hist_pending);
+    sqlite3_finalize(g_insert_stmt);
+    g_insert_stmt = NULL;
+    for (int i = 0; i < HQ_COMBOS; ++i) {
+        sqlite3_finalize(g_history_stmts[i]);
+        g_history_stmts[i] = NULL;
+    }
+    sqlite3_close(g_db);
+    g_db = NULL;
+}
+
+static void log_command_finish(const struct cmd_result *r, long long wall_us);
+
+/* Start the history row of command cmd[0..len) (about to run in the current
+ * directory); log_command_finish() queues it with what the command did. */
+void log_command_n(const char *cmd, size_t len) {
+    if (!cmd || len == 0) return;
+    long long t0 = monotonic_us();
+    if (grow_buf(&g_last_cmd, &g_last_cmd_cap, len + 1) == 0) {
+        memcpy(g_last_cmd, cmd, len);
+        g_last_cmd[len] = '\0';
+        g_last_status = -1;
+        g_context_changed = 1;
+    }
+    if (!g_db) return;
+    if (g_hist_current.cmd) log_command_finish(NULL, 0);
+    char *copy = strndup(cmd, len);
+    if (!copy) return;
+    memset(&g_hist_current, 0, sizeof(g_hist_current));
+    g_hist_current.cmd = copy;
+    g_hist_current.cwd = g_cwd[0] ? strdup(g_cwd) : NULL;
+    g_hist_current.ts = time(NULL);
+    stat_since(STAT_HISTORY_LOG, t0);
+}
+
+/* Queue the started row with the line's result (NULL: unknown) */
+static void log_command_finish(const struct cmd_result *r, long long wall_us) {
+    if (!g_hist_current.cmd) return;
+    if (g_hist_pending == HISTORY_QUEUE_MAX) { /* database unwritable for a long time */
+        free(g_hist_current.cmd);
+        free(g_hist_current.cwd);
+        g_hist_current.cmd = g_hist_current.cwd = NULL;
+        return;
+    }
+    struct history_entry *e = &g_hist_current;
+    if (r && r->have_status) {
+        e->has_result = 1;
+        e->status = r->status;
+        e->wall_us = wall_us;
+        e->user_us = (long long)r->ru.ru_utime.tv_sec * 1000000 + r->ru.ru_utime.tv_usec;
+        e->sys_us = (long long)r->ru.ru_stime.tv_sec * 1000000 + r->ru.ru_stime.tv_usec;
+        e->maxrss_kb = r->ru.ru_maxrss;
+#ifdef __APPLE__
+        e->maxrss_kb /= 1024; /* bytes on macOS */
+#endif
+        e->inblock = r->ru.ru_inblock;
+        e->oublock = r->ru.ru_oublock;
+    }
+    if (g_hist_pending == 0) g_hist_oldest_ms = monotonic_ms();
+    g_hist_queue[g_hist_pending++] = *e;
+    e->cmd = e->cwd = NULL;
+    if (g_hist_pending >= g_hist_flush_at) history_flush();
+}
+
+void log_command(const char *cmd) {
+    if (cmd) log_command_n(cmd, strlen(cmd));
+}
+
+#define HISTORY_ROW_COLUMNS \
+    "h.id, h.ts, h.cmd, h.status, h.wall_us, h.user_us, h.sys_us, h.maxrss_kb, h.inblock, h.oublock"
+
+static sqlite3_stmt *history_stmt(int flags) {
+    if (g_history_stmts[flags]) return g_history_stmts[flags];
+    char sql[1024];
+    size_t n = 0;
+    int nconds = 0;
+    if (flags & HQ_GREP_FTS)
+        n += snprintf(sql + n, sizeof(sql) - n, "SELECT %s FROM history_fts JOIN history h ON h.id = history_fts.rowid",
+                      HISTORY_ROW_COLUMNS);
+    else
+        n += snprintf(sql + n, sizeof(sql) - n, "SELECT %s FROM history h", HISTORY_ROW_COLUMNS);
+#define HQ_COND(flag, text) \
+    if (flags & (flag)) n += snprintf(sql + n, sizeof(sql) - n, "%s%s", nconds++ ? " AND " : " WHERE ", text)
+    HQ_COND(HQ_GREP_FTS, "history_fts MATCH :grep");
+    HQ_COND(HQ_GREP_SCAN, "instr(lower(h.cmd), lower(:grep)) > 0");
+    HQ_COND(HQ_PREFIX, "h.cmd >= :lo AND h.cmd < :hi");
+    HQ_COND(HQ_SINCE, "h.ts >= :since");
+    HQ_COND(HQ_UNTIL, "h.ts < :until");
+    HQ_COND(HQ_BEFORE, "h.id < :before");
+    HQ_COND(HQ_BY_WALL | HQ_BY_CPU, "h.wall_us IS NOT NULL");
+#undef HQ_COND
+    snprintf(sql + n, sizeof(sql) - n, " ORDER BY %s LIMIT :limit;",
+             (flags & HQ_BY_WALL) ? "h.wall_us DESC" : (flags & HQ_BY_CPU) ? "h.user_us + h.sys_us DESC" : "h.id DESC");
+    if (sqlite3_prepare_v3(g_db, sql, -1, SQLITE_PREPARE_PERSISTENT, &g_history_stmts[flags], NULL) != SQLITE_OK) {
+        fprintf(stderr, "history: %s\n", sqlite3_errmsg(g_db));
+        return NULL;
+    }
+    return g_history_stmts[flags];
+}
+
+static void bind_named_text(sqlite3_stmt *stmt, const char *name, const char *val, int len) {
+    int idx = sqlite3_bind_parameter_index(stmt, name);
+    if (idx > 0) sqlite3_bind_text(stmt, idx, val, len, SQLITE_TRANSIENT);
+}
+
+/* Run a history query and stream matching rows (newest first, or in q->order)
+ * to cb. Returns the number of rows delivered, or -1 on error. */
+int history_query_run(const struct history_query *q, void (*cb)(const struct history_row *row, void *ctx), void *ctx) {
+    if (!g_db) return -1;
+    history_flush();
+    int flags = 0;
+    size_t plen = q->prefix ? strlen(q->prefix) : 0;
+    if (plen > 0) flags |= HQ_PREFIX;
+    if (q->grep && *q->grep) {
+        /* the trigram tokenizer cannot match needles shorter than 3 characters */
+        flags |= (g_have_fts && strlen(q->grep) >= 3) ? HQ_GREP_FTS : HQ_GREP_SCAN;
+    }
+    if (q->since) flags |= HQ_SINCE;
+    if (q->until) flags |= HQ_UNTIL;
+    if (q->before > 0) flags |= HQ_BEFORE;
+    if (q->order == HISTORY_SLOWEST) flags |= HQ_BY_WALL;
+    else if (q->order == HISTORY_TOP_CPU) flags |= HQ_BY_CPU;
+
+    sqlite3_stmt *stmt = history_stmt(flags);
+    if (!stmt) return -1;
+
+    if (flags & HQ_PREFIX) {
+        /* upper bound of the range: prefix with its last byte incremented */
+        char *hi = malloc(plen);
+        if (!hi) {
+            fprintf(stderr, "history: out of memory\n");
+            return -1;
+        }
+        memcpy(hi, q->prefix, plen);
+        while (plen > 0 && (unsigned char)hi[plen - 1] == 0xFF) plen--;
+        int hlen = (int)plen;
+        if (hlen > 0) hi[hlen - 1]++;
+        else { hi[0] = (char)0xFF; hlen = 1; }
+        bind_named_text(stmt, ":lo", q->prefix, -1);
+        bind_named_text(stmt, ":hi", hi, hlen);
+        free(hi);
+    }
+    if (flags & HQ_GREP_FTS) {
+        /* quote as a single FTS5 string so operators in the needle are literal */
+        char *phrase = malloc(2 * strlen(q->grep) + 2);
+        if (!phrase) {
+            sqlite3_clear_bindings(stmt);
+            fprintf(stderr, "history: out of memory\n");
+            return -1;
+        }
+        size_t pn = 0;
+        phrase[pn++] = '"';
+        for (const char *p = q->grep; *p; ++p) {
+            if (*p == '"') phrase[pn++] = '"';
+            phrase[pn++] = *p;
+        }
+        phrase[pn++] = '"';
+        bind_named_text(stmt, ":grep", phrase, (int)pn);
+        free(phrase);
+    } else if (flags & HQ_GREP_SCAN) {
+        bind_named_text(stmt, ":grep", q->grep, -1);
+    }
+    if (flags & HQ_SINCE) bind_named_text(stmt, ":since", q->since, -1);
+    if (flags & HQ_UNTIL) bind_named_text(stmt, ":until", q->until, -1);
+    if (flags & HQ_BEFORE) sqlite3_bind_int64(stmt, sqlite3_bind_parameter_index(stmt, ":before"), q->before);
+    sqlite3_bind_int(stmt, sqlite3_bind_parameter_index(stmt, ":limit"), q->limit);
+
+    int rows = 0;
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
         const unsigned char *ts = sqlite3_column_text(stmt, 1);
         const unsigned char *cmd = sqlite3_column_text(stmt, 2);
-        printf("%4d  %s  %s\n", id, ts ? (const char*)ts : "", cmd ? (const char*)cmd : "");
+        struct history_row row = {
+            .id = sqlite3_column_int64(stmt, 0),
+            .ts = ts ? (const char *)ts : "",
+            .cmd = cmd ? (const char *)cmd : "",
+            .has_result = sqlite3_column_type(stmt, 3) != SQLITE_NULL,
+            .status = sqlite3_column_int(stmt, 3),
+            .wall_us = sqlite3_column_int64(stmt, 4),
+            .user_us = sqlite3_column_int64(stmt, 5),
+            .sys_us = sqlite3_column_int64(stmt, 6),
+            .maxrss_kb = sqlite3_column_int64(stmt, 7),
+            .inblock = sqlite3_column_int64(stmt, 8),
+            .oublock = sqlite3_column_int64(stmt, 9),
+        };
+        cb(&row, ctx);
+        rows++;
+    }
+    if (rc != SQLITE_DONE) fprintf(stderr, "history: %s\n", sqlite3_errmsg(g_db));
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    return rows;
+}
+
+static void print_history_row(const struct history_row *row, void *ctx) {
+    (void)ctx;
+    printf("%4lld  %s  %s\n", (long long)row->id, row->ts, row->cmd);
+}
+
+/* --slowest / --top-cpu: the recorded resource use before each command */
+static void print_history_usage_row(const struct history_row *row, void *ctx) {
+    (void)ctx;
+    printf("%4lld  %s %9.3f %9.3f %9.3f %9lld %7lld %7lld %4d  %s\n", (long long)row->id, row->ts,
+           row->wall_us / 1e6, row->user_us / 1e6, row->sys_us / 1e6,
+           row->maxrss_kb, row->inblock, row->oublock, row->status, row->cmd);
+}
+
+/* Print history (most recent N) */
+void print_history(int limit) {
+    struct history_query q = { .limit = limit };
+    history_query_run(&q, print_history_row, NULL);
+}
+
+/* history -r: id and command only */
+static void print_history_match(const struct history_row *row, void *ctx) {
+    (void)ctx;
+    printf("%4lld  %s\n", (long long)row->id, row->cmd);
+}
+
+static void copy_history_cmd(const struct history_row *row, void *ctx) {
+    struct { char *out; size_t outlen; sqlite3_int64 id; } *r = ctx;
+    snprintf(r->out, r->outlen, "%s", row->cmd);
+    r->id = row->id;
+}
+
+/* Reverse incremental search (Ctrl-R style): newest command containing needle
+ * with an id below before_id (0 = from the end). Copies it into out and returns
+ * its id, or 0 when there is no further match. */
+sqlite3_int64 history_reverse_search(const char *needle, sqlite3_int64 before_id, char *out, size_t outlen) {
+    struct { char *out; size_t outlen; sqlite3_int64 id; } r = { out, outlen, 0 };
+    struct history_query q = { .limit = 1, .grep = needle, .before = before_id };
+    if (history_query_run(&q, copy_history_cmd, &r) <= 0) return 0;
+    return r.id;
+}
+
+/* Accept "30m", "12h", "7d", "2w" relative to now, or an absolute UTC timestamp */
+static const char *history_time_arg(const char *arg, char *buf, size_t buflen) {
+    char *end = NULL;
+    long n = strtol(arg, &end, 10);
+    if (end == arg || end[0] == '\0' || end[1] != '\0') return arg;
+    long mult;
+    switch (*end) {
+    case 's': mult = 1; break;
+    case 'm': mult = 60; break;
+    case 'h': mult = 3600; break;
+    case 'd': mult = 86400; break;
+    case 'w': mult = 7 * 86400; break;
+    default: return arg;
     }
-    sqlite3_finalize(stmt);
+    time_t t = time(NULL) - (time_t)(n * mult);
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    strftime(buf, buflen, "%Y-%m-%d %H:%M:%S", &tm);
+    return buf;
 }
 
-/* Trim whitespace in-place */
-char *trim(char *s) {
-    if (!s) return s;
-    while (*s && (*s == ' ' || *s == '\t' || *s == '\n' || *s == '\r')) s++;
-    if (*s == '\0') return s;
-    char *end = s + strlen(s) - 1;
-    while (end > s && (*end == ' ' || *end == '\t' || *end == '\n' || *end == '\r')) *end-- = '\0';
-    return s;
+/* history [N] [--grep TEXT] [--prefix TEXT] [--since WHEN] [--until WHEN] [--before ID]
+ * history --slowest | --top-cpu [N] [filters]   (commands ranked by wall / CPU time)
+ * history -r TEXT [--before ID]     (newest match only, for reverse search) */
+void builtin_history(char **argv) {
+    struct history_query q = { .limit = 0 };
+    char since_buf[32], until_buf[32];
+    const char *reverse = NULL;
+    for (int i = 1; argv[i]; ++i) {
+        const char *opt = argv[i];
+        const char *val = argv[i + 1];
+        if (strcmp(opt, "--grep") == 0 && val) { q.grep = val; i++; }
+        else if (strcmp(opt, "-r") == 0 && val) { reverse = val; i++; }
+        else if (strcmp(opt, "--prefix") == 0 && val) { q.prefix = val; i++; }
+        else if (strcmp(opt, "--since") == 0 && val) { q.since = history_time_arg(val, since_buf, sizeof(since_buf)); i++; }
+        else if (strcmp(opt, "--until") == 0 && val) { q.until = history_time_arg(val, until_buf, sizeof(until_buf)); i++; }
+        else if (strcmp(opt, "--before") == 0 && val) { q.before = strtoll(val, NULL, 10); i++; }
+        else if (strcmp(opt, "--slowest") == 0) q.order = HISTORY_SLOWEST;
+        else if (strcmp(opt, "--top-cpu") == 0) q.order = HISTORY_TOP_CPU;
+        else if (opt[0] != '-' && atoi(opt) > 0) q.limit = atoi(opt);
+        else {
+            fprintf(stderr, "usage: history [N] [--grep TEXT] [--prefix TEXT] [--since WHEN] [--until WHEN] [--before ID]"
+                            " [--slowest | --top-cpu] | -r TEXT\n");
+            return;
+        }
+    }
+    if (q.limit == 0) q.limit = q.order == HISTORY_NEWEST ? 50 : 10;
+    if (reverse) {
+        /* printed from the row, so a match of any length comes out whole */
+        struct history_query r = { .limit = 1, .grep = reverse, .before = q.before };
+        history_query_run(&r, print_history_match, NULL);
+        return;
+    }
+    if (q.order != HISTORY_NEWEST) {
+        printf("%4s  %-19s %9s %9s %9s %9s %7s %7s %4s  %s\n",
+               "id", "ts", "wall(s)", "user(s)", "sys(s)", "rss(KB)", "in", "out", "exit", "command");
+        history_query_run(&q, print_history_usage_row, NULL);
+        return;
+    }
+    history_query_run(&q, print_history_row, NULL);
 }
 
-/* Simple JSON escaping for double quotes and backslashes (in-place into dst; ensure dst has space) */
-static void json_escape(const char *src, char *dst, size_t dstlen) {
+/* JSON string escaping of src[0..srclen) into dst (always NUL-terminated; output
+ * is cut at a character boundary when dst is too small) */
+static void json_escape(const char *src, size_t srclen, char *dst, size_t dstlen) {
     size_t di = 0;
-    for (size_t si = 0; src[si] != '\0' && di + 1 < dstlen; ++si) {
+    for (size_t si = 0; si < srclen && di + 1 < dstlen; ++si) {
         unsigned char c = src[si];
         if (c == '"' || c == '\\') {
             if (di + 2 < dstlen) {
@@ -122,6 +803,9 @@ static void json_escape(const char *src, char *dst, size_t dstlen) {
         } else if (c == '\n') {
             if (di + 2 < dstlen) { dst[di++] = '\\'; dst[di++] = 'n'; }
             else break;
+        } else if (c < 0x20) {
+            if (di + 6 < dstlen) di += (size_t)snprintf(dst + di, dstlen - di, "\\u%04x", c);
+            else break;
         } else {
             dst[di++] = c;
         }
@@ -129,235 +813,3436 @@ static void json_escape(const char *src, char *dst, size_t dstlen) {
     dst[di] = '\0';
 }
 
-/* Parse a command line into argv array. Returns argc. Recognizes '&' to indicate background.
-   NOTE: This simple parser doesn't handle quotes or escapes (can be extended). */
-int parse_line(char *line, char **argv, int *background) {
-    int argc = 0;
-    *background = 0;
-    char *tok = strtok(line, " \t\n");
-    while (tok && argc < MAXARGS - 1) {
-        if (strcmp(tok, "&") == 0) {
-            *background = 1;
-        } else {
-            argv[argc++] = tok;
+/* Per-command arena. Everything a command line needs only until the next one is
+ * read (its token array, parse tables, argv strings) is bump-allocated here and
+ * released all at once by arena_reset() at the top of the REPL loop, so the
+ * sizes follow the line instead of fixed limits and none of it is freed piece
+ * by piece. A line bigger than the current block chains more blocks; the reset
+ * then replaces the chain with one block of the combined size, so after the
+ * longest line so far a command costs no malloc at all. */
+#define ARENA_BLOCK 65536
+#define ARENA_ALIGN 16
+
+struct arena_block {
+    struct arena_block *next;       /* older, fuller blocks */
+    size_t cap, used;
+    _Alignas(ARENA_ALIGN) unsigned char data[];
+};
+
+struct arena {
+    struct arena_block *head;       /* allocations come from here */
+    size_t total;                   /* capacity of the whole chain */
+};
+
+static struct arena g_cmd_arena;
+
+static struct arena_block *arena_add_block(struct arena *a, size_t cap) {
+    struct arena_block *b = malloc(sizeof(*b) + cap);
+    if (!b) return NULL;
+    b->cap = cap;
+    b->used = 0;
+    b->next = a->head;
+    a->head = b;
+    a->total += cap;
+    return b;
+}
+
+/* n bytes aligned to ARENA_ALIGN, valid until the next arena_reset(); NULL when
+ * out of memory */
+static void *arena_alloc(struct arena *a, size_t n) {
+    n = (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    struct arena_block *b = a->head;
+    if (!b || b->cap - b->used < n) {
+        size_t cap = a->total > ARENA_BLOCK ? a->total : ARENA_BLOCK;
+        while (cap < n) cap *= 2;
+        if (!(b = arena_add_block(a, cap))) return NULL;
+    }
+    void *p = b->data + b->used;
+    b->used += n;
+    return p;
+}
+
+/* Resize the most recent allocation p (old bytes) to n bytes, in place when it
+ * is the last thing in its block and the block has room, otherwise by copying */
+static void *arena_realloc(struct arena *a, void *p, size_t old, size_t n) {
+    struct arena_block *b = a->head;
+    if (p && b) {
+        size_t off = (size_t)((unsigned char *)p - b->data);
+        size_t end = off + ((old + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1));
+        if (off < b->cap && end == b->used && n <= b->cap - off) {
+            b->used = off + ((n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1));
+            return p;
         }
-        tok = strtok(NULL, " \t\n");
     }
-    argv[argc] = NULL;
-    return argc;
+    void *q = arena_alloc(a, n);
+    if (q && p) memcpy(q, p, old < n ? old : n);
+    return q;
 }
 
-/* Try a TCP connection to suggestion server on localhost:8888
- * This function returns a malloc'd string on success or NULL on failure.
- * Behavior: try Unix domain socket if available; otherwise try TCP.
- */
-char *get_suggestion_tcp(const char *line_prefix, const char *model, int timeout_ms) {
-    if (!line_prefix || strlen(line_prefix) == 0) return NULL;
-    int sock = -1;
-    struct sockaddr_in serv;
-    sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) return NULL;
-    memset(&serv, 0, sizeof(serv));
-    serv.sin_family = AF_INET;
-    serv.sin_port = htons(SUGGEST_PORT);
-    if (inet_pton(AF_INET, SUGGEST_HOST, &serv.sin_addr) <= 0) {
-        close(sock);
-        return NULL;
+static void arena_reset(struct arena *a) {
+    struct arena_block *b = a->head;
+    if (!b) return;
+    if (!b->next) {
+        b->used = 0;
+        return;
     }
-    if (connect(sock, (struct sockaddr*)&serv, sizeof(serv)) < 0) {
-        close(sock);
-        return NULL;
+    size_t total = a->total;
+    while (b) {
+        struct arena_block *next = b->next;
+        free(b);
+        b = next;
+    }
+    a->head = NULL;
+    a->total = 0;
+    arena_add_block(a, total); /* on failure the next alloc starts small again */
+}
+
+static void arena_free(struct arena *a) {
+    while (a->head) {
+        struct arena_block *next = a->head->next;
+        free(a->head);
+        a->head = next;
     }
+    a->total = 0;
+}
 
-    char payload[MAXLINE];
-    char esc_cmd[MAXLINE];
-    json_escape(line_prefix, esc_cmd, sizeof(esc_cmd));
-    snprintf(payload, sizeof(payload), "{\"cmd\":\"%s\",\"model\":\"%s\"}\n", esc_cmd, model ? model : DEFAULT_SUGGEST_MODEL);
+/* Command line grammar handled by parse_line():
+ *   line     := pipeline { (';' | '&') pipeline } [';' | '&'] [# comment]
+ *   pipeline := command { '|' command }
+ *   command  := { WORD | '<' WORD | '>' WORD | '>>' WORD }
+ * Operators need no surrounding blanks (ls>out works). Words may contain
+ * '...' (literal), "..." (with \" \\ \$ \` escapes) and \-escapes.
+ *
+ * The line is scanned exactly once, by scan_line(), which records tokens as
+ * (offset, length) spans into the original buffer together with the trimmed
+ * extent of the command and whether it needs JSON escaping. Logging and the
+ * suggestion request reuse those spans directly; words are only unquoted into
+ * argv at exec time (materialize_argv). The token array, parse tables and argv
+ * live in the line's arena and are sized by the line; only the number of
+ * stages in one pipeline is bounded (the job table keeps a pid per stage). */
+#define MAXSTAGES 32
+#define SCAN_TOKENS 64                  /* initial token array, doubled as needed */
 
-    ssize_t w = send(sock, payload, (int)strlen(payload), 0);
-    if (w <= 0) { close(sock); return NULL; }
+enum tok_type { TOK_WORD, TOK_PIPE, TOK_LT, TOK_GT, TOK_GTGT, TOK_SEMI, TOK_AMP };
 
-    // wait for response with timeout
-    fd_set rfds;
-    FD_ZERO(&rfds);
-    FD_SET(sock, &rfds);
-    struct timeval tv;
-    tv.tv_sec = timeout_ms / 1000;
-    tv.tv_usec = (timeout_ms % 1000) * 1000;
-    int sel = select(sock+1, &rfds, NULL, NULL, &tv);
-    if (sel <= 0) { close(sock); return NULL; }
-
-    char buf[MAXLINE];
-    ssize_t r = recv(sock, buf, sizeof(buf)-1, 0);
-    if (r <= 0) { close(sock); return NULL; }
-    buf[r] = '\0';
-    // Strip trailing newline
-    char *nl = strchr(buf, '\n'); if (nl) *nl = '\0';
-    char *ret = strdup(buf);
-    close(sock);
-    return ret;
+struct token {
+    enum tok_type type;
+    unsigned start, len;            /* span in the line */
+    int quoted;                     /* word contains quotes/escapes to strip */
+};
+
+struct line_scan {
+    const char *line;
+    struct arena *arena;            /* holds toks and everything parsed from them */
+    size_t start, end;              /* [start, end): the line without blanks or comment */
+    size_t text_end;                /* end of the line with its comment, as history records it */
+    int needs_escape;               /* [start, end) contains characters JSON must escape */
+    int ntoks, cap;
+    struct token *toks;
+};
+
+struct stage {
+    int arg0, argc;                 /* word token indices: command_line.argtok[arg0 ..] */
+    int in_tok, out_tok;            /* < / > file word tokens, -1 if none */
+    int append;
+};
+
+struct pipeline {
+    struct stage *stages;
+    int nstages;
+    int background;
+    size_t text_off, text_len;      /* source text of the pipeline within the line */
+};
+
+struct command_line {
+    const struct line_scan *scan;
+    int *argtok;                    /* word token of each argument, by stage */
+    struct stage *stages;
+    struct pipeline *pipes;
+    int npipes;
+};
+
+static int is_blank(char c) { return c == ' ' || c == '\t' || c == '\n' || c == '\r'; }
+static int is_op_char(char c) { return c == '|' || c == '<' || c == '>' || c == ';' || c == '&'; }
+
+static int out_of_memory(void) {
+    fprintf(stderr, "shell: out of memory\n");
+    return -1;
 }
 
-char *get_suggestion(const char *line_prefix, const char *model, int timeout_ms) {
-    if (!line_prefix || strlen(line_prefix) == 0) return NULL;
-#if HAVE_UNIX_SOCKETS
-    /* Prefer Unix domain socket when available (existing behavior) */
-    int sock = -1;
-    struct sockaddr_un addr;
-    sock = socket(AF_UNIX, SOCK_STREAM, 0);
-    if (sock >= 0) {
-        memset(&addr, 0, sizeof(addr));
-        addr.sun_family = AF_UNIX;
-        strncpy(addr.sun_path, SUGGEST_SOCKET_PATH, sizeof(addr.sun_path)-1);
-        if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
-            char buf[MAXLINE];
-            char payload[MAXLINE];
-            char esc_cmd[MAXLINE];
-            json_escape(line_prefix, esc_cmd, sizeof(esc_cmd));
-            snprintf(payload, sizeof(payload), "{\"cmd\":\"%s\",\"model\":\"%s\"}\n", esc_cmd, model ? model : DEFAULT_SUGGEST_MODEL);
-            ssize_t w = write(sock, payload, strlen(payload));
-            if (w > 0) {
-                fd_set rfds;
-                FD_ZERO(&rfds);
-                FD_SET(sock, &rfds);
-                struct timeval tv;
-                tv.tv_sec = timeout_ms / 1000;
-                tv.tv_usec = (timeout_ms % 1000) * 1000;
-                int sel = select(sock+1, &rfds, NULL, NULL, &tv);
-                if (sel > 0) {
-                    ssize_t r = read(sock, buf, sizeof(buf)-1);
-                    if (r > 0) {
-                        buf[r] = '\0';
-                        char *nl = strchr(buf, '\n'); if (nl) *nl = '\0';
-                        char *ret = strdup(buf);
-                        close(sock);
-                        return ret;
+/* Tokenize line in one pass, with the tokens allocated from arena a. Returns 0,
+ * or -1 after reporting an error. */
+int scan_line(const char *line, struct arena *a, struct line_scan *sc) {
+    sc->line = line;
+    sc->arena = a;
+    sc->start = sc->end = 0;
+    sc->needs_escape = 0;
+    sc->ntoks = 0;
+    sc->cap = SCAN_TOKENS;
+    sc->toks = arena_alloc(a, SCAN_TOKENS * sizeof(struct token));
+    if (!sc->toks) return out_of_memory();
+    int seen = 0, ctl_blank = 0;
+    size_t i = 0;
+    sc->text_end = 0;
+    while (line[i]) {
+        char c = line[i];
+        if (is_blank(c)) {
+            if (c != ' ') ctl_blank = 1; /* a tab or \r between words must be escaped too */
+            i++;
+            continue;
+        }
+        if (c == '#') { /* comment to end of line */
+            size_t e = i + strlen(line + i);
+            while (e > i && is_blank(line[e - 1])) e--;
+            sc->text_end = e;
+            break;
+        }
+        if (seen && ctl_blank) sc->needs_escape = 1;
+        ctl_blank = 0;
+        if (sc->ntoks == sc->cap) {
+            /* the array is the newest allocation, so this usually extends it in place */
+            size_t old = (size_t)sc->cap * sizeof(struct token);
+            struct token *toks = arena_realloc(a, sc->toks, old, 2 * old);
+            if (!toks) return out_of_memory();
+            sc->toks = toks;
+            sc->cap *= 2;
+        }
+        struct token *t = &sc->toks[sc->ntoks++];
+        t->start = (unsigned)i;
+        t->quoted = 0;
+        if (!seen) { sc->start = i; seen = 1; }
+        switch (c) {
+        case '|': t->type = TOK_PIPE; i++; break;
+        case '<': t->type = TOK_LT; i++; break;
+        case ';': t->type = TOK_SEMI; i++; break;
+        case '&': t->type = TOK_AMP; i++; break;
+        case '>':
+            if (line[i + 1] == '>') { t->type = TOK_GTGT; i += 2; }
+            else { t->type = TOK_GT; i++; }
+            break;
+        default:
+            t->type = TOK_WORD;
+            while (line[i] && !is_blank(line[i]) && !is_op_char(line[i])) {
+                char q = line[i];
+                if (q == '\\' || q == '"') sc->needs_escape = 1;
+                if (q == '\\') {
+                    t->quoted = 1;
+                    if (line[i + 1]) i++;
+                } else if (q == '\'' || q == '"') {
+                    t->quoted = 1;
+                    for (i++; line[i] && line[i] != q; i++) {
+                        if (line[i] == '\\' || line[i] == '"' || (unsigned char)line[i] < 0x20) sc->needs_escape = 1;
+                        if (q == '"' && line[i] == '\\' && line[i + 1]) i++;
+                    }
+                    if (!line[i]) {
+                        fprintf(stderr, "shell: unterminated %c quote\n", q);
+                        return -1;
                     }
+                } else if ((unsigned char)q < 0x20) {
+                    sc->needs_escape = 1;
                 }
+                i++;
             }
         }
-        close(sock);
+        t->len = (unsigned)(i - t->start);
+        sc->end = i;
     }
-#endif
-    /* Fallback to TCP (works on Windows and when suggestion server uses TCP) */
-    return get_suggestion_tcp(line_prefix, model, timeout_ms);
+    if (sc->text_end < sc->end) sc->text_end = sc->end;
+    return 0;
 }
 
-/* Execute external command (simple) */
-void exec_command(char **argv, int background) {
-    pid_t pid = fork();
-    if (pid < 0) {
-        perror("fork");
-        return;
+/* Copy a word token into out with quotes and escapes removed; returns its length */
+static size_t unquote_token(const char *line, const struct token *t, char *out) {
+    const char *p = line + t->start, *end = p + t->len;
+    if (!t->quoted) {
+        memcpy(out, p, t->len);
+        return t->len;
     }
-    if (pid == 0) {
-        // child
-        // restore default signals
-        signal(SIGINT, SIG_DFL);
-        signal(SIGQUIT, SIG_DFL);
-        if (execvp(argv[0], argv) < 0) {
-            fprintf(stderr, "shell: exec failed for %s: %s\n", argv[0], strerror(errno));
-            exit(127);
-        }
-    } else {
-        // parent
-        if (!background) {
-            int status;
-            if (waitpid(pid, &status, 0) < 0) perror("waitpid");
+    size_t n = 0;
+    while (p < end) {
+        char c = *p++;
+        if (c == '\\') {
+            if (p < end) out[n++] = *p++;
+        } else if (c == '\'') {
+            while (p < end && *p != '\'') out[n++] = *p++;
+            p++;
+        } else if (c == '"') {
+            while (p < end && *p != '"') {
+                if (*p == '\\' && p + 1 < end && strchr("\"\\$`\n", p[1])) p++;
+                out[n++] = *p++;
+            }
+            p++;
         } else {
-            printf("[bg] pid %d\n", pid);
+            out[n++] = c;
         }
     }
+    return n;
 }
 
-/* Signal handler for SIGINT in shell (ignore in main shell loop) */
-void sigint_handler(int signo) {
-    // Just print a newline and reprint prompt in main loop
-    write(STDOUT_FILENO, "\n", 1);
+/* Materialize one stage's argv (and redirection paths) into buf, which needs room
+ * for the line plus one NUL per word. argv must hold argc + 1 pointers. Returns the
+ * first unused byte of buf. */
+static char *materialize_argv(const struct command_line *cl, const struct stage *s, char **argv,
+                              const char **in, const char **out, char *buf) {
+    const char *line = cl->scan->line;
+    for (int i = 0; i < s->argc; ++i) {
+        size_t n = unquote_token(line, &cl->scan->toks[cl->argtok[s->arg0 + i]], buf);
+        buf[n] = '\0';
+        argv[i] = buf;
+        buf += n + 1;
+    }
+    argv[s->argc] = NULL;
+    *in = *out = NULL;
+    if (s->in_tok >= 0) {
+        size_t n = unquote_token(line, &cl->scan->toks[s->in_tok], buf);
+        buf[n] = '\0';
+        *in = buf;
+        buf += n + 1;
+    }
+    if (s->out_tok >= 0) {
+        size_t n = unquote_token(line, &cl->scan->toks[s->out_tok], buf);
+        buf[n] = '\0';
+        *out = buf;
+        buf += n + 1;
+    }
+    return buf;
 }
 
-int main(int argc, char **argv) {
-#if defined(_WIN32) || defined(_WIN64)
-    /* If building/running on Windows with native Winsock, you must call WSAStartup.
-       If you use MinGW and link -lws2_32, add this initialization here:
-    WSADATA wsaData;
-    if (WSAStartup(MAKEWORD(2,2), &wsaData) != 0) {
-        fprintf(stderr, "WSAStartup failed\\n");
-        return 1;
+/* Does word token t spell exactly name (unquoted)? */
+static int token_is(const struct line_scan *sc, const struct token *t, const char *name) {
+    return t->type == TOK_WORD && !t->quoted && strlen(name) == t->len &&
+           memcmp(sc->line + t->start, name, t->len) == 0;
+}
+
+static int syntax_error(const char *near) {
+    fprintf(stderr, "shell: syntax error near '%s'\n", near);
+    return -1;
+}
+
+static const char *tok_text(enum tok_type type) {
+    switch (type) {
+    case TOK_PIPE: return "|";
+    case TOK_LT: return "<";
+    case TOK_GT: return ">";
+    case TOK_GTGT: return ">>";
+    case TOK_SEMI: return ";";
+    case TOK_AMP: return "&";
+    default: return "word";
     }
-    and call WSACleanup() before exit.
-    */
-#endif
+}
 
-    // Initialize DB
-    if (init_db(DB_PATH) != SQLITE_OK) {
-        fprintf(stderr, "Warning: SQLite DB unavailable. History will be disabled.\n");
-        // continue without DB
-        g_db = NULL;
+/* Build pipelines from a scanned line. Returns the number of pipelines (0 for an
+ * empty line) or -1 after printing a syntax error. */
+int parse_line(const struct line_scan *sc, struct command_line *cl) {
+    const struct token *toks = sc->toks;
+    int ntoks = sc->ntoks;
+    int nargs = 0, nstages = 0;
+    struct pipeline *p = NULL;
+    struct stage *s = NULL;
+    cl->scan = sc;
+    cl->npipes = 0;
+    /* every pipeline, stage and argument takes at least one token */
+    size_t n = ntoks ? (size_t)ntoks : 1;
+    cl->argtok = arena_alloc(sc->arena, n * sizeof(*cl->argtok));
+    cl->stages = arena_alloc(sc->arena, n * sizeof(*cl->stages));
+    cl->pipes = arena_alloc(sc->arena, n * sizeof(*cl->pipes));
+    if (!cl->argtok || !cl->stages || !cl->pipes) return out_of_memory();
+    for (int i = 0; i < ntoks; ++i) {
+        const struct token *t = &toks[i];
+        if (!p) {
+            if (t->type == TOK_PIPE || t->type == TOK_SEMI || t->type == TOK_AMP) return syntax_error(tok_text(t->type));
+            p = &cl->pipes[cl->npipes++];
+            memset(p, 0, sizeof(*p));
+            p->stages = &cl->stages[nstages];
+            p->text_off = t->start;
+        }
+        if (!s) {
+            if (p->nstages == MAXSTAGES) return syntax_error("(pipeline too long)");
+            s = &cl->stages[nstages++];
+            s->arg0 = nargs;
+            s->argc = 0;
+            s->in_tok = s->out_tok = -1;
+            s->append = 0;
+            p->nstages++;
+        }
+        switch (t->type) {
+        case TOK_WORD:
+            cl->argtok[nargs++] = i;
+            s->argc++;
+            break;
+        case TOK_LT: case TOK_GT: case TOK_GTGT:
+            if (i + 1 == ntoks || toks[i + 1].type != TOK_WORD) return syntax_error(tok_text(t->type));
+            if (t->type == TOK_LT) s->in_tok = i + 1;
+            else { s->out_tok = i + 1; s->append = t->type == TOK_GTGT; }
+            i++;
+            break;
+        case TOK_PIPE: case TOK_SEMI: case TOK_AMP:
+            if (s->argc == 0) return syntax_error(tok_text(t->type));
+            s = NULL;
+            if (t->type != TOK_PIPE) {
+                p->background = t->type == TOK_AMP;
+                p->text_len = toks[i - 1].start + toks[i - 1].len - p->text_off;
+                p = NULL;
+            }
+            break;
+        }
+        if (p) p->text_len = toks[i].start + toks[i].len - p->text_off;
     }
+    if (s) {
+        if (s->argc == 0) return syntax_error("newline");
+    } else if (p) {
+        return syntax_error("|"); /* dangling pipe */
+    }
+    return cl->npipes;
+}
 
-    // Setup signal handling: shell should catch SIGINT and not exit
-    struct sigaction sa;
-    sa.sa_handler = sigint_handler;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = SA_RESTART;
-    sigaction(SIGINT, &sa, NULL);
+/* Largest message exchanged with the suggestion server */
+#define SUGGEST_MAX_MESSAGE (1 << 20)
+/* Longest command (and previous command) a hint is computed for, natively or by
+ * the server: lines past this get no hint, and escaped six times over two of them
+ * still fit one message */
+#define SUGGEST_MAX_QUERY (SUGGEST_MAX_MESSAGE / 16)
 
-    char linebuf[MAXLINE];
-    char *args[MAXARGS];
+/* Native suggestion engine. The default model's three engines (typo fix, next
+ * command, similar templates) are answered in-process from the binary model
+ * that train_from_csv.py exports (layout in native_model.py), so the common case
+ * costs no JSON round trip to the Python server. Other models still go to the
+ * server. ISH_MODEL_PATH overrides the file; ISH_NATIVE=0 turns the engine off.
+ * Results mirror rank_and_merge() in suggestion_server.py.
+ *
+ * The file is mapped read-only and used in place: its hash tables, CSR rows and
+ * trigram postings are all precomputed, so loading is a header check and the
+ * pages are shared with every other shell and server that maps the same model. */
+#define NATIVE_MODEL_PATH "models/suggest.bin"
+#define NATIVE_MAGIC "ISHM"
+#define NATIVE_VERSION 2
+#define NATIVE_HEADER_WORDS 16
+#define NATIVE_MAX_GRAM_BITS 24
+#define NATIVE_TYPO_MIN 0.60
+#define NATIVE_MIN_CONF 0.05f
+#define NATIVE_TOP 5
+#define NATIVE_MAX_ITEMS 16
+#define NATIVE_MAX_QTERMS 64
+#define NATIVE_OUT_SIZE 16384
+#define NATIVE_TYPO_CANDIDATES 64    /* like native_model.MAX_CANDIDATES */
 
-    while (1) {
-        // Read line
-        printf("ish> ");
-        fflush(stdout);
-        if (!fgets(linebuf, sizeof(linebuf), stdin)) {
-            if (feof(stdin)) { printf("\n"); break; }
-            continue;
-        }
-        char *line = trim(linebuf);
-        if (strlen(line) == 0) continue;
+struct native_model {
+    const char *map;                /* read-only mapping of the whole file */
+    size_t size;
+    uint32_t created;               /* export time from the header */
+    uint32_t n_cmds, n_edges, n_terms, n_postings, gram_bits, n_gram_ids, strings_size;
+    uint32_t cmd_hash_mask, term_hash_mask;
+    const uint32_t *cmd_str, *cmd_len, *cmd_hash;
+    const uint32_t *edge_row, *edge_dst, *edge_cnt, *edge_total;
+    const uint32_t *term_str, *term_len, *term_hash;
+    const float *term_idf;
+    const uint32_t *post_row, *post_doc;
+    const float *post_w;
+    const uint32_t *gram_row, *gram_ids;
+    const char *strings;
+    float *acc;                     /* template scoring scratch, one per command */
+    uint32_t *gram_count;           /* typo candidate scratch: trigram buckets shared with the query */
+    uint32_t *touched;
+    uint64_t *by_len;               /* length << 32 | id, sorted; built on first use (native_nearest_length) */
+};
 
-        // Non-blocking suggestion: we attempt to fetch a suggestion and print it as a hint
-        char *suggest_json = get_suggestion(line, DEFAULT_SUGGEST_MODEL, 250); // 250 ms timeout
-        if (suggest_json) {
-            // Print raw response JSON as hint
-            printf("\t[suggestion-json] %s\n", suggest_json);
-            free(suggest_json);
-        }
+static struct native_model *g_native = NULL;
 
-        // Builtins: check cd, exit, history
-        // Copy line because parse_line uses strtok
-        char work[MAXLINE]; strncpy(work, line, sizeof(work)); work[sizeof(work)-1] = '\0';
-        int background = 0;
-        int argc2 = parse_line(work, args, &background);
-        if (argc2 == 0) continue;
+struct native_item {
+    const char *source;
+    const char *reason;             /* printf format taking the query */
+    uint32_t cmd;
+    float conf;
+};
 
-        if (strcmp(args[0], "exit") == 0) {
-            break;
-        } else if (strcmp(args[0], "cd") == 0) {
-            const char *dir = args[1] ? args[1] : getenv("HOME");
-            if (chdir(dir) != 0) perror("cd");
-            // log
-            log_command(line);
-            continue;
-        } else if (strcmp(args[0], "history") == 0) {
-            int n = 50; // default
-            if (args[1]) n = atoi(args[1]);
-            print_history(n);
-            continue;
-        }
+/* 32-bit djb2, the hash native_model.py builds the file's tables with */
+static uint32_t hash_bytes(const char *s, size_t n) {
+    uint32_t h = 5381;
+    while (n--) h = h * 33 + (unsigned char)*s++;
+    return h;
+}
 
-        // Not a builtin: execute
-        // Log command before execution so even background jobs are recorded; could also log after
-        log_command(line);
-        exec_command(args, background);
-    }
+static const char *native_cmd(const struct native_model *m, uint32_t id) {
+    return m->strings + m->cmd_str[id];
+}
 
-    if (g_db) sqlite3_close(g_db);
+/* Are rows[0..n] non-decreasing and bounded by limit (a CSR row pointer array)? */
+static int native_rows_ok(const uint32_t *rows, uint32_t n, uint32_t limit) {
+    if (rows[0] != 0 || rows[n] != limit) return 0;
+    for (uint32_t i = 0; i < n; ++i)
+        if (rows[i] > rows[i + 1]) return 0;
+    return 1;
+}
 
-#if defined(_WIN32) || defined(_WIN64)
-    /* If you added WSAStartup above, call WSACleanup here. */
-#endif
+static int native_strings_ok(const uint32_t *off, const uint32_t *len, uint32_t n, uint32_t size) {
+    for (uint32_t i = 0; i < n; ++i)
+        if ((uint64_t)off[i] + len[i] >= size) return 0;
+    return 1;
+}
 
-    return 0;
+static int is_pow2(uint32_t n) {
+    return n && (n & (n - 1)) == 0;
+}
+
+/* Lowercase trigram buckets of "  s " (pad) or of s itself, as native_model.byte_grams()
+ * of padded(s) / s.lower(); out needs room for len + 1 */
+static size_t native_grams(const char *s, size_t len, uint32_t bits, int pad, uint32_t *out) {
+    unsigned char a = ' ', b = ' ';
+    size_t n = 0, i = 0;
+    if (!pad) {
+        if (len < 3) return 0;
+        a = (unsigned char)s[0];
+        b = (unsigned char)s[1];
+        if (a >= 'A' && a <= 'Z') a |= 0x20;
+        if (b >= 'A' && b <= 'Z') b |= 0x20;
+        i = 2;
+    }
+    for (; i < len + (size_t)(pad != 0); ++i) {
+        unsigned char c = i < len ? (unsigned char)s[i] : ' ';
+        if (c >= 'A' && c <= 'Z') c |= 0x20;
+        out[n++] = (((uint32_t)a << 16 | (uint32_t)b << 8 | c) * 2654435761u) >> (32 - bits);
+        a = b;
+        b = c;
+    }
+    return n;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void native_free(struct native_model *m) {
+    if (!m) return;
+    if (m->map) munmap((void *)m->map, m->size);
+    free(m->gram_count);
+    free(m->acc);
+    free(m->touched);
+    free(m->by_len);
+    free(m);
+}
+
+/* Map and check a model file; NULL (with a message on stderr) on failure.
+ * A missing file is only reported when the path was asked for explicitly.
+ * Only the header and the small per-command/per-term tables are validated up
+ * front; ids read from the large arrays are bounds-checked where they are used. */
+static struct native_model *native_load(const char *path, int explicit_path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (explicit_path) fprintf(stderr, "Warning: cannot open suggestion model %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    struct native_model *m = calloc(1, sizeof(*m));
+    struct stat st;
+    if (!m || fstat(fd, &st) != 0 || st.st_size < NATIVE_HEADER_WORDS * 4) goto corrupt;
+    m->size = (size_t)st.st_size;
+    void *map = mmap(NULL, m->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    fd = -1;
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Warning: cannot map suggestion model %s: %s\n", path, strerror(errno));
+        free(m);
+        return NULL;
+    }
+    m->map = map;
+
+    const uint32_t *h = (const uint32_t *)m->map;
+    if (memcmp(m->map, NATIVE_MAGIC, 4) != 0 || h[1] != NATIVE_VERSION || h[2] != NATIVE_HEADER_WORDS) {
+        fprintf(stderr, "Warning: %s is not a version %d suggestion model\n", path, NATIVE_VERSION);
+        goto bad;
+    }
+    m->n_cmds = h[3];
+    m->n_edges = h[4];
+    m->n_terms = h[5];
+    m->n_postings = h[6];
+    m->gram_bits = h[7];
+    m->n_gram_ids = h[8];
+    m->strings_size = h[9];
+    uint32_t cmd_hash_size = h[10], term_hash_size = h[11];
+    m->created = h[12];
+    if (m->n_cmds == 0 || m->strings_size == 0 || m->gram_bits == 0 || m->gram_bits > NATIVE_MAX_GRAM_BITS ||
+        !is_pow2(cmd_hash_size) || !is_pow2(term_hash_size) || cmd_hash_size < m->n_cmds) goto corrupt;
+    uint64_t words = NATIVE_HEADER_WORDS + 2ull * m->n_cmds + cmd_hash_size + (m->n_cmds + 1ull) +
+                     2ull * m->n_edges + m->n_cmds + 3ull * m->n_terms + term_hash_size +
+                     (m->n_terms + 1ull) + 2ull * m->n_postings + (1ull << m->gram_bits) + 1 + m->n_gram_ids;
+    if (words * 4 + m->strings_size != m->size) goto corrupt;
+
+    const uint32_t *p = h + NATIVE_HEADER_WORDS;
+    m->cmd_str = p;    p += m->n_cmds;
+    m->cmd_len = p;    p += m->n_cmds;
+    m->cmd_hash = p;   p += cmd_hash_size;
+    m->edge_row = p;   p += m->n_cmds + 1;
+    m->edge_dst = p;   p += m->n_edges;
+    m->edge_cnt = p;   p += m->n_edges;
+    m->edge_total = p; p += m->n_cmds;
+    m->term_str = p;   p += m->n_terms;
+    m->term_len = p;   p += m->n_terms;
+    m->term_idf = (const float *)p; p += m->n_terms;
+    m->term_hash = p;  p += term_hash_size;
+    m->post_row = p;   p += m->n_terms + 1;
+    m->post_doc = p;   p += m->n_postings;
+    m->post_w = (const float *)p; p += m->n_postings;
+    m->gram_row = p;   p += (1u << m->gram_bits) + 1;
+    m->gram_ids = p;   p += m->n_gram_ids;
+    m->strings = (const char *)p;
+    m->cmd_hash_mask = cmd_hash_size - 1;
+    m->term_hash_mask = term_hash_size - 1;
+    if (!native_strings_ok(m->cmd_str, m->cmd_len, m->n_cmds, m->strings_size) ||
+        !native_strings_ok(m->term_str, m->term_len, m->n_terms, m->strings_size) ||
+        !native_rows_ok(m->edge_row, m->n_cmds, m->n_edges) ||
+        !native_rows_ok(m->post_row, m->n_terms, m->n_postings) ||
+        !native_rows_ok(m->gram_row, 1u << m->gram_bits, m->n_gram_ids) ||
+        m->strings[m->strings_size - 1] != '\0') goto corrupt;
+    return m;
+
+corrupt:
+    fprintf(stderr, "Warning: %s is truncated or corrupt\n", path);
+bad:
+    if (fd >= 0) close(fd);
+    native_free(m);
+    return NULL;
+}
+
+/* Per-process scratch for scoring, allocated on first use so the mapping stays the only startup cost */
+static int native_scratch(struct native_model *m) {
+    if (m->touched) return 0;
+    m->acc = calloc(m->n_cmds, sizeof(float));
+    m->gram_count = calloc(m->n_cmds, sizeof(uint32_t));
+    m->touched = malloc(m->n_cmds * sizeof(uint32_t));
+    if (m->acc && m->gram_count && m->touched) return 0;
+    free(m->acc);
+    free(m->gram_count);
+    free(m->touched);
+    m->acc = NULL;
+    m->gram_count = NULL;
+    m->touched = NULL;
+    return -1;
+}
+
+/* Where the model lives (made absolute so `cd` does not lose it) and the identity
+ * of the file last mapped; checked between commands so a retrain is picked up
+ * without restarting the shell. */
+static struct {
+    int enabled;
+    char path[MAXLINE];
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    long long next_check_ms;
+} g_native_file;
+
+#define NATIVE_RELOAD_CHECK_MS 2000
+
+static void native_remember(const struct stat *st) {
+    g_native_file.dev = st ? st->st_dev : 0;
+    g_native_file.ino = st ? st->st_ino : 0;
+    g_native_file.size = st ? st->st_size : 0;
+    g_native_file.mtime = st ? st->st_mtime : 0;
+}
+
+void native_init(void) {
+    const char *v = getenv("ISH_NATIVE");
+    if (v && strcmp(v, "0") == 0) return;
+    const char *path = getenv("ISH_MODEL_PATH");
+    int explicit_path = path && *path;
+    if (!explicit_path) path = NATIVE_MODEL_PATH;
+    char cwd[MAXLINE];
+    int n = path[0] != '/' && getcwd(cwd, sizeof(cwd))
+                ? snprintf(g_native_file.path, sizeof(g_native_file.path), "%s/%s", cwd, path)
+                : snprintf(g_native_file.path, sizeof(g_native_file.path), "%s", path);
+    if (n < 0 || (size_t)n >= sizeof(g_native_file.path)) return;
+    g_native_file.enabled = 1;
+    g_native_file.next_check_ms = monotonic_ms() + NATIVE_RELOAD_CHECK_MS;
+
+    struct stat st;
+    int have = stat(g_native_file.path, &st) == 0;
+    g_native = native_load(g_native_file.path, explicit_path);
+    native_remember(have ? &st : NULL);
+}
+
+/* Re-map the model if the file was replaced (train_from_csv.py renames a new
+ * one into place). A broken new file keeps the current model. */
+void native_check_reload(void) {
+    if (!g_native_file.enabled) return;
+    long long now = monotonic_ms();
+    if (now < g_native_file.next_check_ms) return;
+    g_native_file.next_check_ms = now + NATIVE_RELOAD_CHECK_MS;
+
+    struct stat st;
+    if (stat(g_native_file.path, &st) != 0) return; /* removed: keep serving the mapped copy */
+    if (st.st_dev == g_native_file.dev && st.st_ino == g_native_file.ino &&
+        st.st_size == g_native_file.size && st.st_mtime == g_native_file.mtime) return;
+    native_remember(&st);
+    struct native_model *m = native_load(g_native_file.path, 1);
+    if (!m) return;
+    native_free(g_native);
+    g_native = m;
+}
+
+/* Only the default model is served natively; named heavier models need the server. */
+static int native_handles(const char *model) {
+    return g_native && (!model || strcmp(model, DEFAULT_SUGGEST_MODEL) == 0);
+}
+
+/* Look text up in one of the file's open-addressing tables (entries are id + 1) */
+static long native_lookup(const struct native_model *m, const uint32_t *table, uint32_t mask,
+                          const uint32_t *str, const uint32_t *len, uint32_t n, const char *q, size_t qlen) {
+    for (uint32_t i = hash_bytes(q, qlen) & mask, probes = 0; table[i] && probes <= mask; i = (i + 1) & mask, ++probes) {
+        uint32_t id = table[i] - 1;
+        if (id < n && len[id] == qlen && memcmp(m->strings + str[id], q, qlen) == 0) return id;
+    }
+    return -1;
+}
+
+static long native_find(const struct native_model *m, const char *q, size_t qlen) {
+    return native_lookup(m, m->cmd_hash, m->cmd_hash_mask, m->cmd_str, m->cmd_len, m->n_cmds, q, qlen);
+}
+
+static long native_term(const struct native_model *m, const char *w, size_t wlen) {
+    return native_lookup(m, m->term_hash, m->term_hash_mask, m->term_str, m->term_len, m->n_terms, w, wlen);
+}
+
+/* Longest common subsequence of a (la bytes) and b, bit-parallel (Hyyro) over
+ * 64-bit blocks of a: peq[c * words + w] has bit i set where a[64 * w + i] == c,
+ * and v is scratch for one word per block. */
+static size_t native_lcs(size_t la, const uint64_t *peq, size_t words, uint64_t *v, const char *b, size_t lb) {
+    uint64_t last = la % 64 ? (1ull << (la % 64)) - 1 : ~0ull;
+    for (size_t w = 0; w < words; ++w) v[w] = ~0ull;
+    for (size_t j = 0; j < lb; ++j) {
+        const uint64_t *eq = peq + (size_t)(unsigned char)b[j] * words;
+        uint64_t carry = 0;
+        for (size_t w = 0; w < words; ++w) {
+            uint64_t u = v[w] & eq[w], x = v[w] + u, c = x < u;
+            x += carry;
+            carry = c | (x < carry);
+            v[w] = x | (v[w] - u);
+        }
+    }
+    size_t lcs = 0;
+    for (size_t w = 0; w < words; ++w)
+        lcs += (size_t)__builtin_popcountll(~v[w] & (w + 1 == words ? last : ~0ull));
+    return lcs;
+}
+
+/* Can a command of length len still reach fuzz.ratio >= floor against qlen chars?
+ * Same bounds and arithmetic as typo_index.ratio_length_bounds(). */
+static int native_len_ok(size_t len, size_t qlen, double floor) {
+    if (floor <= 0) return 1;
+    return (double)len >= qlen * floor / (2 - floor) && (double)len <= qlen * (2 - floor) / floor;
+}
+
+/* Take the ids of the commands exactly len bytes long into cand[*n..max) */
+static void native_take_length(const struct native_model *m, uint64_t len, uint32_t *cand, int *n, int max) {
+    uint32_t a = 0, b = m->n_cmds;
+    while (a < b) {
+        uint32_t mid = a + (b - a) / 2;
+        if (m->by_len[mid] >> 32 < len) a = mid + 1;
+        else b = mid;
+    }
+    for (; *n < max && a < m->n_cmds && m->by_len[a] >> 32 == len; ++a) cand[(*n)++] = (uint32_t)m->by_len[a];
+}
+
+/* Up to max commands of a length native_len_ok() accepts for qlen, nearest to
+ * it first, then shorter, then lower ids, as typo_index.nearest_length() picks
+ * them: the typo candidates when no command shares a trigram bucket with the query */
+static int native_nearest_length(struct native_model *m, size_t qlen, uint32_t *cand, int max) {
+    if (!m->by_len) {
+        if (!(m->by_len = malloc((m->n_cmds ? m->n_cmds : 1) * sizeof(uint64_t)))) return 0;
+        for (uint32_t id = 0; id < m->n_cmds; ++id) m->by_len[id] = (uint64_t)m->cmd_len[id] << 32 | id;
+        qsort(m->by_len, m->n_cmds, sizeof(uint64_t), cmp_u64);
+    }
+    uint64_t longest = m->n_cmds ? m->by_len[m->n_cmds - 1] >> 32 : 0;
+    int n = 0;
+    for (size_t d = 0; n < max; ++d) {
+        int below = d <= qlen && native_len_ok(qlen - d, qlen, NATIVE_TYPO_MIN);
+        int above = d > 0 && qlen + d <= longest && native_len_ok(qlen + d, qlen, NATIVE_TYPO_MIN);
+        if (!below && !above) break;
+        if (below) native_take_length(m, qlen - d, cand, &n, max);
+        if (above) native_take_length(m, qlen + d, cand, &n, max);
+    }
+    return n;
+}
+
+/* Does command a share more of the query's trigram buckets than b by Dice,
+ * 2 * shared / (buckets + len + 1)? Ties go to the lower id. */
+static int native_dice_better(const struct native_model *m, size_t buckets,
+                              uint32_t shared_a, uint32_t a, uint32_t shared_b, uint32_t b) {
+    uint64_t x = (uint64_t)shared_a * (buckets + m->cmd_len[b] + 1);
+    uint64_t y = (uint64_t)shared_b * (buckets + m->cmd_len[a] + 1);
+    return x > y || (x == y && a < b);
+}
+
+/* fuzz.ratio's best match among the NATIVE_TYPO_CANDIDATES length-filtered
+ * commands with the best trigram Dice against the query, ties to the lower id:
+ * the candidates native_model.MappedModel.typo() scores on the server, over the
+ * same hashed buckets of the file. Scores are fuzz.ratio's for ASCII text (it
+ * counts characters where this counts bytes). */
+static long native_typo(struct native_model *m, const char *q, size_t qlen, double *score) {
+    *score = 0.0;
+    uint32_t stack_grams[MAXLINE + 1], *grams = stack_grams;
+    if (qlen >= MAXLINE && !(grams = malloc((qlen + 1) * sizeof(uint32_t)))) return -1;
+    size_t ng = native_grams(q, qlen, m->gram_bits, 1, grams), buckets = 0;
+    qsort(grams, ng, sizeof(uint32_t), cmp_u32);
+    uint32_t ntouched = 0;
+    for (size_t k = 0; k < ng; ++k) {
+        if (k && grams[k] == grams[k - 1]) continue;
+        buckets++;
+        for (uint32_t p = m->gram_row[grams[k]]; p < m->gram_row[grams[k] + 1]; ++p) {
+            uint32_t id = m->gram_ids[p];
+            if (id < m->n_cmds && m->gram_count[id]++ == 0) m->touched[ntouched++] = id;
+        }
+    }
+    if (grams != stack_grams) free(grams);
+
+    // keep the NATIVE_TYPO_CANDIDATES best, best first, then reset the scratch
+    uint32_t cand[NATIVE_TYPO_CANDIDATES], shared[NATIVE_TYPO_CANDIDATES];
+    int ncand = 0;
+    for (uint32_t i = 0; i < ntouched; ++i) {
+        uint32_t id = m->touched[i], s = m->gram_count[id];
+        m->gram_count[id] = 0;
+        if (!native_len_ok(m->cmd_len[id], qlen, NATIVE_TYPO_MIN)) continue;
+        if (ncand == NATIVE_TYPO_CANDIDATES &&
+            !native_dice_better(m, buckets, s, id, shared[ncand - 1], cand[ncand - 1])) continue;
+        int k = ncand < NATIVE_TYPO_CANDIDATES ? ncand++ : ncand - 1;
+        while (k > 0 && native_dice_better(m, buckets, s, id, shared[k - 1], cand[k - 1])) {
+            cand[k] = cand[k - 1];
+            shared[k] = shared[k - 1];
+            --k;
+        }
+        cand[k] = id;
+        shared[k] = s;
+    }
+    // no candidate sharing a trigram (very short query): the ones nearest its length
+    if (ncand == 0) ncand = native_nearest_length(m, qlen, cand, NATIVE_TYPO_CANDIDATES);
+    if (ncand == 0) return -1;
+
+    size_t words = (qlen + 63) / 64;
+    uint64_t stack_peq[256 + 1], *peq = stack_peq;
+    if (words > 1 && !(peq = calloc(257 * words, sizeof(uint64_t)))) return -1;
+    if (words == 1) memset(stack_peq, 0, sizeof(stack_peq));
+    for (size_t i = 0; i < qlen; ++i) peq[(size_t)(unsigned char)q[i] * words + i / 64] |= 1ull << (i % 64);
+    long best = -1;
+    double best_score = 0.0;
+    for (int i = 0; i < ncand; ++i) {
+        uint32_t id = cand[i];
+        size_t len = m->cmd_len[id];
+        if (!native_len_ok(len, qlen, best_score)) continue;
+        size_t lcs = native_lcs(qlen, peq, words, peq + 256 * words, native_cmd(m, id), len);
+        // fuzz.ratio() / 100 as the server computes it: 1 - indel distance / total length
+        double s = 1.0 - (double)(len + qlen - 2 * lcs) / (double)(len + qlen);
+        if (s > best_score || (s == best_score && (long)id < best)) { best_score = s; best = id; }
+    }
+    if (peq != stack_peq) free(peq);
+    *score = best_score;
+    return best;
+}
+
+static int native_word_char(unsigned char c) {
+    return c == '_' || c >= 0x80 || (c >= '0' && c <= '9') || ((c | 0x20) >= 'a' && (c | 0x20) <= 'z');
+}
+
+/* TfidfVectorizer's default analyzer (runs of 2+ word characters of the
+ * lowercased query lq), then cosine against the normalized document rows via
+ * the term postings. */
+static int native_templates(struct native_model *m, const char *lq, size_t qlen,
+                            struct native_item *top, int ntop) {
+    uint32_t terms[NATIVE_MAX_QTERMS];
+    float weights[NATIVE_MAX_QTERMS];
+    int nterms = 0;
+    for (size_t i = 0; i < qlen;) {
+        if (!native_word_char((unsigned char)lq[i])) { ++i; continue; }
+        size_t start = i;
+        while (i < qlen && native_word_char((unsigned char)lq[i])) ++i;
+        long t = i - start >= 2 ? native_term(m, lq + start, i - start) : -1;
+        if (t < 0) continue;
+        int k = 0;
+        while (k < nterms && terms[k] != (uint32_t)t) ++k;
+        if (k == nterms) {
+            if (nterms == NATIVE_MAX_QTERMS) continue;
+            terms[nterms] = (uint32_t)t;
+            weights[nterms++] = 0.0f;
+        }
+        weights[k] += m->term_idf[t];
+    }
+    float norm = 0.0f;
+    for (int k = 0; k < nterms; ++k) norm += weights[k] * weights[k];
+    if (norm <= 0.0f) return 0;
+    norm = sqrtf(norm);
+
+    uint32_t ntouched = 0;
+    for (int k = 0; k < nterms; ++k) {
+        float w = weights[k] / norm;
+        for (uint32_t p = m->post_row[terms[k]]; p < m->post_row[terms[k] + 1]; ++p) {
+            uint32_t d = m->post_doc[p];
+            if (d >= m->n_cmds) continue;
+            if (m->acc[d] == 0.0f) m->touched[ntouched++] = d;
+            m->acc[d] += w * m->post_w[p];
+        }
+    }
+    // keep the ntop best in descending order, then reset the scratch
+    int n = 0;
+    for (uint32_t i = 0; i < ntouched; ++i) {
+        uint32_t d = m->touched[i];
+        float s = m->acc[d];
+        m->acc[d] = 0.0f;
+        if (n == ntop && s <= top[n - 1].conf) continue;
+        int k = n < ntop ? n++ : n - 1;
+        while (k > 0 && top[k - 1].conf < s) { top[k] = top[k - 1]; --k; }
+        top[k].cmd = d;
+        top[k].conf = s;
+    }
+    return n;
+}
+
+/* Up to limit commands containing q (ASCII case-insensitive), in id order, as
+ * native_model.MappedModel.containing(): each trigram of q is one of a matching
+ * command's, so the rows of its rarest buckets are intersected until few enough
+ * ids are left to check directly. Queries under 3 bytes check every command. */
+static int native_containing(struct native_model *m, const char *q, size_t qlen, uint32_t *out, int limit) {
+    uint32_t stack_grams[MAXLINE + 1], *grams = stack_grams;
+    uint64_t stack_keys[MAXLINE + 1], *keys = stack_keys;
+    if (qlen >= MAXLINE) {
+        grams = malloc((qlen + 1) * sizeof(uint32_t));
+        keys = malloc((qlen + 1) * sizeof(uint64_t));
+        if (!grams || !keys) { free(grams); free(keys); return 0; }
+    }
+    const uint32_t *ids = NULL;
+    uint32_t nids = m->n_cmds;
+    size_t ng = native_grams(q, qlen, m->gram_bits, 0, grams);
+    for (size_t k = 0; k < ng; ++k)
+        keys[k] = (uint64_t)(m->gram_row[grams[k] + 1] - m->gram_row[grams[k]]) << 32 | grams[k];
+    qsort(keys, ng, sizeof(uint64_t), cmp_u64);
+    for (size_t k = 0; k < ng && (!ids || nids > (uint32_t)limit * 4); ++k) {
+        if (k && keys[k] == keys[k - 1]) continue;
+        const uint32_t *row = m->gram_ids + m->gram_row[(uint32_t)keys[k]];
+        uint32_t rlen = (uint32_t)(keys[k] >> 32);
+        if (!ids) {
+            ids = row;
+            nids = rlen;
+            continue;
+        }
+        // rows are sorted; the intersection is written over the scratch it reads
+        uint32_t kept = 0;
+        for (uint32_t i = 0, j = 0; i < nids && j < rlen;) {
+            if (ids[i] < row[j]) ++i;
+            else if (ids[i] > row[j]) ++j;
+            else { m->touched[kept++] = ids[i]; ++i; ++j; }
+        }
+        ids = m->touched;
+        nids = kept;
+    }
+    if (grams != stack_grams) { free(grams); free(keys); }
+    int n = 0;
+    for (uint32_t i = 0; i < nids && n < limit; ++i) {
+        uint32_t id = ids ? ids[i] : i;
+        if (id < m->n_cmds && strcasestr(native_cmd(m, id), q)) out[n++] = id;
+    }
+    return n;
+}
+
+static void native_add(struct native_item *items, int *n, const char *source, const char *reason,
+                       uint32_t cmd, float conf) {
+    for (int i = 0; i < *n; ++i) {
+        if (items[i].cmd == cmd) {
+            if (conf > items[i].conf) { items[i].source = source; items[i].reason = reason; items[i].conf = conf; }
+            return;
+        }
+    }
+    if (*n == NATIVE_MAX_ITEMS) return;
+    items[*n].source = source;
+    items[*n].reason = reason;
+    items[*n].cmd = cmd;
+    items[(*n)++].conf = conf;
+}
+
+/* Answer like the server does for the default model; returns a malloc'd JSON line.
+ * Takes the same queries the server does, up to SUGGEST_MAX_QUERY bytes. */
+static char *native_suggest(const char *cmd, size_t len, const char *model) {
+    struct native_model *m = g_native;
+    while (len && (cmd[len - 1] == ' ' || cmd[len - 1] == '\t' || cmd[len - 1] == '\n')) --len;
+    while (len && (*cmd == ' ' || *cmd == '\t')) { ++cmd; --len; }
+    if (len == 0 || len > SUGGEST_MAX_QUERY || native_scratch(m) != 0) return NULL;
+    // the query, then its lowercase copy for the template analyzer
+    char *q = malloc(2 * (len + 1));
+    if (!q) return NULL;
+    char *lq = q + len + 1;
+    memcpy(q, cmd, len);
+    q[len] = '\0';
+    for (size_t i = 0; i <= len; ++i)
+        lq[i] = (q[i] >= 'A' && q[i] <= 'Z') ? (char)(q[i] | 0x20) : q[i];
+
+    struct native_item items[NATIVE_MAX_ITEMS];
+    int n = 0;
+    double typo_score;
+    long typo = native_typo(m, q, len, &typo_score);
+    if (typo >= 0 && typo_score > NATIVE_TYPO_MIN)
+        native_add(items, &n, "TypoFixer", "Possible typo correction for '%s'", (uint32_t)typo, (float)typo_score);
+
+    long id = native_find(m, q, len);
+    if (id >= 0) {
+        uint32_t lo = m->edge_row[id], hi = m->edge_row[id + 1];
+        uint32_t total = m->edge_total[id];
+        for (uint32_t e = lo; e < hi && e < lo + 3 && total; ++e) {
+            float conf = (float)m->edge_cnt[e] / (float)total;
+            if (conf > NATIVE_MIN_CONF && m->edge_dst[e] < m->n_cmds)
+                native_add(items, &n, "NextCmd", "Commonly follows '%s'", m->edge_dst[e], conf);
+        }
+    }
+
+    struct native_item templ[NATIVE_TOP];
+    int nt = native_templates(m, lq, len, templ, NATIVE_TOP);
+    for (int i = 0; i < nt; ++i)
+        if (templ[i].conf > NATIVE_MIN_CONF && strcasecmp(native_cmd(m, templ[i].cmd), q) != 0)
+            native_add(items, &n, "Template", "Similar to '%s'", templ[i].cmd, templ[i].conf);
+
+    if (n == 0 && len > 1) {
+        // merge_engines(): four containing matches, then up to three that are not the query itself
+        uint32_t part[4];
+        int np = native_containing(m, q, len, part, 4);
+        for (int i = 0; i < np && n < 3; ++i)
+            if (strcasecmp(native_cmd(m, part[i]), q) != 0)
+                native_add(items, &n, "Partial", "Contains '%s'", part[i], 0.3f);
+    }
+
+    // stable sort by confidence, best first
+    for (int i = 1; i < n; ++i) {
+        struct native_item it = items[i];
+        int k = i;
+        while (k > 0 && items[k - 1].conf < it.conf) { items[k] = items[k - 1]; --k; }
+        items[k] = it;
+    }
+    if (n > NATIVE_TOP) n = NATIVE_TOP;
+
+    // sized for the worst case: every byte of the query and of each command escaped as \u00XX
+    char esc_model[256];
+    json_escape(model, strlen(model), esc_model, sizeof(esc_model));
+    size_t esc_len = 6 * len + 1, cap = 256 + strlen(esc_model);
+    for (int i = 0; i < n; ++i) cap += 160 + esc_len + 6 * (size_t)m->cmd_len[items[i].cmd];
+    char *esc_q = malloc(esc_len), *out = malloc(cap);
+    if (!esc_q || !out) {
+        free(esc_q);
+        free(out);
+        free(q);
+        return NULL;
+    }
+    json_escape(q, len, esc_q, esc_len);
+    size_t off = (size_t)snprintf(out, cap, "{\"model\":\"%s\",\"model_version\":%u,\"engine\":\"native\",\"suggestions\":[",
+                                  esc_model, (unsigned)m->created);
+    for (int i = 0; i < n; ++i) {
+        off += (size_t)snprintf(out + off, cap - off, "%s{\"source\":\"%s\",\"suggestion\":\"",
+                                i ? "," : "", items[i].source);
+        json_escape(native_cmd(m, items[i].cmd), m->cmd_len[items[i].cmd], out + off, cap - off);
+        off += strlen(out + off);
+        off += (size_t)snprintf(out + off, cap - off, "\",\"confidence\":%.2f,\"reason\":\"", items[i].conf);
+        off += (size_t)snprintf(out + off, cap - off, items[i].reason, esc_q);
+        off += (size_t)snprintf(out + off, cap - off, "\"}");
+    }
+    snprintf(out + off, cap - off, "]}");
+    free(esc_q);
+    free(q);
+    return out;
+}
+
+/* Persistent connection to the suggestion server.
+ * One socket is kept open for the whole session instead of connect-per-command.
+ * Every request carries an "id" that the server echoes back, so several requests
+ * can be pipelined over the socket and late answers to abandoned requests are
+ * recognised and dropped. A broken connection (e.g. server restart) is detected
+ * on send/recv and re-established transparently.
+ *
+ * Right after connecting the shell offers binary framing (see wire.py): a server
+ * that accepts it exchanges u32 length-prefixed MessagePack messages from then
+ * on, so commands go out without JSON escaping and answers of any size (up to
+ * SUGGEST_MAX_MESSAGE) come back whole. Answers are rendered to the same JSON
+ * text either way. ISH_SUGGEST_PROTO=json keeps the line protocol.
+ */
+#define SUGGEST_RBUF_MIN 16384
+#define SUGGEST_PROTO "bin1"
+#define SUGGEST_HELLO_TIMEOUT_MS 300
+/* Time the server gets per request ("deadline_ms"); engines that have not
+ * finished by then are left out of the answer. ISH_SUGGEST_DEADLINE_MS overrides. */
+#define SUGGEST_DEADLINE_MS 250
+
+#ifdef MSG_NOSIGNAL
+#define SUGGEST_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SUGGEST_SEND_FLAGS 0
+#endif
+
+/* Reconnect backoff while no transport is reachable (doubles up to the max) */
+#define SUGGEST_BACKOFF_MIN_MS 100
+#define SUGGEST_BACKOFF_MAX_MS 10000
+
+enum suggest_transport { SUGGEST_NONE = 0, SUGGEST_UNIX, SUGGEST_TCP };
+
+struct suggest_conn {
+    int fd;                         /* -1 when disconnected */
+    unsigned long next_id;          /* id for the next request */
+    enum suggest_transport transport; /* last transport that connected */
+    long backoff_ms;                /* current reconnect backoff, 0 when healthy */
+    long long retry_at_ms;          /* no connect attempts before this time */
+    int negotiated;                 /* framing settled for this connection */
+    int binary;                     /* MessagePack frames instead of JSON lines */
+    int json_only;                  /* binary disabled (ISH_SUGGEST_PROTO=json, failed hello) */
+    size_t rlen;                    /* bytes buffered in rbuf */
+    size_t rcap;                    /* allocated size of rbuf, grows to SUGGEST_MAX_MESSAGE + 4 */
+    int discarding;                 /* dropping the rest of an oversized line */
+    char *rbuf;
+};
+
+static struct suggest_conn g_suggest = { .fd = -1, .next_id = 1, .json_only = -1 };
+
+static void suggest_disconnect(void) {
+    if (g_suggest.fd >= 0) close(g_suggest.fd);
+    g_suggest.fd = -1;
+    g_suggest.rlen = 0;
+    g_suggest.discarding = 0;
+    g_suggest.negotiated = 0;
+    g_suggest.binary = 0;
+}
+
+static void suggest_sockopts(int sock) {
+    fcntl(sock, F_SETFD, FD_CLOEXEC); /* not inherited by commands */
+#ifdef SO_NOSIGPIPE
+    int one = 1;
+    setsockopt(sock, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#else
+    (void)sock;
+#endif
+}
+
+/* Where the server is. ISH_SUGGEST_ENDPOINT names one endpoint, which is then the
+ * only one tried: unix:PATH (or an absolute PATH) for a Unix domain socket, such
+ * as a shared daemon's per-user SUGGEST_SOCKET_DIR/<uid>.sock, or tcp:ADDR:PORT
+ * (or ADDR:PORT) with an IPv4 address or localhost; a value that is neither
+ * leaves no endpoint at all. Without it the shell tries SUGGEST_SOCKET_PATH,
+ * then SUGGEST_HOST:SUGGEST_PORT. */
+static struct {
+    int ready;
+    int use_unix, use_tcp;
+    char path[104];                 /* fits sun_path everywhere */
+    struct in_addr addr;
+    unsigned short port;
+} g_suggest_endpoint;
+
+static int suggest_endpoint_parse(const char *v) {
+    if (strncmp(v, "unix:", 5) == 0 || v[0] == '/') {
+        const char *path = v[0] == '/' ? v : v + 5;
+        if (!HAVE_UNIX_SOCKETS || !*path || strlen(path) >= sizeof(g_suggest_endpoint.path)) return -1;
+        strcpy(g_suggest_endpoint.path, path);
+        g_suggest_endpoint.use_unix = 1;
+        return 0;
+    }
+    if (strncmp(v, "tcp:", 4) == 0) v += 4;
+    const char *colon = strrchr(v, ':');
+    char host[64], *end;
+    if (!colon || (size_t)(colon - v) >= sizeof(host)) return -1;
+    memcpy(host, v, (size_t)(colon - v));
+    host[colon - v] = '\0';
+    long port = strtol(colon + 1, &end, 10);
+    if (end == colon + 1 || *end || port <= 0 || port > 65535) return -1;
+    if (inet_pton(AF_INET, strcmp(host, "localhost") == 0 ? "127.0.0.1" : host, &g_suggest_endpoint.addr) != 1)
+        return -1;
+    g_suggest_endpoint.port = (unsigned short)port;
+    g_suggest_endpoint.use_tcp = 1;
+    return 0;
+}
+
+static void suggest_endpoint_init(void) {
+    if (g_suggest_endpoint.ready) return;
+    g_suggest_endpoint.ready = 1;
+    const char *v = getenv("ISH_SUGGEST_ENDPOINT");
+    if (v && *v) {
+        if (suggest_endpoint_parse(v) == 0) return;
+        /* not the defaults: they may be another user's server */
+        fprintf(stderr, "ish: ISH_SUGGEST_ENDPOINT=%s is not unix:PATH or tcp:ADDR:PORT, server suggestions disabled\n", v);
+        memset(&g_suggest_endpoint, 0, sizeof(g_suggest_endpoint));
+        g_suggest_endpoint.ready = 1;
+        return;
+    }
+    g_suggest_endpoint.use_unix = HAVE_UNIX_SOCKETS;
+    strcpy(g_suggest_endpoint.path, SUGGEST_SOCKET_PATH);
+    g_suggest_endpoint.use_tcp = inet_pton(AF_INET, SUGGEST_HOST, &g_suggest_endpoint.addr) == 1;
+    g_suggest_endpoint.port = SUGGEST_PORT;
+}
+
+#if HAVE_UNIX_SOCKETS
+static int suggest_connect_unix(void) {
+    struct sockaddr_un addr;
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, g_suggest_endpoint.path, sizeof(addr.sun_path)-1);
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+#endif
+
+/* TCP connection to the suggestion server's address and port */
+static int suggest_connect_tcp(void) {
+    struct sockaddr_in serv;
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+    memset(&serv, 0, sizeof(serv));
+    serv.sin_family = AF_INET;
+    serv.sin_port = htons(g_suggest_endpoint.port);
+    serv.sin_addr = g_suggest_endpoint.addr;
+    if (connect(sock, (struct sockaddr*)&serv, sizeof(serv)) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static int suggest_connect_via(enum suggest_transport t) {
+#if HAVE_UNIX_SOCKETS
+    if (t == SUGGEST_UNIX) return suggest_connect_unix();
+#endif
+    if (t == SUGGEST_TCP) return suggest_connect_tcp();
+    return -1;
+}
+
+/* Make sure g_suggest.fd is connected. The transport that worked last time is
+ * tried first; otherwise the Unix domain socket is preferred with TCP as the
+ * fallback (works on Windows and when the suggestion server uses TCP), unless
+ * ISH_SUGGEST_ENDPOINT picked one of them. When
+ * neither is reachable, further attempts are skipped until an exponentially
+ * growing backoff expires, so an absent server costs nothing per line. */
+static int suggest_connect(void) {
+    if (g_suggest.fd >= 0) return 0;
+    long long now = monotonic_ms();
+    if (now < g_suggest.retry_at_ms) return -1;
+
+    suggest_endpoint_init();
+    if (!g_suggest_endpoint.use_unix && !g_suggest_endpoint.use_tcp) return -1;
+    enum suggest_transport order[2];
+    int n = 0;
+    if (g_suggest.transport != SUGGEST_NONE) order[n++] = g_suggest.transport;
+    if (g_suggest_endpoint.use_unix && g_suggest.transport != SUGGEST_UNIX) order[n++] = SUGGEST_UNIX;
+    if (g_suggest_endpoint.use_tcp && n < 2 && g_suggest.transport != SUGGEST_TCP) order[n++] = SUGGEST_TCP;
+
+    for (int i = 0; i < n; ++i) {
+        int sock = suggest_connect_via(order[i]);
+        if (sock < 0) continue;
+        suggest_sockopts(sock);
+        g_suggest.fd = sock;
+        g_suggest.transport = order[i];
+        g_suggest.backoff_ms = 0;
+        g_suggest.retry_at_ms = 0;
+        g_suggest.rlen = 0;
+        g_suggest.discarding = 0;
+        g_suggest.negotiated = 0;
+        g_suggest.binary = 0;
+        return 0;
+    }
+
+    g_suggest.transport = SUGGEST_NONE;
+    g_suggest.backoff_ms = g_suggest.backoff_ms ? g_suggest.backoff_ms * 2 : SUGGEST_BACKOFF_MIN_MS;
+    if (g_suggest.backoff_ms > SUGGEST_BACKOFF_MAX_MS) g_suggest.backoff_ms = SUGGEST_BACKOFF_MAX_MS;
+    g_suggest.retry_at_ms = now + g_suggest.backoff_ms;
+    return -1;
+}
+
+static int send_all_iov(int sock, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = (size_t)iovcnt;
+        ssize_t w = sendmsg(sock, &msg, SUGGEST_SEND_FLAGS);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return -1;
+        while (iovcnt > 0 && (size_t)w >= iov->iov_len) {
+            w -= (ssize_t)iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= (size_t)w;
+        }
+    }
+    return 0;
+}
+
+/* The request fields after "cmd": `","status":n,"prev":"..","cwd":"..` (closing the
+ * cmd string; status only once known), escaped once per change of context rather
+ * than per request. */
+static uint32_t g_context_hash = 0;   /* of the context, the cache version of whole answers */
+
+static size_t last_cmd_sent_len(void) {
+    size_t n = strlen(g_last_cmd);
+    return n < SUGGEST_MAX_QUERY ? n : SUGGEST_MAX_QUERY;
+}
+
+static const char *suggest_context(size_t *len) {
+    static char *ctx = "";
+    static size_t ctx_cap, ctx_len;
+    if (g_context_changed) {
+        size_t plen = last_cmd_sent_len(), clen = strlen(g_cwd);
+        if (grow_buf(&ctx, &ctx_cap, 6 * (plen + clen) + 48) == 0) {
+            size_t n = (size_t)sprintf(ctx, "\",");
+            if (g_last_status >= 0) n += (size_t)sprintf(ctx + n, "\"status\":%d,", g_last_status);
+            n += (size_t)sprintf(ctx + n, "\"prev\":\"");
+            json_escape(g_last_cmd, plen, ctx + n, ctx_cap - n);
+            n += strlen(ctx + n);
+            n += (size_t)sprintf(ctx + n, "\",\"cwd\":\"");
+            json_escape(g_cwd, clen, ctx + n, ctx_cap - n);
+            ctx_len = n + strlen(ctx + n);
+            g_context_hash = hash_bytes(ctx, ctx_len);
+            g_context_changed = 0;
+        }
+    }
+    *len = ctx_len;
+    return ctx;
+}
+
+/* Request fields fixed for the session: the server's deadline, and optionally
+ * ISH_SUGGEST_TOPK=n for at most n suggestions and ISH_SUGGEST_FIELDS=a,b for
+ * only those keys of each one (names are [a-z_] words). Both the JSON fragment
+ * (`,"deadline_ms":n,"k":n,"fields":[..]`) and the MessagePack map entries are built once. */
+static struct {
+    int ready;
+    int topk;                       /* 0 = the server's default */
+    int fields;                     /* answers may lack "source" and "confidence" */
+    int nentries;                   /* map entries in mp */
+    char json[256];
+    unsigned char mp[256];
+    size_t mp_len;
+} g_suggest_opts;
+
+static size_t mp_str_header(unsigned char *dst, size_t n) {
+    if (n < 32) { dst[0] = (unsigned char)(0xa0 | n); return 1; }
+    if (n < 256) { dst[0] = 0xd9; dst[1] = (unsigned char)n; return 2; }
+    if (n < 65536) { dst[0] = 0xda; dst[1] = (unsigned char)(n >> 8); dst[2] = (unsigned char)n; return 3; }
+    dst[0] = 0xdb;
+    for (int i = 0; i < 4; ++i) dst[1 + i] = (unsigned char)(n >> (24 - 8 * i));
+    return 5;
+}
+
+/* Header and bytes of string s[0..n); dst needs n + 5 bytes */
+static size_t mp_str(unsigned char *dst, const char *s, size_t n) {
+    size_t h = mp_str_header(dst, n);
+    memcpy(dst + h, s, n);
+    return h + n;
+}
+
+static void suggest_options_init(void) {
+    if (g_suggest_opts.ready) return;
+    g_suggest_opts.ready = 1;
+    char *j = g_suggest_opts.json;
+    unsigned char *m = g_suggest_opts.mp;
+    size_t jn = 0, mn = 0;
+    const char *d = getenv("ISH_SUGGEST_DEADLINE_MS");
+    long deadline = d && *d ? atol(d) : SUGGEST_DEADLINE_MS;
+    if (deadline <= 0 || deadline > 60000) deadline = SUGGEST_DEADLINE_MS;
+    jn += (size_t)snprintf(j + jn, sizeof(g_suggest_opts.json) - jn, ",\"deadline_ms\":%ld", deadline);
+    mn += mp_str(m + mn, "deadline_ms", 11);
+    m[mn++] = 0xcd;
+    m[mn++] = (unsigned char)(deadline >> 8);
+    m[mn++] = (unsigned char)deadline;
+    g_suggest_opts.nentries++;
+    const char *k = getenv("ISH_SUGGEST_TOPK");
+    long topk = k && *k ? atol(k) : 0;
+    if (topk > 0 && topk < 128) {
+        jn += (size_t)snprintf(j + jn, sizeof(g_suggest_opts.json) - jn, ",\"k\":%ld", topk);
+        mn += mp_str(m + mn, "k", 1);
+        m[mn++] = (unsigned char)topk;
+        g_suggest_opts.topk = (int)topk;
+        g_suggest_opts.nentries++;
+    }
+    const char *f = getenv("ISH_SUGGEST_FIELDS");
+    if (f && *f) {
+        const char *names[8];
+        size_t lens[8];
+        int nf = 0;
+        for (const char *p = f; *p && nf < 8; ) {
+            size_t n = strspn(p, "abcdefghijklmnopqrstuvwxyz_");
+            if (n == 0 || (p[n] && p[n] != ',') || n > 24) {
+                fprintf(stderr, "Warning: ignoring ISH_SUGGEST_FIELDS=%s\n", f);
+                nf = 0;
+                break;
+            }
+            names[nf] = p;
+            lens[nf++] = n;
+            p += n + (p[n] == ',');
+        }
+        if (nf > 0) {
+            jn += (size_t)snprintf(j + jn, sizeof(g_suggest_opts.json) - jn, ",\"fields\":[");
+            mn += mp_str(m + mn, "fields", 6);
+            m[mn++] = (unsigned char)(0x90 | nf);
+            for (int i = 0; i < nf; ++i) {
+                jn += (size_t)snprintf(j + jn, sizeof(g_suggest_opts.json) - jn, "%s\"%.*s\"",
+                                       i ? "," : "", (int)lens[i], names[i]);
+                mn += mp_str(m + mn, names[i], lens[i]);
+            }
+            jn += (size_t)snprintf(j + jn, sizeof(g_suggest_opts.json) - jn, "]");
+            g_suggest_opts.fields = 1;
+            g_suggest_opts.nentries++;
+        }
+    }
+    g_suggest_opts.mp_len = mn;
+}
+
+static char *suggest_recv(unsigned long id, int timeout_ms);
+
+/* Offer binary framing on a fresh connection. The answer is awaited here, once per
+ * connection; a server that does not answer in time is dropped and the shell
+ * stays on JSON lines from then on (its late answer must not be read as a hint). */
+static int suggest_negotiate(void) {
+    g_suggest.negotiated = 1;
+    if (g_suggest.json_only < 0) {
+        const char *v = getenv("ISH_SUGGEST_PROTO");
+        g_suggest.json_only = v && strcasecmp(v, "json") == 0;
+    }
+    if (g_suggest.json_only) return 0;
+    static const char hello[] = "{\"op\":\"hello\",\"proto\":\"" SUGGEST_PROTO "\"}\n";
+    struct iovec iov = { (void *)hello, sizeof(hello) - 1 };
+    if (send_all_iov(g_suggest.fd, &iov, 1) != 0) return -1;
+    char *resp = suggest_recv(0, SUGGEST_HELLO_TIMEOUT_MS);
+    if (!resp) {
+        g_suggest.json_only = 1;
+        return -1;
+    }
+    /* old servers answer the hello like a query: that means JSON lines */
+    g_suggest.binary = strstr(resp, "\"proto\"") && strstr(resp, "\"" SUGGEST_PROTO "\"");
+    free(resp);
+    return 0;
+}
+
+/* The same request as one MessagePack frame: {id, cmd, prev, [status], cwd, model,
+ * [k, fields], [engines]}, with cmd sent straight from the caller's buffer */
+static int suggest_send_frame(unsigned long id, const char *cmd, size_t len, const char *model, int next_only) {
+    unsigned char head[32];
+    /* prev, cwd, a model name of up to 256 bytes, the options, and keys and headers */
+    static unsigned char tail[SUGGEST_MAX_QUERY + MAXLINE + 256 + sizeof(g_suggest_opts.mp) + 96];
+    size_t hn = 4, tn = 0;
+    head[hn++] = (unsigned char)(0x80 | (5 + g_suggest_opts.nentries + (next_only != 0) + (g_last_status >= 0)));
+    hn += mp_str(head + hn, "id", 2);
+    head[hn++] = 0xcf;
+    for (int i = 0; i < 8; ++i) head[hn++] = (unsigned char)((uint64_t)id >> (56 - 8 * i));
+    hn += mp_str(head + hn, "cmd", 3);
+    hn += mp_str_header(head + hn, len);
+    tn += mp_str(tail + tn, "prev", 4);
+    tn += mp_str(tail + tn, g_last_cmd, last_cmd_sent_len());
+    if (g_last_status >= 0) {
+        tn += mp_str(tail + tn, "status", 6);
+        if (g_last_status >= 128) tail[tn++] = 0xcc;
+        tail[tn++] = (unsigned char)g_last_status;
+    }
+    tn += mp_str(tail + tn, "cwd", 3);
+    tn += mp_str(tail + tn, g_cwd, strlen(g_cwd));
+    tn += mp_str(tail + tn, "model", 5);
+    const char *mname = model ? model : DEFAULT_SUGGEST_MODEL;
+    size_t mlen = strlen(mname);
+    if (mlen > 256) mlen = 256;
+    tn += mp_str(tail + tn, mname, mlen);
+    memcpy(tail + tn, g_suggest_opts.mp, g_suggest_opts.mp_len);
+    tn += g_suggest_opts.mp_len;
+    if (next_only) {
+        tn += mp_str(tail + tn, "engines", 7);
+        tail[tn++] = 0x92;
+        tn += mp_str(tail + tn, "NextCmd", 7);
+        tn += mp_str(tail + tn, "Partial", 7);
+    }
+    size_t total = hn - 4 + len + tn;
+    for (int i = 0; i < 4; ++i) head[i] = (unsigned char)(total >> (24 - 8 * i));
+    struct iovec iov[3] = { { head, hn }, { (void *)cmd, len }, { tail, tn } };
+    return send_all_iov(g_suggest.fd, iov, 3);
+}
+
+/* Queue one request for cmd[0..len) on the persistent connection. When the caller
+ * already knows the text needs no JSON escaping it is sent straight from its
+ * buffer (gathered with the JSON framing by sendmsg); binary frames never need
+ * escaping. next_only asks for the context-dependent engines alone (NextCmd, and
+ * Partial when it finds nothing), for a line whose other results are cached.
+ * Returns the request id, or 0 on failure. */
+static unsigned long suggest_send(const char *cmd, size_t len, int needs_escape, const char *model, int next_only) {
+    char head[64];
+    char tail[200 + sizeof(g_suggest_opts.json)];
+    size_t ctx_len;
+    const char *ctx = suggest_context(&ctx_len);
+    suggest_options_init();
+    const char *raw_cmd = cmd;
+    size_t raw_len = len;
+    if (len > SUGGEST_MAX_QUERY) return 0;
+    unsigned long id = g_suggest.next_id++;
+
+    /* A stale socket (server went away) usually only shows up on the first send,
+       so retry once on a fresh connection. */
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        if (suggest_connect() != 0) return 0;
+        if (!g_suggest.negotiated && suggest_negotiate() != 0) {
+            suggest_disconnect();
+            continue;
+        }
+        if (g_suggest.binary) {
+            if (suggest_send_frame(id, raw_cmd, raw_len, model, next_only) == 0) return id;
+            suggest_disconnect();
+            continue;
+        }
+        if (needs_escape) {
+            char *esc_cmd = arena_alloc(&g_cmd_arena, 6 * raw_len + 1);
+            if (!esc_cmd) return 0;
+            json_escape(raw_cmd, raw_len, esc_cmd, 6 * raw_len + 1);
+            cmd = esc_cmd;
+            len = strlen(esc_cmd);
+            needs_escape = 0;
+        }
+        int hn = snprintf(head, sizeof(head), "{\"id\":%lu,\"cmd\":\"", id);
+        int tn = snprintf(tail, sizeof(tail), "\",\"model\":\"%s\"%s%s}\n",
+                          model ? model : DEFAULT_SUGGEST_MODEL, g_suggest_opts.json,
+                          next_only ? ",\"engines\":[\"NextCmd\",\"Partial\"]" : "");
+        if (tn < 0 || (size_t)tn >= sizeof(tail)) return 0;
+        struct iovec iov[4] = {
+            { head, (size_t)hn }, { (void *)cmd, len }, { (void *)ctx, ctx_len }, { tail, (size_t)tn },
+        };
+        if (send_all_iov(g_suggest.fd, iov, 4) == 0) return id;
+        suggest_disconnect();
+    }
+    return 0;
+}
+
+/* Growable output buffer for rendering MessagePack answers as JSON */
+struct strbuf {
+    char *p;
+    size_t len, cap;
+    int failed;
+};
+
+static void sb_put(struct strbuf *b, const char *s, size_t n) {
+    if (b->failed) return;
+    if (b->len + n + 1 > b->cap) {
+        size_t cap = b->cap ? b->cap : 256;
+        while (b->len + n + 1 > cap) cap *= 2;
+        char *p = realloc(b->p, cap);
+        if (!p) { b->failed = 1; return; }
+        b->p = p;
+        b->cap = cap;
+    }
+    memcpy(b->p + b->len, s, n);
+    b->len += n;
+    b->p[b->len] = '\0';
+}
+
+static void sb_json_string(struct strbuf *b, const unsigned char *s, size_t n) {
+    sb_put(b, "\"", 1);
+    size_t run = 0;
+    for (size_t i = 0; i < n; ++i) {
+        unsigned char c = s[i];
+        if (c != '"' && c != '\\' && c >= 0x20) continue;
+        sb_put(b, (const char *)s + run, i - run);
+        char esc[8];
+        if (c == '"' || c == '\\') { esc[0] = '\\'; esc[1] = (char)c; sb_put(b, esc, 2); }
+        else if (c == '\n') sb_put(b, "\\n", 2);
+        else sb_put(b, esc, (size_t)snprintf(esc, sizeof(esc), "\\u%04x", c));
+        run = i + 1;
+    }
+    sb_put(b, (const char *)s + run, n - run);
+    sb_put(b, "\"", 1);
+}
+
+static uint64_t mp_be(const unsigned char *p, int n) {
+    uint64_t v = 0;
+    for (int i = 0; i < n; ++i) v = v << 8 | p[i];
+    return v;
+}
+
+/* Render the MessagePack value at p as JSON; returns the end of the value or NULL
+ * when it is malformed or nests too deep */
+static const unsigned char *mp_render(const unsigned char *p, const unsigned char *end, struct strbuf *out, int depth) {
+    char num[40];
+    if (p >= end || depth > 16) return NULL;
+    unsigned char t = *p++;
+    size_t n = 0;
+    int kind = 0; /* 1 str, 2 array, 3 map */
+    if (t < 0x80) { sb_put(out, num, (size_t)snprintf(num, sizeof(num), "%u", t)); return p; }
+    if (t >= 0xe0) { sb_put(out, num, (size_t)snprintf(num, sizeof(num), "%d", (int)t - 256)); return p; }
+    if ((t & 0xe0) == 0xa0) { n = t & 0x1f; kind = 1; }
+    else if ((t & 0xf0) == 0x90) { n = t & 0x0f; kind = 2; }
+    else if ((t & 0xf0) == 0x80) { n = t & 0x0f; kind = 3; }
+    else switch (t) {
+    case 0xc0: sb_put(out, "null", 4); return p;
+    case 0xc2: sb_put(out, "false", 5); return p;
+    case 0xc3: sb_put(out, "true", 4); return p;
+    case 0xcc: case 0xcd: case 0xce: case 0xcf: {
+        int w = 1 << (t - 0xcc);
+        if (end - p < w) return NULL;
+        sb_put(out, num, (size_t)snprintf(num, sizeof(num), "%llu", (unsigned long long)mp_be(p, w)));
+        return p + w;
+    }
+    case 0xd0: case 0xd1: case 0xd2: case 0xd3: {
+        int w = 1 << (t - 0xd0);
+        if (end - p < w) return NULL;
+        uint64_t u = mp_be(p, w);
+        if (w < 8 && (u >> (8 * w - 1))) u |= ~(uint64_t)0 << (8 * w); /* sign-extend */
+        sb_put(out, num, (size_t)snprintf(num, sizeof(num), "%lld", (long long)u));
+        return p + w;
+    }
+    case 0xca: case 0xcb: {
+        int w = t == 0xca ? 4 : 8;
+        if (end - p < w) return NULL;
+        uint64_t u = mp_be(p, w);
+        double d;
+        if (w == 4) { uint32_t u32 = (uint32_t)u; float f; memcpy(&f, &u32, 4); d = f; }
+        else memcpy(&d, &u, 8);
+        if (isfinite(d)) sb_put(out, num, (size_t)snprintf(num, sizeof(num), "%.15g", d));
+        else sb_put(out, "null", 4);
+        return p + w;
+    }
+    case 0xd9: case 0xda: case 0xdb: case 0xc4: case 0xc5: case 0xc6: {
+        int w = t == 0xd9 || t == 0xc4 ? 1 : t == 0xda || t == 0xc5 ? 2 : 4;
+        if (end - p < w) return NULL;
+        n = (size_t)mp_be(p, w);
+        p += w;
+        kind = 1;
+        break;
+    }
+    case 0xdc: case 0xdd: case 0xde: case 0xdf: {
+        int w = t == 0xdc || t == 0xde ? 2 : 4;
+        if (end - p < w) return NULL;
+        n = (size_t)mp_be(p, w);
+        p += w;
+        kind = t <= 0xdd ? 2 : 3;
+        break;
+    }
+    default:
+        return NULL;
+    }
+    if (kind == 1) {
+        if ((size_t)(end - p) < n) return NULL;
+        sb_json_string(out, p, n);
+        return p + n;
+    }
+    sb_put(out, kind == 2 ? "[" : "{", 1);
+    for (size_t i = 0; i < n && p; ++i) {
+        if (i) sb_put(out, ",", 1);
+        p = mp_render(p, end, out, depth + 1);
+        if (kind == 3 && p) {
+            sb_put(out, ":", 1);
+            p = mp_render(p, end, out, depth + 1);
+        }
+    }
+    sb_put(out, kind == 2 ? "]" : "}", 1);
+    return p;
+}
+
+/* One MessagePack answer as a malloc'd JSON line, or NULL if malformed */
+static char *mp_to_json(const unsigned char *p, size_t n) {
+    struct strbuf out = { 0 };
+    const unsigned char *e = mp_render(p, p + n, &out, 0);
+    if (!e || e != p + n || out.failed) {
+        free(out.p);
+        return NULL;
+    }
+    return out.p;
+}
+
+/* Pop one complete answer out of the receive buffer as a malloc'd JSON string in
+ * *out (NULL when it had to be dropped). Returns 1 if an answer was taken, 0 if
+ * more data is needed, -1 if the stream is unusable. A JSON line longer than
+ * SUGGEST_MAX_MESSAGE is dropped as a whole rather than truncated. */
+static int suggest_take_message(char **out) {
+    *out = NULL;
+    if (g_suggest.binary) {
+        if (g_suggest.rlen < 4) return 0;
+        size_t n = (size_t)mp_be((const unsigned char *)g_suggest.rbuf, 4);
+        if (n > SUGGEST_MAX_MESSAGE) return -1;
+        if (g_suggest.rlen < 4 + n) return 0;
+        *out = mp_to_json((const unsigned char *)g_suggest.rbuf + 4, n);
+        memmove(g_suggest.rbuf, g_suggest.rbuf + 4 + n, g_suggest.rlen - 4 - n);
+        g_suggest.rlen -= 4 + n;
+        return 1;
+    }
+    char *nl = memchr(g_suggest.rbuf, '\n', g_suggest.rlen);
+    if (!nl) {
+        if (g_suggest.rlen >= SUGGEST_MAX_MESSAGE) {
+            g_suggest.rlen = 0;
+            g_suggest.discarding = 1;
+        }
+        return 0;
+    }
+    size_t linelen = (size_t)(nl - g_suggest.rbuf);
+    if (!g_suggest.discarding) *out = strndup(g_suggest.rbuf, linelen);
+    g_suggest.discarding = 0;
+    memmove(g_suggest.rbuf, nl + 1, g_suggest.rlen - linelen - 1);
+    g_suggest.rlen -= linelen + 1;
+    return 1;
+}
+
+/* Room for at least one more byte in rbuf */
+static int suggest_rbuf_reserve(void) {
+    if (g_suggest.rlen < g_suggest.rcap) return 0;
+    size_t cap = g_suggest.rcap ? g_suggest.rcap * 2 : SUGGEST_RBUF_MIN;
+    if (cap > SUGGEST_MAX_MESSAGE + 4) cap = SUGGEST_MAX_MESSAGE + 4;
+    if (cap <= g_suggest.rcap) return -1;
+    char *p = realloc(g_suggest.rbuf, cap);
+    if (!p) return -1;
+    g_suggest.rbuf = p;
+    g_suggest.rcap = cap;
+    return 0;
+}
+
+/* Response id as echoed by the server; 0 when the server did not send one (old servers). */
+static unsigned long response_id(const char *resp) {
+    const char *p = strstr(resp, "\"id\":");
+    if (!p) return 0;
+    return strtoul(p + 5, NULL, 10);
+}
+
+/* Wait up to timeout_ms for the response to request id. Answers to older requests
+ * are discarded. Returns a malloc'd string or NULL. */
+static char *suggest_recv(unsigned long id, int timeout_ms) {
+    struct timeval deadline, now;
+    gettimeofday(&deadline, NULL);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_usec += (timeout_ms % 1000) * 1000;
+    if (deadline.tv_usec >= 1000000) { deadline.tv_sec++; deadline.tv_usec -= 1000000; }
+
+    while (g_suggest.fd >= 0) {
+        char *msg;
+        int got;
+        while ((got = suggest_take_message(&msg)) == 1) {
+            if (!msg) continue;
+            unsigned long rid = response_id(msg);
+            if (rid == id || rid == 0) return msg;
+            free(msg);
+        }
+        if (got < 0) { suggest_disconnect(); return NULL; }
+
+        /* timeout_ms == 0 still polls the socket once without blocking */
+        gettimeofday(&now, NULL);
+        long remain_us = (deadline.tv_sec - now.tv_sec) * 1000000L + (deadline.tv_usec - now.tv_usec);
+        if (remain_us < 0) remain_us = 0;
+
+        fd_set rfds;
+        FD_ZERO(&rfds);
+        FD_SET(g_suggest.fd, &rfds);
+        struct timeval tv;
+        tv.tv_sec = remain_us / 1000000L;
+        tv.tv_usec = remain_us % 1000000L;
+        int sel = select(g_suggest.fd + 1, &rfds, NULL, NULL, &tv);
+        if (sel < 0 && errno == EINTR) continue;
+        if (sel <= 0) return NULL;
+
+        if (suggest_rbuf_reserve() != 0) { suggest_disconnect(); return NULL; }
+        ssize_t r = recv(g_suggest.fd, g_suggest.rbuf + g_suggest.rlen,
+                         g_suggest.rcap - g_suggest.rlen, 0);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) { suggest_disconnect(); return NULL; }
+        g_suggest.rlen += (size_t)r;
+    }
+    return NULL;
+}
+
+/* Suggestion cache. A line the shell has asked about before is answered from here
+ * instead of the native engine, and mostly instead of the server. The key is
+ * (text, model, version): version is the native model's export time for native
+ * answers and SUGGEST_CACHE_SERVER for the context-free part of server ones (see
+ * suggest_cache_server_put). Entries expire after ISH_SUGGEST_CACHE_TTL_MS (default 30000, 0 disables the
+ * cache), the least recently used one is replaced when all slots are taken, and
+ * everything is dropped when a server response reports a new model_version. */
+#define SUGGEST_CACHE_SLOTS 64
+
+struct suggest_cache_entry {
+    char *text;                     /* NULL = free slot */
+    char *resp;
+    const char *model;
+    uint32_t hash;                  /* of text */
+    uint32_t version;
+    long long stored_ms;
+    unsigned long used;             /* LRU stamp */
+};
+
+static struct {
+    struct suggest_cache_entry slots[SUGGEST_CACHE_SLOTS];
+    long ttl_ms;                    /* -1 until read from the environment */
+    unsigned long clock;
+    unsigned long hits, misses;
+    long long server_version;       /* model_version of the last server answer, -1 = none yet */
+} g_suggest_cache = { .ttl_ms = -1, .server_version = -1 };
+
+static void suggest_cache_clear(void) {
+    for (int i = 0; i < SUGGEST_CACHE_SLOTS; ++i) {
+        struct suggest_cache_entry *e = &g_suggest_cache.slots[i];
+        free(e->text);
+        free(e->resp);
+        memset(e, 0, sizeof(*e));
+    }
+}
+
+static long suggest_cache_ttl(void) {
+    if (g_suggest_cache.ttl_ms < 0) {
+        const char *v = getenv("ISH_SUGGEST_CACHE_TTL_MS");
+        g_suggest_cache.ttl_ms = v && *v ? atol(v) : 30000;
+        if (g_suggest_cache.ttl_ms < 0) g_suggest_cache.ttl_ms = 0;
+    }
+    return g_suggest_cache.ttl_ms;
+}
+
+static int suggest_cache_model_eq(const char *a, const char *b) {
+    return strcmp(a ? a : DEFAULT_SUGGEST_MODEL, b ? b : DEFAULT_SUGGEST_MODEL) == 0;
+}
+
+/* Cached response for text[0..len) or NULL; the pointer is valid until the next put */
+static const char *suggest_cache_get(const char *text, size_t len, const char *model, uint32_t version) {
+    long ttl = suggest_cache_ttl();
+    if (ttl == 0) return NULL;
+    uint32_t h = hash_bytes(text, len);
+    long long now = monotonic_ms();
+    for (int i = 0; i < SUGGEST_CACHE_SLOTS; ++i) {
+        struct suggest_cache_entry *e = &g_suggest_cache.slots[i];
+        if (!e->text || e->hash != h || e->version != version) continue;
+        if (strncmp(e->text, text, len) != 0 || e->text[len] != '\0' || !suggest_cache_model_eq(e->model, model)) continue;
+        if (now - e->stored_ms > ttl) break;
+        e->used = ++g_suggest_cache.clock;
+        g_suggest_cache.hits++;
+        return e->resp;
+    }
+    g_suggest_cache.misses++;
+    return NULL;
+}
+
+/* The "model_version" of a server response, or -1 */
+static long long response_model_version(const char *resp) {
+    const char *p = strstr(resp, "\"model_version\":");
+    return p ? strtoll(p + 16, NULL, 10) : -1;
+}
+
+static void suggest_cache_put(const char *text, size_t len, const char *model, uint32_t version,
+                              const char *resp, int from_server) {
+    if (suggest_cache_ttl() == 0) return;
+    if (from_server) {
+        if (!strstr(resp, "\"suggestions\"")) return; /* busy / error answers are not results */
+        long long v = response_model_version(resp);
+        if (v >= 0 && v != g_suggest_cache.server_version) {
+            if (g_suggest_cache.server_version >= 0) suggest_cache_clear();
+            g_suggest_cache.server_version = v;
+        }
+    }
+    uint32_t h = hash_bytes(text, len);
+    struct suggest_cache_entry *slot = NULL;
+    for (int i = 0; i < SUGGEST_CACHE_SLOTS; ++i) {
+        struct suggest_cache_entry *e = &g_suggest_cache.slots[i];
+        if (e->text && e->hash == h && e->version == version && strncmp(e->text, text, len) == 0 &&
+            e->text[len] == '\0' && suggest_cache_model_eq(e->model, model)) {
+            slot = e;   /* refresh an expired or duplicate entry in place */
+            break;
+        }
+        if (!slot || (slot->text && (!e->text || e->used < slot->used))) slot = e;
+    }
+    char *t = strndup(text, len), *r = strdup(resp);
+    if (!t || !r) {
+        free(t);
+        free(r);
+        return;
+    }
+    free(slot->text);
+    free(slot->resp);
+    slot->text = t;
+    slot->resp = r;
+    slot->model = model;
+    slot->hash = h;
+    slot->version = version;
+    slot->stored_ms = monotonic_ms();
+    slot->used = ++g_suggest_cache.clock;
+}
+
+/* suggest [-r]: cache statistics, or drop the cache and reset them */
+void builtin_suggest(char **argv) {
+    if (argv[1] && strcmp(argv[1], "-r") == 0) {
+        suggest_cache_clear();
+        g_suggest_cache.hits = g_suggest_cache.misses = 0;
+        return;
+    }
+    int used = 0;
+    for (int i = 0; i < SUGGEST_CACHE_SLOTS; ++i) used += g_suggest_cache.slots[i].text != NULL;
+    unsigned long total = g_suggest_cache.hits + g_suggest_cache.misses;
+    printf("cache: %lu hits, %lu misses (%.1f%% hit rate), %d/%d entries, ttl %ldms\n",
+           g_suggest_cache.hits, g_suggest_cache.misses,
+           total ? 100.0 * g_suggest_cache.hits / total : 0.0, used, SUGGEST_CACHE_SLOTS, suggest_cache_ttl());
+}
+
+/* Server answers are split for the cache: a line's TypoFixer and Template
+ * suggestions depend on its text and the model alone, so they are kept under
+ * SUGGEST_CACHE_SERVER and serve the line again whatever ran before it. A hit
+ * then only asks the server for NextCmd (and the Partial fallback), which depend
+ * on prev and cwd, and suggest_merge() combines the two answers. With
+ * ISH_SUGGEST_FIELDS an answer may not say where its items came from, and with
+ * ISH_SUGGEST_TOPK the server may have cut context-free items in favour of
+ * NextCmd ones, so then whole answers are cached under g_context_hash instead. */
+#define SUGGEST_CACHE_SERVER UINT32_MAX
+#define SUGGEST_MAX_ITEMS 32
+#define SUGGEST_MERGED_ITEMS 5      /* what the server's merge_engines() returns */
+
+struct suggest_item {
+    const char *p;                  /* the item's JSON object */
+    size_t len;
+    double conf;
+};
+
+static int suggest_cache_split(void) {
+    suggest_options_init();
+    return !g_suggest_opts.fields && !g_suggest_opts.topk;
+}
+
+/* End of the JSON object starting at p ('{'), or NULL if it is not closed */
+static const char *json_object_end(const char *p) {
+    int depth = 0, in_str = 0;
+    for (; *p; ++p) {
+        if (in_str) {
+            if (*p == '\\' && p[1]) ++p;
+            else if (*p == '"') in_str = 0;
+        } else if (*p == '"') {
+            in_str = 1;
+        } else if (*p == '{') {
+            ++depth;
+        } else if (*p == '}' && --depth == 0) {
+            return p + 1;
+        }
+    }
+    return NULL;
+}
+
+/* The first max items of an answer's "suggestions" list; *open and *close point
+ * at its brackets. Returns how many, or -1 when json has no such list. */
+static int suggest_items(const char *json, struct suggest_item *items, int max, const char **open, const char **close) {
+    const char *p = strstr(json, "\"suggestions\"");
+    if (!p || !(p = strchr(p, '['))) return -1;
+    *open = p++;
+    int n = 0;
+    for (;;) {
+        while (*p == ' ' || *p == ',' || *p == '\n') ++p;
+        if (*p != '{') break;
+        const char *end = json_object_end(p);
+        if (!end) return -1;
+        if (n < max) {
+            const char *c = memmem(p, (size_t)(end - p), "\"confidence\":", 13);
+            items[n].p = p;
+            items[n].len = (size_t)(end - p);
+            items[n++].conf = c ? strtod(c + 13, NULL) : 0.0;
+        }
+        p = end;
+    }
+    if (*p != ']') return -1;
+    *close = p;
+    return n;
+}
+
+/* The value of string field `key` in item, without its quotes; NULL if absent */
+static const char *suggest_item_field(const struct suggest_item *it, const char *key, size_t *len) {
+    const char *end = it->p + it->len;
+    size_t klen = strlen(key);
+    for (const char *p = it->p; (p = memmem(p, (size_t)(end - p), key, klen)) != NULL; p += klen) {
+        if (p == it->p || p[-1] != '"' || p + klen >= end || p[klen] != '"') continue;
+        const char *v = p + klen + 1;
+        while (v < end && *v == ' ') ++v;
+        if (v >= end || *v++ != ':') continue;  /* a string value that looks like the key */
+        while (v < end && *v == ' ') ++v;
+        if (v >= end || *v != '"') return NULL;
+        const char *q = ++v;
+        while (q < end && *q != '"') q += *q == '\\' ? 2 : 1;
+        if (q >= end) return NULL;
+        *len = (size_t)(q - v);
+        return v;
+    }
+    return NULL;
+}
+
+static int suggest_item_from(const struct suggest_item *it, const char *source) {
+    size_t n;
+    const char *v = suggest_item_field(it, "source", &n);
+    return v && n == strlen(source) && memcmp(v, source, n) == 0;
+}
+
+/* json with its suggestions replaced by items[0..n), malloc'd */
+static char *suggest_with_items(const char *json, const char *open, const char *close,
+                                const struct suggest_item *items, int n) {
+    size_t head = (size_t)(open + 1 - json), len = head + strlen(close) + 1;
+    for (int i = 0; i < n; ++i) len += items[i].len + 1;
+    char *out = malloc(len);
+    if (!out) return NULL;
+    memcpy(out, json, head);
+    size_t off = head;
+    for (int i = 0; i < n; ++i) {
+        if (i) out[off++] = ',';
+        memcpy(out + off, items[i].p, items[i].len);
+        off += items[i].len;
+    }
+    strcpy(out + off, close);
+    return out;
+}
+
+/* A copy of an answer without the suggestions from sources a and b (b may be NULL);
+ * *left gets how many remain. NULL when json is not a suggestions answer. */
+static char *suggest_without(const char *json, const char *a, const char *b, int *left) {
+    struct suggest_item items[SUGGEST_MAX_ITEMS];
+    const char *open, *close;
+    int n = suggest_items(json, items, SUGGEST_MAX_ITEMS, &open, &close), kept = 0;
+    if (n < 0) return NULL;
+    for (int i = 0; i < n; ++i)
+        if (!suggest_item_from(&items[i], a) && !(b && suggest_item_from(&items[i], b))) items[kept++] = items[i];
+    *left = kept;
+    return suggest_with_items(json, open, close, items, kept);
+}
+
+/* The answer the server would have given: the cached context-free suggestions of
+ * base and the NextCmd ones of fresh (its Partial ones only when there is nothing
+ * else), deduplicated and ordered by confidence like merge_engines() does, in
+ * fresh's envelope. malloc'd; NULL when either is not a suggestions answer. */
+static char *suggest_merge(const char *base, const char *fresh) {
+    struct suggest_item b[SUGGEST_MAX_ITEMS], f[SUGGEST_MAX_ITEMS], out[2 * SUGGEST_MAX_ITEMS];
+    const char *bo, *bc, *fo, *fc;
+    int nb = suggest_items(base, b, SUGGEST_MAX_ITEMS, &bo, &bc);
+    int nf = suggest_items(fresh, f, SUGGEST_MAX_ITEMS, &fo, &fc);
+    if (nb < 0 || nf < 0) return NULL;
+    int n = 0;
+    for (int i = 0; i < nf; ++i)
+        if (suggest_item_from(&f[i], "NextCmd")) out[n++] = f[i];
+    for (int i = 0; i < nb; ++i) out[n++] = b[i];
+    if (n == 0)
+        for (int i = 0; i < nf; ++i) out[n++] = f[i];
+    /* one item per suggestion, the most confident */
+    int kept = 0;
+    for (int i = 0; i < n; ++i) {
+        size_t li, lk;
+        const char *si = suggest_item_field(&out[i], "suggestion", &li);
+        int dup = -1;
+        for (int k = 0; k < kept && si; ++k) {
+            const char *sk = suggest_item_field(&out[k], "suggestion", &lk);
+            if (sk && lk == li && memcmp(sk, si, li) == 0) { dup = k; break; }
+        }
+        if (dup < 0) out[kept++] = out[i];
+        else if (out[i].conf > out[dup].conf) out[dup] = out[i];
+    }
+    for (int i = 1; i < kept; ++i) {     /* stable, best first */
+        struct suggest_item it = out[i];
+        int k = i;
+        while (k > 0 && out[k - 1].conf < it.conf) { out[k] = out[k - 1]; --k; }
+        out[k] = it;
+    }
+    return suggest_with_items(fresh, fo, fc, out, kept < SUGGEST_MERGED_ITEMS ? kept : SUGGEST_MERGED_ITEMS);
+}
+
+/* 0 when resp's "engines" map reports an engine that was not "ok" (late for the
+ * deadline or failed): the answer lacks that engine's items, and a hit on the
+ * split cache would hide them for the whole TTL. The server does not cache such
+ * answers either. */
+static int suggest_engines_ok(const char *resp) {
+    const char *p = strstr(resp, "\"engines\"");
+    if (!p) return 1;
+    for (p += 9; *p == ' ' || *p == ':'; ++p) {}
+    if (*p != '{') return 1;
+    const char *end = json_object_end(p);
+    if (!end) return 0;
+    for (const char *q = p; (q = memchr(q, ':', (size_t)(end - q))) != NULL; ) {
+        for (++q; *q == ' '; ++q) {}
+        if (strncmp(q, "\"ok\"", 4) != 0) return 0;
+    }
+    return 1;
+}
+
+/* Cache a server answer for text: its context-free part, or (see
+ * suggest_cache_split) the whole answer under version ctx */
+static void suggest_cache_server_put(const char *text, size_t len, const char *model, uint32_t ctx, const char *resp) {
+    if (!suggest_engines_ok(resp)) return;
+    if (!suggest_cache_split()) {
+        suggest_cache_put(text, len, model, ctx, resp, 1);
+        return;
+    }
+    int left;
+    char *part = suggest_without(resp, "NextCmd", "Partial", &left);
+    if (!part) return;
+    suggest_cache_put(text, len, model, SUGGEST_CACHE_SERVER, part, 1);
+    free(part);
+}
+
+/* Native answer for text (cached) as a malloc'd JSON line */
+static char *native_suggest_cached(const char *text, size_t len, const char *model) {
+    const char *hit = suggest_cache_get(text, len, model, g_native->created);
+    if (hit) return strdup(hit);
+    long long t0 = monotonic_us();
+    char *resp = native_suggest(text, len, model);
+    stat_since(STAT_SUGGEST_NATIVE, t0);
+    if (resp) suggest_cache_put(text, len, model, g_native->created, resp, 0);
+    return resp;
+}
+
+/* Ask the suggestion server about line_prefix.
+ * This function returns a malloc'd JSON line on success or NULL on failure/timeout.
+ */
+char *get_suggestion(const char *line_prefix, const char *model, int timeout_ms) {
+    if (!line_prefix || strlen(line_prefix) == 0) return NULL;
+    size_t len = strlen(line_prefix);
+    if (native_handles(model)) return native_suggest_cached(line_prefix, len, model ? model : DEFAULT_SUGGEST_MODEL);
+    size_t ctx_len;
+    suggest_context(&ctx_len);
+    int split = suggest_cache_split();
+    uint32_t ctx = split ? SUGGEST_CACHE_SERVER : g_context_hash;
+    const char *hit = suggest_cache_get(line_prefix, len, model, ctx);
+    if (hit && !split) return strdup(hit);
+    char *base = hit ? strdup(hit) : NULL;
+    long long t0 = monotonic_us();
+    unsigned long id = suggest_send(line_prefix, len, 1, model, base != NULL);
+    char *resp = id ? suggest_recv(id, timeout_ms) : NULL;
+    if (id && !resp && g_suggest.fd < 0) {
+        /* Server closed the connection under us (e.g. restart): retry once on a new one */
+        id = suggest_send(line_prefix, len, 1, model, base != NULL);
+        if (id != 0) resp = suggest_recv(id, timeout_ms);
+    }
+    if (resp) stat_since(STAT_SUGGEST_RTT, t0);
+    if (base) {
+        /* without the server's NextCmd part the cached one is still an answer */
+        char *merged = resp ? suggest_merge(base, resp) : NULL;
+        free(resp);
+        if (!merged) return base;
+        free(base);
+        return merged;
+    }
+    if (resp) suggest_cache_server_put(line_prefix, len, model, ctx, resp);
+    return resp;
+}
+
+/* Asynchronous hints for the REPL: the request is sent before the command runs,
+ * so a slow server never delays fork/exec. While a foreground job runs the shell
+ * waits in pselect() on the suggestion socket as well as for SIGCHLD, and reads
+ * the answer as soon as it arrives (native hints are computed at that point, in
+ * parallel with the child), so the next prompt shows a prefetched hint at no
+ * cost. Otherwise the answer is polled for once before the next prompt; one that
+ * has not arrived by then is dropped (its late reply is discarded by id). When
+ * the command exits non-zero or changes the directory, the hint's NextCmd
+ * suggestions are removed (and a whole answer is not cached): they predicted
+ * what follows a successful run there. Typo fixes, templates and partial
+ * matches are about the line itself and are still shown. A line whose
+ * context-free suggestions are cached only asks the server for the rest. */
+static unsigned long g_hint_pending = 0;
+static char *g_hint_ready = NULL;    /* answer prefetched while the command ran */
+static uint32_t g_hint_cwd = 0;      /* hash of the directory at submit time */
+/* Native hints are computed from a copy of the command's text; the copy also
+ * keys the cache entry for a server answer */
+static char *g_hint_text = "";       /* the submitted line, in a buffer reused across commands */
+static size_t g_hint_text_cap = 0;
+static const char *g_hint_native_model = NULL;
+static const char *g_hint_model = NULL;
+static uint32_t g_hint_ctx = 0;
+static char *g_hint_cached = NULL;   /* cache hit found at submit time (context-free part, or whole) */
+static long long g_hint_sent_us = 0;
+static int g_hint_unsettled = 0;     /* the command failed or left the directory */
+
+void suggest_hint_submit(const struct line_scan *sc, const char *model) {
+    if (sc->end <= sc->start) return;
+    size_t len = sc->end - sc->start;
+    if (len > SUGGEST_MAX_QUERY) return;
+    g_hint_cwd = hash_bytes(g_cwd, strlen(g_cwd));
+    int copied = grow_buf(&g_hint_text, &g_hint_text_cap, len + 1) == 0;
+    if (copied) {
+        memcpy(g_hint_text, sc->line + sc->start, len);
+        g_hint_text[len] = '\0';
+    }
+    if (native_handles(model) && copied) {
+        g_hint_native_model = model;
+        g_hint_model = NULL;
+        return;
+    }
+    size_t ctx_len;
+    suggest_context(&ctx_len);
+    int split = suggest_cache_split();
+    g_hint_ctx = split ? SUGGEST_CACHE_SERVER : g_context_hash;
+    g_hint_model = copied ? model : NULL;
+    const char *hit = copied ? suggest_cache_get(g_hint_text, len, model, g_hint_ctx) : NULL;
+    if (hit) {
+        g_hint_cached = strdup(hit);
+        if (!split) return;
+    }
+    g_hint_sent_us = monotonic_us();
+    g_hint_pending = suggest_send(sc->line + sc->start, len, sc->needs_escape, model, hit != NULL);
+    stat_since(STAT_SUGGEST_SEND, g_hint_sent_us);
+}
+
+/* Stand-in for sigsuspend(waitmask) while a foreground job runs: also returns
+ * after taking in the pending hint, which the caller's loop then stops waiting for. */
+static void suggest_hint_wait(const sigset_t *waitmask) {
+    if (g_hint_native_model && !g_hint_ready) {
+        g_hint_ready = native_suggest_cached(g_hint_text, strlen(g_hint_text), g_hint_native_model);
+        g_hint_native_model = NULL;
+        return;
+    }
+    if (g_hint_pending == 0 || g_suggest.fd < 0) {
+        history_wait(waitmask);
+        return;
+    }
+    fd_set rfds;
+    FD_ZERO(&rfds);
+    FD_SET(g_suggest.fd, &rfds);
+    struct timespec ts;
+    int ready = pselect(g_suggest.fd + 1, &rfds, NULL, NULL, history_flush_timeout(&ts), waitmask);
+    if (ready == 0) history_flush_if_due();
+    if (ready <= 0) return; /* SIGCHLD, or history was due */
+    char *msg = suggest_recv(g_hint_pending, 0);
+    if (g_suggest.fd < 0) {
+        g_hint_pending = 0;
+        g_hints_missed++;
+    }
+    if (!msg) return; /* partial answer, or a reply to an older request */
+    stat_since(STAT_SUGGEST_HINT, g_hint_sent_us);
+    g_hint_pending = 0;
+    g_hint_ready = msg;
+}
+
+/* Mark the hint of a command that failed (status != 0) or changed the directory */
+void suggest_hint_settle(const struct cmd_result *r) {
+    int failed = r->have_status && r->status != 0;
+    g_hint_unsettled = failed || hash_bytes(g_cwd, strlen(g_cwd)) != g_hint_cwd;
+}
+
+void suggest_hint_collect(void) {
+    char *suggest_json = NULL;
+    int fresh = 0;      /* suggest_json is the server's answer to this line */
+    if (g_hint_ready) {
+        suggest_json = g_hint_ready;
+        g_hint_ready = NULL;
+        fresh = 1;
+    } else if (g_hint_native_model) {
+        suggest_json = native_suggest_cached(g_hint_text, strlen(g_hint_text), g_hint_native_model);
+        g_hint_native_model = NULL;
+    } else if (g_hint_pending != 0) {
+        suggest_json = suggest_recv(g_hint_pending, 0);
+        g_hint_pending = 0;
+        if (suggest_json) stat_since(STAT_SUGGEST_HINT, g_hint_sent_us);
+        else g_hints_missed++;
+        fresh = suggest_json != NULL;
+    }
+    if (g_hint_cached) {
+        char *merged = fresh ? suggest_merge(g_hint_cached, suggest_json) : NULL;
+        free(suggest_json);
+        suggest_json = merged ? merged : g_hint_cached;
+        if (merged) free(g_hint_cached);
+        g_hint_cached = NULL;
+    } else if (fresh && g_hint_model && (suggest_cache_split() || !g_hint_unsettled)) {
+        suggest_cache_server_put(g_hint_text, strlen(g_hint_text), g_hint_model, g_hint_ctx, suggest_json);
+    }
+    if (suggest_json && g_hint_unsettled) {
+        int left = 0;
+        char *kept = suggest_without(suggest_json, "NextCmd", NULL, &left);
+        free(suggest_json);
+        suggest_json = kept;
+        if (kept && left == 0) {
+            free(kept);
+            suggest_json = NULL;
+        }
+    }
+    g_hint_unsettled = 0;
+    if (suggest_json) {
+        // Print raw response JSON as hint
+        printf("\t[suggestion-json] %s\n", suggest_json);
+        free(suggest_json);
+    }
+}
+
+/* Job table. Every pipeline gets a slot; the SIGCHLD handler reaps its
+ * processes asynchronously with wait4() and records state, exit status (of the
+ * last stage) and rusage (summed over the stages) in the slot, so no zombies
+ * accumulate. The main loop only touches the
+ * table with SIGCHLD blocked, reports finished background jobs before the next
+ * prompt and frees their slots. With an interactive terminal each job runs in
+ * its own process group and owns the terminal while in the foreground. */
+#define MAXJOBS 64
+
+enum job_state { JOB_FREE = 0, JOB_FG, JOB_BG, JOB_STOPPED, JOB_DONE };
+
+struct job {
+    pid_t pids[MAXSTAGES];          /* one per pipeline stage */
+    int nprocs;
+    int nalive;                     /* processes not reaped yet */
+    pid_t pgid;                     /* own process group, or 0 without job control */
+    int jid;
+    int state;                      /* enum job_state */
+    int status;                     /* wait status once JOB_DONE */
+    int notify;                     /* report the next state change at the prompt */
+    long long start_ms;
+    long long end_ms;
+    struct rusage ru;
+    char *cmdline;
+};
+
+static struct job g_jobs[MAXJOBS];
+static int g_interactive = 0;
+static pid_t g_shell_pgid = 0;
+
+static struct job *job_by_pid(pid_t pid, int *stage) {
+    for (int i = 0; i < MAXJOBS; ++i) {
+        if (g_jobs[i].state == JOB_FREE) continue;
+        for (int k = 0; k < g_jobs[i].nprocs; ++k) {
+            if (g_jobs[i].pids[k] == pid) {
+                if (stage) *stage = k;
+                return &g_jobs[i];
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Accumulate a stage's rusage into the job's (async-signal-safe) */
+static void rusage_add(struct rusage *acc, const struct rusage *ru) {
+    acc->ru_utime.tv_sec += ru->ru_utime.tv_sec;
+    acc->ru_utime.tv_usec += ru->ru_utime.tv_usec;
+    if (acc->ru_utime.tv_usec >= 1000000) { acc->ru_utime.tv_sec++; acc->ru_utime.tv_usec -= 1000000; }
+    acc->ru_stime.tv_sec += ru->ru_stime.tv_sec;
+    acc->ru_stime.tv_usec += ru->ru_stime.tv_usec;
+    if (acc->ru_stime.tv_usec >= 1000000) { acc->ru_stime.tv_sec++; acc->ru_stime.tv_usec -= 1000000; }
+    if (ru->ru_maxrss > acc->ru_maxrss) acc->ru_maxrss = ru->ru_maxrss;
+    acc->ru_inblock += ru->ru_inblock;
+    acc->ru_oublock += ru->ru_oublock;
+}
+
+/* Shell convention for a wait status: the exit code, or 128 + the signal number */
+static int exit_code(int wstatus) {
+    if (WIFEXITED(wstatus)) return WEXITSTATUS(wstatus);
+    if (WIFSIGNALED(wstatus)) return 128 + WTERMSIG(wstatus);
+    return 0;
+}
+
+/* Count a finished foreground job into the running line's result */
+static void cmd_result_add(int wstatus, const struct rusage *ru) {
+    g_cmd_result.have_status = 1;
+    g_cmd_result.status = exit_code(wstatus);
+    rusage_add(&g_cmd_result.ru, ru);
+}
+
+static void sigchld_handler(int signo) {
+    (void)signo;
+    int saved_errno = errno;
+    int status;
+    struct rusage ru;
+    pid_t pid;
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &ru)) > 0) {
+        int stage = 0;
+        struct job *j = job_by_pid(pid, &stage);
+        if (!j) continue;
+        if (WIFSTOPPED(status)) {
+            j->state = JOB_STOPPED;
+            j->notify = 1;
+        } else if (WIFCONTINUED(status)) {
+            if (j->state == JOB_STOPPED) j->state = JOB_BG;
+        } else {
+            /* a pipeline's status is that of its last stage */
+            if (stage == j->nprocs - 1) j->status = status;
+            rusage_add(&j->ru, &ru);
+            j->pids[stage] = -1;
+            if (--j->nalive > 0) continue;
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            j->end_ms = (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+            j->notify = j->state != JOB_FG;
+            j->state = JOB_DONE;
+        }
+    }
+    errno = saved_errno;
+}
+
+static void block_sigchld(sigset_t *old) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &set, old);
+}
+
+static void restore_sigmask(const sigset_t *old) {
+    sigprocmask(SIG_SETMASK, old, NULL);
+}
+
+/* Job numbers restart above the highest one still in use, like other shells */
+static int job_next_jid(void) {
+    int max = 0;
+    for (int i = 0; i < MAXJOBS; ++i)
+        if (g_jobs[i].state != JOB_FREE && g_jobs[i].jid > max) max = g_jobs[i].jid;
+    return max + 1;
+}
+
+/* Caller must have SIGCHLD blocked */
+static struct job *job_add(const pid_t *pids, int nprocs, pid_t pgid, int state,
+                           const char *cmdline, size_t cmdlen) {
+    for (int i = 0; i < MAXJOBS; ++i) {
+        struct job *j = &g_jobs[i];
+        if (j->state != JOB_FREE) continue;
+        memset(j, 0, sizeof(*j));
+        memcpy(j->pids, pids, sizeof(pid_t) * (size_t)nprocs);
+        j->nprocs = j->nalive = nprocs;
+        j->pgid = pgid;
+        j->jid = job_next_jid();
+        j->start_ms = monotonic_ms();
+        j->cmdline = strndup(cmdline, cmdlen);
+        j->state = state;
+        return j;
+    }
+    return NULL;
+}
+
+static void job_free(struct job *j) {
+    free(j->cmdline);
+    memset(j, 0, sizeof(*j));
+}
+
+static void job_signal(const struct job *j, int sig) {
+    if (j->pgid > 0) { kill(-j->pgid, sig); return; }
+    for (int k = 0; k < j->nprocs; ++k)
+        if (j->pids[k] > 0) kill(j->pids[k], sig);
+}
+
+static void job_print_done(const struct job *j) {
+    char what[32];
+    if (WIFSIGNALED(j->status)) snprintf(what, sizeof(what), "Killed (%s)", strsignal(WTERMSIG(j->status)));
+    else if (WEXITSTATUS(j->status) != 0) snprintf(what, sizeof(what), "Exit %d", WEXITSTATUS(j->status));
+    else snprintf(what, sizeof(what), "Done");
+    long maxrss_kb = j->ru.ru_maxrss;
+#ifdef __APPLE__
+    maxrss_kb /= 1024; /* bytes on macOS */
+#endif
+    printf("[%d]  %-12s %s  (wall %.2fs user %.2fs sys %.2fs maxrss %ld KB)\n",
+           j->jid, what, j->cmdline,
+           (j->end_ms - j->start_ms) / 1000.0,
+           j->ru.ru_utime.tv_sec + j->ru.ru_utime.tv_usec / 1e6,
+           j->ru.ru_stime.tv_sec + j->ru.ru_stime.tv_usec / 1e6,
+           maxrss_kb);
+}
+
+/* Report finished/stopped jobs and release finished slots (called before the prompt) */
+void jobs_notify(void) {
+    sigset_t old;
+    block_sigchld(&old);
+    for (int i = 0; i < MAXJOBS; ++i) {
+        struct job *j = &g_jobs[i];
+        if (j->state == JOB_DONE) {
+            if (j->notify) job_print_done(j);
+            job_free(j);
+        } else if (j->state == JOB_STOPPED && j->notify) {
+            printf("[%d]  Stopped      %s\n", j->jid, j->cmdline);
+            j->notify = 0;
+        }
+    }
+    restore_sigmask(&old);
+}
+
+/* Wait until j leaves the foreground. Caller must have SIGCHLD blocked; old is the
+ * mask to restore while suspended. */
+static void job_wait_fg(struct job *j, const sigset_t *old) {
+    sigset_t waitmask = *old;
+    sigdelset(&waitmask, SIGCHLD);
+    if (g_interactive && j->pgid > 0) tcsetpgrp(STDIN_FILENO, j->pgid);
+    while (j->state == JOB_FG) suggest_hint_wait(&waitmask);
+    if (g_interactive && j->pgid > 0) tcsetpgrp(STDIN_FILENO, g_shell_pgid);
+    if (j->state == JOB_DONE) {
+        if (WIFSIGNALED(j->status) && WTERMSIG(j->status) == SIGINT) printf("\n");
+        cmd_result_add(j->status, &j->ru);
+        job_free(j);
+    }
+}
+
+/* Look up a job by "%jid", pid, or the most recent job when spec is NULL */
+static struct job *job_find(const char *spec) {
+    struct job *best = NULL;
+    if (!spec) {
+        for (int i = 0; i < MAXJOBS; ++i) {
+            struct job *j = &g_jobs[i];
+            if (j->state != JOB_FREE && j->state != JOB_DONE && (!best || j->jid > best->jid)) best = j;
+        }
+        return best;
+    }
+    int want = atoi(spec[0] == '%' ? spec + 1 : spec);
+    for (int i = 0; i < MAXJOBS; ++i) {
+        struct job *j = &g_jobs[i];
+        if (j->state == JOB_FREE) continue;
+        if (spec[0] == '%' ? j->jid == want : j == job_by_pid(want, NULL)) return j;
+    }
+    return NULL;
+}
+
+void builtin_jobs(void) {
+    static const char *names[] = { "", "Running", "Running", "Stopped", "Done" };
+    sigset_t old;
+    block_sigchld(&old);
+    for (int i = 0; i < MAXJOBS; ++i) {
+        struct job *j = &g_jobs[i];
+        if (j->state == JOB_FREE) continue;
+        printf("[%d]  %-7d %-8s %s\n", j->jid, (int)(j->pgid ? j->pgid : j->pids[0]), names[j->state], j->cmdline);
+    }
+    restore_sigmask(&old);
+}
+
+/* fg / bg [%jid|pid] */
+void builtin_fg_bg(char **argv, int foreground) {
+    sigset_t old;
+    block_sigchld(&old);
+    struct job *j = job_find(argv[1]);
+    if (!j || j->state == JOB_DONE) {
+        fprintf(stderr, "%s: no such job\n", argv[0]);
+        restore_sigmask(&old);
+        return;
+    }
+    if (foreground) {
+        printf("%s\n", j->cmdline);
+        fflush(stdout);
+        j->state = JOB_FG;
+        job_signal(j, SIGCONT);
+        job_wait_fg(j, &old);
+    } else {
+        j->state = JOB_BG;
+        job_signal(j, SIGCONT);
+        printf("[%d]  %s &\n", j->jid, j->cmdline);
+    }
+    restore_sigmask(&old);
+}
+
+/* wait [%jid|pid]: block until the job (or every running job) has finished */
+void builtin_wait(char **argv) {
+    sigset_t old;
+    block_sigchld(&old);
+    sigset_t waitmask = old;
+    sigdelset(&waitmask, SIGCHLD);
+    if (argv[1]) {
+        struct job *j = job_find(argv[1]);
+        if (!j) fprintf(stderr, "wait: no such job\n");
+        else while (j->state == JOB_BG) history_wait(&waitmask);
+    } else {
+        /* stopped jobs would never finish; only wait for running ones */
+        for (;;) {
+            int running = 0;
+            for (int i = 0; i < MAXJOBS; ++i) if (g_jobs[i].state == JOB_BG) running = 1;
+            if (!running) break;
+            history_wait(&waitmask);
+        }
+    }
+    restore_sigmask(&old);
+    jobs_notify();
+}
+
+/* Take over the terminal and install job-control signal dispositions */
+void init_job_control(void) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigchld_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGCHLD, &sa, NULL);
+
+    g_interactive = isatty(STDIN_FILENO);
+    if (!g_interactive) return;
+    /* the shell itself must not be stopped by job-control signals */
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+    setpgid(0, 0);
+    g_shell_pgid = getpgrp();
+    tcsetpgrp(STDIN_FILENO, g_shell_pgid);
+}
+
+/* Command hash (like bash's `hash`): open-addressing table mapping a command
+ * name to the absolute path found on $PATH, so repeated commands skip the PATH
+ * walk. The whole table is dropped when PATH changes (checked on every lookup)
+ * and a single entry is dropped when exec reports ENOENT for its path. */
+#define PATH_HASH_INITIAL 64        /* power of two */
+
+struct path_hash_entry {
+    char *name;                     /* NULL = empty slot */
+    char *path;
+    unsigned long hits;
+    int deleted;                    /* tombstone, keeps probe chains intact */
+};
+
+static struct {
+    struct path_hash_entry *slots;
+    size_t cap;
+    size_t used;                    /* live + tombstones */
+    char *path_env;                 /* PATH the entries were resolved against */
+    unsigned long hits, misses;
+} g_path_hash;
+
+static unsigned long hash_str(const char *s) {
+    unsigned long h = 5381;
+    while (*s) h = h * 33 + (unsigned char)*s++;
+    return h;
+}
+
+void path_hash_clear(void) {
+    for (size_t i = 0; i < g_path_hash.cap; ++i) {
+        free(g_path_hash.slots[i].name);
+        free(g_path_hash.slots[i].path);
+    }
+    free(g_path_hash.slots);
+    g_path_hash.slots = NULL;
+    g_path_hash.cap = g_path_hash.used = 0;
+}
+
+static struct path_hash_entry *path_hash_slot(const char *name, int for_insert) {
+    if (g_path_hash.cap == 0) return NULL;
+    size_t mask = g_path_hash.cap - 1;
+    struct path_hash_entry *tomb = NULL;
+    for (size_t i = hash_str(name) & mask, n = 0; n < g_path_hash.cap; i = (i + 1) & mask, ++n) {
+        struct path_hash_entry *e = &g_path_hash.slots[i];
+        if (!e->name) {
+            if (!for_insert) return NULL;
+            return tomb ? tomb : e;
+        }
+        if (e->deleted) { if (!tomb) tomb = e; continue; }
+        if (strcmp(e->name, name) == 0) return e;
+    }
+    return for_insert ? tomb : NULL;
+}
+
+static void path_hash_insert(const char *name, const char *path) {
+    if (g_path_hash.used + 1 > g_path_hash.cap * 7 / 10) {
+        /* grow (and drop tombstones) by rehashing into a table twice as large */
+        struct path_hash_entry *old = g_path_hash.slots;
+        size_t oldcap = g_path_hash.cap;
+        size_t cap = oldcap ? oldcap * 2 : PATH_HASH_INITIAL;
+        struct path_hash_entry *slots = calloc(cap, sizeof(*slots));
+        if (!slots) return;
+        g_path_hash.slots = slots;
+        g_path_hash.cap = cap;
+        g_path_hash.used = 0;
+        for (size_t i = 0; i < oldcap; ++i) {
+            if (!old[i].name) continue;
+            if (old[i].deleted) { free(old[i].name); continue; }
+            *path_hash_slot(old[i].name, 1) = old[i];
+            g_path_hash.used++;
+        }
+        free(old);
+    }
+    struct path_hash_entry *e = path_hash_slot(name, 1);
+    if (!e) return;
+    if (e->name) { free(e->name); free(e->path); } else g_path_hash.used++;
+    e->name = strdup(name);
+    e->path = strdup(path);
+    e->hits = 0;
+    e->deleted = 0;
+    if (!e->name || !e->path) { free(e->name); free(e->path); e->name = e->path = NULL; g_path_hash.used--; }
+}
+
+/* Forget a cached path (e.g. the binary was removed) */
+void path_hash_forget(const char *name) {
+    struct path_hash_entry *e = path_hash_slot(name, 0);
+    if (!e) return;
+    free(e->path);
+    e->path = NULL;
+    e->deleted = 1;
+}
+
+/* Walk $PATH for an executable regular file called name. *relative is set when
+ * it was found through a relative element (empty, ".", "bin"), which names a
+ * different file after cd. */
+static int path_search(const char *name, const char *pathenv, char *out, size_t outlen, int *relative) {
+    const char *p = pathenv;
+    while (p) {
+        const char *colon = strchr(p, ':');
+        size_t dlen = colon ? (size_t)(colon - p) : strlen(p);
+        /* an empty PATH element means the current directory */
+        int n = dlen ? snprintf(out, outlen, "%.*s/%s", (int)dlen, p, name)
+                     : snprintf(out, outlen, "./%s", name);
+        struct stat st;
+        if (n > 0 && (size_t)n < outlen && stat(out, &st) == 0 && S_ISREG(st.st_mode) && access(out, X_OK) == 0) {
+            *relative = p[0] != '/';
+            return 0;
+        }
+        p = colon ? colon + 1 : NULL;
+    }
+    return -1;
+}
+
+/* Resolve a command name to the path to exec. Names containing '/' are used as-is.
+ * Returns NULL when the command is not on PATH. Paths found through a relative
+ * PATH element are not cached. */
+const char *path_lookup(const char *name) {
+    if (strchr(name, '/')) return name;
+    const char *pathenv = getenv("PATH");
+    if (!pathenv) pathenv = "/usr/local/bin:/usr/bin:/bin";
+    if (!g_path_hash.path_env || strcmp(g_path_hash.path_env, pathenv) != 0) {
+        path_hash_clear();
+        free(g_path_hash.path_env);
+        g_path_hash.path_env = strdup(pathenv);
+    }
+    struct path_hash_entry *e = path_hash_slot(name, 0);
+    if (e) {
+        g_path_hash.hits++;
+        e->hits++;
+        return e->path;
+    }
+    g_path_hash.misses++;
+    static char found[MAXLINE];     /* returned as-is when not cached */
+    int relative;
+    if (path_search(name, pathenv, found, sizeof(found), &relative) != 0) return NULL;
+    if (relative) return found;
+    path_hash_insert(name, found);
+    e = path_hash_slot(name, 0);
+    if (e) e->hits++;
+    return e ? e->path : NULL;
+}
+
+/* hash [-r] [name ...]: list, reset, or pre-resolve cached command paths */
+void builtin_hash(char **argv) {
+    if (argv[1] && strcmp(argv[1], "-r") == 0) {
+        path_hash_clear();
+        g_path_hash.hits = g_path_hash.misses = 0;
+        return;
+    }
+    if (argv[1]) {
+        for (int i = 1; argv[i]; ++i)
+            if (!path_lookup(argv[i])) fprintf(stderr, "hash: %s: not found\n", argv[i]);
+        return;
+    }
+    printf("hits\tcommand\n");
+    for (size_t i = 0; i < g_path_hash.cap; ++i) {
+        struct path_hash_entry *e = &g_path_hash.slots[i];
+        if (e->name && !e->deleted) printf("%4lu\t%s\n", e->hits, e->path);
+    }
+    printf("lookups: %lu hits, %lu misses\n", g_path_hash.hits, g_path_hash.misses);
+}
+
+/* Signals whose disposition the shell changes and children must get back as default */
+static const int g_child_default_signals[] = { SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU, SIGCHLD, SIGPIPE };
+#define N_CHILD_DEFAULT_SIGNALS ((int)(sizeof(g_child_default_signals) / sizeof(g_child_default_signals[0])))
+
+/* Process launch. The default path is posix_spawn(), which glibc implements with
+ * clone(CLONE_VM|CLONE_VFORK) so launch cost does not grow with the shell's RSS;
+ * signal dispositions, mask and process group are set through spawn attributes.
+ * fork() is kept for children that must run shell code before exec (and can be
+ * forced with ISH_SPAWN=fork for comparison, see bench_spawn.c). */
+static int g_use_fork = -1;
+
+static int use_fork_launch(void) {
+    if (g_use_fork < 0) {
+        const char *v = getenv("ISH_SPAWN");
+        g_use_fork = v && strcmp(v, "fork") == 0;
+    }
+    return g_use_fork;
+}
+
+/* Create a pipe whose ends are close-on-exec in every process that does not
+ * dup2() them onto stdin/stdout, so no stage inherits stray pipe fds. */
+static int make_pipe(int fds[2]) {
+#if defined(__linux__)
+    return pipe2(fds, O_CLOEXEC);
+#else
+    if (pipe(fds) < 0) return -1;
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return 0;
+#endif
+}
+
+/* Start the program at path in a child with stdin/stdout replaced by in_fd/out_fd
+ * (-1 = inherit). pgid < 0 keeps the shell's group, 0 makes a new group. mask is
+ * the signal mask the child should run with. Returns pid, or -1 with errno set. */
+static pid_t spawn_process(const char *path, char **argv, pid_t pgid, const sigset_t *mask,
+                           int in_fd, int out_fd) {
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t fa;
+    sigset_t defaults;
+    short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+    sigemptyset(&defaults);
+    for (int i = 0; i < N_CHILD_DEFAULT_SIGNALS; ++i) sigaddset(&defaults, g_child_default_signals[i]);
+
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setsigmask(&attr, mask);
+    if (pgid >= 0) {
+        flags |= POSIX_SPAWN_SETPGROUP;
+        posix_spawnattr_setpgroup(&attr, pgid);
+    }
+    posix_spawnattr_setflags(&attr, flags);
+    posix_spawn_file_actions_init(&fa);
+    if (in_fd >= 0) posix_spawn_file_actions_adddup2(&fa, in_fd, STDIN_FILENO);
+    if (out_fd >= 0) posix_spawn_file_actions_adddup2(&fa, out_fd, STDOUT_FILENO);
+
+    pid_t pid;
+    int err = posix_spawn(&pid, path, &fa, &attr, argv, environ);
+    posix_spawn_file_actions_destroy(&fa);
+    posix_spawnattr_destroy(&attr);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return pid;
+}
+
+/* Child side of fork(): join the process group, restore signals and set up fds */
+static void child_setup(pid_t pgid, const sigset_t *mask, int in_fd, int out_fd) {
+    if (pgid >= 0) setpgid(0, pgid);
+    // restore default signals
+    for (int i = 0; i < N_CHILD_DEFAULT_SIGNALS; ++i) signal(g_child_default_signals[i], SIG_DFL);
+    sigprocmask(SIG_SETMASK, mask, NULL);
+    if (in_fd >= 0) dup2(in_fd, STDIN_FILENO);
+    if (out_fd >= 0) dup2(out_fd, STDOUT_FILENO);
+}
+
+/* argv for running the script at path with /bin/sh, as execvp() does for a file
+ * without a #! line (ENOEXEC); malloc'd, NULL when out of memory */
+static char **sh_script_argv(const char *path, char **argv) {
+    int n = 0;
+    while (argv[n]) ++n;
+    char **sh = malloc((size_t)(n + 2) * sizeof(*sh));
+    if (!sh) return NULL;
+    sh[0] = "/bin/sh";
+    sh[1] = (char *)path;
+    for (int i = 1; i <= n; ++i) sh[i + 1] = argv[i];
+    return sh;
+}
+
+static pid_t fork_process(const char *path, char **argv, pid_t pgid, const sigset_t *mask,
+                          int in_fd, int out_fd) {
+    pid_t pid = fork();
+    if (pid < 0) return -1;
+    if (pid == 0) {
+        // child
+        child_setup(pgid, mask, in_fd, out_fd);
+        execv(path, argv);
+        char **sh = errno == ENOEXEC ? sh_script_argv(path, argv) : NULL;
+        if (sh) execv(sh[0], sh);
+        fprintf(stderr, "shell: exec failed for %s: %s\n", argv[0], strerror(errno));
+        _exit(127);
+    }
+    return pid;
+}
+
+/* Resolve argv[0] through the command hash and start it. A cached path that has
+ * gone away (ENOENT) is forgotten and looked up once more. An executable that
+ * is not a binary and has no #! line (ENOEXEC) is run by /bin/sh, which
+ * posix_spawn() does not do by itself. */
+static pid_t launch_process(char **argv, pid_t pgid, const sigset_t *mask, int in_fd, int out_fd) {
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        const char *path = path_lookup(argv[0]);
+        if (!path) {
+            fprintf(stderr, "shell: %s: command not found\n", argv[0]);
+            return -1;
+        }
+        pid_t pid = use_fork_launch() ? fork_process(path, argv, pgid, mask, in_fd, out_fd)
+                                      : spawn_process(path, argv, pgid, mask, in_fd, out_fd);
+        if (pid >= 0) return pid;
+        int err = errno;
+        if (err == ENOEXEC) {
+            char **sh = sh_script_argv(path, argv);
+            if (sh) {
+                pid = spawn_process(sh[0], sh, pgid, mask, in_fd, out_fd);
+                err = errno;
+                free(sh);
+                if (pid >= 0) return pid;
+            }
+        }
+        if (err == ENOENT && path != argv[0] && attempt == 0) {
+            path_hash_forget(argv[0]);
+            continue;
+        }
+        fprintf(stderr, "shell: exec failed for %s: %s\n", argv[0], strerror(err));
+        return -1;
+    }
+    return -1;
+}
+
+/* Reporting for the latency histograms (see stat_record) */
+enum stats_format { STATS_TEXT, STATS_JSON, STATS_PROM };
+
+static volatile sig_atomic_t g_stats_dump_requested = 0;
+static long long g_stats_start_us = 0;
+
+/* Value at quantile q of h: the top of the bucket it falls in, capped at the max */
+static unsigned long long hist_quantile(const struct histogram *h, double q) {
+    if (h->count == 0) return 0;
+    unsigned long long rank = (unsigned long long)ceil(q * (double)h->count), seen = 0;
+    if (rank == 0) rank = 1;
+    for (int i = 0; i < HIST_BUCKETS; ++i) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            unsigned long long v = hist_bucket_high(i);
+            return v < h->max_us ? v : h->max_us;
+        }
+    }
+    return h->max_us;
+}
+
+static const double g_stats_quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+static const char *const g_stats_quantile_names[] = { "p50", "p90", "p99", "p999" };
+#define N_STATS_QUANTILES 4
+/* Prometheus bucket bounds in microseconds */
+static const unsigned long long g_prom_bounds_us[] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000, 10000000, 30000000, 60000000,
+};
+#define N_PROM_BOUNDS ((int)(sizeof(g_prom_bounds_us) / sizeof(g_prom_bounds_us[0])))
+
+static void stats_write(FILE *out, enum stats_format fmt) {
+    if (fmt == STATS_TEXT) {
+        fprintf(out, "%-16s %8s %10s %10s %10s %10s %10s %10s %10s\n",
+                "(ms)", "count", "min", "p50", "p90", "p99", "p99.9", "max", "mean");
+        for (int id = 0; id < STAT_COUNT; ++id) {
+            const struct histogram *h = &g_stats[id];
+            fprintf(out, "%-16s %8llu %10.3f", h->name, h->count, h->min_us / 1000.0);
+            for (int q = 0; q < N_STATS_QUANTILES; ++q)
+                fprintf(out, " %10.3f", hist_quantile(h, g_stats_quantiles[q]) / 1000.0);
+            fprintf(out, " %10.3f %10.3f\n", h->max_us / 1000.0, h->count ? h->sum_us / 1000.0 / h->count : 0.0);
+        }
+        fprintf(out, "hints missed: %llu\n", g_hints_missed);
+    } else if (fmt == STATS_JSON) {
+        fprintf(out, "{\"pid\":%d,\"uptime_us\":%lld,\"hints_missed\":%llu,\"unit\":\"us\",\"histograms\":{",
+                (int)getpid(), monotonic_us() - g_stats_start_us, g_hints_missed);
+        for (int id = 0; id < STAT_COUNT; ++id) {
+            const struct histogram *h = &g_stats[id];
+            fprintf(out, "%s\"%s\":{\"count\":%llu,\"sum\":%llu,\"min\":%llu,\"max\":%llu",
+                    id ? "," : "", h->name, h->count, h->sum_us, h->min_us, h->max_us);
+            for (int q = 0; q < N_STATS_QUANTILES; ++q)
+                fprintf(out, ",\"%s\":%llu", g_stats_quantile_names[q], hist_quantile(h, g_stats_quantiles[q]));
+            // non-empty buckets as [highest value, count]
+            fprintf(out, ",\"buckets\":[");
+            int first = 1;
+            for (int i = 0; i < HIST_BUCKETS; ++i) {
+                if (!h->buckets[i]) continue;
+                fprintf(out, "%s[%llu,%u]", first ? "" : ",", hist_bucket_high(i), h->buckets[i]);
+                first = 0;
+            }
+            fprintf(out, "]}");
+        }
+        fprintf(out, "}}\n");
+    } else {
+        for (int id = 0; id < STAT_COUNT; ++id) {
+            const struct histogram *h = &g_stats[id];
+            fprintf(out, "# HELP ish_%s_seconds %s\n# TYPE ish_%s_seconds histogram\n", h->name, h->help, h->name);
+            unsigned long long cum = 0;
+            int i = 0;
+            for (int b = 0; b < N_PROM_BOUNDS; ++b) {
+                for (; i < HIST_BUCKETS && hist_bucket_high(i) <= g_prom_bounds_us[b]; ++i) cum += h->buckets[i];
+                fprintf(out, "ish_%s_seconds_bucket{le=\"%g\"} %llu\n", h->name, g_prom_bounds_us[b] / 1e6, cum);
+            }
+            fprintf(out, "ish_%s_seconds_bucket{le=\"+Inf\"} %llu\n", h->name, h->count);
+            fprintf(out, "ish_%s_seconds_sum %.6f\nish_%s_seconds_count %llu\n",
+                    h->name, h->sum_us / 1e6, h->name, h->count);
+        }
+        fprintf(out, "# HELP ish_suggest_hints_missed_total Hint answers not there by the next prompt\n"
+                     "# TYPE ish_suggest_hints_missed_total counter\nish_suggest_hints_missed_total %llu\n",
+                g_hints_missed);
+    }
+}
+
+/* Write the stats to ISH_STATS_FILE (replaced atomically; Prometheus text when
+ * ISH_STATS_FORMAT=prom or the name ends in .prom, JSON otherwise). Without the
+ * variable the exit dump is skipped and a SIGUSR1 dump goes to stderr as JSON. */
+static void stats_dump(int on_signal) {
+    const char *path = getenv("ISH_STATS_FILE");
+    if (!path || !*path) {
+        if (on_signal) stats_write(stderr, STATS_JSON);
+        return;
+    }
+    const char *f = getenv("ISH_STATS_FORMAT");
+    size_t n = strlen(path);
+    enum stats_format fmt = (f && strcmp(f, "prom") == 0) || (n > 5 && strcmp(path + n - 5, ".prom") == 0)
+                            ? STATS_PROM : STATS_JSON;
+    char tmp[MAXLINE];
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+    FILE *out = fopen(tmp, "w");
+    if (!out) {
+        perror(tmp);
+        return;
+    }
+    stats_write(out, fmt);
+    if (fclose(out) != 0 || rename(tmp, path) != 0) {
+        perror(path);
+        unlink(tmp);
+    }
+}
+
+static void sigusr1_handler(int signo) {
+    (void)signo;
+    g_stats_dump_requested = 1;
+}
+
+/* SIGHUP ends the REPL like `exit`, so queued history is still committed */
+static volatile sig_atomic_t g_hangup = 0;
+
+static void sighup_handler(int signo) {
+    (void)signo;
+    g_hangup = 1;
+}
+
+/* stats [-j|-p|-r]: latency table, JSON, Prometheus text, or reset */
+void builtin_stats(char **argv) {
+    const char *opt = argv[1] ? argv[1] : "";
+    if (strcmp(opt, "-r") == 0) {
+        for (int id = 0; id < STAT_COUNT; ++id) {
+            struct histogram *h = &g_stats[id];
+            h->count = h->sum_us = h->min_us = h->max_us = 0;
+            memset(h->buckets, 0, sizeof(h->buckets));
+        }
+        g_hints_missed = 0;
+        return;
+    }
+    if (*opt && strcmp(opt, "-j") != 0 && strcmp(opt, "-p") != 0) {
+        fprintf(stderr, "stats: usage: stats [-j | -p | -r]\n");
+        return;
+    }
+    stats_write(stdout, opt[1] == 'j' ? STATS_JSON : opt[1] == 'p' ? STATS_PROM : STATS_TEXT);
+}
+
+/* Builtins run inside the shell process; set by `exit` */
+static int g_exit_requested = 0;
+static int g_exit_status = 0;       /* the shell's own: the last line's status, or exit N */
+
+static const char *const g_builtin_names[] = { "exit", "cd", "history", "jobs", "fg", "bg", "wait", "hash", "suggest", "stats", NULL };
+
+static int is_builtin(const char *name) {
+    for (int i = 0; g_builtin_names[i]; ++i)
+        if (strcmp(name, g_builtin_names[i]) == 0) return 1;
+    return 0;
+}
+
+static int token_is_builtin(const struct line_scan *sc, const struct token *t) {
+    for (int i = 0; g_builtin_names[i]; ++i)
+        if (token_is(sc, t, g_builtin_names[i])) return 1;
+    return 0;
+}
+
+static void run_builtin(char **args) {
+    if (strcmp(args[0], "exit") == 0) {
+        g_exit_requested = 1;
+        g_cmd_result.status = args[1] ? atoi(args[1]) & 0xff : g_exit_status;
+    } else if (strcmp(args[0], "jobs") == 0) {
+        builtin_jobs();
+    } else if (strcmp(args[0], "fg") == 0 || strcmp(args[0], "bg") == 0) {
+        builtin_fg_bg(args, args[0][0] == 'f');
+    } else if (strcmp(args[0], "wait") == 0) {
+        builtin_wait(args);
+    } else if (strcmp(args[0], "hash") == 0) {
+        builtin_hash(args);
+    } else if (strcmp(args[0], "suggest") == 0) {
+        builtin_suggest(args);
+    } else if (strcmp(args[0], "stats") == 0) {
+        builtin_stats(args);
+    } else if (strcmp(args[0], "cd") == 0) {
+        const char *dir = args[1] ? args[1] : getenv("HOME");
+        if (chdir(dir) != 0) {
+            perror("cd");
+            g_cmd_result.status = 1;
+        }
+        refresh_cwd();
+    } else if (strcmp(args[0], "history") == 0) {
+        builtin_history(args);
+    }
+}
+
+/* Builtin as a pipeline stage: it needs shell code in the child, so this is the
+ * one place fork() is still required. */
+static pid_t fork_builtin(char **argv, pid_t pgid, const sigset_t *mask, int in_fd, int out_fd) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        child_setup(pgid, mask, in_fd, out_fd);
+        run_builtin(argv);
+        fflush(stdout);
+        _exit(0);
+    }
+    return pid;
+}
+
+/* A pipeline stage with its words materialized for exec */
+struct exec_stage {
+    char **argv;
+    const char *in;                 /* < file */
+    const char *out;                /* > file or >> file */
+    int append;
+};
+
+/* Open a stage's < / > / >> files. On failure reports the error and returns -1. */
+static int open_redirects(const struct exec_stage *s, int *in_fd, int *out_fd) {
+    *in_fd = *out_fd = -1;
+    if (s->in && (*in_fd = open(s->in, O_RDONLY | O_CLOEXEC)) < 0) {
+        fprintf(stderr, "shell: %s: %s\n", s->in, strerror(errno));
+        return -1;
+    }
+    if (s->out) {
+        int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (s->append ? O_APPEND : O_TRUNC);
+        if ((*out_fd = open(s->out, flags, 0666)) < 0) {
+            fprintf(stderr, "shell: %s: %s\n", s->out, strerror(errno));
+            if (*in_fd >= 0) close(*in_fd);
+            *in_fd = -1;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* A lone builtin runs in the shell itself, with its redirections applied around it */
+static void run_builtin_redirected(const struct exec_stage *s) {
+    int in_fd, out_fd, saved_in = -1, saved_out = -1;
+    g_cmd_result.have_status = 1;
+    g_cmd_result.status = 1;
+    if (open_redirects(s, &in_fd, &out_fd) != 0) return;
+    g_cmd_result.status = 0; /* builtins succeed unless they say otherwise (cd) */
+    fflush(stdout);
+    if (in_fd >= 0) { saved_in = dup(STDIN_FILENO); dup2(in_fd, STDIN_FILENO); close(in_fd); }
+    if (out_fd >= 0) { saved_out = dup(STDOUT_FILENO); dup2(out_fd, STDOUT_FILENO); close(out_fd); }
+    run_builtin(s->argv);
+    fflush(stdout);
+    if (saved_in >= 0) { dup2(saved_in, STDIN_FILENO); close(saved_in); }
+    if (saved_out >= 0) { dup2(saved_out, STDOUT_FILENO); close(saved_out); }
+}
+
+/* Execute one pipeline as a job. All pipes are created up front, every stage is
+ * launched into one process group before any of them is waited for, and the
+ * job is then waited on as a whole (foreground) or left to SIGCHLD (background). */
+void exec_pipeline(const struct command_line *cl, const struct pipeline *p) {
+    /* unquote every stage's words now that they are about to be exec'd, into the
+       line's arena: no word is longer unquoted than its source text, plus a NUL */
+    size_t nptrs = 0, nwords = 0;
+    for (int i = 0; i < p->nstages; ++i) {
+        nptrs += (size_t)p->stages[i].argc + 1;
+        nwords += (size_t)p->stages[i].argc + 2;
+    }
+    char *buf = arena_alloc(cl->scan->arena, p->text_len + nwords);
+    char **argv = arena_alloc(cl->scan->arena, nptrs * sizeof(char *));
+    if (!buf || !argv) {
+        out_of_memory();
+        return;
+    }
+    struct exec_stage stages[MAXSTAGES];
+    int any_builtin = 0;
+    for (int i = 0; i < p->nstages; ++i) {
+        const struct stage *ps = &p->stages[i];
+        struct exec_stage *s = &stages[i];
+        s->argv = argv;
+        s->append = ps->append;
+        buf = materialize_argv(cl, ps, argv, &s->in, &s->out, buf);
+        argv += ps->argc + 1;
+        any_builtin |= is_builtin(s->argv[0]);
+    }
+
+    if (p->nstages == 1 && any_builtin) {
+        run_builtin_redirected(&stages[0]);
+        return;
+    }
+    /* a forked builtin (e.g. `history | grep x`) must not write the parent's queue again */
+    if (any_builtin) history_flush();
+    fflush(stdout); /* builtin output so far goes out before the children's */
+    long long t0 = monotonic_us();
+
+    int pipes[MAXSTAGES - 1][2];
+    int npipes = 0;
+    for (; npipes < p->nstages - 1; ++npipes) {
+        if (make_pipe(pipes[npipes]) < 0) {
+            perror("pipe");
+            while (npipes-- > 0) { close(pipes[npipes][0]); close(pipes[npipes][1]); }
+            return;
+        }
+    }
+
+    sigset_t old;
+    block_sigchld(&old); /* the job must be in the table before SIGCHLD can arrive */
+    pid_t pids[MAXSTAGES];
+    int nprocs = 0;
+    pid_t pgid = g_interactive ? 0 : -1;
+    for (int i = 0; i < p->nstages; ++i) {
+        const struct exec_stage *s = &stages[i];
+        int in_fd = i > 0 ? pipes[i - 1][0] : -1;
+        int out_fd = i < p->nstages - 1 ? pipes[i][1] : -1;
+        int rin, rout;
+        /* a stage whose redirection fails is skipped; its neighbours see EOF/EPIPE */
+        if (open_redirects(s, &rin, &rout) != 0) continue;
+        if (rin >= 0) in_fd = rin;
+        if (rout >= 0) out_fd = rout;
+        pid_t pid = is_builtin(s->argv[0]) ? fork_builtin(s->argv, pgid, &old, in_fd, out_fd)
+                                            : launch_process(s->argv, pgid, &old, in_fd, out_fd);
+        if (rin >= 0) close(rin);
+        if (rout >= 0) close(rout);
+        if (pid < 0) continue;
+        if (pgid == 0) pgid = pid; /* first stage leads the group */
+        if (pgid > 0) setpgid(pid, pgid); /* also done in the child; whichever runs first wins */
+        pids[nprocs++] = pid;
+    }
+    for (int i = 0; i < npipes; ++i) { close(pipes[i][0]); close(pipes[i][1]); }
+    if (nprocs == 0) {
+        restore_sigmask(&old);
+        if (!p->background) {
+            g_cmd_result.have_status = 1;
+            g_cmd_result.status = 127; /* nothing could be launched */
+        }
+        return;
+    }
+    stat_since(STAT_EXEC_SPAWN, t0);
+
+    struct job *j = job_add(pids, nprocs, pgid > 0 ? pgid : 0, p->background ? JOB_BG : JOB_FG,
+                            cl->scan->line + p->text_off, p->text_len);
+    if (!j) {
+        /* table full: still wait for a foreground pipeline so it is not orphaned */
+        fprintf(stderr, "shell: job table full\n");
+        if (!p->background) {
+            for (int i = 0; i < nprocs; ++i) {
+                int status;
+                struct rusage ru;
+                if (wait4(pids[i], &status, 0, &ru) > 0 && i == nprocs - 1) cmd_result_add(status, &ru);
+            }
+        }
+    } else if (!p->background) {
+        t0 = monotonic_us();
+        job_wait_fg(j, &old);
+        stat_since(STAT_EXEC_WAIT, t0);
+    } else {
+        printf("[%d] %d\n", j->jid, pids[nprocs - 1]);
+    }
+    restore_sigmask(&old);
+}
+
+/* Signal handler for SIGINT in shell (ignore in main shell loop) */
+void sigint_handler(int signo) {
+    // Just print a newline and reprint prompt in main loop
+    write(STDOUT_FILENO, "\n", 1);
+}
+
+/* getline() at the prompt. When queued history comes due while nobody types,
+ * the SIGALRM from history_arm_timer() interrupts the read, the queue is
+ * committed and the read resumes without printing the prompt again. */
+static ssize_t prompt_getline(char **buf, size_t *cap) {
+    for (;;) {
+        history_arm_timer(1);
+        ssize_t n = getline(buf, cap, stdin);
+        int due = g_hist_timer_fired;
+        history_arm_timer(0);
+        if (n >= 0 || feof(stdin) || !due) return n;
+        clearerr(stdin);
+        history_flush_if_due();
+    }
+}
+
+/* Script mode (stdin not a terminal, `ish -c COMMANDS` or `ish FILE`): no
+ * prompt, no hints, input read SCRIPT_CHUNK bytes at a time and split into
+ * lines here instead of one fgets per line. Reading stdin ahead means a command
+ * in a piped script does not see the script lines after it on its own stdin.
+ * The buffer grows to hold the longest line, so no line is cut or skipped. */
+#define SCRIPT_CHUNK 65536
+
+struct script_input {
+    int fd;                         /* -1: buf already holds all of the input (-c) */
+    char *buf;                      /* always one byte spare, for the last line's NUL */
+    size_t len, pos, cap;
+    int eof;
+};
+
+static int g_script = 0;
+
+static int script_open(struct script_input *in, int fd, const char *text) {
+    memset(in, 0, sizeof(*in));
+    in->fd = fd;
+    in->cap = text ? strlen(text) + 1 : SCRIPT_CHUNK;
+    in->buf = text ? strdup(text) : malloc(in->cap);
+    if (!in->buf) {
+        perror("malloc");
+        return -1;
+    }
+    if (text) {
+        in->len = in->cap - 1;
+        in->eof = 1;
+    }
+    return 0;
+}
+
+static void script_close(struct script_input *in) {
+    if (in->fd > STDIN_FILENO) close(in->fd);
+    free(in->buf);
+    in->buf = NULL;
+}
+
+/* Next line, NUL-terminated in place (without its newline) and valid until the
+ * next call; 1 = got one, 0 = end of input, -1 = interrupted by a signal. */
+static int script_read_line(struct script_input *in, char **line) {
+    for (;;) {
+        char *start = in->buf + in->pos;
+        size_t avail = in->len - in->pos;
+        char *nl = memchr(start, '\n', avail);
+        if (nl || (in->eof && avail)) {
+            size_t n = nl ? (size_t)(nl - start) : avail;
+            start[n] = '\0';
+            in->pos += nl ? n + 1 : n;
+            *line = start;
+            return 1;
+        }
+        if (in->eof) return 0;
+        // keep the partial line, then refill behind it
+        memmove(in->buf, start, avail);
+        in->len = avail;
+        in->pos = 0;
+        if (in->cap - in->len < SCRIPT_CHUNK / 2) {
+            char *grown = realloc(in->buf, in->cap * 2);
+            if (!grown) {
+                perror("realloc");
+                in->eof = 1; /* run what we have */
+                continue;
+            }
+            in->buf = grown;
+            in->cap *= 2;
+        }
+        ssize_t r = read(in->fd, in->buf + in->len, in->cap - in->len - 1);
+        if (r < 0) {
+            if (errno == EINTR) return -1;
+            perror("read");
+            in->eof = 1;
+        } else if (r == 0) {
+            in->eof = 1;
+        } else {
+            in->len += (size_t)r;
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+#if defined(_WIN32) || defined(_WIN64)
+    /* If building/running on Windows with native Winsock, you must call WSAStartup.
+       If you use MinGW and link -lws2_32, add this initialization here:
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2,2), &wsaData) != 0) {
+        fprintf(stderr, "WSAStartup failed\\n");
+        return 1;
+    }
+    and call WSACleanup() before exit.
+    */
+#endif
+
+    struct script_input script;
+    if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+        if (argc < 3) {
+            fprintf(stderr, "usage: %s [-c COMMANDS | FILE]\n", argv[0]);
+            return 2;
+        }
+        if (script_open(&script, -1, argv[2]) != 0) return 1;
+        g_script = 1;
+    } else if (argc > 1) {
+        int fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            perror(argv[1]);
+            return 127;
+        }
+        if (script_open(&script, fd, NULL) != 0) return 1;
+        g_script = 1;
+    } else if (!isatty(STDIN_FILENO)) {
+        if (script_open(&script, STDIN_FILENO, NULL) != 0) return 1;
+        g_script = 1;
+    }
+
+    // Initialize DB
+    if (init_db(history_db_path()) != SQLITE_OK) {
+        fprintf(stderr, "Warning: SQLite DB unavailable. History will be disabled.\n");
+        // continue without DB
+        g_db = NULL;
+    }
+    if (g_script) history_begin_batch();
+
+    // Setup signal handling: shell should catch SIGINT and not exit
+    struct sigaction sa;
+    sa.sa_handler = sigint_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGINT, &sa, NULL);
+    // SIGUSR1 dumps the latency stats; no SA_RESTART so an idle prompt wakes up for it
+    sa.sa_handler = sigusr1_handler;
+    sa.sa_flags = 0;
+    sigaction(SIGUSR1, &sa, NULL);
+    sa.sa_handler = sighup_handler;
+    sigaction(SIGHUP, &sa, NULL);
+    sa.sa_handler = sigalrm_handler;
+    sigaction(SIGALRM, &sa, NULL);
+    g_stats_start_us = monotonic_us();
+    init_job_control();
+    native_init();
+    refresh_cwd();
+
+    char *linebuf = NULL;           /* interactive input, grown by getline() */
+    size_t linecap = 0;
+    char *line;
+    struct line_scan scan;
+    struct command_line cl;
+
+    long long line_us = 0;
+    while (!g_exit_requested && !g_hangup) {
+        if (g_stats_dump_requested) {
+            g_stats_dump_requested = 0;
+            stats_dump(1);
+        }
+        history_flush_if_due();
+        native_check_reload();
+        jobs_notify();
+        arena_reset(&g_cmd_arena); /* the previous line is finished with */
+
+        if (g_script) {
+            if (line_us) stat_since(STAT_PROMPT, line_us);
+            line_us = 0;
+            int got = script_read_line(&script, &line);
+            if (got == 0) break;
+            if (got < 0) continue; /* interrupted, e.g. by SIGUSR1 */
+            line_us = monotonic_us();
+        } else {
+            // Show the hint for the previous command if it has arrived by now
+            suggest_hint_collect();
+
+            // Read line
+            if (line_us) stat_since(STAT_PROMPT, line_us);
+            line_us = 0;
+            printf("ish> ");
+            fflush(stdout);
+            if (prompt_getline(&linebuf, &linecap) < 0) {
+                if (feof(stdin)) { printf("\n"); break; }
+                clearerr(stdin); /* interrupted, e.g. by SIGUSR1 */
+                continue;
+            }
+            line = linebuf;
+            line_us = monotonic_us();
+        }
+        // One pass over the line: token spans, trimmed extent, JSON-escape need
+        if (scan_line(line, &g_cmd_arena, &scan) != 0 || scan.ntoks == 0) continue;
+        const char *cmd = line + scan.start;
+        size_t cmdlen = scan.text_end - scan.start;
+
+        // Non-blocking suggestion: fire the request now, collect the hint before the next prompt
+        if (!g_script) suggest_hint_submit(&scan, DEFAULT_SUGGEST_MODEL);
+
+        int npipes = parse_line(&scan, &cl);
+        if (npipes <= 0) continue;
+
+        // Log everything except a lone builtin that only inspects shell state (history, jobs, ...)
+        const struct token *first = &scan.toks[cl.argtok[0]];
+        int logged = npipes > 1 || cl.pipes[0].nstages > 1 || token_is(&scan, first, "cd") ||
+                     !token_is_builtin(&scan, first);
+        if (logged) log_command_n(cmd, cmdlen);
+
+        memset(&g_cmd_result, 0, sizeof(g_cmd_result));
+        long long exec_us = monotonic_us();
+        for (int i = 0; i < npipes && !g_exit_requested && !g_hangup; ++i)
+            exec_pipeline(&cl, &cl.pipes[i]);
+        log_command_finish(&g_cmd_result, monotonic_us() - exec_us);
+        if (g_cmd_result.have_status) g_exit_status = g_cmd_result.status;
+        if (logged && g_cmd_result.have_status) {
+            g_last_status = g_cmd_result.status;
+            g_context_changed = 1;
+        }
+        if (!g_script) suggest_hint_settle(&g_cmd_result);
+    }
+
+    close_db();
+    native_free(g_native);
+    stats_dump(0);
+    if (g_script) script_close(&script);
+    free(linebuf);
+    arena_free(&g_cmd_arena);
+
+#if defined(_WIN32) || defined(_WIN64)
+    /* If you added WSAStartup above, call WSACleanup here. */
+#endif
+
+    return g_exit_status;
 }
\ No newline at end of file
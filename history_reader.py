@@ -0,0 +1,121 @@
+# history_reader.py
+"""Reading the shell's history table, if need be with its owner's credentials.
+
+The shared suggestion daemon (user_shards.py) runs as root and learns from a
+history database under each served user's home directory. Opening that path
+as root would follow whatever the user put there, a symlink to another user's
+database included, so for any user other than the daemon's own the rows are
+read by a short-lived child process running as that user (read_as): it sees
+exactly what the user could read themselves, and it also refuses a database
+that is a symlink or not owned by the user. The child is only started when
+signature() shows the database or its WAL changed since the last read.
+
+Run as a script, this is that child:
+
+    history_reader.py PATH AFTER LIMIT
+
+prints the table's highest rowid, then up to LIMIT rows with a rowid above
+AFTER, one JSON array [id, cmd, ts, cwd, status] per line. It uses nothing
+outside the standard library, so it starts quickly in isolated mode; read_as
+hands it its own source with -c rather than a path the user may not reach.
+"""
+import json
+import os
+import sqlite3
+import stat
+import subprocess
+import sys
+
+HELPER_ROWS = 50000
+# the child's interpreter must be one every served user can run
+HELPER_PYTHON = os.environ.get("SUGGEST_READER_PYTHON", sys.executable)
+HELPER_TIMEOUT = 30.0
+
+_SOURCE = None
+
+
+class ReadError(Exception):
+    pass
+
+
+def history_columns(conn):
+    """SELECT list for (cmd, ts, cwd, status) that works whichever optional columns the table has."""
+    cols = {row[1] for row in conn.execute("PRAGMA table_info(history)")}
+    return ", ".join(["cmd", "CAST(strftime('%s', ts) AS INTEGER)",
+                      "cwd" if "cwd" in cols else "NULL",
+                      "status" if "status" in cols else "NULL"])
+
+
+def signature(path):
+    """lstat of the database and its WAL, or None when there is no database yet.
+
+    Taken without following links, so it is safe as root on any path; it
+    changes whenever the shell commits.
+    """
+    sig = []
+    for p in (path, path + "-wal"):
+        try:
+            st = os.lstat(p)
+        except OSError:
+            if p == path:
+                return None
+            sig.append(None)
+            continue
+        sig.append((st.st_dev, st.st_ino, st.st_size, st.st_mtime_ns))
+    return tuple(sig)
+
+
+def _source():
+    # passed with -c: the user may not be able to read this file where it is installed
+    global _SOURCE
+    if _SOURCE is None:
+        with open(__file__, encoding="utf-8") as f:
+            _SOURCE = f.read()
+    return _SOURCE
+
+
+def read_as(owner, path, after, limit=HELPER_ROWS):
+    """(highest rowid, rows with a rowid above after) of path, read as owner = (uid, gid)."""
+    uid, gid = owner
+    try:
+        proc = subprocess.run([HELPER_PYTHON, "-I", "-c", _source(), path, str(after), str(limit)],
+                              user=uid, group=gid, extra_groups=[], cwd="/", env={},
+                              stdin=subprocess.DEVNULL, capture_output=True, timeout=HELPER_TIMEOUT)
+    except (OSError, subprocess.SubprocessError) as e:
+        raise ReadError(str(e)) from None
+    if proc.returncode != 0:
+        err = proc.stderr.decode(errors="replace").strip().splitlines()
+        raise ReadError(err[-1] if err else f"reader exited with status {proc.returncode}")
+    try:
+        lines = proc.stdout.splitlines()
+        return int(lines[0]), [tuple(json.loads(line)) for line in lines[1:]]
+    except (IndexError, ValueError) as e:
+        raise ReadError(f"bad reader output: {e}") from None
+
+
+def _main(path, after, limit):
+    try:
+        fd = os.open(path, os.O_RDONLY | os.O_NOFOLLOW | os.O_NONBLOCK)
+    except OSError as e:
+        sys.exit(f"{path}: {e.strerror}")
+    st = os.fstat(fd)
+    os.close(fd)
+    if not stat.S_ISREG(st.st_mode) or st.st_uid != os.getuid():
+        sys.exit(f"{path}: not a regular file owned by uid {os.getuid()}")
+    try:
+        conn = sqlite3.connect(f"file:{path}?mode=ro", uri=True, timeout=1.0)
+        (top,) = conn.execute("SELECT ifnull(max(id), 0) FROM history").fetchone()
+        rows = conn.execute(f"SELECT id, {history_columns(conn)} FROM history "
+                            "WHERE id > ? ORDER BY id LIMIT ?", (after, limit)).fetchall()
+    except sqlite3.Error as e:
+        sys.exit(f"{path}: {e}")
+    out = sys.stdout
+    out.write(f"{top}\n")
+    for row in rows:
+        out.write(json.dumps(row) + "\n")
+
+
+if __name__ == "__main__":
+    if len(sys.argv) != 4:
+        sys.exit("usage: history_reader.py PATH AFTER LIMIT")
+    _main(sys.argv[1], int(sys.argv[2]), int(sys.argv[3]))
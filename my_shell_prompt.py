@@ -6,8 +6,11 @@ import threading
 import time
 import queue
 
-from suggestion_client import get_suggestions
+from suggestion_client import get_suggestions, SuggestionStream
 
+# Suggestions normally stream: every edit goes to the server as a keystroke delta
+# over one connection and ranked updates come back as the engines finish. Against
+# a server without sessions the worker below debounces and refetches instead.
 # Debounce interval (seconds) before sending prefix to server
 DEBOUNCE = 0.15
 # Suggestion fetch timeout (seconds)
@@ -41,12 +44,14 @@ class LiveCompleter(Completer):
         if not suggs:
             return
         prefix = text
+        # a snapshot for older text is filtered; one for this text is already ranked for it
+        exact = q == text
         for it in suggs:
             s = it.get("suggestion")
             reason = it.get("reason", "")
             if not s:
                 continue
-            if prefix == "" or prefix.lower() in s.lower():
+            if exact or prefix == "" or prefix.lower() in s.lower():
                 yield Completion(
                     s,
                     start_position=-len(document.get_word_before_cursor()),
@@ -104,11 +109,29 @@ def main_loop():
     worker = threading.Thread(target=suggestion_worker, args=(input_q, shared, stop_event), daemon=True)
     worker.start()
 
+    def refresh_completions(text):
+        buf = session.default_buffer
+        if buf.text == text:
+            buf.start_completion(select_first=False)
+
+    def on_update(text, suggestions, final):
+        # called on the stream's reader thread; the menu is redrawn on the prompt's loop
+        shared.update(text, suggestions)
+        app = session.app
+        loop = getattr(app, "loop", None)
+        if app.is_running and loop is not None:
+            loop.call_soon_threadsafe(refresh_completions, text)
+
+    stream = SuggestionStream(on_update, model=DEFAULT_MODEL, timeout=FETCH_TIMEOUT)
+    stream.open()
+
     try:
         while True:
             # Use a small wrapper to push buffer text to fetcher while typing
             def on_text_changed(buf):
-                # push current text to queue (non-blocking)
+                if stream.update(buf.text):
+                    return
+                # no session: push current text to queue (non-blocking)
                 try:
                     input_q.put_nowait(buf.text)
                 except queue.Full:
@@ -133,6 +156,8 @@ def main_loop():
             if text.strip().lower() == "exit":
                 print("Exiting myOS shell.")
                 break
+            # start the next line from scratch, with this command as its context
+            stream.update("", prev=text.strip())
 
             # On submit, get final suggestions one more time synchronously
             final_suggestions = get_suggestions(text, model=DEFAULT_MODEL, timeout=FETCH_TIMEOUT)
@@ -152,6 +177,7 @@ def main_loop():
         print("\nExiting myOS shell.")
     finally:
         stop_event.set()
+        stream.close()
         worker.join(timeout=0.5)
 
 
@@ -0,0 +1,421 @@
+# native_model.py
+"""Memory-mapped binary suggestion model shared by the server and the C shell.
+
+train_from_csv.py exports the known-command list, the Markov transitions, the
+TF-IDF vocabulary/postings and a trigram index into one flat little-endian
+file (models/suggest.bin). Readers map it read-only: nothing is unpickled or
+rebuilt at startup, and every shell and server process on a host shares the
+same page-cache pages. core.c reads the same layout (native_load).
+
+Layout (u32 unless noted, every section 4-byte aligned, in this order):
+
+    header      16 u32: "ISHM" version header_words n_cmds n_edges n_terms
+                n_postings gram_bits n_gram_ids strings_size cmd_hash_size
+                term_hash_size created reserved reserved reserved
+    cmd_str[n_cmds]  cmd_len[n_cmds]          command text (offset/length into strings)
+    cmd_hash[cmd_hash_size]                   open addressing: command id + 1, 0 = empty
+    edge_row[n_cmds + 1]                      Markov CSR rows, edges sorted by count desc
+    edge_dst[n_edges]  edge_cnt[n_edges]
+    edge_total[n_cmds]                        precomputed row sums
+    term_str[n_terms]  term_len[n_terms]      vocabulary
+    term_idf[n_terms]  (f32)
+    term_hash[term_hash_size]                 open addressing: term id + 1, 0 = empty
+    post_row[n_terms + 1]                     term -> documents containing it
+    post_doc[n_postings]  post_w[n_postings] (f32, weight in the L2-normalized row)
+    gram_row[2**gram_bits + 1]                hashed padded trigram -> commands (CSR)
+    gram_ids[n_gram_ids]
+    strings[strings_size]                     UTF-8 text, NUL-terminated
+
+Hash tables use 32-bit djb2 over the UTF-8 bytes with linear probing and are
+sized to a power of two at least twice the key count. Trigrams are taken over
+the bytes of "  " + cmd.lower() + " " (ASCII lowercasing), hashed as
+((a << 16 | b << 8 | c) * 2654435761 mod 2**32) >> (32 - gram_bits).
+"""
+import mmap
+import os
+import re
+import struct
+import sys
+import time
+from array import array
+
+import numpy as np
+from rapidfuzz import process, fuzz
+
+from typo_index import best_matches, nearest_length
+
+MAGIC = b"ISHM"
+VERSION = 2
+HEADER_WORDS = 16
+MODEL_FILE = "suggest.bin"
+GRAM_BITS = 16
+MAX_CANDIDATES = 64          # typo candidates scored exactly, as in typo_index
+TOKEN_RE = re.compile(r"(?u)\b\w\w+\b")  # TfidfVectorizer's default token_pattern
+
+
+def djb2(b):
+    h = 5381
+    for c in b:
+        h = (h * 33 + c) & 0xFFFFFFFF
+    return h
+
+
+def table_size(n):
+    size = 16
+    while size < 2 * n:
+        size <<= 1
+    return size
+
+
+def byte_grams(b, bits=GRAM_BITS):
+    """Hashed trigram buckets of b (already padded and lowercased)."""
+    shift = 32 - bits
+    return {((b[i] << 16 | b[i + 1] << 8 | b[i + 2]) * 2654435761 & 0xFFFFFFFF) >> shift
+            for i in range(len(b) - 2)}
+
+
+def top_positions(scores, k):
+    """Positions of the k highest scores in ascending order, ties going to the earlier position."""
+    if len(scores) <= k:
+        return np.arange(len(scores))
+    kth = np.partition(scores, len(scores) - k)[len(scores) - k]
+    keep = scores > kth
+    keep[np.flatnonzero(scores == kth)[:k - int(keep.sum())]] = True
+    return np.flatnonzero(keep)
+
+
+def padded(s):
+    return b"  " + s.encode("utf8").lower() + b" "
+
+
+def _hash_table(keys):
+    table = array("I", bytes(4 * table_size(len(keys))))
+    mask = len(table) - 1
+    for i, k in enumerate(keys):
+        j = djb2(k) & mask
+        while table[j]:
+            j = (j + 1) & mask
+        table[j] = i + 1
+    return table
+
+
+def export(path, commands, transitions, vectorizer, X):
+    """Write commands, their Markov transitions and the TF-IDF matrix X (rows = commands)."""
+    strings = bytearray()
+
+    def intern(b):
+        off = len(strings)
+        strings.extend(b + b"\0")
+        return off, len(b)
+
+    ids = {c: i for i, c in enumerate(commands)}
+    encoded = [c.encode("utf8") for c in commands]
+    cmd_str, cmd_len = array("I"), array("I")
+    for b in encoded:
+        off, n = intern(b)
+        cmd_str.append(off)
+        cmd_len.append(n)
+
+    edge_row, edge_dst, edge_cnt, edge_total = array("I", [0]), array("I"), array("I"), array("I")
+    for c in commands:
+        total = 0
+        for nxt, count in sorted(transitions.get(c, {}).items(), key=lambda x: x[1], reverse=True):
+            if nxt in ids:
+                edge_dst.append(ids[nxt])
+                edge_cnt.append(count)
+                total += count
+        edge_row.append(len(edge_dst))
+        edge_total.append(total)
+
+    vocab = sorted(vectorizer.vocabulary_.items(), key=lambda kv: kv[1])
+    terms = [t.encode("utf8") for t, _ in vocab]
+    cols = X.tocsc()
+    term_str, term_len, term_idf = array("I"), array("I"), array("f")
+    post_row, post_doc, post_w = array("I", [0]), array("I"), array("f")
+    for (term, col), b in zip(vocab, terms):
+        off, n = intern(b)
+        term_str.append(off)
+        term_len.append(n)
+        term_idf.append(float(vectorizer.idf_[col]))
+        lo, hi = cols.indptr[col], cols.indptr[col + 1]
+        post_doc.extend(int(d) for d in cols.indices[lo:hi])
+        post_w.extend(float(w) for w in cols.data[lo:hi])
+        post_row.append(len(post_doc))
+
+    buckets = [[] for _ in range(1 << GRAM_BITS)]
+    for i, c in enumerate(commands):
+        for g in byte_grams(padded(c)):
+            buckets[g].append(i)
+    gram_row, gram_ids = array("I", [0]), array("I")
+    for ids_in in buckets:
+        gram_ids.extend(ids_in)
+        gram_row.append(len(gram_ids))
+
+    while len(strings) % 4:
+        strings.append(0)
+
+    cmd_hash = _hash_table(encoded)
+    term_hash = _hash_table(terms)
+    sections = [cmd_str, cmd_len, cmd_hash, edge_row, edge_dst, edge_cnt, edge_total,
+                term_str, term_len, term_idf, term_hash, post_row, post_doc, post_w,
+                gram_row, gram_ids]
+    if sys.byteorder != "little":
+        for a in sections:
+            a.byteswap()
+    header = struct.pack("<4s15I", MAGIC, VERSION, HEADER_WORDS, len(commands), len(edge_dst), len(terms),
+                         len(post_doc), GRAM_BITS, len(gram_ids), len(strings), len(cmd_hash),
+                         len(term_hash), int(time.time()), 0, 0, 0)
+    # write next to the target and rename, so readers mapping the old file keep a consistent view
+    tmp = f"{path}.tmp"
+    with open(tmp, "wb") as f:
+        f.write(header)
+        for a in sections:
+            f.write(a.tobytes())
+        f.write(strings)
+    os.replace(tmp, path)
+
+
+class MappedModel:
+    """Read-only view of suggest.bin; all arrays are numpy views into the mapping.
+
+    Commands appended at runtime (the server's extra commands) live in a small
+    in-memory overlay that every lookup also consults.
+    """
+
+    def __init__(self, path):
+        with open(path, "rb") as f:
+            self.mm = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        if len(self.mm) < HEADER_WORDS * 4 or self.mm[:4] != MAGIC:
+            raise ValueError(f"{path} is not a suggestion model")
+        h = struct.unpack_from(f"<{HEADER_WORDS - 1}I", self.mm, 4)
+        (self.version, header_words, self.n_cmds, n_edges, self.n_terms, n_postings, self.gram_bits,
+         n_gram_ids, strings_size, cmd_hash_size, term_hash_size, self.created) = h[:12]
+        if self.version != VERSION or header_words != HEADER_WORDS:
+            raise ValueError(f"{path}: model version {self.version}, expected {VERSION}")
+
+        sizes = [("cmd_str", self.n_cmds), ("cmd_len", self.n_cmds), ("cmd_hash", cmd_hash_size),
+                 ("edge_row", self.n_cmds + 1), ("edge_dst", n_edges), ("edge_cnt", n_edges),
+                 ("edge_total", self.n_cmds), ("term_str", self.n_terms), ("term_len", self.n_terms),
+                 ("term_idf", self.n_terms), ("term_hash", term_hash_size), ("post_row", self.n_terms + 1),
+                 ("post_doc", n_postings), ("post_w", n_postings),
+                 ("gram_row", (1 << self.gram_bits) + 1), ("gram_ids", n_gram_ids)]
+        words = HEADER_WORDS + sum(n for _, n in sizes)
+        if words * 4 + strings_size != len(self.mm):
+            raise ValueError(f"{path} is truncated or corrupt")
+        u32 = np.frombuffer(self.mm, dtype="<u4", count=words)
+        off = HEADER_WORDS
+        for name, n in sizes:
+            view = u32[off:off + n]
+            setattr(self, name, view.view("<f4") if name in ("term_idf", "post_w") else view)
+            off += n
+        self.strings_off = off * 4
+        self.extra = []          # overlay: commands not in the file
+        self.extra_vecs = []     # their normalized {term id: weight}
+        self._by_length = None   # length -> ascending command ids, built when first needed
+
+    def close(self):
+        # drop the numpy views first; mmap.close() refuses while buffers are exported
+        for name in list(vars(self)):
+            if isinstance(getattr(self, name), np.ndarray):
+                delattr(self, name)
+        self.mm.close()
+
+    # -- lookups ---------------------------------------------------------
+
+    def command(self, i):
+        if i >= self.n_cmds:
+            return self.extra[i - self.n_cmds]
+        o = self.strings_off + int(self.cmd_str[i])
+        return self.mm[o:o + int(self.cmd_len[i])].decode("utf8")
+
+    def _find(self, table, str_arr, len_arr, b):
+        mask = len(table) - 1
+        j = djb2(b) & mask
+        while table[j]:
+            i = int(table[j]) - 1
+            o = self.strings_off + int(str_arr[i])
+            if int(len_arr[i]) == len(b) and self.mm[o:o + len(b)] == b:
+                return i
+            j = (j + 1) & mask
+        return -1
+
+    def find_command(self, cmd):
+        i = self._find(self.cmd_hash, self.cmd_str, self.cmd_len, cmd.encode("utf8"))
+        if i < 0 and cmd in self.extra:
+            return self.n_cmds + self.extra.index(cmd)
+        return i
+
+    def find_term(self, term):
+        return self._find(self.term_hash, self.term_str, self.term_len, term.encode("utf8"))
+
+    def __len__(self):
+        return self.n_cmds + len(self.extra)
+
+    def vectorize(self, text):
+        """{term id: weight} for text, L2-normalized, like the trained TfidfVectorizer."""
+        counts = {}
+        for tok in TOKEN_RE.findall(text.lower()):
+            t = self.find_term(tok)
+            if t >= 0:
+                counts[t] = counts.get(t, 0) + 1
+        vec = {t: c * float(self.term_idf[t]) for t, c in counts.items()}
+        norm = sum(w * w for w in vec.values()) ** 0.5
+        return {t: w / norm for t, w in vec.items()} if norm else {}
+
+    def extend(self, commands):
+        """Add commands the file does not know about to the in-memory overlay."""
+        for c in commands:
+            if self.find_command(c) < 0:
+                self.extra.append(c)
+                self.extra_vecs.append(self.vectorize(c))
+
+    # -- engines ---------------------------------------------------------
+
+    def next_counts(self, query):
+        """({next command: count}, row total) of the Markov row for query, or ({}, 0)."""
+        i = self.find_command(query)
+        if i < 0 or i >= self.n_cmds:
+            return {}, 0
+        lo, hi = int(self.edge_row[i]), int(self.edge_row[i + 1])
+        return ({self.command(int(d)): int(c) for d, c in zip(self.edge_dst[lo:hi], self.edge_cnt[lo:hi])},
+                int(self.edge_total[i]))
+
+    def templates(self, query, topk=5):
+        """[(command, cosine)] for the topk most similar commands, best first."""
+        qv = self.vectorize(query)
+        if not qv:
+            return []
+        docs, weights = [], []
+        for t, w in qv.items():
+            lo, hi = int(self.post_row[t]), int(self.post_row[t + 1])
+            docs.append(self.post_doc[lo:hi])
+            weights.append(self.post_w[lo:hi] * w)
+        docs, inv = np.unique(np.concatenate(docs), return_inverse=True)
+        sims = np.bincount(inv, weights=np.concatenate(weights))
+        results = list(zip(docs.tolist(), sims.tolist()))
+        for k, vec in enumerate(self.extra_vecs):
+            s = sum(w * vec.get(t, 0.0) for t, w in qv.items())
+            if s > 0:
+                results.append((self.n_cmds + k, s))
+        results.sort(key=lambda x: x[1], reverse=True)
+        return [(self.command(i), s) for i, s in results[:topk]]
+
+    def templates_many(self, queries, topk=5):
+        """templates() for each of queries.
+
+        The batch is one sparse product of its query vectors with the posting
+        lists, done on the mapped arrays: every (query, document) pair is keyed
+        and summed in a single np.unique/bincount pass.
+        """
+        vecs = [self.vectorize(q) for q in queries]
+        rows, docs, weights = [], [], []
+        for r, qv in enumerate(vecs):
+            for t, w in qv.items():
+                lo, hi = int(self.post_row[t]), int(self.post_row[t + 1])
+                rows.append(np.full(hi - lo, r, dtype=np.int64))
+                docs.append(self.post_doc[lo:hi])
+                weights.append(self.post_w[lo:hi] * w)
+        results = [[] for _ in queries]
+        if rows:
+            stride = self.n_cmds + 1
+            keys, inv = np.unique(np.concatenate(rows) * stride + np.concatenate(docs), return_inverse=True)
+            sims = np.bincount(inv, weights=np.concatenate(weights))
+            for key, s in zip(keys.tolist(), sims.tolist()):
+                results[key // stride].append((key % stride, s))
+        for r, qv in enumerate(vecs):
+            if not qv:
+                continue
+            for k, vec in enumerate(self.extra_vecs):
+                s = sum(w * vec.get(t, 0.0) for t, w in qv.items())
+                if s > 0:
+                    results[r].append((self.n_cmds + k, s))
+        out = []
+        for res in results:
+            res.sort(key=lambda x: x[1], reverse=True)
+            out.append([(self.command(i), s) for i, s in res[:topk]])
+        return out
+
+    def _typo_candidates(self, query, threshold):
+        """Ids, ascending, of the MAX_CANDIDATES length-filtered commands sharing the most
+        trigram buckets with query by Dice. core.c's native_typo() picks the same ones."""
+        qn = len(query.encode("utf8"))
+        lo, hi = qn * threshold / (2 - threshold), qn * (2 - threshold) / threshold
+        grams = byte_grams(padded(query), self.gram_bits)
+        lists = [self.gram_ids[self.gram_row[g]:self.gram_row[g + 1]] for g in grams]
+        lists = [a for a in lists if len(a)]
+        if lists:
+            hits, counts = np.unique(np.concatenate(lists), return_counts=True)
+            lengths = self.cmd_len[hits]
+            ok = (lengths >= lo) & (lengths <= hi)
+            hits, counts, lengths = hits[ok], counts[ok], lengths[ok]
+            if len(hits) > MAX_CANDIDATES:
+                dice = 2.0 * counts / (len(grams) + lengths + 1.0)
+                hits = hits[top_positions(dice, MAX_CANDIDATES)]
+            if len(hits):
+                return hits
+        # no shared bucket: the commands nearest the query's length
+        if self._by_length is None:
+            order = np.argsort(self.cmd_len, kind="stable")
+            sizes, starts = np.unique(self.cmd_len[order], return_index=True)
+            ends = np.append(starts[1:], len(order))
+            self._by_length = {int(m): order[a:b] for m, a, b in zip(sizes, starts, ends)}
+        return np.sort(nearest_length(self._by_length, qn, lo, hi, MAX_CANDIDATES))
+
+    def typo(self, query, threshold):
+        """(command, score 0..1) of the closest command by fuzz.ratio, or (None, 0.0)."""
+        if not len(self) or not query:
+            return None, 0.0
+        choices = [self.command(int(i)) for i in self._typo_candidates(query, threshold)] + self.extra
+        if not choices:
+            return None, 0.0
+        match, score, _ = process.extractOne(query, choices, scorer=fuzz.ratio)
+        return match, float(score) / 100.0
+
+    def typo_many(self, queries, threshold):
+        """typo() for each of queries, scored in bulk (typo_index.best_matches)."""
+        if not len(self):
+            return [(None, 0.0)] * len(queries)
+        choices = [[self.command(int(i)) for i in self._typo_candidates(q, threshold)] + self.extra if q else []
+                   for q in queries]
+        return best_matches(queries, choices)
+
+    def containing(self, query, limit):
+        """Up to limit commands that contain query (case-insensitive)."""
+        q = query.lower()
+        b = q.encode("utf8")
+        out = []
+        if len(b) >= 3:
+            # every trigram of q is a trigram of a command containing it
+            lists = sorted((self.gram_ids[self.gram_row[g]:self.gram_row[g + 1]]
+                            for g in byte_grams(b, self.gram_bits)), key=len)
+            ids = lists[0]
+            for other in lists[1:]:
+                if len(ids) <= limit * 4:
+                    break
+                ids = np.intersect1d(ids, other, assume_unique=True)
+            pool = (self.command(int(i)) for i in ids)
+        else:
+            pool = (self.command(i) for i in range(self.n_cmds))
+        for cmd in pool:
+            if q in cmd.lower():
+                out.append(cmd)
+                if len(out) >= limit:
+                    return out
+        for cmd in self.extra:
+            if q in cmd.lower():
+                out.append(cmd)
+                if len(out) >= limit:
+                    break
+        return out
+
+
+def open_model(models_dir):
+    """MappedModel for models_dir/suggest.bin, or None if there is no usable file."""
+    path = os.path.join(models_dir, MODEL_FILE)
+    if not os.path.exists(path):
+        return None
+    try:
+        return MappedModel(path)
+    except (OSError, ValueError) as e:
+        print(f"Ignoring {path}: {e}")
+        return None
@@ -0,0 +1,258 @@
+# ngram_model.py
+"""Context-aware next-command model: 2-3 grams with optional cwd / exit-status features.
+
+A state is a context the next command is predicted from. From most to least
+specific:
+
+    p3c  (previous command, current command, cwd)
+    p3   (previous command, current command)
+    c2s  (current command, whether it failed)      only when the exit status is known
+    c2c  (current command, cwd)
+    c2   (current command)                          what markov_model.pkl held
+
+Contexts are hashed to 64 bits (blake2b, so the hashes are stable across
+processes and files). NgramCounts accumulates weighted counts per state and
+prunes itself to a fixed number of states, so memory stays bounded however
+much history is fed in. compile() produces CompactNgrams: an open-addressing table
+from state hash to a slot holding that state's TOPK next commands and their
+probabilities. That top-k is computed once, so a lookup is a few hash probes
+and no sorting.
+
+predict() backs off automatically: every context level a store knows
+contributes, and a level d steps below the most specific hit is scaled by
+BACKOFF**d (stupid backoff). A command keeps its best score.
+"""
+import hashlib
+import heapq
+import io
+import os
+
+import numpy as np
+
+from history_reader import history_columns  # also used as ngram_model.history_columns
+
+MODEL_FILE = "ngram_model.npz"
+TOPK = 8
+BACKOFF = 0.4
+MAX_STATES = 200000
+MAX_ROW = 32            # next commands kept per state when pruning
+SESSION_GAP = 30 * 60   # seconds between rows that still count as one sequence
+
+
+def context_keys(cur, prev=None, cwd=None, status=None):
+    """[(level, parts)] for the contexts of cur, most specific first."""
+    keys = []
+    if prev:
+        if cwd:
+            keys.append(("p3c", (prev, cur, cwd)))
+        keys.append(("p3", (prev, cur)))
+    if status is not None:
+        keys.append(("c2s", (cur, "fail" if status else "ok")))
+    if cwd:
+        keys.append(("c2c", (cur, cwd)))
+    keys.append(("c2", (cur,)))
+    return keys
+
+
+def state_hash(level, parts):
+    h = hashlib.blake2b("\x1f".join((level,) + parts).encode("utf8"), digest_size=8).digest()
+    return int.from_bytes(h, "little") | 1  # 0 marks an empty slot
+
+
+class NgramCounts:
+    """Mutable weighted counts per context, for training and the online learner."""
+
+    def __init__(self, max_states=MAX_STATES):
+        self.max_states = max_states
+        self.rows = {}    # state hash -> {next command: weight}
+        self.totals = {}  # state hash -> sum of its row
+
+    def __len__(self):
+        return len(self.rows)
+
+    def add(self, nxt, cur, prev=None, cwd=None, status=None, weight=1.0):
+        """Count nxt following cur (after prev, in cwd, cur exiting with status)."""
+        for level, parts in context_keys(cur, prev, cwd, status):
+            h = state_hash(level, parts)
+            row = self.rows.get(h)
+            if row is None:
+                row = self.rows[h] = {}
+            row[nxt] = row.get(nxt, 0.0) + weight
+            self.totals[h] = self.totals.get(h, 0.0) + weight
+        if len(self.rows) > 2 * self.max_states:
+            self.prune()
+
+    def add_sequence(self, seq, weight=1.0):
+        """Count a session given as [(command, cwd or None, status or None)] in order.
+
+        A command that failed (non-zero status) still counts as context for the
+        one after it, but is never counted as a next command to suggest.
+        """
+        for i in range(1, len(seq)):
+            cur, cwd, status = seq[i - 1]
+            prev = seq[i - 2][0] if i >= 2 else None
+            if seq[i][0] != cur and not seq[i][2]:
+                self.add(seq[i][0], cur, prev, cwd, status, weight)
+
+    def prune(self):
+        """Keep the max_states heaviest states and the MAX_ROW heaviest entries of each."""
+        if len(self.rows) > self.max_states:
+            keep = heapq.nlargest(self.max_states, self.totals, key=self.totals.get)
+            self.rows = {h: self.rows[h] for h in keep}
+            self.totals = {h: self.totals[h] for h in keep}
+        for h, row in self.rows.items():
+            if len(row) > MAX_ROW:
+                self.rows[h] = dict(heapq.nlargest(MAX_ROW, row.items(), key=lambda x: x[1]))
+
+    def decay(self, factor, min_weight):
+        """Multiply every count by factor and drop those below min_weight; returns how many were dropped."""
+        dropped = 0
+        for h in list(self.rows):
+            row = self.rows[h]
+            for nxt in list(row):
+                row[nxt] *= factor
+                if row[nxt] < min_weight:
+                    del row[nxt]
+                    dropped += 1
+            if row:
+                self.totals[h] *= factor
+            else:
+                del self.rows[h]
+                del self.totals[h]
+        return dropped
+
+    def compile(self, topk=TOPK):
+        names, ids = [], {}
+        n = len(self.rows)
+        size = 1
+        while size < 2 * n:
+            size <<= 1
+        keys = np.zeros(size, dtype=np.uint64)
+        slots = np.full(size, -1, dtype=np.int32)
+        top_ids = np.full((n, topk), -1, dtype=np.int32)
+        top_p = np.zeros((n, topk), dtype=np.float32)
+        mask = size - 1
+        for s, (h, row) in enumerate(self.rows.items()):
+            j = h & mask
+            while slots[j] >= 0:
+                j = (j + 1) & mask
+            keys[j], slots[j] = h, s
+            total = self.totals[h]
+            for k, (nxt, w) in enumerate(heapq.nlargest(topk, row.items(), key=lambda x: x[1])):
+                if nxt not in ids:
+                    ids[nxt] = len(names)
+                    names.append(nxt)
+                top_ids[s, k] = ids[nxt]
+                top_p[s, k] = w / total
+        return CompactNgrams(names, keys, slots, top_ids, top_p)
+
+
+class CompactNgrams:
+    """Read-only n-gram store: hashed state table plus precomputed top-k per state."""
+
+    def __init__(self, names, keys, slots, top_ids, top_p):
+        self.names = names
+        self.keys = keys
+        self.slots = slots
+        self.top_ids = top_ids
+        self.top_p = top_p
+        self.mask = len(keys) - 1
+
+    def __len__(self):
+        return len(self.top_ids)
+
+    def state(self, h):
+        if not len(self.top_ids):
+            return -1
+        j = h & self.mask
+        while True:
+            s = int(self.slots[j])
+            if s < 0 or int(self.keys[j]) == h:
+                return s
+            j = (j + 1) & self.mask
+
+    def scores(self, keys, out):
+        """Fold the backed-off probabilities of every known context in keys into out."""
+        first = None
+        for d, (level, parts) in enumerate(keys):
+            s = self.state(state_hash(level, parts))
+            if s < 0:
+                continue
+            if first is None:
+                first = d
+            scale = BACKOFF ** (d - first)
+            for i, p in zip(self.top_ids[s].tolist(), self.top_p[s].tolist()):
+                if i < 0:
+                    break
+                cmd = self.names[i]
+                if p * scale > out.get(cmd, 0.0):
+                    out[cmd] = p * scale
+
+    def save(self, path):
+        strings = "\n".join(self.names).encode("utf8")
+        buf = io.BytesIO()
+        np.savez(buf, keys=self.keys, slots=self.slots, top_ids=self.top_ids, top_p=self.top_p,
+                 strings=np.frombuffer(strings, dtype=np.uint8))
+        tmp = path + ".tmp"
+        with open(tmp, "wb") as f:
+            f.write(buf.getvalue())
+        os.replace(tmp, path)
+
+    @classmethod
+    def load(cls, path):
+        with np.load(path, allow_pickle=False) as z:
+            strings = z["strings"].tobytes().decode("utf8")
+            names = strings.split("\n") if strings else []
+            return cls(names, z["keys"], z["slots"], z["top_ids"], z["top_p"])
+
+
+class LegacyMarkov:
+    """A model's plain 1-gram rows (markov_model.pkl / suggest.bin) behind the store interface."""
+
+    def __init__(self, model):
+        self.model = model
+
+    def scores(self, keys, out):
+        cur = keys[-1][1][0]
+        nxts, total = self.model.next_counts(cur)
+        for cmd, c in heapq.nlargest(TOPK, nxts.items(), key=lambda x: x[1]):
+            p = c / total
+            if p > out.get(cmd, 0.0):
+                out[cmd] = p
+
+
+def open_store(models_dir):
+    """CompactNgrams from models_dir, or None if there is no usable file."""
+    path = os.path.join(models_dir, MODEL_FILE)
+    if not os.path.exists(path):
+        return None
+    try:
+        return CompactNgrams.load(path)
+    except (OSError, ValueError, KeyError) as e:
+        print(f"Ignoring {path}: {e}")
+        return None
+
+
+def predict(stores, cur, prev=None, cwd=None, status=None, k=3):
+    """[(next command, score)] best first, merged over stores."""
+    keys = context_keys(cur, prev, cwd, status)
+    out = {}
+    for store in stores:
+        store.scores(keys, out)
+    return heapq.nlargest(k, out.items(), key=lambda x: x[1])
+
+
+def history_sessions(rows):
+    """Split history rows [(cmd, unix ts, cwd, status)] into sequences at SESSION_GAP."""
+    seq, last_ts = [], None
+    for cmd, ts, cwd, status in rows:
+        cmd = (cmd or "").strip()
+        if not cmd:
+            continue
+        if seq and (ts is None or last_ts is None or not 0 <= ts - last_ts <= SESSION_GAP):
+            yield seq
+            seq = []
+        seq.append((cmd, cwd, status))
+        last_ts = ts
+    if seq:
+        yield seq
@@ -0,0 +1,332 @@
+# online_learner.py
+"""Incremental learning from the shell's own history (commands.db).
+
+core.c appends every command to the `history` table. OnlineLearner tails that
+table by rowid and folds each new row into in-memory state, so suggestions
+follow what users actually type without waiting for a retrain:
+
+  - n-gram counts (ngram_model.NgramCounts) over consecutive commands with
+    their cwd and exit status, when the table has those columns (rows more
+    than SESSION_GAP seconds apart are not treated as a sequence),
+  - the set of known commands (typo correction, partial matches),
+  - per-term document frequencies over those commands (template search).
+
+A command that exited non-zero is still context for the next one but is not
+learned as something to suggest: it is neither a transition target nor a known
+command until it runs successfully.
+
+Transition weights decay exponentially with a configurable half-life. A row is
+weighted by its age when it is read, and every decay interval all weights are
+multiplied down and the ones that fall below MIN_WEIGHT are dropped, so the
+transitions of habits the user gave up fade out. Lookups go to a compiled
+snapshot of the counts (CompactNgrams), rebuilt at most every COMPILE_INTERVAL
+seconds while new rows arrive.
+
+LearnedView layers the learner over the trained model (MappedModel or
+PickledModel) behind the same interface, which is what the engines in
+suggestion_server.py query.
+"""
+import math
+import os
+import sqlite3
+import threading
+import time
+
+import history_reader
+import ngram_model
+from native_model import TOKEN_RE
+from typo_index import TypoIndex
+
+MIN_WEIGHT = 0.05
+BATCH_ROWS = 5000
+MAX_STATES = 50000
+COMPILE_INTERVAL = 5.0
+
+# Rough CPython cost of the learned state, for footprint(): a context state (its
+# row and total, and its slot in the compiled snapshot), a counted transition,
+# a known command before its text, each byte of command text (the string, its
+# trigram postings), and a term posting.
+STATE_BYTES = 400
+ENTRY_BYTES = 120
+COMMAND_BYTES = 300
+TEXT_BYTES = 10
+POSTING_BYTES = 80
+
+
+class OnlineLearner:
+    def __init__(self, db_path, half_life=7 * 86400, decay_interval=3600, owner=None):
+        """owner: (uid, gid) whose credentials db_path is read with (history_reader.read_as)."""
+        self.db_path = db_path
+        # reading as ourselves needs no helper process
+        self.owner = owner if owner is not None and owner[0] != os.geteuid() else None
+        self.signature = None     # history_reader.signature() at the last read as owner
+        self.half_life = half_life
+        self.decay_interval = decay_interval
+        self.last_rowid = 0
+        self.prev = None          # (command, unix ts, cwd, status) of the last row read
+        self.prev2 = None         # the command before that, same session
+        self.last_decay = time.time()
+        self.lock = threading.Lock()  # held briefly by readers and by each batch update
+        self.counts = ngram_model.NgramCounts(MAX_STATES)
+        self.ngrams = self.counts.compile()  # snapshot served to lookups; rebound, never mutated
+        self.dirty = False
+        self.last_compile = 0.0
+        self.generation = 0       # bumped when the learned commands change (cache_key in suggestion_server.py)
+        self.known = TypoIndex()  # learned commands, in first-seen order
+        self.known_set = set()
+        self.df = {}              # term -> number of learned commands containing it
+        self.postings = {}        # term -> [(command id, term count)]
+        self.n_docs = 0
+        self.n_postings = 0
+        self.text_bytes = 0       # total length of the known commands
+
+    def __len__(self):
+        return len(self.known.commands)
+
+    # -- learning --------------------------------------------------------
+
+    def _connect(self):
+        if not os.path.exists(self.db_path):
+            return None
+        # read-only: the shell is the only writer
+        return sqlite3.connect(f"file:{self.db_path}?mode=ro", uri=True, timeout=1.0)
+
+    def poll(self):
+        """Read rows added since the last call; returns how many were learned."""
+        if self.owner is not None:
+            return self._poll_as_owner()
+        try:
+            conn = self._connect()
+        except sqlite3.Error as e:
+            print(f"History: cannot open {self.db_path}: {e}")
+            return 0
+        if conn is None:
+            return 0
+        learned = 0
+        try:
+            sql = (f"SELECT id, {history_reader.history_columns(conn)} FROM history "
+                   "WHERE id > ? ORDER BY id LIMIT ?")
+            while True:
+                rows = conn.execute(sql, (self.last_rowid, BATCH_ROWS)).fetchall()
+                if not rows:
+                    (top,) = conn.execute("SELECT ifnull(max(id), 0) FROM history").fetchone()
+                    if top < self.last_rowid:
+                        # database was recreated: keep what was learned, start over at its first row
+                        self.last_rowid, self.prev, self.prev2 = 0, None, None
+                        continue
+                    break
+                self._learn(rows)
+                learned += len(rows)
+                if len(rows) < BATCH_ROWS:
+                    break
+        except sqlite3.Error as e:
+            print(f"History: read failed after row {self.last_rowid}: {e}")
+        finally:
+            conn.close()
+        return learned
+
+    def _poll_as_owner(self):
+        sig = history_reader.signature(self.db_path)
+        if sig is None or sig == self.signature:
+            return 0
+        learned = 0
+        while True:
+            try:
+                top, rows = history_reader.read_as(self.owner, self.db_path, self.last_rowid)
+            except history_reader.ReadError as e:
+                # not retried until the file changes
+                print(f"History: cannot read {self.db_path} as uid {self.owner[0]}: {e}")
+                break
+            if not rows:
+                if top < self.last_rowid:
+                    self.last_rowid, self.prev, self.prev2 = 0, None, None
+                    continue
+                break
+            self._learn(rows)
+            learned += len(rows)
+            if len(rows) < history_reader.HELPER_ROWS:
+                break
+        self.signature = sig  # taken before the read, so a commit during it is read next time
+        return learned
+
+    def _learn(self, rows):
+        now = time.time()
+        new_cmds = []
+        with self.lock:
+            for rowid, cmd, ts, cwd, status in rows:
+                self.last_rowid = rowid
+                cmd = (cmd or "").strip()
+                if not cmd:
+                    continue
+                ts = ts or now
+                prev = self.prev
+                if prev is None or not 0 <= ts - prev[1] <= ngram_model.SESSION_GAP:
+                    self.prev2 = prev = None  # new session
+                failed = bool(status)
+                if prev is not None and prev[0] != cmd:
+                    if not failed:
+                        w = 0.5 ** (max(0.0, now - ts) / self.half_life)
+                        self.counts.add(cmd, prev[0], self.prev2, prev[2], prev[3], w)
+                        self.dirty = True
+                    self.prev2 = prev[0]
+                self.prev = (cmd, ts, cwd, status)
+                if cmd not in self.known_set and not failed:
+                    self.known_set.add(cmd)
+                    new_cmds.append(cmd)
+                    self._add_document(cmd)
+            self.known.add_all(new_cmds)
+            if new_cmds:
+                self.generation += 1
+
+    def _add_document(self, cmd):
+        doc = self.n_docs
+        counts = {}
+        for tok in TOKEN_RE.findall(cmd.lower()):
+            counts[tok] = counts.get(tok, 0) + 1
+        for term, c in counts.items():
+            self.df[term] = self.df.get(term, 0) + 1
+            self.postings.setdefault(term, []).append((doc, c))
+        self.n_docs += 1
+        self.n_postings += len(counts)
+        self.text_bytes += len(cmd)
+
+    def footprint(self):
+        """Estimated bytes of memory held by what has been learned."""
+        with self.lock:
+            entries = sum(len(row) for row in self.counts.rows.values())
+            return (len(self.counts) * STATE_BYTES + entries * ENTRY_BYTES +
+                    self.n_docs * COMMAND_BYTES + self.text_bytes * TEXT_BYTES +
+                    self.n_postings * POSTING_BYTES)
+
+    def decay_if_due(self):
+        """Scale every transition down by the time since the last decay; drop faded ones."""
+        now = time.time()
+        elapsed = now - self.last_decay
+        if elapsed < self.decay_interval:
+            return
+        factor = 0.5 ** (elapsed / self.half_life)
+        with self.lock:
+            dropped = self.counts.decay(factor, MIN_WEIGHT)
+            self.last_decay = now
+            self.dirty = True
+        if dropped:
+            print(f"History: decayed transitions by {factor:.3f}, dropped {dropped}")
+
+    def compile_if_due(self):
+        if not self.dirty or time.time() - self.last_compile < COMPILE_INTERVAL:
+            return
+        with self.lock:
+            ngrams = self.counts.compile()
+            self.dirty = False
+        self.ngrams = ngrams
+        self.last_compile = time.time()
+
+    def run(self, interval):
+        """Poll loop for a daemon thread."""
+        while True:
+            n = self.poll()
+            if n:
+                print(f"History: learned {n} commands (up to row {self.last_rowid}), "
+                      f"{len(self)} known, {len(self.counts)} n-gram states")
+            self.decay_if_due()
+            self.compile_if_due()
+            time.sleep(interval)
+
+    # -- lookups (same shapes as MappedModel) ----------------------------
+
+    def typo(self, query, threshold):
+        with self.lock:
+            return self.known.best_match(query, threshold)
+
+    def containing(self, query, limit):
+        with self.lock:
+            return self.known.containing(query, limit)
+
+    def templates(self, query, topk=5):
+        """Cosine over the learned commands with smoothed idf from the current df."""
+        terms = {}
+        for tok in TOKEN_RE.findall(query.lower()):
+            terms[tok] = terms.get(tok, 0) + 1
+        with self.lock:
+            n = self.n_docs
+            if not n:
+                return []
+            scores = {}
+            qnorm = 0.0
+            for term, qc in terms.items():
+                df = self.df.get(term)
+                if not df:
+                    continue
+                idf = math.log((1 + n) / (1 + df)) + 1  # TfidfVectorizer(smooth_idf=True)
+                qw = qc * idf
+                qnorm += qw * qw
+                for doc, c in self.postings[term]:
+                    scores[doc] = scores.get(doc, 0.0) + qw * c * idf
+            if not scores:
+                return []
+            best = sorted(scores.items(), key=lambda x: x[1], reverse=True)[:topk]
+            return [(self.known.commands[d], s / (math.sqrt(qnorm) * self._doc_norm(d)))
+                    for d, s in best]
+
+    def _doc_norm(self, doc):
+        cmd = self.known.commands[doc]
+        n = self.n_docs
+        counts = {}
+        for tok in TOKEN_RE.findall(cmd.lower()):
+            counts[tok] = counts.get(tok, 0) + 1
+        return math.sqrt(sum((c * (math.log((1 + n) / (1 + self.df[t])) + 1)) ** 2
+                             for t, c in counts.items())) or 1.0
+
+
+class LearnedView:
+    """The trained model with the learner's state merged into every lookup."""
+
+    def __init__(self, base, learner):
+        self.base = base
+        self.learner = learner
+        self.created = base.created
+        self.ngram_stores = base.ngram_stores + [learner.ngrams]
+
+    def __len__(self):
+        return len(self.base) + len(self.learner)
+
+    def typo(self, query, threshold):
+        match, score = self.base.typo(query, threshold)
+        if score < 1.0 and len(self.learner):
+            m2, s2 = self.learner.typo(query, threshold)
+            if s2 > score:
+                return m2, s2
+        return match, score
+
+    def typo_many(self, queries, threshold):
+        out = self.base.typo_many(queries, threshold)
+        if len(self.learner):
+            for i, (match, score) in enumerate(out):
+                if score < 1.0:
+                    m2, s2 = self.learner.typo(queries[i], threshold)
+                    if s2 > score:
+                        out[i] = (m2, s2)
+        return out
+
+    def templates_many(self, queries, topk=5):
+        out = self.base.templates_many(queries, topk)
+        for i, results in enumerate(out):
+            seen = {cmd for cmd, _ in results}
+            results += [(cmd, s) for cmd, s in self.learner.templates(queries[i], topk) if cmd not in seen]
+            results.sort(key=lambda x: x[1], reverse=True)
+            out[i] = results[:topk]
+        return out
+
+    def templates(self, query, topk=5):
+        results = self.base.templates(query, topk)
+        seen = {cmd for cmd, _ in results}
+        results += [(cmd, s) for cmd, s in self.learner.templates(query, topk) if cmd not in seen]
+        results.sort(key=lambda x: x[1], reverse=True)
+        return results[:topk]
+
+    def containing(self, query, limit):
+        out = self.base.containing(query, limit)
+        if len(out) < limit:
+            seen = set(out)
+            out += [c for c in self.learner.containing(query, limit) if c not in seen][:limit - len(out)]
+        return out
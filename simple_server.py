@@ -49,43 +49,54 @@ def make_suggestions(q):
     return items
 
 
+def handle_request(raw, addr):
+    print(f"[{addr}] received: {raw}")
+    query = raw
+    model = 'Claude Haiku 4.5'
+    req_id = None
+    try:
+        obj = json.loads(raw)
+        if isinstance(obj, dict):
+            query = obj.get('cmd', raw)
+            model = obj.get('model', model)
+            req_id = obj.get('id')
+    except Exception:
+        # not JSON, keep raw
+        pass
+
+    suggestions = make_suggestions(query)
+    payload = {'model': model, 'suggestions': suggestions}
+    if req_id is not None:
+        payload = {'id': req_id, **payload}
+    print(f"[{addr}] sent {len(suggestions)} suggestions (model={model})")
+    return payload
+
+
 def handle_conn(conn, addr):
+    """Serve newline-delimited requests until the client closes the connection.
+
+    A request without a trailing newline is answered only at EOF.
+    """
     try:
-        conn.settimeout(1.0)
         data = b''
-        try:
-            while True:
-                chunk = conn.recv(4096)
-                if not chunk:
+        while True:
+            chunk = conn.recv(4096)
+            if not chunk:
+                if data.strip():
+                    data += b"\n"
+                else:
                     break
+            else:
                 data += chunk
-                if b"\n" in data:
-                    break
-        except socket.timeout:
-            pass
 
-        if not data:
-            print(f"[{addr}] no data received")
-            return
-
-        raw = data.decode().strip()
-        print(f"[{addr}] received: {raw}")
-        query = raw
-        model = 'Claude Haiku 4.5'
-        try:
-            obj = json.loads(raw)
-            if isinstance(obj, dict):
-                query = obj.get('cmd', raw)
-                model = obj.get('model', model)
-        except Exception:
-            # not JSON, keep raw
-            pass
+            while b"\n" in data:
+                line, data = data.split(b"\n", 1)
+                raw = line.decode().strip()
+                if raw:
+                    conn.sendall((json.dumps(handle_request(raw, addr)) + '\n').encode())
 
-        suggestions = make_suggestions(query)
-        payload = {'model': model, 'suggestions': suggestions}
-        resp = (json.dumps(payload) + '\n').encode()
-        conn.sendall(resp)
-        print(f"[{addr}] sent {len(suggestions)} suggestions (model={model})")
+            if not chunk:
+                break
     except Exception as e:
         print(f"[{addr}] error: {e}")
     finally:
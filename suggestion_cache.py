@@ -0,0 +1,88 @@
+# suggestion_cache.py
+"""Caches in front of rank_and_merge().
+
+ResultCache is an LRU of the engines' results. The server keeps the
+context-free engines' (TypoFixer, Template) there, keyed by (query, model,
+model_version, learner generation), so a reload or newly learned commands never
+serve stale results and old keys just age out. NextCmd depends on the request's
+prev/cwd/status and is recomputed, cheaply, for every request; keying whole
+answers by that context made nearly every lookup a miss.
+
+PrefixCandidates keeps the candidate sets of the substring ("Partial") engine.
+Everything that contains "git st" also contains "git s", so when the set cached for a
+shorter prefix of the query is complete (not cut at the limit), it is filtered
+in place of a search over the full command list. Typing one more character
+then costs a scan of the previous few candidates.
+"""
+import threading
+from collections import OrderedDict
+
+PREFIX_MAX_CANDIDATES = 256
+PREFIX_MAX_BACKTRACK = 16   # shorter prefixes tried before searching the corpus
+
+
+class ResultCache:
+    def __init__(self, capacity):
+        self.capacity = capacity
+        self.entries = OrderedDict()
+        self.lock = threading.Lock()
+        self.hits = self.misses = self.evictions = 0
+
+    def get(self, key):
+        with self.lock:
+            value = self.entries.get(key)
+            if value is None:
+                self.misses += 1
+                return None
+            self.entries.move_to_end(key)
+            self.hits += 1
+            return value
+
+    def put(self, key, value):
+        if self.capacity <= 0:
+            return
+        with self.lock:
+            self.entries[key] = value
+            self.entries.move_to_end(key)
+            while len(self.entries) > self.capacity:
+                self.entries.popitem(last=False)
+                self.evictions += 1
+
+    def stats(self):
+        total = self.hits + self.misses
+        return {"hits": self.hits, "misses": self.misses, "evictions": self.evictions,
+                "size": len(self.entries), "capacity": self.capacity,
+                "hit_rate": round(self.hits / total, 4) if total else 0.0}
+
+
+class PrefixCandidates:
+    def __init__(self, capacity):
+        self.sets = ResultCache(capacity)  # (scope, lowercased query) -> (commands, complete)
+        self.prefix_hits = 0
+
+    def containing(self, scope, query, limit, search):
+        """Up to limit commands containing query; search(query, n) runs the full lookup.
+
+        scope identifies the corpus (model version, learner generation); sets of
+        different corpora never mix.
+        """
+        q = query.lower()
+        cached = self.sets.get((scope, q))
+        if cached is None:
+            base = None
+            for cut in range(len(q) - 1, max(0, len(q) - 1 - PREFIX_MAX_BACKTRACK), -1):
+                entry = self.sets.entries.get((scope, q[:cut]))
+                if entry is not None and entry[1]:
+                    base = entry[0]
+                    break
+            if base is not None:
+                self.prefix_hits += 1
+                cached = ([c for c in base if q in c.lower()], True)
+            else:
+                found = search(query, PREFIX_MAX_CANDIDATES)
+                cached = (found, len(found) < PREFIX_MAX_CANDIDATES)
+            self.sets.put((scope, q), cached)
+        return cached[0][:limit]
+
+    def stats(self):
+        return {**self.sets.stats(), "prefix_hits": self.prefix_hits}
@@ -1,15 +1,57 @@
+import os
 import socket
 import json
+import threading
+import time
+from collections import OrderedDict
 
 DEFAULT_HOST = "127.0.0.1"
 DEFAULT_PORT = 9999
 
+# Answers already fetched, keyed by (command, model); the debounced prompt asks for the
+# same prefixes over and over. Entries expire after CACHE_TTL seconds and the cache is
+# dropped when the server reports a different model_version.
+CACHE_SIZE = 256
+CACHE_TTL = 30.0
+_cache = OrderedDict()
+_cache_lock = threading.Lock()
+_cache_version = None
+cache_stats = {"hits": 0, "misses": 0}
 
-def get_suggestions(command, model=None, timeout=0.5):
+
+def _cache_get(key):
+    with _cache_lock:
+        entry = _cache.get(key)
+        if entry is not None and time.monotonic() - entry[0] <= CACHE_TTL:
+            _cache.move_to_end(key)
+            cache_stats["hits"] += 1
+            return entry[1]
+        cache_stats["misses"] += 1
+        return None
+
+
+def _cache_put(key, suggestions, version):
+    global _cache_version
+    with _cache_lock:
+        if version is not None and version != _cache_version:
+            _cache.clear()
+            _cache_version = version
+        _cache[key] = (time.monotonic(), suggestions)
+        _cache.move_to_end(key)
+        while len(_cache) > CACHE_SIZE:
+            _cache.popitem(last=False)
+
+
+def get_suggestions(command, model=None, timeout=0.5, k=None, fields=None):
     """Send a small JSON request to the suggestion server and return the list of suggestions.
 
+    k limits the number of suggestions and fields the keys kept in each one.
     Returns list of suggestion dicts (source, suggestion, confidence, reason) or [] on error.
     """
+    key = (command, model, k, tuple(fields) if fields else None)
+    cached = _cache_get(key)
+    if cached is not None:
+        return list(cached)
     try:
         client = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
         client.settimeout(timeout)
@@ -17,6 +59,11 @@ def get_suggestions(command, model=None, timeout=0.5):
         payload = {"cmd": command}
         if model:
             payload["model"] = model
+        payload["deadline_ms"] = int(timeout * 1000)
+        if k:
+            payload["k"] = k
+        if fields:
+            payload["fields"] = list(fields)
         client.sendall((json.dumps(payload) + "\n").encode())
 
         data = b""
@@ -37,7 +84,10 @@ def get_suggestions(command, model=None, timeout=0.5):
             obj = json.loads(data.decode().strip())
             # server may return {"model":..., "suggestions":[...]}
             if isinstance(obj, dict) and "suggestions" in obj:
-                return obj.get("suggestions", [])
+                suggestions = obj.get("suggestions", [])
+                if all(s == "ok" for s in obj.get("engines", {}).values()):
+                    _cache_put(key, suggestions, obj.get("model_version"))
+                return list(suggestions)
             # or it might return a list directly
             if isinstance(obj, list):
                 return obj
@@ -46,3 +96,147 @@ def get_suggestions(command, model=None, timeout=0.5):
             return []
     except Exception:
         return []
+
+
+def get_suggestions_batch(commands, model=None, timeout=5.0, k=None, fields=None):
+    """Suggestions for many commands in one request ({"op":"batch"}).
+
+    Returns one list per command, in order ([] for a command the server could not
+    answer). A command may also be a dict with "cmd" and its own prev/cwd/status;
+    those bypass the local cache. The batch waits for every engine.
+    """
+    results = [None] * len(commands)
+    keys = {}
+    if fields:
+        fields = list(fields)
+    for i, c in enumerate(commands):
+        if isinstance(c, str):
+            keys[i] = (c, model, k, tuple(fields) if fields else None)
+            cached = _cache_get(keys[i])
+            if cached is not None:
+                results[i] = list(cached)
+    todo = [i for i, r in enumerate(results) if r is None]
+    if todo:
+        payload = {"op": "batch", "queries": [commands[i] for i in todo]}
+        if model:
+            payload["model"] = model
+        if k:
+            payload["k"] = k
+        if fields:
+            payload["fields"] = fields
+        try:
+            with socket.create_connection((DEFAULT_HOST, DEFAULT_PORT), timeout=timeout) as client:
+                client.sendall((json.dumps(payload) + "\n").encode())
+                obj = json.loads(client.makefile("rb").readline().decode())
+            answers = obj.get("results") or []
+        except Exception:
+            obj, answers = {}, []
+        for i, answer in zip(todo, answers):
+            suggestions = answer.get("suggestions", []) if isinstance(answer, dict) else []
+            results[i] = list(suggestions)
+            if i in keys and all(s == "ok" for s in answer.get("engines", {}).values()):
+                _cache_put(keys[i], suggestions, obj.get("model_version"))
+    return [r if r is not None else [] for r in results]
+
+
+class SuggestionStream:
+    """Streaming completions over one connection (the server's {"op":"session"}).
+
+    update(text) sends the edit since the previous call as a keystroke delta and
+    returns at once; a reader thread calls on_update(text, suggestions, final) as
+    the server pushes re-ranked answers, only for the newest text. update() returns
+    False when there is no session (server down, or too old to stream); the caller
+    then falls back to get_suggestions(). A dropped connection is reopened on the
+    next update, at most every RETRY_INTERVAL seconds.
+    """
+
+    RETRY_INTERVAL = 1.0
+
+    def __init__(self, on_update, model=None, k=None, fields=None, timeout=0.5):
+        self.on_update = on_update
+        self.model, self.k, self.fields, self.timeout = model, k, fields, timeout
+        self.lock = threading.Lock()
+        self.sock = None
+        self.sent = ""        # the text as the server has it
+        self.seq = 0
+        self.supported = None  # False once a server answered without a session
+        self.retry_at = 0.0
+
+    def open(self):
+        with self.lock:
+            return self._open()
+
+    def _open(self):
+        if self.sock is not None:
+            return True
+        if self.supported is False or time.monotonic() < self.retry_at:
+            return False
+        self.retry_at = time.monotonic() + self.RETRY_INTERVAL
+        payload = {"op": "session"}
+        for name in ("model", "k", "fields"):
+            if getattr(self, name):
+                payload[name] = getattr(self, name)
+        try:
+            sock = socket.create_connection((DEFAULT_HOST, DEFAULT_PORT), timeout=self.timeout)
+            sock.sendall((json.dumps(payload) + "\n").encode())
+            lines = sock.makefile("rb")
+            ack = json.loads(lines.readline().decode() or "null")
+        except (OSError, ValueError):
+            return False
+        if not (isinstance(ack, dict) and ack.get("session")):
+            self.supported = False
+            sock.close()
+            return False
+        sock.settimeout(None)
+        self.supported = True
+        self.sock, self.sent = sock, ""
+        threading.Thread(target=self._read, args=(sock, lines), daemon=True).start()
+        return True
+
+    def _send(self, msg):
+        try:
+            self.sock.sendall((json.dumps(msg) + "\n").encode())
+            return True
+        except OSError:
+            self.sock.close()
+            self.sock = None
+            return False
+
+    def update(self, text, **context):
+        """Send text (the whole current line); context may carry prev/cwd/status."""
+        with self.lock:
+            if not self._open():
+                return False
+            common = len(os.path.commonprefix([self.sent, text]))
+            self.seq += 1
+            msg = {"op": "delta", "seq": self.seq, "del": len(self.sent) - common, "ins": text[common:]}
+            msg.update(context)
+            if not self._send(msg):
+                return False
+            self.sent = text
+            return True
+
+    def _read(self, sock, lines):
+        try:
+            for line in lines:
+                try:
+                    obj = json.loads(line.decode())
+                except ValueError:
+                    continue
+                if isinstance(obj, dict) and obj.get("op") == "update" and obj.get("seq") == self.seq:
+                    self.on_update(obj.get("text", ""), obj.get("suggestions", []), bool(obj.get("final")))
+        except (OSError, ValueError):
+            pass
+        with self.lock:
+            if self.sock is sock:
+                self.sock = None
+
+    def close(self):
+        with self.lock:
+            if self.sock is not None:
+                try:
+                    self.sock.shutdown(socket.SHUT_RDWR)  # wakes the reader thread
+                except OSError:
+                    pass
+                self.sock.close()
+                self.sock = None
@@ -1,41 +1,45 @@
 #!/usr/bin/env python3
-import socket, os, json, threading, joblib
-from rapidfuzz import process, fuzz
-from sklearn.metrics.pairwise import cosine_similarity
-import numpy as np
+import socket, os, json, threading, time, joblib
+import asyncio
+import functools
+import queue
+from concurrent.futures import ThreadPoolExecutor, wait
 import traceback
+from template_index import TemplateIndex
+from typo_index import TypoIndex
+import native_model
+import wire
+import ngram_model
+from online_learner import OnlineLearner, LearnedView
+from suggestion_cache import ResultCache, PrefixCandidates
 
-# Use TCP instead of Unix sockets for Windows compatibility
+# TCP works everywhere (including Windows); on Unix the shell prefers the
+# Unix domain socket below, which skips the TCP handshake.
 HOST = "localhost"
-PORT = 9999
+SOCKET_PATH = os.environ.get("SUGGEST_SOCKET_PATH", "/tmp/shell_suggest.sock")
 
-MODELS_DIR = "models"
+# Shared daemon: SUGGEST_USERS=alice,bob (names or uids) serves each of them on
+# SUGGEST_SOCKET_DIR/<uid>.sock with a learner over their own history
+# (SUGGEST_USER_HISTORY, formatted with {user}, {uid} and {home}); see
+# user_shards.py. SUGGEST_SHARD_MEMORY_MB caps the learners together. Each
+# history is read as its user, with SUGGEST_READER_PYTHON (default: this
+# interpreter, which must then be executable by them); see history_reader.py.
+USERS = os.environ.get("SUGGEST_USERS", "")
+SOCKET_DIR = os.environ.get("SUGGEST_SOCKET_DIR", "/tmp/ish-suggest")
+USER_HISTORY = os.environ.get("SUGGEST_USER_HISTORY", "{home}/commands.db")
+SHARD_MEMORY_MB = float(os.environ.get("SUGGEST_SHARD_MEMORY_MB", "256"))
+if USERS:
+    from user_shards import ShardPool, resolve_users  # Unix only (pwd)
 
-# Default model for suggestions; can be overridden with env var SUGGEST_DEFAULT_MODEL
-DEFAULT_MODEL = os.environ.get("SUGGEST_DEFAULT_MODEL", "Claude Haiku 4.5")
-
-def load_models():
-    """Load models with error handling"""
-    try:
-        vectorizer = joblib.load(f"{MODELS_DIR}/tfidf_vectorizer.pkl")
-        commands_list = joblib.load(f"{MODELS_DIR}/commands_list.pkl")
-        markov = joblib.load(f"{MODELS_DIR}/markov_model.pkl")
-        with open(f"{MODELS_DIR}/known_cmds.json", "r", encoding="utf8") as f:
-            known_cmds = json.load(f)
+# TCP port; 0 turns the TCP listener off. A shared daemon has none unless asked,
+# since a TCP connection does not say which user it belongs to.
+PORT = int(os.environ.get("SUGGEST_PORT", "0" if USERS else "9999"))
 
-        print(f"Loaded {len(commands_list)} commands, {len(known_cmds)} known commands")
-        print(f"Sample commands: {commands_list[:5]}")  
-        return vectorizer, commands_list, markov, known_cmds
+# Trained model files (train_from_csv.py --outdir)
+MODELS_DIR = os.environ.get("SUGGEST_MODELS_DIR", "models")
 
-    except Exception as e:
-        print(f"Error loading models: {e}")
-        print(traceback.format_exc())
-        from sklearn.feature_extraction.text import TfidfVectorizer
-        vectorizer = TfidfVectorizer()
-        vectorizer.fit([""])
-        return vectorizer, [], {}, []
-
-vectorizer, commands_list, markov, known_cmds = load_models()
+# Default model for suggestions; can be overridden with env var SUGGEST_DEFAULT_MODEL
+DEFAULT_MODEL = os.environ.get("SUGGEST_DEFAULT_MODEL", "Claude Haiku 4.5")
 
 # -------------------------------------------
 # ADDING EXTRA COMMANDS HERE
@@ -64,90 +68,381 @@ extra_commands = [
     "npm uninstall"
 ]
 
-# Add to lists if not already present
-for cmd in extra_commands:
-    if cmd not in commands_list:
-        commands_list.append(cmd)
-    if cmd not in known_cmds:
-        known_cmds.append(cmd)
+class PickledModel:
+    """The joblib/JSON files of older training runs, behind MappedModel's interface."""
 
-print(f"Added {len(extra_commands)} extra commands.")
-print(f"Total commands: {len(commands_list)} | Total known commands: {len(known_cmds)}")
-# -------------------------------------------
+    def __init__(self, models_dir, extra, strict=False):
+        self.created = 0  # model version: training time of the files
+        try:
+            self.vectorizer = joblib.load(f"{models_dir}/tfidf_vectorizer.pkl")
+            self.commands_list = joblib.load(f"{models_dir}/commands_list.pkl")
+            self.markov = joblib.load(f"{models_dir}/markov_model.pkl")
+            with open(f"{models_dir}/known_cmds.json", "r", encoding="utf8") as f:
+                self.known_cmds = json.load(f)
+            print(f"Loaded {len(self.commands_list)} commands, {len(self.known_cmds)} known commands")
+            print(f"Sample commands: {self.commands_list[:5]}")
+            self.created = int(os.path.getmtime(f"{models_dir}/commands_list.pkl"))
+        except Exception as e:
+            if strict:
+                raise
+            print(f"Error loading models: {e}")
+            print(traceback.format_exc())
+            from sklearn.feature_extraction.text import TfidfVectorizer
+            self.vectorizer = TfidfVectorizer().fit(extra)
+            self.commands_list, self.markov, self.known_cmds = [], {}, []
+
+        # Add to lists if not already present
+        for cmd in extra:
+            if cmd not in self.commands_list:
+                self.commands_list.append(cmd)
+            if cmd not in self.known_cmds:
+                self.known_cmds.append(cmd)
+        print(f"Added {len(extra)} extra commands.")
+        print(f"Total commands: {len(self.commands_list)} | Total known commands: {len(self.known_cmds)}")
+
+        # Corpus TF-IDF matrix, built once (or loaded from training) instead of per query
+        self.template_index = TemplateIndex.load(self.vectorizer, self.commands_list, models_dir)
+        print(f"Template index: {self.template_index.matrix.shape[0]} rows, {self.template_index.matrix.nnz} non-zeros")
+        # Trigram index over known_cmds for typo_fix() and the partial-match fallback
+        self.typo_index = TypoIndex.load(self.known_cmds, models_dir)
+        print(f"Typo index: {len(self.typo_index.commands)} commands, {len(self.typo_index.postings)} trigrams")
+
+    def __len__(self):
+        return len(self.known_cmds)
+
+    def typo(self, query, threshold):
+        return self.typo_index.best_match(query, threshold)
+
+    def next_counts(self, query):
+        nxts = self.markov.get(query, {})
+        return nxts, sum(nxts.values())
+
+    def templates(self, query, topk=5):
+        return self.template_index.search(query, topk) if self.commands_list else []
+
+    def typo_many(self, queries, threshold):
+        return self.typo_index.best_match_many(queries, threshold)
+
+    def templates_many(self, queries, topk=5):
+        return self.template_index.search_many(queries, topk) if self.commands_list else [[] for _ in queries]
+
+    def containing(self, query, limit):
+        return self.typo_index.containing(query, limit)
+
+def load_models(strict=False):
+    """Map models/suggest.bin; fall back to the pickled models of older training runs.
+
+    With strict=True (reloads) a broken model raises instead of degrading to the
+    extra commands only, so the model being served stays in place.
+    """
+    path = os.path.join(MODELS_DIR, native_model.MODEL_FILE)
+    model = native_model.MappedModel(path) if strict and os.path.exists(path) else native_model.open_model(MODELS_DIR)
+    if model is not None:
+        model.extend(extra_commands)
+        print(f"Mapped {path}: {model.n_cmds} commands, "
+              f"{model.n_terms} terms, {len(model.extra)} extra commands")
+    else:
+        model = PickledModel(MODELS_DIR, extra_commands, strict)
+    # next-command predictors: the trained n-gram store, or the model's plain transitions
+    ngrams = ngram_model.open_store(MODELS_DIR)
+    if ngrams is not None:
+        print(f"N-gram model: {len(ngrams)} states")
+    model.ngram_stores = [ngrams if ngrams is not None else ngram_model.LegacyMarkov(model)]
+    return model
+
+# Files whose replacement triggers a reload
+MODEL_FILES = [native_model.MODEL_FILE, ngram_model.MODEL_FILE, "tfidf_vectorizer.pkl",
+               "commands_list.pkl", "markov_model.pkl", "known_cmds.json"]
+
+# Seconds between checks of MODELS_DIR; 0 disables the watcher (reloads then only on {"op":"reload"})
+RELOAD_INTERVAL = float(os.environ.get("SUGGEST_RELOAD_INTERVAL", "2"))
+
+def model_signature():
+    sig = []
+    for name in MODEL_FILES:
+        try:
+            st = os.stat(os.path.join(MODELS_DIR, name))
+            sig.append((name, st.st_ino, st.st_size, st.st_mtime_ns))
+        except OSError:
+            pass
+    return tuple(sig)
+
+class ModelSlot:
+    """Versioned pointer to the model being served.
+
+    A request reads `current` once and uses that (version, model) pair to the
+    end, so a swap never changes the model under an in-flight request; the old
+    model (and its mapping) is released when the last request holding it
+    returns. Rebinding `current` is a single reference store, atomic for readers.
+    """
+
+    def __init__(self):
+        self._reload_lock = threading.Lock()  # one load at a time; readers never take it
+        self.signature = model_signature()
+        model = load_models()
+        self.current = (model.created, model)
+
+    def reload(self):
+        """Load the models directory again and swap it in; returns the new version."""
+        with self._reload_lock:
+            signature = model_signature()
+            model = load_models(strict=True)
+            self.current = (model.created, model)
+            self.signature = signature
+            print(f"Model reloaded: version {model.created}")
+            return model.created
+
+    def watch(self):
+        """Reload when MODELS_DIR changes and then stays unchanged for one interval."""
+        pending = None
+        while True:
+            time.sleep(RELOAD_INTERVAL)
+            signature = model_signature()
+            if signature == self.signature:
+                pending = None
+            elif signature != pending:
+                pending = signature  # still being written; look again next round
+            else:
+                try:
+                    self.reload()
+                except Exception as e:
+                    print(f"Model reload failed, keeping version {self.current[0]}: {e}")
+                    self.signature = signature  # don't retry the same broken files
+                pending = None
+
+models = ModelSlot()
+
+# Learn from the shell's history as it is written; SUGGEST_HISTORY_POLL=0 turns it off
+HISTORY_DB = os.environ.get("SUGGEST_HISTORY_DB", os.path.expanduser("~/commands.db"))  # the shell's default
+HISTORY_POLL = float(os.environ.get("SUGGEST_HISTORY_POLL", "1"))
+HISTORY_HALF_LIFE = float(os.environ.get("SUGGEST_HISTORY_HALF_LIFE_DAYS", "7")) * 86400
+learner = OnlineLearner(HISTORY_DB, HISTORY_HALF_LIFE) if HISTORY_POLL > 0 and not USERS else None
+shared_users = resolve_users(USERS) if USERS else []
+shards = None
+if USERS and HISTORY_POLL > 0:
+    shards = ShardPool(shared_users, USER_HISTORY, HISTORY_HALF_LIFE, int(SHARD_MEMORY_MB * (1 << 20)))
+
+# Finished suggestion lists (SUGGEST_CACHE_SIZE=0 disables) and Partial-engine candidate sets
+result_cache = ResultCache(int(os.environ.get("SUGGEST_CACHE_SIZE", "4096")))
+partial_cache = PrefixCandidates(int(os.environ.get("SUGGEST_PREFIX_CACHE_SIZE", "1024")))
+
+# Per-query tracing, off unless SUGGEST_VERBOSE=1. Messages are formatted and
+# printed by one daemon thread, so ranking workers never block on stdout.
+VERBOSE = os.environ.get("SUGGEST_VERBOSE", "0") == "1"
+trace_queue = queue.SimpleQueue()
+
+def trace(fmt, *args):
+    if VERBOSE:
+        trace_queue.put((fmt, args))
+
+def trace_printer():
+    while True:
+        fmt, args = trace_queue.get()
+        try:
+            print(fmt % args if args else fmt)
+        except Exception as e:
+            print(f"Bad trace message {fmt!r}: {e}")
 
-def typo_fix(query):
+# Engine fan-out. TypoFixer and Template run on their own pool while NextCmd (a
+# few hash probes) runs on the request's thread; the merge takes whatever has
+# finished by the request deadline. The deadline is the client's "deadline_ms"
+# (SUGGEST_DEADLINE_MS when it sends none), counted from when the request
+# arrived, less DEADLINE_MARGIN_MS for encoding and the trip back.
+ENGINE_WORKERS = int(os.environ.get("SUGGEST_ENGINE_WORKERS", str(2 * min(8, os.cpu_count() or 2))))
+DEFAULT_DEADLINE_MS = float(os.environ.get("SUGGEST_DEADLINE_MS", "200"))
+DEADLINE_MARGIN_MS = float(os.environ.get("SUGGEST_DEADLINE_MARGIN_MS", "20"))
+engine_pool = ThreadPoolExecutor(max_workers=ENGINE_WORKERS, thread_name_prefix="engine")
+MAX_BATCH = int(os.environ.get("SUGGEST_MAX_BATCH", "1000"))  # queries per {"op":"batch"}
+
+def typo_fix(query, model):
     """Fix typos in PowerShell commands with better matching"""
-    if not known_cmds or not query.strip():
+    if not len(model) or not query.strip():
         return None, 0.0
 
-    print(f"  TypoFix: searching for '{query}' in {len(known_cmds)} known commands")
+    trace("  TypoFix: searching for %r in %d known commands", query, len(model))
 
-    match, score, _ = process.extractOne(query, known_cmds, scorer=fuzz.ratio)
-    normalized_score = float(score) / 100.0
+    match, normalized_score = model.typo(query, 0.60)
 
-    print(f"  TypoFix: best match '{match}' with score {normalized_score}")
+    trace("  TypoFix: best match %r with score %s", match, normalized_score)
 
     if normalized_score > 0.60:
         return match, normalized_score
 
     return None, 0.0
 
-def predict_next(query):
-    """Predict next PowerShell command in sequence"""
+def predict_next(query, model, context):
+    """Predict next PowerShell command in sequence (n-grams over prev/cwd/status, backing off)"""
     if not query.strip():
         return []
 
-    print(f"  NextCmd: checking Markov for '{query}'")
-
-    if query in markov:
-        nxts = markov[query]
-        top_next = sorted(nxts.items(), key=lambda x: x[1], reverse=True)[:3]
-        results = []
-        total = sum(nxts.values())
+    trace("  NextCmd: checking n-grams for %r", query)
 
-        for nxt, count in top_next:
-            confidence = float(count) / total
-            if confidence > 0.05:
-                results.append((nxt, confidence))
-
-        print(f"  NextCmd: found {len(results)} next commands")
+    top_next = ngram_model.predict(model.ngram_stores, query, context.get("prev"),
+                                   context.get("cwd"), context.get("status"), k=3)
+    if top_next:
+        results = [(nxt, confidence) for nxt, confidence in top_next if confidence > 0.05]
+        trace("  NextCmd: found %d next commands", len(results))
         return results
-    print(f"  NextCmd: no Markov transitions for '{query}'")
+    trace("  NextCmd: no transitions for %r", query)
     return []
 
-def recommend_templates(query, topk=5):
+def recommend_templates(query, model, topk=5):
     """Recommend similar PowerShell command templates"""
-    if not commands_list or not query.strip():
+    if not len(model) or not query.strip():
         return []
 
     try:
-        print(f"  Template: finding similar to '{query}'")
-        qv = vectorizer.transform([query])
-        sims = cosine_similarity(qv, vectorizer.transform(commands_list)).flatten()
-        idx = sims.argsort()[-topk:][::-1]
-        results = []
-        for i in idx:
-            if sims[i] > 0.05:
-                results.append((commands_list[i], float(sims[i])))
-
-        print(f"  Template: found {len(results)} similar commands")
+        trace("  Template: finding similar to %r", query)
+        results = [(cmd, sim) for cmd, sim in model.templates(query, topk) if sim > 0.05]
+
+        trace("  Template: found %d similar commands", len(results))
         return results
     except Exception as e:
         print(f"Template recommendation error: {e}")
         return []
 
-def rank_and_merge(query):
-    """Merge suggestions with PowerShell-specific logic"""
+def typo_fix_many(queries, model):
+    """typo_fix() for a batch of stripped, non-empty queries, fuzzy-scored together"""
+    if not len(model):
+        return [(None, 0.0)] * len(queries)
+    trace("  TypoFix: scoring %d queries", len(queries))
+    return [(match, score) if score > 0.60 else (None, 0.0) for match, score in model.typo_many(queries, 0.60)]
+
+def recommend_templates_many(queries, model, topk=5):
+    """recommend_templates() for a batch: one vectorization and one sparse product"""
+    if not len(model):
+        return [[] for _ in queries]
+    try:
+        trace("  Template: finding similar to %d queries", len(queries))
+        return [[(cmd, sim) for cmd, sim in row if sim > 0.05] for row in model.templates_many(queries, topk)]
+    except Exception as e:
+        print(f"Template recommendation error: {e}")
+        return [[] for _ in queries]
+
+def request_deadline(obj, received):
+    """time.monotonic() by which a request must be answered."""
+    ms = obj.get("deadline_ms")
+    if isinstance(ms, bool) or not isinstance(ms, (int, float)) or ms <= 0:
+        ms = DEFAULT_DEADLINE_MS
+    return received + max(0.0, ms - DEADLINE_MARGIN_MS) / 1000.0
+
+ENGINES = ("NextCmd", "TypoFixer", "Template", "Partial")
+# Engines whose results depend on the query and the model alone; result_cache
+# keeps these, while NextCmd is computed from each request's context
+CONTEXT_FREE = ("TypoFixer", "Template")
+
+def request_engines(obj):
+    """The engines a request asks for with "engines": [names]; all of them by default."""
+    names = obj.get("engines")
+    if not isinstance(names, list):
+        return ENGINES
+    return tuple(name for name in ENGINES if name in names)
+
+def timed(timings, name, fn, *args):
+    """fn(*args); with a timings dict, also records its run time there in microseconds."""
+    if timings is None:
+        return fn(*args)
+    t0 = time.perf_counter()
+    try:
+        return fn(*args)
+    finally:
+        timings[name] = round((time.perf_counter() - t0) * 1e6)
+
+def collect_engines(jobs, results, deadline):
+    """Wait for the engine futures in jobs until deadline; results holds the ones already computed."""
+    status = dict.fromkeys(results, "ok")
+    wait(jobs.values(), timeout=None if deadline is None else max(0.0, deadline - time.monotonic()))
+    for name, job in jobs.items():
+        if not job.done():
+            job.cancel()  # still queued: never starts; running: its result is dropped
+            results[name], status[name] = None, "late"
+        elif job.exception() is not None:
+            print(f"{name} engine error: {job.exception()}")
+            results[name], status[name] = None, "error"
+        else:
+            results[name], status[name] = job.result(), "ok"
+    return results, status
+
+def rank_and_merge(query, model, context=None, scope=None, deadline=None, key=None, wanted=ENGINES,
+                   timings=None):
+    """Merge suggestions with PowerShell-specific logic.
+
+    Returns (suggestions, {engine: "ok" | "late" | "error"}). Engines that miss
+    deadline (a time.monotonic() value; None waits for all) are left out. With a
+    cache key (cache_key()) the context-free engines' results come from, or go
+    into, result_cache; wanted limits the engines that run (request_engines()).
+    timings, a dict, gets the run time of every engine that ran (timed()).
+    """
     if not query or not query.strip():
-        return [{"source": "Info", "suggestion": "Type a command to get suggestions", "confidence": 0.0, "reason": "Empty input"}]
+        return [{"source": "Info", "suggestion": "Type a command to get suggestions", "confidence": 0.0, "reason": "Empty input"}], {}
 
     query = query.strip()
-    print(f"Processing query: '{query}'")
+    trace("Processing query: %r", query)
+
+    cacheable = key is not None and all(name in wanted for name in CONTEXT_FREE)
+    cached = result_cache.get(key) if cacheable else None
+    jobs = {}
+    if cached is None:
+        if "TypoFixer" in wanted:
+            jobs["TypoFixer"] = engine_pool.submit(timed, timings, "TypoFixer", typo_fix, query, model)
+        if "Template" in wanted:
+            jobs["Template"] = engine_pool.submit(timed, timings, "Template", recommend_templates, query, model, 5)
+    next_commands = (timed(timings, "NextCmd", predict_next, query, model, context or {})
+                     if "NextCmd" in wanted else [])
+    if cached is None:
+        results, status = collect_engines(jobs, {}, deadline)
+        cached = (results.get("TypoFixer") or (None, 0.0), results.get("Template") or [], status)
+        if cacheable and complete(status):
+            result_cache.put(key, cached)
+    return merge_cached(query, model, cached, next_commands, scope, deadline, wanted, timings)
+
+def merge_cached(query, model, cached, next_commands, scope, deadline, wanted=ENGINES, timings=None):
+    """(suggestions, engines) from a (typo, templates, engines) entry of result_cache and NextCmd's results."""
+    typo, templ, status = cached
+    engines = {"NextCmd": "ok", **status} if "NextCmd" in wanted else dict(status)
+    return merge_engines(query, model, typo, next_commands, templ, engines, scope, deadline,
+                         fallback="Partial" in wanted, timings=timings), engines
+
+def rank_many(queries, model, contexts, keys, scope=None, deadline=None):
+    """rank_and_merge() over a batch; TypoFixer and Template each score the batch's cache misses in one call."""
+    out = [None] * len(queries)
+    todo = []
+    for i, query in enumerate(queries):
+        if query and query.strip():
+            todo.append(i)
+        else:
+            out[i] = rank_and_merge(query, model)
+    if not todo:
+        return out
+    qs = {i: queries[i].strip() for i in todo}
+    cached = {i: result_cache.get(keys[i]) for i in todo}
+    misses = [i for i in todo if cached[i] is None]
+    trace("Processing batch of %d queries, %d not cached", len(todo), len(misses))
+    if misses:
+        miss_qs = [qs[i] for i in misses]
+        jobs = {"TypoFixer": engine_pool.submit(typo_fix_many, miss_qs, model),
+                "Template": engine_pool.submit(recommend_templates_many, miss_qs, model, 5)}
+    nexts = {i: predict_next(qs[i], model, contexts[i]) for i in todo}
+    if misses:
+        results, status = collect_engines(jobs, {}, deadline)
+        for n, i in enumerate(misses):
+            typo = results["TypoFixer"][n] if results["TypoFixer"] is not None else (None, 0.0)
+            templ = results["Template"][n] if results["Template"] is not None else []
+            cached[i] = (typo, templ, status)
+            if complete(status):
+                result_cache.put(keys[i], cached[i])
+    for i in todo:
+        out[i] = merge_cached(qs[i], model, cached[i], nexts[i], scope, deadline)
+    return out
 
-    typo_s, typo_conf = typo_fix(query)
-    next_commands = predict_next(query)
-    templ = recommend_templates(query, topk=5)
+def merge_engines(query, model, typo, next_commands, templ, engines, scope, deadline, fallback=True,
+                  timings=None):
+    """The final suggestion list from the engine results for a stripped query.
 
+    fallback=False skips the Partial search when nothing else matched (interim
+    session updates; see Session).
+    """
+    typo_s, typo_conf = typo
     items = []
 
     if typo_s and typo_conf > 0.6:
@@ -176,10 +471,17 @@ def rank_and_merge(query):
                 "reason": f"Similar to '{query}'"
             })
 
-    if not items and len(query) > 1:
-        print(f"  Fallback: searching for partial matches to '{query}'")
-        for cmd in known_cmds:
-            if query.lower() in cmd.lower() and cmd.lower() != query.lower():
+    if not items and len(query) > 1 and not fallback:
+        pass
+    elif not items and len(query) > 1 and deadline is not None and time.monotonic() >= deadline:
+        engines["Partial"] = "late"
+    elif not items and len(query) > 1:
+        trace("  Fallback: searching for partial matches to %r", query)
+        engines["Partial"] = "ok"
+        partial = (timed(timings, "Partial", partial_cache.containing, scope, query, 4, model.containing)
+                   if scope is not None else timed(timings, "Partial", model.containing, query, 4))
+        for cmd in partial:
+            if cmd.lower() != query.lower():
                 items.append({
                     "source": "Partial",
                     "suggestion": cmd,
@@ -197,78 +499,533 @@ def rank_and_merge(query):
 
     merged = sorted(seen.values(), key=lambda x: x["confidence"], reverse=True)
     result = merged[:5]
-    print(f"  Final: returning {len(result)} suggestions")
+    trace("  Final: returning %d suggestions (%s)", len(result), engines)
     return result
 
-def handle_conn(conn):
+def select_fields(suggestions, k, fields):
+    """The first k suggestions with only the requested fields (both optional)."""
+    if isinstance(k, int) and not isinstance(k, bool) and k >= 0:
+        suggestions = suggestions[:k]
+    if isinstance(fields, list):
+        suggestions = [{f: it[f] for f in fields if f in it} for it in suggestions]
+    return suggestions
+
+def handle_request(raw, received=None, uid=None):
+    """Answer one JSON request line (or a plain-text query from old clients)."""
+    trace("Received: %s", raw)
     try:
-        data = b""
-        conn.settimeout(1.0)
-        try:
-            while True:
-                chunk = conn.recv(4096)
-                if not chunk:
-                    break
-                data += chunk
-                if b"\n" in data:
-                    break
-        except socket.timeout:
-            pass
+        obj = json.loads(raw)
+    except Exception:
+        obj = None
+    return handle_message(obj if isinstance(obj, dict) else {"cmd": raw}, received, uid)
 
-        if not data:
-            conn.close()
-            return
+def request_context(obj):
+    """Optional context for next-command prediction."""
+    return {k: obj[k] for k in ("prev", "cwd", "status") if isinstance(obj.get(k), (str, int))}
+
+def model_snapshot(uid=None):
+    """(version, model, learner generation) that one request is answered from.
+
+    uid is the user whose socket the request came in on (shared daemon only).
+    """
+    version, model = models.current
+    if uid is not None and shards is not None:
+        shard = shards.get(uid)
+        if shard is not None:
+            return version, LearnedView(model, shard.learner), shard.generation()
+    if learner is None:
+        return version, model, 0
+    return version, LearnedView(model, learner), learner.generation
+
+def cache_key(query, model_used, version, generation):
+    """result_cache key of a query's context-free engine results (see CONTEXT_FREE)."""
+    return (query.strip(), model_used, version, generation)
+
+def complete(engines):
+    """Whether every engine in an {engine: status} map finished, so its results may be cached."""
+    return all(state == "ok" for state in engines.values())
 
-        raw = data.decode().strip()
-        print(f"Received: {raw}")
+def handle_batch(obj, received, uid=None):
+    """{"op":"batch","queries":[...]}: many queries in one round trip.
 
-        query = raw
-        model_req = None
+    A query is a string or an object with "cmd" and its own prev/cwd/status.
+    "model", "k", "fields" and "deadline_ms" apply to the whole batch; a batch
+    without deadline_ms waits for every engine. Results come back in query order
+    as {"suggestions", "engines"} and share the result cache with single requests.
+    """
+    queries = obj.get("queries")
+    if not isinstance(queries, list):
+        return {"op": "batch", "error": "queries must be a list"}
+    if len(queries) > MAX_BATCH:
+        return {"op": "batch", "error": f"at most {MAX_BATCH} queries per batch"}
+    texts, contexts = [], []
+    for q in queries:
+        cmd, ctx = (q.get("cmd", ""), request_context(q)) if isinstance(q, dict) else (q, {})
+        texts.append(cmd if isinstance(cmd, str) else str(cmd))
+        contexts.append(ctx)
+
+    version, model, generation = model_snapshot(uid)
+    model_used = obj.get("model") or DEFAULT_MODEL
+    keys = [cache_key(t, model_used, version, generation) for t in texts]
+    deadline = None
+    if "deadline_ms" in obj:
+        deadline = request_deadline(obj, time.monotonic() if received is None else received)
+    answers = rank_many(texts, model, contexts, keys, (version, generation), deadline)
+
+    k, fields = obj.get("k"), obj.get("fields")
+    return {"op": "batch", "model": model_used, "model_version": version,
+            "results": [{"suggestions": select_fields(resp, k, fields), "engines": engines}
+                        for resp, engines in answers]}
+
+def handle_message(obj, received=None, uid=None):
+    """Answer one decoded request; echoes the request "id" so clients can pipeline.
+
+    Optional "k" caps the number of suggestions and "fields" lists the keys kept in
+    each one, so clients only pay for the part of the answer they show. "engines"
+    reports which engines made it into the answer; one that missed the deadline
+    is "late", and such partial answers are not cached. "engines": [names] in
+    the request runs only those engines: a client that kept a line's context-free
+    suggestions (TypoFixer, Template) asks for ["NextCmd", "Partial"] alone.
+
+    For measuring the server (bench_pipeline.py): "timing": true adds
+    "engine_us", the run time of each engine that ran for this request, and
+    "cache": false answers without reading or filling the result and partial
+    caches. Both apply to single requests only, not to batches or sessions.
+    """
+    query = obj.get("cmd", "")
+    if not isinstance(query, str):
+        query = str(query)
+    model_req = obj.get("model")
+    req_id = obj.get("id")
+    op = obj.get("op")
+    context = request_context(obj)
+
+    if op == "reload":
         try:
-            obj = json.loads(raw)
-            if isinstance(obj, dict):
-                query = obj.get("cmd", "")
-                model_req = obj.get("model")
-        except Exception:
-            pass
+            response_payload = {"op": "reload", "model_version": models.reload()}
+        except Exception as e:
+            response_payload = {"op": "reload", "error": str(e), "model_version": models.current[0]}
+        return {"id": req_id, **response_payload} if req_id is not None else response_payload
+    if op == "stats":
+        response_payload = {"op": "stats", "cache": result_cache.stats(), "partial": partial_cache.stats()}
+        if shards is not None:
+            response_payload["shards"] = shards.stats()
+        return {"id": req_id, **response_payload} if req_id is not None else response_payload
+    if op == "batch":
+        response_payload = handle_batch(obj, received, uid)
+        return {"id": req_id, **response_payload} if req_id is not None else response_payload
+
+    version, model, generation = model_snapshot(uid)
+    model_used = model_req if model_req else DEFAULT_MODEL
+    cached = obj.get("cache") is not False
+    key = cache_key(query, model_used, version, generation) if cached else None
+    scope = (version, generation) if cached else None
+    timings = {} if obj.get("timing") is True else None
+    deadline = request_deadline(obj, time.monotonic() if received is None else received)
+    resp, engines = rank_and_merge(query, model, context, scope, deadline, key,
+                                   request_engines(obj), timings)
 
-        model_used = model_req if model_req else DEFAULT_MODEL
-        resp = rank_and_merge(query)
+    resp = select_fields(resp, obj.get("k"), obj.get("fields"))
+    response_payload = {"model": model_used, "model_version": version, "suggestions": resp, "engines": engines}
+    if timings is not None:
+        response_payload["engine_us"] = dict(timings)
+    if req_id is not None:
+        response_payload = {"id": req_id, **response_payload}
+    return response_payload
 
-        response_payload = {"model": model_used, "suggestions": resp}
-        response_data = (json.dumps(response_payload) + "\n").encode()
-        conn.sendall(response_data)
+# Connection handling: one asyncio event loop multiplexes every client socket and
+# hands the CPU-bound ranking to a fixed pool of worker threads. When MAX_PENDING
+# requests are already queued or running, new ones get an immediate "busy" answer
+# instead of waiting in line until the client gives up.
+BACKLOG = int(os.environ.get("SUGGEST_BACKLOG", "512"))
+WORKERS = int(os.environ.get("SUGGEST_WORKERS", str(min(8, os.cpu_count() or 2))))
+MAX_PENDING = int(os.environ.get("SUGGEST_MAX_PENDING", str(WORKERS * 8)))
+MAX_REQUEST_BYTES = wire.MAX_FRAME  # a JSON batch may be as large as a binary one
+BUSY_RETRY_MS = 50
 
+class LineFramer:
+    """Splits a byte stream into newline-terminated request lines.
+
+    Bytes are appended to one buffer and only scanned once; complete lines are cut
+    off the front. A line longer than limit raises ValueError.
+    """
+
+    def __init__(self, limit=MAX_REQUEST_BYTES):
+        self.buf = bytearray()
+        self.limit = limit
+        self.scanned = 0  # no newline before this offset
+
+    def feed(self, data):
+        self.buf += data
+        lines, start = [], 0
+        while True:
+            nl = self.buf.find(b"\n", max(start, self.scanned))
+            if nl < 0:
+                break
+            lines.append(bytes(self.buf[start:nl]))
+            start = nl + 1
+        if start:
+            del self.buf[:start]
+        self.scanned = len(self.buf)
+        if len(self.buf) > self.limit:
+            raise ValueError(f"request longer than {self.limit} bytes")
+        return lines
+
+    def flush(self):
+        """The partial line buffered so far (a last request the client ended with EOF)."""
+        line = bytes(self.buf)
+        self.buf.clear()
+        self.scanned = 0
+        return line
+
+# Worker-thread entry points: decode, answer and encode one request; never raise
+def answer_line(raw, received, uid=None):
+    try:
+        payload = handle_request(raw, received, uid)
     except Exception as e:
-        print(f"Error handling connection: {e}")
+        print(f"Error handling request: {e}")
+        payload = {"error": str(e)}
+    return (json.dumps(payload) + "\n").encode()
+
+def answer_frame(data, received, uid=None):
+    try:
+        obj = wire.unpack(data)
+        trace("Received frame: %s", obj)
+        payload = handle_message(obj, received, uid) if isinstance(obj, dict) else {"error": "request is not a map"}
+    except Exception as e:
+        print(f"Error handling request: {e}")
+        payload = {"error": str(e)}
+    return wire.frame(payload)
+
+def busy_response(msg, binary):
+    try:
+        obj = wire.unpack(msg) if binary else json.loads(msg)
+        req_id = obj.get("id") if isinstance(obj, dict) else None
+    except Exception:
+        req_id = None
+    payload = {"busy": True, "error": "server busy", "retry_after_ms": BUSY_RETRY_MS}
+    if req_id is not None:
+        payload = {"id": req_id, **payload}
+    return wire.frame(payload) if binary else (json.dumps(payload) + "\n").encode()
+
+def session_request(raw):
+    """The decoded line if it is a streaming session message (see Session), else None."""
+    if '"session"' not in raw and '"delta"' not in raw:
+        return None
+    try:
+        obj = json.loads(raw)
+    except Exception:
+        return None
+    return obj if isinstance(obj, dict) and obj.get("op") in ("session", "delta") else None
+
+class Session:
+    """Streaming completions for one JSON-line connection.
+
+    {"op":"session"} (with optional model, k, fields, prev, cwd) opens it. Each
+    edit of the client's input line is then sent as {"op":"delta","seq":n} that
+    drops "del" characters from the end of the text and appends "ins" ("text"
+    replaces it; prev/cwd/status update the context). For every delta the server
+    pushes {"op":"update","seq","text","engine","suggestions","engines","final"}:
+    the last answer first, narrowed to the new text when it only grew, then
+    a re-ranked list as each engine finishes. A newer delta cancels the refresh
+    in flight, so nothing is computed or sent for text the user already changed.
+    """
+
+    def __init__(self, writer, obj, uid=None):
+        self.writer = writer
+        self.uid = uid
+        self.model_used = obj.get("model") or DEFAULT_MODEL
+        self.context = request_context(obj)
+        self.k, self.fields = obj.get("k"), obj.get("fields")
+        self.text = ""
+        self.seq = 0
+        self.task = None
+        self.shown = ("", [])  # (query, full suggestions) of the last update
+
+    def opened(self, obj):
+        version = models.current[0]
+        ack = {"op": "session", "session": True, "model": self.model_used, "model_version": version}
+        return {"id": obj["id"], **ack} if obj.get("id") is not None else ack
+
+    def delta(self, obj):
+        if isinstance(obj.get("text"), str):
+            self.text = obj["text"]
+        else:
+            drop, ins = obj.get("del", 0), obj.get("ins", "")
+            if isinstance(drop, int) and drop > 0:
+                self.text = self.text[:-drop] if drop < len(self.text) else ""
+            if isinstance(ins, str):
+                self.text += ins
+        self.context.update(request_context(obj))
+        seq = obj.get("seq")
+        self.seq = seq if isinstance(seq, int) and not isinstance(seq, bool) else self.seq + 1
+        self.close()
+        self.task = asyncio.ensure_future(self.refresh(self.seq, self.text))
+
+    def close(self):
+        if self.task is not None:
+            self.task.cancel()
+            self.task = None
+
+    def push(self, seq, text, engine, suggestions, engines, final):
+        if suggestions or final:
+            self.shown = (text.strip(), suggestions)
+        payload = {"op": "update", "seq": seq, "text": text, "engine": engine,
+                   "suggestions": select_fields(suggestions, self.k, self.fields),
+                   "engines": engines, "final": final}
+        self.writer.write((json.dumps(payload) + "\n").encode())
+
+    async def refresh(self, seq, text):
+        query = text.strip()
+        if not query:
+            self.push(seq, text, None, [], {}, True)
+            return
+        version, model, generation = model_snapshot(self.uid)
+        key = cache_key(query, self.model_used, version, generation)
+        scope = (version, generation)
+        loop = asyncio.get_running_loop()
+        context = dict(self.context)
+        cached = result_cache.get(key)
+        if cached is not None:
+            resp, engines = await loop.run_in_executor(
+                engine_pool, lambda: merge_cached(query, model, cached, predict_next(query, model, context), scope, None))
+            self.push(seq, text, "cache", resp, engines, True)
+            return
+        last_query, last = self.shown
+        q = query.lower()
+        if last and last_query and q.startswith(last_query.lower()):
+            self.push(seq, text, "narrowed", [it for it in last if q in it["suggestion"].lower()], {}, False)
+
+        jobs = {loop.run_in_executor(engine_pool, typo_fix, query, model): "TypoFixer",
+                loop.run_in_executor(engine_pool, predict_next, query, model, context): "NextCmd",
+                loop.run_in_executor(engine_pool, recommend_templates, query, model, 5): "Template"}
+        results = dict.fromkeys(jobs.values())
+        engines = {}
+        pending = set(jobs)
         try:
-            error_resp = json.dumps({"error": str(e)}) + "\n"
-            conn.sendall(error_resp.encode())
-        except:
-            pass
-    finally:
+            while pending:
+                done, pending = await asyncio.wait(pending, return_when=asyncio.FIRST_COMPLETED)
+                for job in done:
+                    try:
+                        results[jobs[job]], engines[jobs[job]] = job.result(), "ok"
+                    except Exception as e:
+                        print(f"{jobs[job]} engine error: {e}")
+                        engines[jobs[job]] = "error"
+                merged = (query, model, results["TypoFixer"] or (None, 0.0), results["NextCmd"] or [],
+                          results["Template"] or [])
+                if pending:
+                    interim = merge_engines(*merged, dict(engines), None, None, fallback=False)
+                    if interim:  # an empty list would only hide the narrowed one
+                        self.push(seq, text, jobs[next(iter(done))], interim, dict(engines), False)
+            resp = await loop.run_in_executor(engine_pool, merge_engines, *merged, engines, scope, None)
+        finally:
+            for job in pending:
+                job.cancel()
+        status = {name: engines.get(name) for name in CONTEXT_FREE}
+        if complete(status):
+            result_cache.put(key, (results["TypoFixer"] or (None, 0.0), results["Template"] or [], status))
+        self.push(seq, text, jobs[next(iter(done))], resp, engines, True)
+
+def is_hello(raw):
+    """The client's request to switch this connection to binary frames (wire.py)."""
+    if '"hello"' not in raw:
+        return False
+    try:
+        obj = json.loads(raw)
+    except Exception:
+        return False
+    return isinstance(obj, dict) and obj.get("op") == "hello" and obj.get("proto") == wire.PROTO
+
+class ServerCore:
+    def __init__(self):
+        self.pool = ThreadPoolExecutor(max_workers=WORKERS, thread_name_prefix="rank")
+        self.pending = 0  # requests in the pool; only touched on the event loop thread
+        self.busy_replies = 0
+
+    async def answer(self, msg, binary, uid=None):
+        """Encoded response to one JSON line (str) or frame payload (bytes) from user uid's socket."""
+        if self.pending >= MAX_PENDING:
+            self.busy_replies += 1
+            return busy_response(msg, binary)
+        self.pending += 1
         try:
-            conn.close()
-        except:
-            pass
+            return await asyncio.get_running_loop().run_in_executor(
+                self.pool, answer_frame if binary else answer_line, msg, time.monotonic(), uid)
+        finally:
+            self.pending -= 1
+
+    async def handle_client(self, reader, writer, uid=None):
+        """Serve one (possibly long-lived) connection.
+
+        Each newline-terminated request gets one response line, in order; the
+        connection stays open until the client closes it. A request without a
+        trailing newline is only answered once the client has closed its end, so
+        a pause in the middle of a line is never taken for its end.
+        After a hello (see wire.py) requests and responses are binary frames.
+        uid is the user a per-user socket belongs to (None on shared listeners).
+        """
+        trace("Connection from %s", writer.get_extra_info('peername') or writer.get_extra_info('sockname'))
+        framer = LineFramer()
+        frames = None  # wire.FrameReader once the connection is binary
+        session = None
+        try:
+            while True:
+                if frames is not None:
+                    data = await reader.read(65536)
+                    for msg in frames.feed(data):
+                        writer.write(await self.answer(msg, True, uid))
+                    await writer.drain()
+                    if not data:
+                        break
+                    continue
+                data = await reader.read(65536)
+                lines = framer.feed(data) if data else [framer.flush()]
+                for line in lines:
+                    raw = line.decode(errors="replace").strip()
+                    if frames is not None:
+                        break  # the client waits for the hello answer, nothing may follow it
+                    if is_hello(raw):
+                        writer.write((json.dumps({"op": "hello", "proto": wire.PROTO}) + "\n").encode())
+                        frames = wire.FrameReader()
+                        for msg in frames.feed(framer.flush()):
+                            writer.write(await self.answer(msg, True, uid))
+                    elif raw:
+                        obj = session_request(raw)
+                        if obj is None:
+                            writer.write(await self.answer(raw, False, uid))
+                        elif obj["op"] == "session":
+                            if session is not None:
+                                session.close()
+                            session = Session(writer, obj, uid)
+                            writer.write((json.dumps(session.opened(obj)) + "\n").encode())
+                        elif session is not None:
+                            session.delta(obj)
+                        else:
+                            writer.write((json.dumps({"op": "delta", "error": "no session"}) + "\n").encode())
+                await writer.drain()
+                if not data:
+                    break
+        except ValueError as e:
+            err = {"error": str(e)}
+            writer.write(wire.frame(err) if frames is not None else (json.dumps(err) + "\n").encode())
+        except (ConnectionError, OSError) as e:
+            print(f"Error handling connection: {e}")
+        finally:
+            if session is not None:
+                session.close()
+            try:
+                writer.close()
+            except Exception:
+                pass
+
+    async def serve(self, listeners):
+        """listeners: [(socket, uid of the user it serves or None)]"""
+        servers = []
+        for sock, uid in listeners:
+            handler = functools.partial(self.handle_client, uid=uid)
+            if hasattr(socket, "AF_UNIX") and sock.family == socket.AF_UNIX:
+                servers.append(await asyncio.start_unix_server(handler, sock=sock, limit=MAX_REQUEST_BYTES))
+            else:
+                servers.append(await asyncio.start_server(handler, sock=sock, limit=MAX_REQUEST_BYTES))
+        await asyncio.gather(*(srv.serve_forever() for srv in servers))
+
+def open_unix_listener(path, owner=None):
+    """Listen on the Unix domain socket the C shell tries first; None where unsupported.
+
+    owner=(uid, gid) hands the socket to that user (needs root), so only they can connect.
+    """
+    if not hasattr(socket, "AF_UNIX"):
+        return None
+    try:
+        if os.path.exists(path):
+            os.unlink(path)  # stale socket from a previous run
+        server = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        server.bind(path)
+        os.chmod(path, 0o600)
+        if owner is not None:
+            os.chown(path, *owner)
+        server.listen(BACKLOG)
+        return server
+    except OSError as e:
+        print(f"Unix socket {path} unavailable: {e}")
+        return None
+
+def open_user_listeners(users):
+    """[(listener, uid)] for the shared daemon: SOCKET_DIR/<uid>.sock per user."""
+    try:
+        os.makedirs(SOCKET_DIR, mode=0o755, exist_ok=True)
+        st = os.lstat(SOCKET_DIR)
+    except OSError as e:
+        print(f"Socket directory {SOCKET_DIR} unavailable: {e}")
+        return []
+    if st.st_uid != os.geteuid() or st.st_mode & 0o022:
+        # whoever else can write here could swap a user's socket for their own
+        print(f"Socket directory {SOCKET_DIR} must be owned by this user and not group/world writable")
+        return []
+    listeners = []
+    for name, uid, gid, _ in users:
+        if uid != os.geteuid() and os.geteuid() != 0:
+            print(f"Skipping {name}: only root can serve other users' sockets")
+            continue
+        path = os.path.join(SOCKET_DIR, f"{uid}.sock")
+        sock = open_unix_listener(path, (uid, gid) if uid != os.geteuid() else None)
+        if sock:
+            listeners.append((sock, uid))
+            print(f"Serving {name} on {path}")
+    return listeners
 
 def run_server():
-    server = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
-    server.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
-    server.bind((HOST, PORT))
-    server.listen(5)
-    print(f"Suggestion server listening on {HOST}:{PORT} (default model: {DEFAULT_MODEL})")
+    listeners = []
+    if PORT:
+        server = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        server.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        server.bind((HOST, PORT))
+        server.listen(BACKLOG)
+        listeners.append((server, None))
+        print(f"Suggestion server listening on {HOST}:{PORT} (default model: {DEFAULT_MODEL}, "
+              f"{WORKERS} workers, {ENGINE_WORKERS} engine threads, backlog {BACKLOG}, "
+              f"busy above {MAX_PENDING} pending)")
+    else:
+        print(f"Suggestion server without TCP (default model: {DEFAULT_MODEL}, "
+              f"{WORKERS} workers, {ENGINE_WORKERS} engine threads, backlog {BACKLOG}, "
+              f"busy above {MAX_PENDING} pending)")
+    if VERBOSE:
+        threading.Thread(target=trace_printer, daemon=True).start()
+    if RELOAD_INTERVAL > 0:
+        threading.Thread(target=models.watch, daemon=True).start()
+    if learner is not None:
+        print(f"Learning from {HISTORY_DB} every {HISTORY_POLL:g}s")
+        threading.Thread(target=learner.run, args=(HISTORY_POLL,), daemon=True).start()
+    unix_paths = []
+    if USERS:
+        user_listeners = open_user_listeners(shared_users)
+        listeners += user_listeners
+        unix_paths += [sock.getsockname() for sock, _ in user_listeners]
+        if shards is not None:
+            print(f"Learning from {USER_HISTORY} of {len(shared_users)} users every {HISTORY_POLL:g}s, "
+                  f"at most {SHARD_MEMORY_MB:g} MB")
+            threading.Thread(target=shards.run, args=(HISTORY_POLL,), daemon=True).start()
+    else:
+        unix_server = open_unix_listener(SOCKET_PATH)
+        if unix_server:
+            print(f"Suggestion server listening on {SOCKET_PATH}")
+            listeners.append((unix_server, None))
+            unix_paths.append(SOCKET_PATH)
+    if not listeners:
+        print("Nothing to listen on")
+        return
     try:
-        while True:
-            conn, addr = server.accept()
-            print(f"Connection from {addr}")
-            t = threading.Thread(target=handle_conn, args=(conn,))
-            t.daemon = True
-            t.start()
+        asyncio.run(ServerCore().serve(listeners))
     except KeyboardInterrupt:
         print("Shutting down server...")
     finally:
-        server.close()
+        for sock, _ in listeners:
+            sock.close()
+        for path in unix_paths:
+            try:
+                os.unlink(path)
+            except OSError:
+                pass
 
 if __name__ == "__main__":
     run_server()
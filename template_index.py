@@ -0,0 +1,87 @@
+# template_index.py
+"""Precomputed TF-IDF index for the template recommender.
+
+The corpus is vectorized once: rows are L2-normalized so a dot product is the
+cosine similarity, and the matrix is kept transposed (term -> documents, CSR)
+so a query only touches the posting lists of its own terms. Top-k is taken with
+argpartition over the non-zero similarities instead of sorting the whole corpus.
+
+train_from_csv.py saves the matrix next to the vectorizer (tfidf_matrix.npz);
+the server loads it and only vectorizes commands that are not covered yet.
+"""
+import os
+
+import numpy as np
+from scipy import sparse
+from sklearn.preprocessing import normalize
+
+MATRIX_FILE = "tfidf_matrix.npz"
+
+
+def build_matrix(vectorizer, commands):
+    """Vectorize commands into an L2-normalized CSR matrix (one row per command)."""
+    X = vectorizer.transform(commands) if commands else sparse.csr_matrix((0, len(vectorizer.vocabulary_)))
+    return normalize(sparse.csr_matrix(X, dtype=np.float32), norm="l2", copy=False)
+
+
+def save_matrix(path, X):
+    sparse.save_npz(path, normalize(sparse.csr_matrix(X, dtype=np.float32), norm="l2"), compressed=False)
+
+
+class TemplateIndex:
+    def __init__(self, vectorizer, commands, matrix=None):
+        self.vectorizer = vectorizer
+        self.commands = commands
+        vocab = len(vectorizer.vocabulary_)
+        if matrix is None or matrix.shape[1] != vocab or matrix.shape[0] > len(commands):
+            matrix = build_matrix(vectorizer, commands)
+        elif matrix.shape[0] < len(commands):
+            # commands appended after training (e.g. the server's extra commands)
+            tail = build_matrix(vectorizer, commands[matrix.shape[0]:])
+            matrix = sparse.vstack([matrix, tail], format="csr")
+        self.matrix = matrix
+        self.postings = matrix.T.tocsr()
+
+    @classmethod
+    def load(cls, vectorizer, commands, models_dir):
+        """Use the trained matrix if there is one; otherwise build it now."""
+        path = os.path.join(models_dir, MATRIX_FILE)
+        matrix = None
+        if os.path.exists(path):
+            try:
+                matrix = sparse.load_npz(path).tocsr()
+            except Exception as e:
+                print(f"Ignoring {path}: {e}")
+        return cls(vectorizer, commands, matrix)
+
+    def search(self, query, topk=5):
+        """[(command, cosine)] for the topk most similar commands, best first."""
+        qv = normalize(self.vectorizer.transform([query]), norm="l2")
+        if qv.nnz == 0 or self.matrix.shape[0] == 0:
+            return []
+        row = (qv @ self.postings).tocsr()  # 1 x N, non-zero only where a term is shared
+        idx, sims = row.indices, row.data
+        if len(sims) > topk:
+            part = np.argpartition(-sims, topk - 1)[:topk]
+            idx, sims = idx[part], sims[part]
+        order = np.argsort(-sims)
+        return [(self.commands[idx[i]], float(sims[i])) for i in order]
+
+    def search_many(self, queries, topk=5):
+        """search() for each of queries: one transform and one sparse product for the batch."""
+        if not queries:
+            return []
+        if self.matrix.shape[0] == 0:
+            return [[] for _ in queries]
+        Q = normalize(self.vectorizer.transform(queries), norm="l2")
+        S = (Q @ self.postings).tocsr()  # len(queries) x N
+        out = []
+        for r in range(len(queries)):
+            lo, hi = S.indptr[r], S.indptr[r + 1]
+            idx, sims = S.indices[lo:hi], S.data[lo:hi]
+            if len(sims) > topk:
+                part = np.argpartition(-sims, topk - 1)[:topk]
+                idx, sims = idx[part], sims[part]
+            order = np.argsort(-sims)
+            out.append([(self.commands[idx[i]], float(sims[i])) for i in order])
+        return out
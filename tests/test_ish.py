@@ -0,0 +1,268 @@
+# tests/test_ish.py
+"""The C shell end to end: `ish -c` quoting and exit status, and the escaping of
+the hint requests an interactive shell sends to the suggestion server.
+
+The shell is built from core.c into a temporary directory (CC, default cc,
+needs SQLite), or taken from ISH when that names a built binary. Every run gets
+its own ISH_HISTORY_DB, so the user's history is never touched.
+"""
+import atexit
+import json
+import os
+import select
+import shutil
+import socket
+import subprocess
+import tempfile
+import threading
+import time
+import unittest
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+ROOT = os.path.dirname(HERE)
+
+_build = {}
+
+
+def ish_binary():
+    """Path of the shell under test, or None (with the reason in _build) if it cannot be built."""
+    if "path" in _build:
+        return _build["path"]
+    path = os.environ.get("ISH")
+    if not path:
+        cc = os.environ.get("CC", "cc")
+        if shutil.which(cc) is None:
+            _build.update(path=None, error=f"{cc} not found")
+            return None
+        build_dir = tempfile.mkdtemp(prefix="ish_test.")
+        atexit.register(shutil.rmtree, build_dir, ignore_errors=True)  # shared by the other shell tests
+        path = os.path.join(build_dir, "ish")
+        proc = subprocess.run([cc, "-std=gnu11", "-O1", os.path.join(ROOT, "core.c"), "-o", path,
+                               "-lsqlite3", "-lm"], capture_output=True, text=True)
+        if proc.returncode != 0:
+            _build.update(path=None, error=f"cannot build core.c: {proc.stderr.strip()[-300:]}")
+            return None
+    _build["path"] = path
+    return path
+
+
+class ShellTestCase(unittest.TestCase):
+    def setUp(self):
+        self.ish = ish_binary()
+        if self.ish is None:
+            self.skipTest(_build["error"])
+        tmp = tempfile.TemporaryDirectory(prefix="ish_test.")
+        self.addCleanup(tmp.cleanup)
+        self.tmp = tmp.name
+        self.env = dict(os.environ, HOME=self.tmp, ISH_HISTORY_DB=os.path.join(self.tmp, "commands.db"),
+                        ISH_NATIVE="0", ISH_SUGGEST_ENDPOINT=os.path.join(self.tmp, "none.sock"))
+        self.env.pop("ISH_STATS_FILE", None)
+
+    def run_c(self, commands):
+        """(exit status, stdout, stderr) of `ish -c commands` in the scratch directory."""
+        proc = subprocess.run([self.ish, "-c", commands], cwd=self.tmp, env=self.env,
+                              stdin=subprocess.DEVNULL, capture_output=True, text=True, timeout=30)
+        return proc.returncode, proc.stdout, proc.stderr
+
+
+class QuotingTest(ShellTestCase):
+    def words(self, line):
+        status, out, err = self.run_c("printf '[%s]' " + line)
+        self.assertEqual((status, err), (0, ""))
+        return out
+
+    def test_quotes_group_words(self):
+        self.assertEqual(self.words("'a  b' \"c d\" e\\ f"), "[a  b][c d][e f]")
+        self.assertEqual(self.words("'' \"\" a''b 'x'\"y\"z"), "[][][ab][xyz]")
+
+    def test_backslashes(self):
+        self.assertEqual(self.words('"x\\"y" "a\\\\b" a\\\\b'), '[x"y][a\\b][a\\b]')
+        self.assertEqual(self.words("'q\\n' 'it\\'"), "[q\\n][it\\]")  # nothing is special in single quotes
+
+    def test_blanks(self):
+        self.assertEqual(self.words("a\tb  \t c"), "[a][b][c]")
+        self.assertEqual(self.words("'a\tb' \"c\td\""), "[a\tb][c\td]")
+
+    def test_comments(self):
+        self.assertEqual(self.run_c("echo a # b c")[1], "a\n")
+        self.assertEqual(self.run_c("echo 'a # b' x#y")[1], "a # b x#y\n")
+
+    def test_operators(self):
+        self.assertEqual(self.run_c("echo one two | wc -w")[1].strip(), "2")
+        self.assertEqual(self.run_c("echo hi > f; cat < f; echo more >> f; cat f")[1], "hi\nhi\nmore\n")
+        self.assertEqual(self.words("'a|b' \"c;d\" 'e>f'"), "[a|b][c;d][e>f]")
+
+    def test_unterminated_quote(self):
+        status, out, err = self.run_c("echo 'open\necho next")
+        self.assertIn("unterminated", err)
+        self.assertEqual(out, "next\n")  # only the bad line is skipped
+
+    def test_history_keeps_the_line_as_typed(self):
+        line = "printf '%s\\n' \"a\tb\" # note"
+        status, out, _ = self.run_c(f"{line}\nhistory 1")
+        self.assertEqual(status, 0)
+        self.assertEqual(out.splitlines()[0], "a\tb")
+        self.assertTrue(out.splitlines()[1].endswith("  " + line), out)
+
+
+class ExitStatusTest(ShellTestCase):
+    def test_last_line(self):
+        self.assertEqual(self.run_c("true")[0], 0)
+        self.assertEqual(self.run_c("false")[0], 1)
+        self.assertEqual(self.run_c("false\ntrue")[0], 0)
+        self.assertEqual(self.run_c("true\nfalse")[0], 1)
+        self.assertEqual(self.run_c("sh -c 'exit 7'")[0], 7)
+
+    def test_pipeline_is_its_last_stage(self):
+        self.assertEqual(self.run_c("false | true")[0], 0)
+        self.assertEqual(self.run_c("true | false")[0], 1)
+
+    def test_exit_builtin(self):
+        self.assertEqual(self.run_c("exit 3\necho not reached"), (3, "", ""))
+        self.assertEqual(self.run_c("false\nexit")[0], 1)
+        self.assertEqual(self.run_c("exit 257")[0], 1)
+
+    def test_failures_of_the_shell_itself(self):
+        status, _, err = self.run_c("no-such-command-ish")
+        self.assertEqual(status, 127)
+        self.assertIn("command not found", err)
+        self.assertEqual(self.run_c("cd /nonexistent-ish")[0], 1)
+        proc = subprocess.run([self.ish, os.path.join(self.tmp, "missing.sh")], env=self.env,
+                              capture_output=True, timeout=30)
+        self.assertEqual(proc.returncode, 127)
+
+    def test_status_is_recorded_in_history(self):
+        status, out, _ = self.run_c("sh -c 'exit 5'\ntrue\nhistory --slowest 2")
+        self.assertEqual(status, 0)
+        # id, ts (2 words), wall, user, sys, rss, in, out, exit, command
+        rows = {line.split("  ")[-1]: line.split()[9] for line in out.splitlines()[1:]}
+        self.assertEqual(rows, {"sh -c 'exit 5'": "5", "true": "0"})
+
+
+class FakeServer:
+    """A JSON-lines suggestion server on a Unix socket that keeps every request it reads.
+
+    Like suggestion_server.py it rejects lines that are not strict JSON, such as
+    strings holding raw control characters.
+    """
+
+    def __init__(self, path):
+        self.engines = {}  # the "engines" map of every answer
+        self.requests = []
+        self.rejected = []
+        self.cond = threading.Condition()
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.sock.bind(path)
+        self.sock.listen(4)
+        threading.Thread(target=self._serve, daemon=True).start()
+
+    def _serve(self):
+        while True:
+            try:
+                conn, _ = self.sock.accept()
+            except OSError:
+                return
+            threading.Thread(target=self._conn, args=(conn,), daemon=True).start()
+
+    def _conn(self, conn):
+        buf = b""
+        with conn:
+            while True:
+                try:
+                    data = conn.recv(65536)
+                except OSError:
+                    return
+                if not data:
+                    return
+                buf += data
+                while b"\n" in buf:
+                    line, buf = buf.split(b"\n", 1)
+                    try:
+                        req = json.loads(line)
+                    except ValueError:
+                        with self.cond:
+                            self.rejected.append(line)
+                            self.cond.notify_all()
+                        continue
+                    answer = {"id": req.get("id"), "suggestions": [], "engines": self.engines}
+                    if req.get("op") == "hello":
+                        answer = {"op": "hello", "error": "unknown op"}  # stay on JSON lines
+                    else:
+                        with self.cond:
+                            self.requests.append(req)
+                            self.cond.notify_all()
+                    conn.sendall((json.dumps(answer) + "\n").encode())
+
+    def wait(self, n, timeout=10.0):
+        """The first n requests (or what arrived before timeout)."""
+        with self.cond:
+            self.cond.wait_for(lambda: len(self.requests) + len(self.rejected) >= n, timeout)
+            return list(self.requests)
+
+    def close(self):
+        self.sock.close()
+
+
+@unittest.skipUnless(hasattr(os, "openpty") and hasattr(socket, "AF_UNIX"), "needs a pty and Unix sockets")
+class HintRequestTest(ShellTestCase):
+    """Interactive lines are sent as hint requests; their text must arrive intact."""
+
+    def setUp(self):
+        super().setUp()
+        sock_path = os.path.join(self.tmp, "suggest.sock")
+        self.server = FakeServer(sock_path)
+        self.addCleanup(self.server.close)
+        self.env.update(ISH_SUGGEST_ENDPOINT="unix:" + sock_path, ISH_SUGGEST_PROTO="json")
+
+    def type_lines(self, lines):
+        master, slave = os.openpty()
+        proc = subprocess.Popen([self.ish], cwd=self.tmp, env=self.env, stdin=slave, stdout=slave,
+                                stderr=slave, start_new_session=True)
+        os.close(slave)
+        self.addCleanup(os.close, master)
+        try:
+            for i, line in enumerate(lines):
+                os.write(master, line.encode() + b"\n")
+                self.server.wait(i + 1)
+                self._drain(master, 0.1)
+            os.write(master, b"exit\n")
+            deadline = time.monotonic() + 10
+            while proc.poll() is None and time.monotonic() < deadline:
+                self._drain(master, 0.1)
+        finally:
+            if proc.poll() is None:
+                proc.kill()
+            proc.wait()
+
+    @staticmethod
+    def _drain(fd, timeout):
+        while select.select([fd], [], [], timeout)[0]:
+            try:
+                if not os.read(fd, 65536):
+                    return
+            except OSError:
+                return
+
+    def test_control_characters_quotes_and_utf8(self):
+        lines = ["echo a\tb", 'printf "%s" \'x"y\\z\'', "echo café ☃ # note"]
+        self.type_lines(lines)
+        self.assertEqual(self.server.rejected, [])
+        requests = self.server.wait(len(lines) + 1)
+        self.assertEqual([r["cmd"] for r in requests[:3]], ["echo a\tb", 'printf "%s" \'x"y\\z\'',
+                                                           "echo café ☃"])
+        # prev is the whole logged line, comment included
+        self.assertEqual([r.get("prev") for r in requests[1:4]], lines)
+        self.assertEqual(requests[1]["cwd"], os.path.realpath(self.tmp))
+
+    def test_cache_hit_asks_for_the_context_engines_only(self):
+        self.type_lines(["true", "true"])
+        self.assertEqual([r.get("engines") for r in self.server.wait(2)[:2]], [None, ["NextCmd", "Partial"]])
+
+    def test_partial_answers_are_not_cached(self):
+        self.server.engines = {"NextCmd": "ok", "TypoFixer": "late", "Template": "ok", "Partial": "error"}
+        self.type_lines(["true", "true"])
+        self.assertEqual([r.get("engines") for r in self.server.wait(2)[:2]], [None, None])
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,178 @@
+# tests/test_ngram_model.py
+"""ngram_model.py: context keys, NgramCounts, CompactNgrams and stupid backoff."""
+import os
+import sys
+import tempfile
+import unittest
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, os.path.dirname(HERE))
+
+try:
+    import numpy
+except ImportError:
+    numpy = None
+
+if numpy is not None:
+    import ngram_model
+    from ngram_model import BACKOFF, NgramCounts, context_keys, predict, state_hash
+
+
+@unittest.skipIf(numpy is None, "numpy is not installed")
+class ContextKeysTest(unittest.TestCase):
+    def test_most_specific_first(self):
+        self.assertEqual([level for level, _ in context_keys("b", "a", "/tmp", 0)],
+                         ["p3c", "p3", "c2s", "c2c", "c2"])
+        self.assertEqual(context_keys("b", "a", "/tmp", 0)[0], ("p3c", ("a", "b", "/tmp")))
+
+    def test_optional_features(self):
+        self.assertEqual(context_keys("b"), [("c2", ("b",))])
+        self.assertEqual(context_keys("b", status=0), [("c2s", ("b", "ok")), ("c2", ("b",))])
+        self.assertEqual(context_keys("b", status=2)[0], ("c2s", ("b", "fail")))
+        self.assertEqual([level for level, _ in context_keys("b", "a")], ["p3", "c2"])
+
+    def test_state_hash(self):
+        h = state_hash("c2", ("git status",))
+        self.assertEqual(h, state_hash("c2", ("git status",)))  # stable: stored in files
+        self.assertEqual(h & 1, 1)  # never 0, the empty slot
+        self.assertLess(h, 1 << 64)
+        self.assertNotEqual(h, state_hash("c2c", ("git status",)))
+        self.assertNotEqual(state_hash("p3", ("a b", "c")), state_hash("p3", ("a", "b c")))
+
+
+@unittest.skipIf(numpy is None, "numpy is not installed")
+class NgramCountsTest(unittest.TestCase):
+    def test_predict_ranks_by_probability(self):
+        counts = NgramCounts()
+        for nxt, w in (("git push", 3.0), ("git log", 1.0)):
+            counts.add(nxt, "git commit", weight=w)
+        self.assertEqual(predict([counts.compile()], "git commit"), [("git push", 0.75), ("git log", 0.25)])
+        self.assertEqual(predict([counts.compile()], "git commit", k=1), [("git push", 0.75)])
+
+    def test_backoff_scales_less_specific_levels(self):
+        counts = NgramCounts()
+        counts.add("make test", "make", prev="vim Makefile")
+        counts.add("make install", "make", prev="git pull")
+        store = counts.compile()
+        got = dict(predict([store], "make", prev="vim Makefile"))
+        self.assertAlmostEqual(got["make test"], 1.0)  # p3 hit
+        self.assertAlmostEqual(got["make install"], 0.5 * BACKOFF, places=6)  # c2 only, one level down
+        # no p3 state for this prev: c2 is the first hit and is not scaled
+        got = dict(predict([store], "make", prev="ls"))
+        self.assertAlmostEqual(got["make test"], 0.5)
+        self.assertAlmostEqual(got["make install"], 0.5)
+
+    def test_status_context(self):
+        counts = NgramCounts()
+        counts.add("make clean", "make", status=2)
+        counts.add("make clean", "make", status=2)
+        counts.add("./run", "make", status=0)
+        top = predict([counts.compile()], "make", status=1)
+        self.assertEqual(top[0], ("make clean", 1.0))
+
+    def test_unknown_context(self):
+        counts = NgramCounts()
+        counts.add("b", "a")
+        self.assertEqual(predict([counts.compile()], "x"), [])
+        self.assertEqual(predict([NgramCounts().compile()], "a"), [])
+        self.assertEqual(len(NgramCounts().compile()), 0)
+
+    def test_stores_merge_keeping_the_best_score(self):
+        one, two = NgramCounts(), NgramCounts()
+        one.add("b", "a", weight=1.0)
+        one.add("c", "a", weight=3.0)
+        two.add("b", "a", weight=1.0)
+        self.assertEqual(predict([one.compile(), two.compile()], "a"), [("b", 1.0), ("c", 0.75)])
+
+    def test_add_sequence_skips_failed_and_repeated_targets(self):
+        counts = NgramCounts()
+        counts.add_sequence([("make", "/src", 0), ("make", "/src", 0), ("./bad", "/src", 1),
+                             ("make test", "/src", 0)])
+        store = counts.compile()
+        self.assertEqual(predict([store], "make"), [])  # "make" repeated, "./bad" failed
+        self.assertEqual(predict([store], "./bad", prev="make", cwd="/src", status=1)[0][0], "make test")
+
+    def test_prune_keeps_the_heaviest_states_and_entries(self):
+        counts = NgramCounts(max_states=2)
+        for i in range(5):
+            counts.add("next", f"cmd{i}", weight=float(i + 1))
+        self.assertEqual(len(counts), 2)  # pruned once it passed twice the cap
+        store = counts.compile()
+        self.assertEqual(predict([store], "cmd4"), [("next", 1.0)])
+        self.assertEqual(predict([store], "cmd0"), [])
+
+        wide = NgramCounts()
+        for i in range(ngram_model.MAX_ROW + 5):
+            wide.add(f"n{i}", "a", weight=float(i + 1))
+        wide.prune()
+        (row,) = wide.rows.values()
+        self.assertEqual(len(row), ngram_model.MAX_ROW)
+        self.assertNotIn("n0", row)
+
+    def test_decay_drops_faded_entries_and_empty_states(self):
+        counts = NgramCounts()
+        counts.add("b", "a", weight=1.0)
+        counts.add("c", "a", weight=0.1)
+        counts.add("e", "d", weight=0.1)
+        self.assertEqual(counts.decay(0.5, 0.1), 2)
+        self.assertEqual(len(counts), 1)
+        (h,) = counts.rows
+        self.assertEqual(counts.rows[h], {"b": 0.5})
+        self.assertAlmostEqual(counts.totals[h], 0.55)  # the total keeps the dropped share
+        self.assertEqual(predict([counts.compile()], "d"), [])
+
+    def test_compile_keeps_topk_per_state(self):
+        counts = NgramCounts()
+        for i, w in enumerate((5.0, 4.0, 3.0, 2.0)):
+            counts.add(f"n{i}", "a", weight=w)
+        store = counts.compile(topk=2)
+        self.assertEqual([cmd for cmd, _ in predict([store], "a", k=5)], ["n0", "n1"])
+        self.assertAlmostEqual(predict([store], "a")[0][1], 5.0 / 14.0, places=6)
+
+    def test_lookup_probes_past_collisions(self):
+        counts = NgramCounts()
+        for i in range(200):
+            counts.add(f"next{i}", f"cmd{i}")
+        store = counts.compile()
+        self.assertEqual(len(store), 200)
+        self.assertGreaterEqual(len(store.keys), 400)
+        for i in range(200):
+            self.assertEqual(predict([store], f"cmd{i}"), [(f"next{i}", 1.0)])
+
+    def test_save_and_load(self):
+        counts = NgramCounts()
+        counts.add("git push", "git commit", prev="git add .", cwd="/src")
+        counts.add("ls -l", "cd ..")
+        store = counts.compile()
+        with tempfile.TemporaryDirectory() as tmp:
+            self.assertIsNone(ngram_model.open_store(tmp))
+            store.save(os.path.join(tmp, ngram_model.MODEL_FILE))
+            loaded = ngram_model.open_store(tmp)
+        self.assertEqual(loaded.names, store.names)
+        for args in (("git commit", "git add .", "/src"), ("cd ..",), ("nothing",)):
+            self.assertEqual(predict([loaded], *args), predict([store], *args))
+
+
+@unittest.skipIf(numpy is None, "numpy is not installed")
+class SessionsTest(unittest.TestCase):
+    def test_split_at_gaps(self):
+        gap = ngram_model.SESSION_GAP
+        rows = [("a", 0, "/", 0), (" ", 1, "/", 0), ("b", 10, "/", 1), ("c", 10 + gap + 1, "/", 0),
+                ("d", None, None, None), ("e", 5, None, None)]
+        self.assertEqual(list(ngram_model.history_sessions(rows)),
+                         [[("a", "/", 0), ("b", "/", 1)], [("c", "/", 0)], [("d", None, None)],
+                          [("e", None, None)]])
+
+    def test_legacy_markov(self):
+        class Model:
+            def next_counts(self, cur):
+                return ({"git push": 3, "git log": 1}, 4) if cur == "git status" else ({}, 0)
+
+        store = ngram_model.LegacyMarkov(Model())
+        self.assertEqual(predict([store], "git status", prev="git add .", cwd="/src"),
+                         [("git push", 0.75), ("git log", 0.25)])
+        self.assertEqual(predict([store], "ls"), [])
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,159 @@
+# tests/test_stats.py
+"""The shell's latency histograms: `stats -j`, `stats -p`, `stats -r` and the ISH_STATS_FILE dump."""
+import json
+import os
+import re
+import unittest
+
+from test_ish import ShellTestCase
+
+QUANTILES = ("p50", "p90", "p99", "p999")
+PROM_LINE = re.compile(r'^ish_(\w+)_seconds_bucket\{le="([^"]+)"\} (\d+)$')
+
+
+class StatsTestCase(ShellTestCase):
+    def stats_json(self, commands):
+        status, out, err = self.run_c(commands + "\nstats -j")
+        self.assertEqual((status, err), (0, ""))
+        return json.loads(out.splitlines()[-1])
+
+    def check_histogram(self, name, h):
+        """The invariants every histogram keeps, empty or not."""
+        counts = [n for _, n in h["buckets"]]
+        self.assertEqual(sum(counts), h["count"], name)
+        if h["count"] == 0:
+            self.assertEqual((h["sum"], h["min"], h["max"], h["buckets"]), (0, 0, 0, []), name)
+            return
+        highs = [high for high, _ in h["buckets"]]
+        self.assertEqual(highs, sorted(set(highs)), name)
+        self.assertTrue(all(counts), name)  # only non-empty buckets are listed
+        values = [h["min"]] + [h[q] for q in QUANTILES] + [h["max"]]
+        self.assertEqual(values, sorted(values), name)
+        self.assertLessEqual(h["count"] * h["min"], h["sum"], name)
+        self.assertLessEqual(h["sum"], h["count"] * h["max"], name)
+        # buckets are exact below 32 us and within 1/32 of the value above
+        for v, high in ((h["min"], highs[0]), (h["max"], highs[-1])):
+            self.assertGreaterEqual(high, v, name)
+            self.assertLessEqual(high - v, v // 32, name)
+
+    def parse(self, text):
+        """{histogram: ([(le, cumulative count), ...], sum, count)} from the exposition text."""
+        buckets, sums, counts = {}, {}, {}
+        for line in text.splitlines():
+            m = PROM_LINE.match(line)
+            if m:
+                buckets.setdefault(m.group(1), []).append((m.group(2), int(m.group(3))))
+                continue
+            m = re.match(r"^ish_(\w+)_seconds_(sum|count) (\S+)$", line)
+            if m:
+                (sums if m.group(2) == "sum" else counts)[m.group(1)] = float(m.group(3))
+        return {name: (b, sums[name], int(counts[name])) for name, b in buckets.items()}
+
+    def check_exposition(self, text):
+        hists = self.parse(text)
+        self.assertIn("exec_spawn", hists)
+        for name, (buckets, total, count) in hists.items():
+            bounds = [float(le) for le, _ in buckets[:-1]]
+            self.assertEqual(bounds, sorted(set(bounds)), name)
+            self.assertEqual(buckets[-1], ("+Inf", count), name)
+            cumulative = [n for _, n in buckets]
+            self.assertEqual(cumulative, sorted(cumulative), name)
+            self.assertGreaterEqual(total, 0.0, name)
+            for kind in ("HELP", "TYPE"):
+                self.assertIn(f"# {kind} ish_{name}_seconds ", text)
+        self.assertIn("\nish_suggest_hints_missed_total 0\n", text)
+        return hists
+
+
+class StatsJsonTest(StatsTestCase):
+    def test_commands_are_counted(self):
+        report = self.stats_json("true\ntrue | true\nfalse")
+        self.assertEqual(report["unit"], "us")
+        self.assertGreater(report["pid"], 0)
+        hists = report["histograms"]
+        self.assertEqual(set(hists), {"prompt", "exec_spawn", "exec_wait", "history_log", "history_flush",
+                                      "suggest_send", "suggest_rtt", "suggest_hint", "suggest_native"})
+        for name, h in hists.items():
+            self.check_histogram(name, h)
+        self.assertEqual(hists["exec_spawn"]["count"], 3)  # once per pipeline
+        self.assertEqual(hists["exec_wait"]["count"], 3)
+        self.assertEqual(hists["prompt"]["count"], 3)  # not yet for the stats line itself
+        self.assertGreaterEqual(hists["history_log"]["count"], 3)
+        self.assertGreater(hists["exec_wait"]["min"], 0)
+
+    def test_builtins_spawn_nothing(self):
+        hists = self.stats_json("cd .\nhistory 1")["histograms"]
+        self.assertEqual(hists["exec_spawn"]["count"], 0)
+        self.assertEqual(hists["prompt"]["count"], 2)
+
+    def test_reset(self):
+        hists = self.stats_json("true\ntrue\nstats -r")["histograms"]
+        for name, h in hists.items():
+            self.check_histogram(name, h)
+        self.assertEqual(hists["exec_spawn"]["count"], 0)
+        self.assertEqual(hists["prompt"]["count"], 1)  # the line that reset them
+
+    def test_usage(self):
+        status, out, err = self.run_c("stats -x")
+        self.assertEqual(out, "")
+        self.assertIn("usage", err)
+
+    def test_text_table(self):
+        status, out, _ = self.run_c("true\nstats")
+        self.assertEqual(status, 0)
+        rows = {line.split()[0]: line.split()[1:] for line in out.splitlines()[1:-1]}
+        self.assertEqual(rows["exec_spawn"][0], "1")
+        self.assertTrue(out.splitlines()[0].startswith("(ms)"))
+        self.assertEqual(out.splitlines()[-1], "hints missed: 0")
+
+
+class PrometheusTest(StatsTestCase):
+    def test_buckets_are_cumulative(self):
+        status, out, _ = self.run_c("true\ntrue\nstats -p")
+        self.assertEqual(status, 0)
+        hists = self.check_exposition(out)
+        self.assertEqual(hists["exec_spawn"][2], 2)
+        self.assertEqual(hists["suggest_rtt"][2], 0)
+
+    def test_agrees_with_json(self):
+        status, out, _ = self.run_c("true\nsleep 0.01\nstats -j\nstats -p")
+        self.assertEqual(status, 0)
+        lines = out.splitlines()
+        report = json.loads(lines[0])["histograms"]["exec_wait"]
+        buckets, total, count = self.parse("\n".join(lines[1:]))["exec_wait"]
+        self.assertEqual(count, report["count"])
+        self.assertAlmostEqual(total, report["sum"] / 1e6, places=6)
+        # each Prometheus bucket counts the JSON buckets whose top value fits under its bound
+        for le, n in buckets[:-1]:
+            self.assertEqual(n, sum(c for high, c in report["buckets"] if high <= float(le) * 1e6))
+
+
+class StatsFileTest(StatsTestCase):
+    def dump(self, name, **env):
+        path = os.path.join(self.tmp, name)
+        self.env.update(ISH_STATS_FILE=path, **env)
+        status, out, err = self.run_c("true")
+        self.assertEqual((status, out, err), (0, "", ""))
+        self.assertEqual(os.listdir(self.tmp).count(name), 1)
+        self.assertEqual([f for f in os.listdir(self.tmp) if f.endswith(".tmp")], [])
+        with open(path) as f:
+            return f.read()
+
+    def test_json_on_exit(self):
+        hists = json.loads(self.dump("stats.json"))["histograms"]
+        for name, h in hists.items():
+            self.check_histogram(name, h)
+        self.assertEqual(hists["exec_spawn"]["count"], 1)
+
+    def test_prometheus_by_suffix_or_format(self):
+        for name, env in (("stats.prom", {}), ("stats.txt", {"ISH_STATS_FORMAT": "prom"})):
+            with self.subTest(name=name):
+                self.check_exposition(self.dump(name, **env))
+
+    def test_no_file_without_the_variable(self):
+        self.assertEqual(self.run_c("true"), (0, "", ""))
+        self.assertEqual([f for f in os.listdir(self.tmp) if not f.startswith("commands.db")], [])
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,106 @@
+# tests/test_suggestion_cache.py
+"""suggestion_cache.py: the LRU result cache and the Partial engine's prefix candidates."""
+import os
+import sys
+import unittest
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, os.path.dirname(HERE))
+
+from suggestion_cache import PREFIX_MAX_BACKTRACK, PREFIX_MAX_CANDIDATES, PrefixCandidates, ResultCache  # noqa: E402
+
+
+class ResultCacheTest(unittest.TestCase):
+    def test_hits_and_misses(self):
+        cache = ResultCache(4)
+        self.assertIsNone(cache.get("a"))
+        cache.put("a", [1])
+        self.assertEqual(cache.get("a"), [1])
+        self.assertEqual(cache.stats(), {"hits": 1, "misses": 1, "evictions": 0, "size": 1,
+                                         "capacity": 4, "hit_rate": 0.5})
+
+    def test_evicts_least_recently_used(self):
+        cache = ResultCache(2)
+        cache.put("a", 1)
+        cache.put("b", 2)
+        cache.get("a")  # b is now the oldest
+        cache.put("c", 3)
+        self.assertIsNone(cache.get("b"))
+        self.assertEqual((cache.get("a"), cache.get("c")), (1, 3))
+        cache.put("a", 10)  # replacing refreshes too
+        cache.put("d", 4)
+        self.assertIsNone(cache.get("c"))
+        self.assertEqual(cache.get("a"), 10)
+        self.assertEqual(cache.stats()["evictions"], 2)
+        self.assertEqual(cache.stats()["size"], 2)
+
+    def test_zero_capacity_stores_nothing(self):
+        cache = ResultCache(0)
+        cache.put("a", 1)
+        self.assertIsNone(cache.get("a"))
+        self.assertEqual(cache.stats()["size"], 0)
+        self.assertEqual(ResultCache(0).stats()["hit_rate"], 0.0)
+
+
+class Corpus:
+    """A full substring search over commands that counts its calls."""
+
+    def __init__(self, commands):
+        self.commands = commands
+        self.calls = []
+
+    def __call__(self, query, limit):
+        self.calls.append(query)
+        q = query.lower()
+        return [c for c in self.commands if q in c.lower()][:limit]
+
+
+class PrefixCandidatesTest(unittest.TestCase):
+    def setUp(self):
+        self.search = Corpus(["git status", "git stash", "git show", "Git Stage", "docker ps"])
+        self.cands = PrefixCandidates(64)
+
+    def test_longer_query_filters_the_shorter_ones_set(self):
+        self.assertEqual(self.cands.containing("v1", "git s", 10, self.search),
+                         ["git status", "git stash", "git show", "Git Stage"])
+        self.assertEqual(self.cands.containing("v1", "git sta", 10, self.search),
+                         ["git status", "git stash", "Git Stage"])
+        self.assertEqual(self.cands.containing("v1", "GIT STAT", 10, self.search), ["git status"])
+        self.assertEqual(self.search.calls, ["git s"])
+        self.assertEqual(self.cands.stats()["prefix_hits"], 2)
+
+    def test_exact_repeat_is_a_hit(self):
+        self.cands.containing("v1", "git", 10, self.search)
+        self.cands.containing("v1", "git", 10, self.search)
+        self.assertEqual(self.search.calls, ["git"])
+        self.assertEqual(self.cands.stats()["hits"], 1)
+
+    def test_limit_applies_to_the_answer_not_the_set(self):
+        self.assertEqual(self.cands.containing("v1", "git", 2, self.search), ["git status", "git stash"])
+        self.assertEqual(self.cands.containing("v1", "git sh", 2, self.search), ["git show"])
+        self.assertEqual(self.search.calls, ["git"])
+
+    def test_scopes_do_not_mix(self):
+        self.cands.containing("v1", "git", 10, self.search)
+        self.search.commands = ["git grep"]
+        self.assertEqual(self.cands.containing("v2", "git g", 10, self.search), ["git grep"])
+        self.assertEqual(self.search.calls, ["git", "git g"])
+
+    def test_cut_set_is_not_filtered(self):
+        search = Corpus([f"cmd{i}" for i in range(PREFIX_MAX_CANDIDATES + 1)] + ["cmdx final"])
+        self.cands.containing("v1", "cmd", 4, search)  # cut at PREFIX_MAX_CANDIDATES
+        self.assertEqual(self.cands.containing("v1", "cmdx", 4, search), ["cmdx final"])
+        self.assertEqual(search.calls, ["cmd", "cmdx"])
+
+    def test_backtrack_is_bounded(self):
+        self.cands.containing("v1", "g", 10, self.search)
+        near = "g" + "x" * PREFIX_MAX_BACKTRACK  # "g" is its last cut tried
+        self.assertEqual(self.cands.containing("v1", near, 10, self.search), [])
+        self.assertEqual(self.search.calls, ["g"])
+        far = "g" + "y" * (PREFIX_MAX_BACKTRACK + 1)  # one character further
+        self.cands.containing("v1", far, 10, self.search)
+        self.assertEqual(self.search.calls, ["g", far])
+
+
+if __name__ == "__main__":
+    unittest.main()
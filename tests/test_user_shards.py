@@ -0,0 +1,135 @@
+# tests/test_user_shards.py
+"""user_shards.py: resolving served users, per-user shards and the pool's memory cap."""
+import contextlib
+import io
+import os
+import pwd
+import sqlite3
+import sys
+import tempfile
+import time
+import unittest
+from unittest import mock
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, os.path.dirname(HERE))
+
+try:
+    import user_shards
+    from user_shards import MB, ShardPool
+except ImportError as e:  # the learner needs numpy and rapidfuzz
+    user_shards, missing = None, str(e)
+else:
+    missing = None
+
+ME = pwd.getpwuid(os.geteuid())
+
+
+def fake_users(n):
+    # uids nobody polls in these tests, so no reader process is ever started as them
+    return [(f"user{i}", 60000 + i, 60000 + i, f"/home/user{i}") for i in range(n)]
+
+
+class StopLoop(Exception):
+    pass
+
+
+@unittest.skipIf(user_shards is None, f"user_shards cannot be imported: {missing}")
+class ResolveUsersTest(unittest.TestCase):
+    def test_names_and_uids(self):
+        me = (ME.pw_name, ME.pw_uid, ME.pw_gid, ME.pw_dir)
+        out = io.StringIO()
+        with contextlib.redirect_stdout(out):
+            users = user_shards.resolve_users(f" {ME.pw_name}, ,{ME.pw_uid},no-such-user-ish ")
+        self.assertEqual(users, [me, me])
+        self.assertIn("no-such-user-ish", out.getvalue())
+
+
+@unittest.skipIf(user_shards is None, f"user_shards cannot be imported: {missing}")
+class ShardPoolTest(unittest.TestCase):
+    def test_get_creates_each_shard_once(self):
+        pool = ShardPool(fake_users(2), "/data/{user}/{uid}/{home}.db", 3600, 10 * MB)
+        self.assertIsNone(pool.get(12345))
+        shard = pool.get(60000)
+        self.assertIs(pool.get(60000), shard)
+        self.assertEqual((shard.name, shard.uid), ("user0", 60000))
+        self.assertEqual(shard.learner.db_path, "/data/user0/60000//home/user0.db")
+        self.assertEqual(shard.learner.owner, (60000, 60000))  # read as its user
+        self.assertEqual(pool.created, 1)
+
+    def test_evicts_least_recently_used_over_the_cap(self):
+        pool = ShardPool(fake_users(3), "/nonexistent/{user}.db", 3600, 10 * MB)
+        a, b, c = (pool.get(uid) for uid in (60000, 60001, 60002))
+        for shard in (a, b, c):
+            shard.bytes = 4 * MB
+        pool.get(60000)  # b is now the least recently used
+        with contextlib.redirect_stdout(io.StringIO()):
+            pool.evict()
+        self.assertEqual(list(pool.shards), [60002, 60000])
+        self.assertEqual(pool.evictions, 1)
+        with contextlib.redirect_stdout(io.StringIO()):
+            pool.evict()  # 8 MB fit
+        self.assertEqual(pool.evictions, 1)
+
+    def test_keeps_the_last_used_shard_whatever_its_size(self):
+        pool = ShardPool(fake_users(2), "/nonexistent/{user}.db", 3600, 1 * MB)
+        pool.get(60000).bytes = 5 * MB
+        pool.get(60001).bytes = 5 * MB
+        with contextlib.redirect_stdout(io.StringIO()):
+            pool.evict()
+        self.assertEqual(list(pool.shards), [60001])
+
+    def test_rebuilt_shard_has_a_new_generation(self):
+        pool = ShardPool(fake_users(2), "/nonexistent/{user}.db", 3600, 0)
+        first = pool.get(60000)
+        gen = first.generation()
+        self.assertEqual(gen, first.generation())
+        first.learner.generation += 1
+        self.assertNotEqual(first.generation(), gen)
+        first.bytes = 1
+        pool.get(60001)
+        with contextlib.redirect_stdout(io.StringIO()):
+            pool.evict()
+        rebuilt = pool.get(60000)
+        self.assertIsNot(rebuilt, first)
+        self.assertNotEqual(rebuilt.generation()[:2], first.generation()[:2])  # cached results never carry over
+        self.assertEqual(pool.created, 3)
+
+    def test_stats(self):
+        pool = ShardPool(fake_users(3), "/nonexistent/{user}.db", 3600, 2 * MB)
+        pool.get(60001).bytes = MB
+        stats = pool.stats()
+        self.assertEqual({k: stats[k] for k in ("users", "loaded", "bytes", "cap_bytes", "created", "evictions")},
+                         {"users": 3, "loaded": 1, "bytes": MB, "cap_bytes": 2 * MB, "created": 1, "evictions": 0})
+        self.assertEqual(set(stats["shards"]["user1"]), {"bytes", "known", "states", "idle_s"})
+
+    def test_poll_round_learns_then_evicts(self):
+        with tempfile.TemporaryDirectory() as tmp:
+            for name in ("me", "other"):
+                conn = sqlite3.connect(os.path.join(tmp, f"{name}.db"))
+                conn.execute("CREATE TABLE history (id INTEGER PRIMARY KEY AUTOINCREMENT, cmd TEXT NOT NULL, "
+                             "ts DATETIME DEFAULT CURRENT_TIMESTAMP, cwd TEXT, status INTEGER)")
+                start = int(time.time()) - 10
+                conn.executemany("INSERT INTO history (cmd, ts, cwd, status) "
+                                 "VALUES (?, datetime(?, 'unixepoch'), '/src', 0)",
+                                 [(f"{name} cmd {i}", start + i) for i in range(5)])
+                conn.commit()
+                conn.close()
+            # both shards read as ourselves, so no reader process is needed
+            users = [("me", ME.pw_uid, ME.pw_gid, ME.pw_dir), ("other", ME.pw_uid + 1, ME.pw_gid, ME.pw_dir)]
+            pool = ShardPool(users, os.path.join(tmp, "{user}.db"), 3600, 1)
+            other = pool.get(ME.pw_uid + 1)
+            other.learner.owner = None
+            me = pool.get(ME.pw_uid)
+            with contextlib.redirect_stdout(io.StringIO()), \
+                    mock.patch.object(user_shards.time, "sleep", side_effect=StopLoop):
+                with self.assertRaises(StopLoop):
+                    pool.run(0)
+        self.assertEqual((len(me.learner), len(other.learner)), (5, 5))
+        self.assertGreater(me.bytes, 0)
+        self.assertEqual(list(pool.shards), [ME.pw_uid])  # over the cap: only the last used is kept
+        self.assertEqual(pool.evictions, 1)
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,143 @@
+# tests/test_wire.py
+"""wire.py: the built-in MessagePack codec and the frame reader.
+
+The codec is loaded with msgpack hidden, so these tests cover the pure-Python
+fallback whether or not the package is installed; when it is, the two are also
+checked to agree.
+"""
+import importlib.util
+import os
+import struct
+import sys
+import unittest
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, os.path.dirname(HERE))
+
+import wire  # noqa: E402
+
+try:
+    import msgpack
+except ImportError:
+    msgpack = None
+
+
+def load_fallback():
+    saved = sys.modules.get("msgpack")
+    sys.modules["msgpack"] = None  # makes `import msgpack` raise ImportError
+    try:
+        spec = importlib.util.spec_from_file_location("wire_fallback", wire.__file__)
+        module = importlib.util.module_from_spec(spec)
+        spec.loader.exec_module(module)
+        return module
+    finally:
+        if saved is None:
+            del sys.modules["msgpack"]
+        else:
+            sys.modules["msgpack"] = saved
+
+
+fallback = load_fallback()
+
+SAMPLES = [
+    None, True, False,
+    0, 1, 127, 128, 255, 65535, 1 << 32, (1 << 64) - 1, -1, -32, -33, -(1 << 40),
+    0.0, 0.25, -1.5e300,
+    "", "a", "x" * 31, "x" * 32, "x" * 255, "x" * 256, "x" * 65536, "héllo ☃",
+    b"", b"\x00\xff" * 10,
+    [], [1, [2, [3]]], list(range(16)),
+    {}, {"a": 1}, {str(i): i for i in range(16)},
+    {"op": "hello", "proto": "bin1", "ctx": {"prev": "git status", "cwd": "/tmp"}, "engines": ["NextCmd"]},
+]
+
+
+class CodecTest(unittest.TestCase):
+    def test_round_trip(self):
+        for obj in SAMPLES:
+            with self.subTest(obj=repr(obj)[:40]):
+                self.assertEqual(fallback.unpack(fallback.pack(obj)), obj)
+
+    def test_tuple_packs_as_array(self):
+        self.assertEqual(fallback.unpack(fallback.pack((1, "a"))), [1, "a"])
+
+    def test_encodings(self):
+        cases = [
+            (None, b"\xc0"), (True, b"\xc3"), (False, b"\xc2"),
+            (5, b"\x05"), (-1, b"\xff"), (-32, b"\xe0"),
+            (200, b"\xce\x00\x00\x00\xc8"), (-33, b"\xd3" + struct.pack(">q", -33)),
+            (1.0, b"\xcb" + struct.pack(">d", 1.0)),
+            ("ab", b"\xa2ab"), ("x" * 32, b"\xd9\x20" + b"x" * 32),
+            ("x" * 256, b"\xda\x01\x00" + b"x" * 256),
+            (b"\x01", b"\xc6\x00\x00\x00\x01\x01"),
+            ([1, 2], b"\x92\x01\x02"), ({"a": None}, b"\x81\xa1a\xc0"),
+        ]
+        for obj, encoded in cases:
+            with self.subTest(obj=repr(obj)[:40]):
+                self.assertEqual(fallback.pack(obj), encoded)
+
+    def test_decodes_types_it_does_not_emit(self):
+        cases = [
+            (b"\xcc\xff", 255), (b"\xcd\x01\x00", 256), (b"\xcf" + struct.pack(">Q", 7), 7),
+            (b"\xd0\x80", -128), (b"\xd1\xff\xfe", -2), (b"\xd2\xff\xff\xff\xfd", -3),
+            (b"\xca" + struct.pack(">f", 0.5), 0.5),
+            (b"\xdb\x00\x00\x00\x02hi", "hi"), (b"\xc4\x01z", b"z"), (b"\xc5\x00\x01z", b"z"),
+            (b"\xdc\x00\x01\x01", [1]), (b"\xde\x00\x01\xa1k\x02", {"k": 2}),
+            (b"\xdf\x00\x00\x00\x00", {}),
+        ]
+        for data, obj in cases:
+            with self.subTest(data=data):
+                self.assertEqual(fallback.unpack(data), obj)
+
+    def test_rejects_unknown_types(self):
+        with self.assertRaises(TypeError):
+            fallback.pack({1, 2})
+        with self.assertRaises(ValueError):
+            fallback.unpack(b"\xc1")  # never used
+
+    def test_rejects_truncated_and_trailing_bytes(self):
+        for data in (b"\xa3ab", b"\x92\x01", b"\xcd\x01", b"\xdd\x00\x00", b"\x81\xa1a"):
+            with self.subTest(data=data), self.assertRaises(ValueError):
+                fallback.unpack(data)
+        with self.assertRaises(ValueError):
+            fallback.unpack(b"\x01\x02")
+
+    @unittest.skipIf(msgpack is None, "msgpack is not installed")
+    def test_agrees_with_msgpack(self):
+        for obj in SAMPLES:
+            with self.subTest(obj=repr(obj)[:40]):
+                self.assertEqual(wire.unpack(fallback.pack(obj)), obj)
+                self.assertEqual(fallback.unpack(wire.pack(obj)), obj)
+
+
+class FrameTest(unittest.TestCase):
+    def test_frame_header(self):
+        payload = fallback.pack({"id": 1})
+        self.assertEqual(fallback.frame({"id": 1}), struct.pack(">I", len(payload)) + payload)
+
+    def test_reader_splits_stream(self):
+        stream = b"".join(fallback.frame(obj) for obj in SAMPLES[:12])
+        reader = fallback.FrameReader()
+        frames = []
+        for i in range(0, len(stream), 3):  # arbitrary chunking, headers split too
+            frames += reader.feed(stream[i:i + 3])
+        self.assertEqual([fallback.unpack(f) for f in frames], SAMPLES[:12])
+        self.assertEqual(reader.buf, b"")
+
+    def test_reader_returns_all_complete_frames_and_keeps_the_rest(self):
+        data = fallback.frame("a") + fallback.frame("b") + fallback.frame("c")[:3]
+        reader = fallback.FrameReader()
+        self.assertEqual([fallback.unpack(f) for f in reader.feed(data)], ["a", "b"])
+        self.assertEqual(reader.feed(fallback.frame("c")[3:]), [fallback.pack("c")])
+
+    def test_empty_payload(self):
+        self.assertEqual(fallback.FrameReader().feed(b"\x00\x00\x00\x00"), [b""])
+
+    def test_reader_limit(self):
+        reader = fallback.FrameReader(limit=8)
+        self.assertEqual(reader.feed(struct.pack(">I", 8) + b"x" * 8), [b"x" * 8])
+        with self.assertRaises(ValueError):
+            reader.feed(struct.pack(">I", 9))
+
+
+if __name__ == "__main__":
+    unittest.main()
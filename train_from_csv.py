@@ -8,11 +8,17 @@ import json
 from collections import defaultdict, Counter
 import argparse
 import os
+from template_index import MATRIX_FILE, save_matrix
+from typo_index import INDEX_FILE, TypoIndex
+import native_model
+import ngram_model
+import sqlite3
 
 parser = argparse.ArgumentParser()
 parser.add_argument("--input", default="powershell_commands.csv", help="CSV or XLSX file with commands")
 parser.add_argument("--col", default=None, help="column name that contains commands (optional)")
 parser.add_argument("--outdir", default="models", help="folder to save models")
+parser.add_argument("--history", default=None, help="shell history database (commands.db) to add to the n-gram model")
 args = parser.parse_args()
 
 os.makedirs(args.outdir, exist_ok=True)
@@ -44,6 +50,10 @@ known_cmds = commands.copy()
 with open(f"{args.outdir}/known_cmds.json", "w", encoding="utf8") as f:
     json.dump(known_cmds, f, indent=2, ensure_ascii=False)
 
+# trigram index over the same list, so typo lookups only score a few candidates
+TypoIndex(known_cmds).save(f"{args.outdir}/{INDEX_FILE}")
+print(f"Saved known_cmds.json and {INDEX_FILE}")
+
 # 3) Next command predictor (Markov / 1-gram transitions)
 transitions = defaultdict(Counter)
 for i in range(len(commands) - 1):
@@ -54,14 +64,32 @@ transitions_dict = {k: dict(v) for k, v in transitions.items()}
 joblib.dump(transitions_dict, f"{args.outdir}/markov_model.pkl")
 print("Saved markov_model.pkl")
 
+# 3b) Context-aware n-grams: the CSV sequence, plus real sessions (with cwd / exit status) from the shell
+ngrams = ngram_model.NgramCounts()
+ngrams.add_sequence([(c, None, None) for c in commands])
+if args.history:
+    conn = sqlite3.connect(f"file:{args.history}?mode=ro", uri=True)
+    rows = conn.execute(f"SELECT {ngram_model.history_columns(conn)} FROM history ORDER BY id")
+    for session in ngram_model.history_sessions(rows):
+        ngrams.add_sequence(session)
+    conn.close()
+ngrams.prune()
+ngrams.compile().save(f"{args.outdir}/{ngram_model.MODEL_FILE}")
+print(f"Saved {ngram_model.MODEL_FILE} ({len(ngrams)} states)")
+
 # 4) TF-IDF for flag/template recommender
 vectorizer = TfidfVectorizer()
 X = vectorizer.fit_transform(commands)
 joblib.dump(vectorizer, f"{args.outdir}/tfidf_vectorizer.pkl")
 joblib.dump(commands, f"{args.outdir}/commands_list.pkl")  # save the corpus
-print("Saved tfidf_vectorizer.pkl and commands_list.pkl")
+save_matrix(f"{args.outdir}/{MATRIX_FILE}", X)  # normalized CSR rows, so the server skips re-vectorizing
+print(f"Saved tfidf_vectorizer.pkl, commands_list.pkl and {MATRIX_FILE}")
+
+# 5) Binary model for the shell's native engine (core.c loads it at startup)
+native_model.export(f"{args.outdir}/{native_model.MODEL_FILE}", commands, transitions_dict, vectorizer, X)
+print(f"Saved {native_model.MODEL_FILE}")
 
-# 5) Quick test function printout
+# 6) Quick test function printout
 print("\nQuick tests (examples):")
 sample = commands[0] if commands else "ls -la"
 print(" Sample command:", sample)
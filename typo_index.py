@@ -0,0 +1,207 @@
+# typo_index.py
+"""Trigram posting index for typo correction and substring lookups.
+
+Every known command is split into lowercase trigrams (padded, so short commands
+and word starts get grams too) and each trigram maps to the sorted ids of the
+commands containing it. A query then only scores the few commands with the
+most similar trigram sets (Dice coefficient) whose length can still reach the
+score threshold, instead of running fuzz.ratio over the whole list.
+native_model.MappedModel ranks candidates the same way over the exported
+model's hashed trigram buckets, and core.c's native engine mirrors that one;
+the exact trigrams here can pick different candidates.
+
+train_from_csv.py saves the index (typo_index.pkl); the server loads it and
+adds commands that were appended after training.
+"""
+import os
+
+import joblib
+import numpy as np
+from rapidfuzz import process, fuzz
+
+INDEX_FILE = "typo_index.pkl"
+MAX_CANDIDATES = 64
+
+
+def trigrams(s, pad=True):
+    s = s.lower()
+    if pad:
+        s = f"  {s} "
+    return {s[i:i + 3] for i in range(len(s) - 2)}
+
+
+def ratio_length_bounds(n, threshold):
+    """Lengths m for which fuzz.ratio(a, b) >= threshold is still possible when len(a) == n.
+
+    ratio = 1 - indel / (n + m) and indel >= |n - m|, so m must lie within
+    [n * t / (2 - t), n * (2 - t) / t].
+    """
+    if threshold <= 0:
+        return 0, float("inf")
+    return n * threshold / (2 - threshold), n * (2 - threshold) / threshold
+
+
+def nearest_length(by_length, n, lo, hi, limit):
+    """Up to limit ids from by_length (length -> ascending ids) with a length in
+    [lo, hi]: closest to n first, then shorter, then lower ids. With no trigram to
+    rank by, a nearer length is what leaves room for a higher fuzz.ratio."""
+    out = []
+    for m in sorted((m for m in by_length if lo <= m <= hi), key=lambda m: (abs(m - n), m)):
+        out.extend(by_length[m][:limit - len(out)])
+        if len(out) >= limit:
+            break
+    return np.asarray(out, dtype=np.int64)
+
+
+def best_matches(queries, choice_lists):
+    """[(command, score 0..1) or (None, 0.0)] for each query against its own choices.
+
+    Every (query, choice) pair is scored exactly once with rapidfuzz's pairwise
+    cpdist, on all cores and outside the GIL, and each query takes the first of
+    its top-scoring choices in its own order: what extractOne returns for it.
+    """
+    sizes = [len(choices) for choices in choice_lists]
+    if not any(sizes):
+        return [(None, 0.0)] * len(queries)
+    if not hasattr(process, "cpdist"):  # rapidfuzz < 3.6
+        return [_extract_one(q, choices) for q, choices in zip(queries, choice_lists)]
+    flat_queries = [q for q, n in zip(queries, sizes) for _ in range(n)]
+    flat_choices = [c for choices in choice_lists for c in choices]
+    scores = process.cpdist(flat_queries, flat_choices, scorer=fuzz.ratio, dtype=np.float64, workers=-1)
+    out, lo = [], 0
+    for choices, n in zip(choice_lists, sizes):
+        if not n:
+            out.append((None, 0.0))
+            continue
+        j = int(scores[lo:lo + n].argmax())  # first maximum, as extractOne keeps it
+        out.append((choices[j], float(scores[lo + j]) / 100.0))
+        lo += n
+    return out
+
+
+def _extract_one(query, choices):
+    if not choices:
+        return None, 0.0
+    match, score, _ = process.extractOne(query, choices, scorer=fuzz.ratio)
+    return match, float(score) / 100.0
+
+
+class TypoIndex:
+    def __init__(self, commands=()):
+        self.commands = []
+        self.lengths = np.zeros(0, dtype=np.int32)
+        self.postings = {}   # padded trigram -> sorted np.int32 command ids
+        self.substr = {}     # unpadded trigram -> sorted np.int32 command ids
+        self.by_length = {}  # command length -> ascending command ids
+        self.add_all(commands)
+
+    def add_all(self, commands):
+        """Index commands in order; ids continue from the current size."""
+        commands = list(commands)
+        if not commands:
+            return
+        base = len(self.commands)
+        fuzzy, plain = {}, {}
+        for off, cmd in enumerate(commands):
+            for g in trigrams(cmd):
+                fuzzy.setdefault(g, []).append(base + off)
+            for g in trigrams(cmd, pad=False):
+                plain.setdefault(g, []).append(base + off)
+            self.by_length.setdefault(len(cmd), []).append(base + off)
+        for table, new in ((self.postings, fuzzy), (self.substr, plain)):
+            for g, ids in new.items():
+                ids = np.asarray(ids, dtype=np.int32)
+                table[g] = np.concatenate([table[g], ids]) if g in table else ids
+        self.commands.extend(commands)
+        self.lengths = np.concatenate([self.lengths, np.fromiter((len(c) for c in commands), np.int32, len(commands))])
+
+    @classmethod
+    def load(cls, commands, models_dir):
+        """Use the trained index if it is a prefix of commands; otherwise build it now."""
+        path = os.path.join(models_dir, INDEX_FILE)
+        index = None
+        if os.path.exists(path):
+            try:
+                index = joblib.load(path)
+                if index.commands != commands[:len(index.commands)]:
+                    print(f"Ignoring {path}: built from a different command list")
+                    index = None
+                elif not hasattr(index, "by_length"):  # saved before the length table existed
+                    index.by_length = {}
+                    for i, cmd in enumerate(index.commands):
+                        index.by_length.setdefault(len(cmd), []).append(i)
+            except Exception as e:
+                print(f"Ignoring {path}: {e}")
+                index = None
+        if index is None:
+            return cls(commands)
+        index.add_all(commands[len(index.commands):])
+        return index
+
+    def save(self, path):
+        joblib.dump(self, path)
+
+    def candidates(self, query, threshold, limit=MAX_CANDIDATES):
+        """Ids of the commands whose trigrams best match query's, length-filtered.
+
+        Only the commands on the query's posting lists are counted and length
+        checked, so the work does not grow with the size of the index.
+        """
+        lo, hi = ratio_length_bounds(len(query), threshold)
+        grams = trigrams(query)
+        lists = [self.postings[g] for g in grams if g in self.postings]
+        if lists:
+            hits, counts = np.unique(np.concatenate(lists), return_counts=True)
+            lengths = self.lengths[hits]
+            ok = (lengths >= lo) & (lengths <= hi)
+            hits, counts, lengths = hits[ok], counts[ok], lengths[ok]
+            if len(hits) > limit:
+                # rank by trigram Dice so equally-overlapping but longer commands lose
+                dice = 2.0 * counts / (len(grams) + lengths + 1)
+                hits = hits[np.argpartition(-dice, limit - 1)[:limit]]
+            if len(hits):
+                return hits
+        # no shared trigram (very short query): the commands nearest its length
+        return nearest_length(self.by_length, len(query), lo, hi, limit)
+
+    def best_match(self, query, threshold):
+        """(command, score 0..1) of the closest known command, or (None, 0.0)."""
+        if not self.commands or not query:
+            return None, 0.0
+        ids = self.candidates(query, threshold)
+        if not len(ids):
+            return None, 0.0
+        choices = [self.commands[i] for i in ids]
+        match, score, _ = process.extractOne(query, choices, scorer=fuzz.ratio)
+        return match, float(score) / 100.0
+
+    def best_match_many(self, queries, threshold):
+        """best_match() for each of queries, scored in bulk."""
+        if not self.commands:
+            return [(None, 0.0)] * len(queries)
+        choices = [[self.commands[i] for i in self.candidates(q, threshold)] if q else [] for q in queries]
+        return best_matches(queries, choices)
+
+    def containing(self, query, limit):
+        """Up to limit commands that contain query (case-insensitive), in index order."""
+        q = query.lower()
+        grams = trigrams(q, pad=False)
+        if grams:
+            lists = sorted((self.substr.get(g) for g in grams), key=lambda a: 0 if a is None else len(a))
+            if lists[0] is None:
+                return []
+            ids = lists[0]
+            for other in lists[1:]:
+                if len(ids) <= limit * 4:
+                    break  # few enough to verify directly
+                ids = np.intersect1d(ids, other, assume_unique=True)
+            pool = (self.commands[i] for i in ids)
+        else:
+            pool = iter(self.commands)
+        out = []
+        for cmd in pool:
+            if q in cmd.lower():
+                out.append(cmd)
+                if len(out) >= limit:
+                    break
+        return out
@@ -0,0 +1,133 @@
+# user_shards.py
+"""Per-user overlays for the shared suggestion daemon.
+
+With SUGGEST_USERS set, one suggestion_server.py serves every listed user on a
+Unix socket of their own, SUGGEST_SOCKET_DIR/<uid>.sock, owned by that user and
+mode 0600, so the socket a connection arrives on says whose shell it is. The
+trained model is loaded once and shared read-only by all of them; what is
+personal is a UserShard: an OnlineLearner over that user's history database
+(their n-gram counts, known commands and term statistics), which LearnedView
+layers over the shared model for each of their requests. The database lives
+where its user can put anything, so it is read with the user's own credentials
+(history_reader.read_as), never the daemon's.
+
+A shard is created on its user's first request and filled in by the poll
+thread, so until it has caught up that user sees the shared model plus what has
+been read so far. ShardPool keeps the shards in least-recently-used order and
+holds their estimated footprint (OnlineLearner.footprint) under a memory cap:
+after every poll round, the least recently used shards are dropped until the
+rest fit. A dropped shard is rebuilt from the history database the next time
+its user asks for something. The shard in use last is never dropped, so a cap
+smaller than one user's history still serves that user.
+"""
+import itertools
+import pwd
+import threading
+import time
+from collections import OrderedDict
+
+from online_learner import OnlineLearner
+
+MB = 1 << 20
+
+_epochs = itertools.count(1)  # tells a rebuilt shard from the one it replaced
+
+
+def resolve_users(spec):
+    """[(name, uid, gid, home)] for a comma-separated list of user names or uids."""
+    users = []
+    for item in spec.split(","):
+        item = item.strip()
+        if not item:
+            continue
+        try:
+            pw = pwd.getpwuid(int(item)) if item.isdigit() else pwd.getpwnam(item)
+        except KeyError:
+            print(f"Shards: no such user {item!r}, skipped")
+            continue
+        users.append((pw.pw_name, pw.pw_uid, pw.pw_gid, pw.pw_dir))
+    return users
+
+
+class UserShard:
+    def __init__(self, name, uid, gid, db_path, half_life):
+        self.name = name
+        self.uid = uid
+        self.epoch = next(_epochs)
+        self.learner = OnlineLearner(db_path, half_life, owner=(uid, gid))
+        self.bytes = 0
+        self.last_used = time.monotonic()
+
+    def generation(self):
+        """Cache-key part for this user's learned state (see cache_key in suggestion_server.py)."""
+        return (self.uid, self.epoch, self.learner.generation)
+
+
+class ShardPool:
+    def __init__(self, users, history_path, half_life, cap_bytes):
+        """users from resolve_users(); history_path is formatted with {user}, {uid} and {home}."""
+        self.paths = {uid: (name, gid, history_path.format(user=name, uid=uid, home=home))
+                      for name, uid, gid, home in users}
+        self.half_life = half_life
+        self.cap_bytes = cap_bytes
+        self.shards = OrderedDict()  # uid -> UserShard, least recently used first
+        self.lock = threading.Lock()
+        self.created = self.evictions = 0
+
+    def get(self, uid):
+        """The user's shard, created on first use; None for a user this pool does not serve."""
+        with self.lock:
+            shard = self.shards.get(uid)
+            if shard is None:
+                if uid not in self.paths:
+                    return None
+                name, gid, path = self.paths[uid]
+                shard = self.shards[uid] = UserShard(name, uid, gid, path, self.half_life)
+                self.created += 1
+            else:
+                self.shards.move_to_end(uid)
+            shard.last_used = time.monotonic()
+            return shard
+
+    def evict(self):
+        """Drop least recently used shards while the pool is over its cap."""
+        dropped = []
+        with self.lock:
+            total = sum(s.bytes for s in self.shards.values())
+            while total > self.cap_bytes and len(self.shards) > 1:
+                _, shard = self.shards.popitem(last=False)
+                total -= shard.bytes
+                self.evictions += 1
+                dropped.append(shard)
+        for shard in dropped:
+            print(f"Shards: dropped {shard.name} ({shard.bytes / MB:.1f} MB, idle "
+                  f"{time.monotonic() - shard.last_used:.0f}s); {total / MB:.1f} of "
+                  f"{self.cap_bytes / MB:.1f} MB in use")
+
+    def run(self, interval):
+        """Poll loop for a daemon thread: learn new history rows for every live shard."""
+        while True:
+            with self.lock:
+                shards = list(self.shards.values())
+            for shard in shards:
+                learner = shard.learner
+                n = learner.poll()
+                learner.decay_if_due()
+                learner.compile_if_due()
+                if n:
+                    shard.bytes = learner.footprint()
+                    print(f"History: {shard.name} learned {n} commands (up to row {learner.last_rowid}), "
+                          f"{len(learner)} known, {len(learner.counts)} n-gram states, "
+                          f"{shard.bytes / MB:.1f} MB")
+            self.evict()
+            time.sleep(interval)
+
+    def stats(self):
+        now = time.monotonic()
+        with self.lock:
+            shards = {s.name: {"bytes": s.bytes, "known": len(s.learner), "states": len(s.learner.counts),
+                               "idle_s": round(now - s.last_used, 1)}
+                      for s in self.shards.values()}
+        return {"users": len(self.paths), "loaded": len(shards), "bytes": sum(s["bytes"] for s in shards.values()),
+                "cap_bytes": self.cap_bytes, "created": self.created, "evictions": self.evictions,
+                "shards": shards}
@@ -0,0 +1,188 @@
+# wire.py
+"""Binary framing for the suggestion protocol.
+
+A connection starts in the JSON line protocol. A client that wants frames sends
+the line {"op":"hello","proto":"bin1"}; a server that supports them answers with
+the same line, and from then on every message in both directions is
+
+    u32 big-endian payload length | MessagePack payload
+
+Strings travel length-prefixed, so neither side escapes or scans them, and a
+message can be any size up to MAX_FRAME. Servers that predate the framing treat
+the hello as an ordinary query, and the client stays on JSON.
+
+The msgpack package is used when it is installed; otherwise the pure-Python codec
+below handles the subset the protocol needs (nil, bool, int, float, str, bin,
+array, map).
+"""
+import struct
+
+PROTO = "bin1"
+MAX_FRAME = 1 << 20
+HEADER = struct.Struct(">I")
+
+
+def _pack(obj, out):
+    if obj is None:
+        out.append(0xc0)
+    elif obj is True:
+        out.append(0xc3)
+    elif obj is False:
+        out.append(0xc2)
+    elif isinstance(obj, int):
+        if 0 <= obj < 0x80:
+            out.append(obj)
+        elif -32 <= obj < 0:
+            out.append(obj & 0xff)
+        elif 0 <= obj < 1 << 32:
+            out += struct.pack(">BI", 0xce, obj)
+        elif obj >= 0:
+            out += struct.pack(">BQ", 0xcf, obj)
+        else:
+            out += struct.pack(">Bq", 0xd3, obj)
+    elif isinstance(obj, float):
+        out += struct.pack(">Bd", 0xcb, obj)
+    elif isinstance(obj, str):
+        b = obj.encode("utf8")
+        n = len(b)
+        if n < 32:
+            out.append(0xa0 | n)
+        elif n < 1 << 8:
+            out += struct.pack(">BB", 0xd9, n)
+        elif n < 1 << 16:
+            out += struct.pack(">BH", 0xda, n)
+        else:
+            out += struct.pack(">BI", 0xdb, n)
+        out += b
+    elif isinstance(obj, (bytes, bytearray)):
+        out += struct.pack(">BI", 0xc6, len(obj))
+        out += obj
+    elif isinstance(obj, (list, tuple)):
+        n = len(obj)
+        if n < 16:
+            out.append(0x90 | n)
+        else:
+            out += struct.pack(">BI", 0xdd, n)
+        for v in obj:
+            _pack(v, out)
+    elif isinstance(obj, dict):
+        n = len(obj)
+        if n < 16:
+            out.append(0x80 | n)
+        else:
+            out += struct.pack(">BI", 0xdf, n)
+        for k, v in obj.items():
+            _pack(k, out)
+            _pack(v, out)
+    else:
+        raise TypeError(f"cannot encode {type(obj).__name__}")
+
+
+_FIXED = {0xcc: ">B", 0xcd: ">H", 0xce: ">I", 0xcf: ">Q",
+          0xd0: ">b", 0xd1: ">h", 0xd2: ">i", 0xd3: ">q", 0xca: ">f", 0xcb: ">d"}
+_SIZES = {0xd9: ">B", 0xda: ">H", 0xdb: ">I", 0xc4: ">B", 0xc5: ">H", 0xc6: ">I",
+          0xdc: ">H", 0xdd: ">I", 0xde: ">H", 0xdf: ">I"}
+
+
+def _unpack(b, i):
+    t = b[i]
+    i += 1
+    if t < 0x80:
+        return t, i
+    if t >= 0xe0:
+        return t - 0x100, i
+    if 0xa0 <= t <= 0xbf:
+        n = t & 0x1f
+        return b[i:i + n].decode("utf8"), i + n
+    if 0x90 <= t <= 0x9f:
+        return _unpack_array(b, i, t & 0x0f)
+    if 0x80 <= t <= 0x8f:
+        return _unpack_map(b, i, t & 0x0f)
+    if t == 0xc0:
+        return None, i
+    if t in (0xc2, 0xc3):
+        return t == 0xc3, i
+    if t in _FIXED:
+        fmt = _FIXED[t]
+        return struct.unpack_from(fmt, b, i)[0], i + struct.calcsize(fmt)
+    if t in _SIZES:
+        fmt = _SIZES[t]
+        n = struct.unpack_from(fmt, b, i)[0]
+        i += struct.calcsize(fmt)
+        if t in (0xd9, 0xda, 0xdb):
+            return b[i:i + n].decode("utf8"), i + n
+        if t in (0xc4, 0xc5, 0xc6):
+            return bytes(b[i:i + n]), i + n
+        if t in (0xdc, 0xdd):
+            return _unpack_array(b, i, n)
+        return _unpack_map(b, i, n)
+    raise ValueError(f"unsupported msgpack type 0x{t:02x}")
+
+
+def _unpack_array(b, i, n):
+    out = []
+    for _ in range(n):
+        v, i = _unpack(b, i)
+        out.append(v)
+    return out, i
+
+
+def _unpack_map(b, i, n):
+    out = {}
+    for _ in range(n):
+        k, i = _unpack(b, i)
+        v, i = _unpack(b, i)
+        out[k] = v
+    return out, i
+
+
+try:
+    import msgpack
+
+    def pack(obj):
+        return msgpack.packb(obj, use_bin_type=True)
+
+    def unpack(data):
+        return msgpack.unpackb(data, raw=False)
+except ImportError:
+    def pack(obj):
+        out = bytearray()
+        _pack(obj, out)
+        return bytes(out)
+
+    def unpack(data):
+        try:
+            obj, end = _unpack(bytes(data), 0)
+        except (IndexError, struct.error) as e:
+            raise ValueError(f"truncated message: {e}")
+        if end != len(data):
+            raise ValueError("trailing bytes after message")
+        return obj
+
+
+def frame(obj):
+    payload = pack(obj)
+    return HEADER.pack(len(payload)) + payload
+
+
+class FrameReader:
+    """Splits a byte stream into length-prefixed frames (payload bytes)."""
+
+    def __init__(self, limit=MAX_FRAME):
+        self.buf = bytearray()
+        self.limit = limit
+
+    def feed(self, data):
+        self.buf += data
+        frames, pos = [], 0
+        while len(self.buf) - pos >= HEADER.size:
+            (n,) = HEADER.unpack_from(self.buf, pos)
+            if n > self.limit:
+                raise ValueError(f"frame of {n} bytes exceeds {self.limit}")
+            if len(self.buf) - pos - HEADER.size < n:
+                break
+            frames.append(bytes(self.buf[pos + HEADER.size:pos + HEADER.size + n]))
+            pos += HEADER.size + n
+        if pos:
+            del self.buf[:pos]
+        return frames